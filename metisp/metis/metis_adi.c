@@ -0,0 +1,156 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "metis_adi.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Positions this close outside the frame, in pixels, are rounding errors on its edge */
+#define METIS_ADI_EDGE               1e-9
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_adi     Angular differential imaging
+ *
+ * Kernels for the post-processing of pupil-tracking sequences, in which the
+ * field rotates around the star while the speckles stay put.
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Derotate every frame of a stack around a common centre
+ *
+ * @param    frames     @em nframes planes of @em ny rows of @em nx pixels
+ * @param    nframes    number of frames
+ * @param    nx         number of columns of a frame
+ * @param    ny         number of rows of a frame
+ * @param    angles     field rotation of every frame, in degrees,
+ *                      counter-clockwise
+ * @param    xc         column of the centre of rotation (0-based)
+ * @param    yc         row of the centre of rotation (0-based)
+ * @param    derotated  output, the derotated frames with the same layout
+ *                      as @em frames
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * Frame n is rotated by -angles[n] around (xc, yc), so that a source that
+ * appears at the centre plus the offset s rotated by angles[n] ends up at the
+ * centre plus s in every derotated frame. Every output pixel is interpolated
+ * bilinearly from the four input pixels around its position in the input
+ * frame; pixels that map outside the input frame are set to NaN, and so are
+ * those next to a non-finite input pixel. Derotating by zero reproduces the
+ * finite input exactly.
+ *
+ * The positions along an output row are advanced incrementally, so the inner
+ * loop is free of trigonometry. If the library is built with OpenMP support
+ * the rows of all frames are derotated in parallel.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em frames, @em angles or @em derotated is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em nframes is negative, or a frame has fewer
+ *   than two rows or columns
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_adi_derotate(
+    const float          *frames,
+    cpl_size              nframes,
+    cpl_size              nx,
+    cpl_size              ny,
+    const double         *angles,
+    double                xc,
+    double                yc,
+    float                *derotated)
+{
+  cpl_ensure_code(frames != NULL && angles != NULL && derotated != NULL,
+                  CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nframes >= 0 && nx >= 2 && ny >= 2,
+                  CPL_ERROR_ILLEGAL_INPUT);
+
+  const cpl_size npix = nx * ny;
+
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2) schedule(static)
+#endif
+  for (cpl_size n = 0; n < nframes; n++) {
+      for (cpl_size y = 0; y < ny; y++) {
+          const float *in = frames + n * npix;
+          float *out = derotated + n * npix + y * nx;
+          const double theta = angles[n] * CPL_MATH_PI / 180.0;
+          const double c = cos(theta);
+          const double s = sin(theta);
+          const double dy = (double)y - yc;
+
+          /* Position of the first pixel of the row in the input frame, as an
+             offset from the output pixel so that zero rotation is exact */
+          const double sx0 = -(c - 1.0) * xc - s * dy;
+          const double sy0 = (double)y - s * xc + (c - 1.0) * dy;
+
+          for (cpl_size x = 0; x < nx; x++) {
+              double sx = sx0 + c * (double)x;
+              double sy = sy0 + s * (double)x;
+
+              if (!(sx >= -METIS_ADI_EDGE && sx <= (double)(nx - 1) + METIS_ADI_EDGE &&
+                    sy >= -METIS_ADI_EDGE && sy <= (double)(ny - 1) + METIS_ADI_EDGE)) {
+                  out[x] = NAN;
+                  continue;
+              }
+              sx = CPL_MIN(CPL_MAX(sx, 0.0), (double)(nx - 1));
+              sy = CPL_MIN(CPL_MAX(sy, 0.0), (double)(ny - 1));
+
+              /* The last column (row) is interpolated from the one before */
+              const cpl_size x0 = CPL_MIN((cpl_size)sx, nx - 2);
+              const cpl_size y0 = CPL_MIN((cpl_size)sy, ny - 2);
+              const double fx = sx - (double)x0;
+              const double fy = sy - (double)y0;
+              const float *p = in + y0 * nx + x0;
+
+              out[x] = (float)((1.0 - fy) * ((1.0 - fx) * p[0] + fx * p[1])
+                               + fy * ((1.0 - fx) * p[nx] + fx * p[nx + 1]));
+          }
+      }
+  }
+
+  return CPL_ERROR_NONE;
+}
+
+/**@}*/
@@ -0,0 +1,47 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METIS_ADI_H
+#define METIS_ADI_H
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+cpl_error_code metis_adi_derotate(
+    const float          *frames,
+    cpl_size              nframes,
+    cpl_size              nx,
+    cpl_size              ny,
+    const double         *angles,
+    double                xc,
+    double                yc,
+    float                *derotated);
+
+#endif
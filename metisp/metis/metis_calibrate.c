@@ -0,0 +1,636 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <float.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "metis_calibrate.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Number of neighbouring pixels of a frame calibrated together by one thread */
+#define METIS_CALIBRATE_TILE         2048
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+static void metis_calibrate_tile(const float *, const float *, const float *,
+                                 const float *, double, const float *,
+                                 cpl_size, cpl_size, const int *,
+                                 double, double, cpl_size,
+                                 float *, float *, int *);
+static void metis_linearity_horner(const float *, const double *,
+                                   const double *, cpl_size, cpl_size,
+                                   cpl_size, float *, float *, float *);
+static void metis_linearity_horner_single(const float *, const float *,
+                                          const float *, cpl_size, cpl_size,
+                                          cpl_size, float *, float *, float *);
+static void metis_linearity_apply(float *, float *, int *, const int *,
+                                  const float *, const float *, const float *,
+                                  cpl_size);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_calibrate   Application of detector calibrations
+ *
+ * Detector calibrations applied to raw frames in a single pass, producing
+ * the science, error and data quality layers together.
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Calibrate a stack of raw frames and propagate the error
+ *
+ * @param    raw        @em nframes raw frames of @em npix pixels, in ADU
+ * @param    nframes    number of frames
+ * @param    npix       number of pixels per frame
+ * @param    dark       master dark of @em npix pixels in ADU, or NULL
+ * @param    flat       normalised master flat of @em npix pixels, or NULL
+ * @param    gain       gain map of @em npix pixels in e-/ADU, or NULL to use
+ *                      @em gain_value for all pixels
+ * @param    gain_value gain in e-/ADU, only used if @em gain is NULL
+ * @param    linearity  @em ncoeffs planes of @em npix nonlinearity correction
+ *                      coefficients, highest degree first, or NULL
+ * @param    ncoeffs    number of coefficient planes in @em linearity
+ * @param    dq_static  @em npix data quality flags that apply to every frame,
+ *                      e.g. from a bad pixel map, or NULL
+ * @param    read_noise read noise in electrons
+ * @param    saturation raw level at which pixels saturate, in ADU,
+ *                      or a non-positive value to not check
+ * @param    sci        output, @em nframes calibrated frames in electrons
+ * @param    err        output, @em nframes errors of @em sci, or NULL
+ * @param    dq         output, @em nframes data quality layers (bits of
+ *                      metis_dq_flag), or NULL
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * Every raw value r is, in this order,
+ * - corrected for nonlinearity: r * P(r), with the per-pixel polynomial P
+ *   evaluated in Horner's scheme,
+ * - dark subtracted and converted to electrons: s = (r - dark) * gain,
+ * - divided by the flat.
+ *
+ * The error is sqrt(max(s, 0) + read_noise^2) / flat, i.e. shot noise and
+ * read noise added in quadrature. The data quality layer combines
+ * @em dq_static with METIS_DQ_SATURATED for raw values at or above
+ * @em saturation, and METIS_DQ_INVALID for non-finite raw values or results
+ * and for non-positive flats. Invalid pixels are set to zero, with a zero
+ * error.
+ *
+ * All outputs are written in one traversal of the raw frames. The frames are
+ * cut into tiles of contiguous pixels that are calibrated in parallel if the
+ * library is built with OpenMP support, with the innermost loop vectorised.
+ * @em sci may be the same array as @em raw, to calibrate in place.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em raw or @em sci is NULL, or @em linearity is
+ *   NULL with a positive @em ncoeffs
+ * - CPL_ERROR_ILLEGAL_INPUT if @em nframes, @em npix or @em ncoeffs is
+ *   negative, or @em read_noise is negative
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_calibrate_frames(
+    const float *raw,
+    cpl_size     nframes,
+    cpl_size     npix,
+    const float *dark,
+    const float *flat,
+    const float *gain,
+    double       gain_value,
+    const float *linearity,
+    cpl_size     ncoeffs,
+    const int   *dq_static,
+    double       read_noise,
+    double       saturation,
+    float       *sci,
+    float       *err,
+    int         *dq)
+{
+  cpl_ensure_code(raw != NULL && sci != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(linearity != NULL || ncoeffs <= 0, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nframes >= 0 && npix >= 0 && ncoeffs >= 0,
+                  CPL_ERROR_ILLEGAL_INPUT);
+  cpl_ensure_code(read_noise >= 0.0, CPL_ERROR_ILLEGAL_INPUT);
+
+  const cpl_size ntiles = (npix + METIS_CALIBRATE_TILE - 1) / METIS_CALIBRATE_TILE;
+
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2) schedule(static)
+#endif
+  for (cpl_size n = 0; n < nframes; n++) {
+      for (cpl_size tile = 0; tile < ntiles; tile++) {
+          const cpl_size first = tile * METIS_CALIBRATE_TILE;
+          const cpl_size count = CPL_MIN(METIS_CALIBRATE_TILE, npix - first);
+          const cpl_size offset = n * npix + first;
+
+          metis_calibrate_tile(raw + offset,
+                               dark != NULL ? dark + first : NULL,
+                               flat != NULL ? flat + first : NULL,
+                               gain != NULL ? gain + first : NULL,
+                               gain_value,
+                               linearity != NULL ? linearity + first : NULL,
+                               ncoeffs, npix,
+                               dq_static != NULL ? dq_static + first : NULL,
+                               read_noise, saturation, count,
+                               sci + offset,
+                               err != NULL ? err + offset : NULL,
+                               dq != NULL ? dq + offset : NULL);
+      }
+  }
+
+  return CPL_ERROR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Correct a stack of frames for detector nonlinearity, in place
+ *
+ * @param    data       @em nframes frames of @em npix pixels, corrected in place
+ * @param    err        @em nframes errors of @em data, propagated in place,
+ *                      or NULL
+ * @param    dq         @em nframes data quality layers, to which
+ *                      METIS_DQ_NONLINEAR is added, or NULL
+ * @param    nframes    number of frames
+ * @param    npix       number of pixels per frame
+ * @param    coeffs     @em ncoeffs planes of @em npix correction coefficients,
+ *                      highest degree first
+ * @param    coeffs_err @em ncoeffs planes of the errors of @em coeffs, or NULL
+ * @param    ncoeffs    number of coefficient planes
+ * @param    coeffs_dq  @em npix flags of the coefficients, non-zero where the
+ *                      correction is not valid, or NULL
+ * @param    single     evaluate the polynomials in single precision
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * Every value r is replaced by r * P(r), with the polynomial P of its pixel
+ * evaluated in Horner's scheme, together with its derivative. The error e
+ * becomes sqrt((dy/dr * e)^2 + sum_k (r^(n-k) * s_k)^2), i.e. the propagated
+ * input error and the errors s_k of the n coefficients, assumed uncorrelated,
+ * added in quadrature.
+ *
+ * Pixels flagged in @em coeffs_dq and finite values for which the correction
+ * is not finite are left as they are and flagged as METIS_DQ_NONLINEAR.
+ * Non-finite values are left to the caller.
+ *
+ * The coefficients are evaluated in double precision, unless @em single is
+ * set; then they are converted to single precision once and the evaluation
+ * runs on twice as many pixels per vector instruction. That is only accurate
+ * if the polynomials are well conditioned over the range of the data, which
+ * the caller has to check. The frames are cut into tiles of contiguous pixels
+ * that are corrected in parallel if the library is built with OpenMP support.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em data or @em coeffs is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em nframes or @em npix is negative, or
+ *   @em ncoeffs is not positive
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_linearity_correct(
+    float        *data,
+    float        *err,
+    int          *dq,
+    cpl_size      nframes,
+    cpl_size      npix,
+    const double *coeffs,
+    const double *coeffs_err,
+    cpl_size      ncoeffs,
+    const int    *coeffs_dq,
+    cpl_boolean   single)
+{
+  cpl_ensure_code(data != NULL && coeffs != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nframes >= 0 && npix >= 0 && ncoeffs > 0,
+                  CPL_ERROR_ILLEGAL_INPUT);
+
+  const cpl_size ntiles = (npix + METIS_CALIBRATE_TILE - 1) / METIS_CALIBRATE_TILE;
+  float *coeffs_single = NULL;
+  float *coeffs_err_single = NULL;
+
+  /* Convert the coefficients once, rather than for every frame */
+  if (single) {
+      const cpl_size size = ncoeffs * npix;
+      coeffs_single = cpl_malloc(size * sizeof(*coeffs_single));
+      coeffs_err_single = coeffs_err != NULL
+          ? cpl_malloc(size * sizeof(*coeffs_err_single)) : NULL;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+      for (cpl_size i = 0; i < size; i++) {
+          coeffs_single[i] = (float)coeffs[i];
+          if (coeffs_err_single != NULL) {
+              coeffs_err_single[i] = (float)coeffs_err[i];
+          }
+      }
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2) schedule(static)
+#endif
+  for (cpl_size n = 0; n < nframes; n++) {
+      for (cpl_size tile = 0; tile < ntiles; tile++) {
+          const cpl_size first = tile * METIS_CALIBRATE_TILE;
+          const cpl_size count = CPL_MIN(METIS_CALIBRATE_TILE, npix - first);
+          const cpl_size offset = n * npix + first;
+          float value[METIS_CALIBRATE_TILE];
+          float slope[METIS_CALIBRATE_TILE];
+          float variance[METIS_CALIBRATE_TILE];
+
+          if (single) {
+              metis_linearity_horner_single(
+                  data + offset, coeffs_single + first,
+                  coeffs_err_single != NULL ? coeffs_err_single + first : NULL,
+                  ncoeffs, npix, count, value, slope, variance);
+          } else {
+              metis_linearity_horner(
+                  data + offset, coeffs + first,
+                  coeffs_err != NULL ? coeffs_err + first : NULL,
+                  ncoeffs, npix, count, value, slope, variance);
+          }
+
+          metis_linearity_apply(data + offset,
+                                err != NULL ? err + offset : NULL,
+                                dq != NULL ? dq + offset : NULL,
+                                coeffs_dq != NULL ? coeffs_dq + first : NULL,
+                                value, slope, variance, count);
+      }
+  }
+
+  cpl_free(coeffs_single);
+  cpl_free(coeffs_err_single);
+
+  return CPL_ERROR_NONE;
+}
+
+/**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Calibrate a tile of contiguous pixels of a single frame
+ *
+ * @param    raw        raw values of the tile
+ * @param    dark       dark values of the tile, or NULL
+ * @param    flat       flat values of the tile, or NULL
+ * @param    gain       gain values of the tile, or NULL
+ * @param    gain_value gain used if @em gain is NULL
+ * @param    linearity  first coefficient of the tile, or NULL
+ * @param    ncoeffs    number of coefficient planes
+ * @param    stride     distance between coefficient planes (pixels per frame)
+ * @param    dq_static  static flags of the tile, or NULL
+ * @param    read_noise read noise in electrons
+ * @param    saturation saturation level in ADU, ignored if not positive
+ * @param    count      number of pixels in the tile
+ * @param    sci        output values of the tile
+ * @param    err        output errors of the tile, or NULL
+ * @param    dq         output flags of the tile, or NULL
+ *
+ * Every step is a separate pass over a buffer of the tile, which stays in
+ * the cache, and the polynomial is evaluated one coefficient plane at a
+ * time. No loop branches, so that the compiler can vectorise all of them.
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_calibrate_tile(
+    const float *raw,
+    const float *dark,
+    const float *flat,
+    const float *gain,
+    double       gain_value,
+    const float *linearity,
+    cpl_size     ncoeffs,
+    cpl_size     stride,
+    const int   *dq_static,
+    double       read_noise,
+    double       saturation,
+    cpl_size     count,
+    float       *sci,
+    float       *err,
+    int         *dq)
+{
+  const float rn2 = (float)(read_noise * read_noise);
+  const float level = saturation > 0.0 ? (float)saturation : INFINITY;
+  float value[METIS_CALIBRATE_TILE];
+  float unity[METIS_CALIBRATE_TILE];
+  float sigma[METIS_CALIBRATE_TILE];
+  int flags[METIS_CALIBRATE_TILE];
+
+  /* Missing outputs are computed into scratch space, so the loops have no branches */
+  float *e = err != NULL ? err : sigma;
+  int *q = dq != NULL ? dq : flags;
+
+  /* Nonlinearity correction r * P(r), one coefficient plane at a time */
+  if (ncoeffs > 0) {
+      for (cpl_size j = 0; j < count; j++) {
+          value[j] = linearity[j];
+      }
+      for (cpl_size k = 1; k < ncoeffs; k++) {
+          const float *c = linearity + k * stride;
+          for (cpl_size j = 0; j < count; j++) {
+              value[j] = value[j] * raw[j] + c[j];
+          }
+      }
+      for (cpl_size j = 0; j < count; j++) {
+          value[j] *= raw[j];
+      }
+  } else {
+      for (cpl_size j = 0; j < count; j++) {
+          value[j] = raw[j];
+      }
+  }
+
+  if (dark != NULL) {
+      for (cpl_size j = 0; j < count; j++) {
+          value[j] -= dark[j];
+      }
+  }
+
+  if (gain != NULL) {
+      for (cpl_size j = 0; j < count; j++) {
+          value[j] *= gain[j];
+      }
+  } else {
+      const float g = (float)gain_value;
+      for (cpl_size j = 0; j < count; j++) {
+          value[j] *= g;
+      }
+  }
+
+  if (flat == NULL) {
+      for (cpl_size j = 0; j < count; j++) {
+          unity[j] = 1.0f;
+      }
+      flat = unity;
+  }
+
+  for (cpl_size j = 0; j < count; j++) {
+      q[j] = dq_static != NULL ? dq_static[j] : 0;
+  }
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (cpl_size j = 0; j < count; j++) {
+      const float electrons = value[j];
+      const float f = flat[j];
+      value[j] = electrons / f;
+      e[j] = sqrtf((electrons > 0.0f ? electrons : 0.0f) + rn2) / f;
+  }
+
+  /* Comparisons with NaN are false, so these also catch NaN */
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (cpl_size j = 0; j < count; j++) {
+      const float r = raw[j];
+      const int invalid = !(fabsf(r) <= FLT_MAX) | !(flat[j] > 0.0f) |
+                          !(fabsf(value[j]) <= FLT_MAX) | !(e[j] <= FLT_MAX);
+
+      q[j] |= (r >= level ? METIS_DQ_SATURATED : 0) |
+              (invalid ? METIS_DQ_INVALID : 0);
+      sci[j] = invalid ? 0.0f : value[j];
+      e[j] = invalid ? 0.0f : e[j];
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Evaluate the nonlinearity correction of a tile in double precision
+ *
+ * @param    raw        values of the tile
+ * @param    coeffs     first coefficient of the tile
+ * @param    coeffs_err first coefficient error of the tile, or NULL
+ * @param    ncoeffs    number of coefficient planes
+ * @param    stride     distance between coefficient planes (pixels per frame)
+ * @param    count      number of pixels in the tile
+ * @param    value      output, corrected values r * P(r)
+ * @param    slope      output, derivatives P(r) + r * P'(r) of the correction
+ * @param    variance   output, variances of the corrected values due to the
+ *                      coefficient errors, zero without @em coeffs_err
+ *
+ * The polynomial and its derivative are evaluated together, one coefficient
+ * plane at a time, and the coefficient variance is a polynomial in r^2 with
+ * the squared errors as coefficients, evaluated in the same way.
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_linearity_horner(
+    const float  *raw,
+    const double *coeffs,
+    const double *coeffs_err,
+    cpl_size      ncoeffs,
+    cpl_size      stride,
+    cpl_size      count,
+    float        *value,
+    float        *slope,
+    float        *variance)
+{
+  double p[METIS_CALIBRATE_TILE];
+  double d[METIS_CALIBRATE_TILE];
+
+  for (cpl_size j = 0; j < count; j++) {
+      p[j] = coeffs[j];
+      d[j] = 0.0;
+  }
+  for (cpl_size k = 1; k < ncoeffs; k++) {
+      const double *c = coeffs + k * stride;
+      for (cpl_size j = 0; j < count; j++) {
+          const double r = raw[j];
+          d[j] = d[j] * r + p[j];
+          p[j] = p[j] * r + c[j];
+      }
+  }
+  for (cpl_size j = 0; j < count; j++) {
+      const double r = raw[j];
+      value[j] = (float)(r * p[j]);
+      slope[j] = (float)(p[j] + r * d[j]);
+  }
+
+  if (coeffs_err == NULL) {
+      for (cpl_size j = 0; j < count; j++) {
+          variance[j] = 0.0f;
+      }
+      return;
+  }
+
+  /* p is reused for the variance */
+  for (cpl_size j = 0; j < count; j++) {
+      p[j] = coeffs_err[j] * coeffs_err[j];
+  }
+  for (cpl_size k = 1; k < ncoeffs; k++) {
+      const double *s = coeffs_err + k * stride;
+      for (cpl_size j = 0; j < count; j++) {
+          const double r = raw[j];
+          p[j] = p[j] * r * r + s[j] * s[j];
+      }
+  }
+  for (cpl_size j = 0; j < count; j++) {
+      const double r = raw[j];
+      variance[j] = (float)(r * r * p[j]);
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Evaluate the nonlinearity correction of a tile in single precision
+ *
+ * Same as metis_linearity_horner, with coefficients converted to float.
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_linearity_horner_single(
+    const float *raw,
+    const float *coeffs,
+    const float *coeffs_err,
+    cpl_size     ncoeffs,
+    cpl_size     stride,
+    cpl_size     count,
+    float       *value,
+    float       *slope,
+    float       *variance)
+{
+  for (cpl_size j = 0; j < count; j++) {
+      value[j] = coeffs[j];
+      slope[j] = 0.0f;
+  }
+  for (cpl_size k = 1; k < ncoeffs; k++) {
+      const float *c = coeffs + k * stride;
+      for (cpl_size j = 0; j < count; j++) {
+          const float r = raw[j];
+          slope[j] = slope[j] * r + value[j];
+          value[j] = value[j] * r + c[j];
+      }
+  }
+  for (cpl_size j = 0; j < count; j++) {
+      const float r = raw[j];
+      slope[j] = value[j] + r * slope[j];
+      value[j] = r * value[j];
+  }
+
+  if (coeffs_err == NULL) {
+      for (cpl_size j = 0; j < count; j++) {
+          variance[j] = 0.0f;
+      }
+      return;
+  }
+
+  for (cpl_size j = 0; j < count; j++) {
+      variance[j] = coeffs_err[j] * coeffs_err[j];
+  }
+  for (cpl_size k = 1; k < ncoeffs; k++) {
+      const float *s = coeffs_err + k * stride;
+      for (cpl_size j = 0; j < count; j++) {
+          const float r = raw[j];
+          variance[j] = variance[j] * r * r + s[j] * s[j];
+      }
+  }
+  for (cpl_size j = 0; j < count; j++) {
+      const float r = raw[j];
+      variance[j] *= r * r;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Replace the values of a tile by their corrections
+ *
+ * @param    data       values of the tile, corrected in place
+ * @param    err        errors of the tile, propagated in place, or NULL
+ * @param    dq         data quality flags of the tile, or NULL
+ * @param    coeffs_dq  flags of the coefficients of the tile, or NULL
+ * @param    value      corrected values
+ * @param    slope      derivatives of the correction
+ * @param    variance   variances due to the coefficient errors
+ * @param    count      number of pixels in the tile
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_linearity_apply(
+    float       *data,
+    float       *err,
+    int         *dq,
+    const int   *coeffs_dq,
+    const float *value,
+    const float *slope,
+    const float *variance,
+    cpl_size     count)
+{
+  float sigma[METIS_CALIBRATE_TILE];
+  int flags[METIS_CALIBRATE_TILE];
+  int valid[METIS_CALIBRATE_TILE];
+
+  /* Missing arrays are replaced by scratch space, so the loop has no branches */
+  float *e = err != NULL ? err : sigma;
+  int *q = dq != NULL ? dq : flags;
+
+  for (cpl_size j = 0; j < count; j++) {
+      valid[j] = coeffs_dq != NULL ? coeffs_dq[j] == 0 : 1;
+  }
+  if (err == NULL) {
+      for (cpl_size j = 0; j < count; j++) {
+          sigma[j] = 0.0f;
+      }
+  }
+  if (dq == NULL) {
+      for (cpl_size j = 0; j < count; j++) {
+          flags[j] = 0;
+      }
+  }
+
+  /* Comparisons with NaN are false, so these also catch NaN */
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (cpl_size j = 0; j < count; j++) {
+      const float s = slope[j];
+      const float propagated = sqrtf(s * s * e[j] * e[j] + variance[j]);
+      const int finite = fabsf(data[j]) <= FLT_MAX;
+      const int bad = (valid[j] == 0) | (finite & (!(fabsf(value[j]) <= FLT_MAX) |
+                                                   !(fabsf(s) <= FLT_MAX) |
+                                                   !(propagated <= FLT_MAX)));
+
+      data[j] = bad ? data[j] : value[j];
+      e[j] = bad ? e[j] : propagated;
+      q[j] |= bad ? METIS_DQ_NONLINEAR : 0;
+  }
+}
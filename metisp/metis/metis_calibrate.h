@@ -0,0 +1,81 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METIS_CALIBRATE_H
+#define METIS_CALIBRATE_H
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              New types
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Bits of the data quality (DQ) layer, combined with bitwise or */
+typedef enum {
+    METIS_DQ_GOOD      = 0,
+    METIS_DQ_BAD_PIXEL = 1 << 0,    /* flagged in a bad pixel map */
+    METIS_DQ_NONLINEAR = 1 << 1,    /* no valid nonlinearity correction */
+    METIS_DQ_SATURATED = 1 << 2,    /* raw value at or above saturation */
+    METIS_DQ_INVALID   = 1 << 3     /* non-finite value or non-positive flat */
+} metis_dq_flag;
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+cpl_error_code metis_calibrate_frames(
+    const float *raw,
+    cpl_size     nframes,
+    cpl_size     npix,
+    const float *dark,
+    const float *flat,
+    const float *gain,
+    double       gain_value,
+    const float *linearity,
+    cpl_size     ncoeffs,
+    const int   *dq_static,
+    double       read_noise,
+    double       saturation,
+    float       *sci,
+    float       *err,
+    int         *dq);
+
+cpl_error_code metis_linearity_correct(
+    float        *data,
+    float        *err,
+    int          *dq,
+    cpl_size      nframes,
+    cpl_size      npix,
+    const double *coeffs,
+    const double *coeffs_err,
+    cpl_size      ncoeffs,
+    const int    *coeffs_dq,
+    cpl_boolean   single);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "metis_chopnod.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_chopnod     Chop-nod differencing
+ *
+ * Kernels for the reduction of chopped and nodded sequences, in which every
+ * cycle observes the four beams of two chop positions at two nod positions.
+ * Both kernels only update running sums, so a sequence of any length is
+ * reduced in constant memory.
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Add a calibrated frame to the running sums of its beam
+ *
+ * @param    sci          calibrated frame of @em npix pixels
+ * @param    err          its error, or NULL
+ * @param    dq           its data quality layer, or NULL
+ * @param    npix         number of pixels of a frame
+ * @param    sum          sum of the values of the beam in the current cycle
+ * @param    sum_var      sum of the squared errors of the beam in the cycle
+ * @param    count        number of frames of the beam in the cycle
+ * @param    total        sum of the values of the beam over the sequence,
+ *                        or NULL
+ * @param    total_sq     sum of the squared values over the sequence, or NULL
+ * @param    total_count  number of frames over the sequence, or NULL
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * Every pixel with a finite value and no data quality flag is added to all
+ * given sums and counted. The sums of the current cycle give the mean of the
+ * beam and its error, those over the sequence its frame-to-frame scatter.
+ * The three sums over the sequence are either all given or all NULL.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em sci, @em sum, @em sum_var or @em count is
+ *   NULL, or only some of the sums over the sequence are
+ * - CPL_ERROR_ILLEGAL_INPUT if @em npix is negative
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_chopnod_add_frame(
+    const float          *sci,
+    const float          *err,
+    const int            *dq,
+    cpl_size              npix,
+    double               *sum,
+    double               *sum_var,
+    int                  *count,
+    double               *total,
+    double               *total_sq,
+    int                  *total_count)
+{
+  cpl_ensure_code(sci != NULL && sum != NULL && sum_var != NULL && count != NULL,
+                  CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code((total == NULL) == (total_sq == NULL) &&
+                  (total == NULL) == (total_count == NULL),
+                  CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(npix >= 0, CPL_ERROR_ILLEGAL_INPUT);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (cpl_size p = 0; p < npix; p++) {
+      const double value = sci[p];
+      if (!isfinite(value) || (dq != NULL && dq[p] != 0)) {
+          continue;
+      }
+      const double error = err != NULL ? err[p] : 0.0;
+
+      sum[p] += value;
+      sum_var[p] += error * error;
+      count[p] += 1;
+
+      if (total != NULL) {
+          total[p] += value;
+          total_sq[p] += value * value;
+          total_count[p] += 1;
+      }
+  }
+
+  return CPL_ERROR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Reject outliers of the double difference of a cycle and add it
+ *
+ * @param    difference   double difference (A - B) - (C - D) of a cycle,
+ *                        @em npix pixels
+ * @param    variance     its propagated variance
+ * @param    npix         number of pixels
+ * @param    reference    expected value of every pixel, or NULL for the mean
+ *                        of the cycles accumulated so far
+ * @param    kappa        rejection threshold in units of the propagated error,
+ *                        zero to accept every finite value
+ * @param    sum          sum of the accepted differences
+ * @param    sum_sq       sum of their squares
+ * @param    sum_var      sum of their variances
+ * @param    count        number of accepted cycles
+ * @param    rejected     number of rejected cycles
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * A pixel is rejected if it deviates from its reference by more than kappa
+ * times the square root of its variance. Pixels without a finite reference
+ * (including those without any accepted cycle yet, if @em reference is NULL)
+ * or without a positive variance are accepted as they are. Non-finite
+ * differences are neither accepted nor rejected.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if any argument but @em reference is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em npix or @em kappa is negative
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_chopnod_add_cycle(
+    const float          *difference,
+    const float          *variance,
+    cpl_size              npix,
+    const double         *reference,
+    double                kappa,
+    double               *sum,
+    double               *sum_sq,
+    double               *sum_var,
+    int                  *count,
+    int                  *rejected)
+{
+  cpl_ensure_code(difference != NULL && variance != NULL && sum != NULL &&
+                  sum_sq != NULL && sum_var != NULL && count != NULL &&
+                  rejected != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(npix >= 0 && kappa >= 0.0, CPL_ERROR_ILLEGAL_INPUT);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (cpl_size p = 0; p < npix; p++) {
+      const double value = difference[p];
+      const double var = variance[p];
+      if (!isfinite(value)) {
+          continue;
+      }
+
+      const double expected = reference != NULL ? reference[p]
+                            : count[p] > 0 ? sum[p] / count[p] : NAN;
+      if (kappa > 0.0 && var > 0.0 && isfinite(expected) &&
+          fabs(value - expected) > kappa * sqrt(var)) {
+          rejected[p] += 1;
+          continue;
+      }
+
+      sum[p] += value;
+      sum_sq[p] += value * value;
+      sum_var[p] += isfinite(var) ? var : 0.0;
+      count[p] += 1;
+  }
+
+  return CPL_ERROR_NONE;
+}
+
+/**@}*/
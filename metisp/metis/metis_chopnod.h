@@ -0,0 +1,61 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METIS_CHOPNOD_H
+#define METIS_CHOPNOD_H
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+cpl_error_code metis_chopnod_add_frame(
+    const float          *sci,
+    const float          *err,
+    const int            *dq,
+    cpl_size              npix,
+    double               *sum,
+    double               *sum_var,
+    int                  *count,
+    double               *total,
+    double               *total_sq,
+    int                  *total_count);
+
+cpl_error_code metis_chopnod_add_cycle(
+    const float          *difference,
+    const float          *variance,
+    cpl_size              npix,
+    const double         *reference,
+    double                kappa,
+    double               *sum,
+    double               *sum_sq,
+    double               *sum_var,
+    int                  *count,
+    int                  *rejected);
+
+#endif
@@ -0,0 +1,317 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "metis_combine.h"
+#include "metis_sigclip.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Number of neighbouring pixels whose stack columns are gathered together */
+#define METIS_COMBINE_TILE           512
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+static void metis_combine_tile(const float *, const unsigned char *,
+                               cpl_size, cpl_size, metis_combine_method,
+                               double, double, double, cpl_size,
+                               cpl_size, cpl_size,
+                               double *, double *, cpl_size *, float *,
+                               float *, float *, unsigned char *);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_combine     Combination of frame stacks
+ *
+ * Pixel-wise combination of a stack of frames together with the propagation
+ * of read and shot noise, in a single pass over the stack.
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Combine a stack of frames and propagate the error
+ *
+ * @param    stack      @em nframes planes of @em npix pixels
+ * @param    bpm        bad pixel flags with the same layout as @em stack,
+ *                      non-zero excludes a sample, or NULL if all are good
+ * @param    nframes    number of frames in the stack
+ * @param    npix       number of pixels per frame
+ * @param    method     combination method
+ * @param    read_noise read noise, in the units of @em stack
+ * @param    kappa_low  lower clipping threshold in standard deviations,
+ *                      only used by METIS_COMBINE_SIGCLIP
+ * @param    kappa_high upper clipping threshold in standard deviations,
+ *                      only used by METIS_COMBINE_SIGCLIP
+ * @param    niter      maximum number of clipping iterations,
+ *                      only used by METIS_COMBINE_SIGCLIP
+ * @param    combined   output, @em npix combined pixels
+ * @param    error      output, @em npix propagated errors, or NULL
+ * @param    rejected   output, @em npix flags, non-zero where no good sample
+ *                      was available, or NULL
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * Only the good samples of every pixel take part in the combination:
+ * - METIS_COMBINE_ADD: their sum,
+ * - METIS_COMBINE_AVERAGE: their mean,
+ * - METIS_COMBINE_MEDIAN: their median (the mean of the two central values
+ *   for an even number of samples),
+ * - METIS_COMBINE_SIGCLIP: the mean of the samples that survive iterative
+ *   clipping at @em kappa_low and @em kappa_high standard deviations around
+ *   the mean. The iteration stops when nothing more is rejected, when fewer
+ *   than two samples would remain, or after @em niter iterations
+ *   (see metis_sigclip_values()).
+ *
+ * The error of a pixel is sqrt(sum(s + read_noise^2) / n) over its n good
+ * samples s, i.e. read noise and shot noise added in quadrature. Negative
+ * variances, as may result from background-subtracted data, are clipped to
+ * zero. Pixels without any good sample are set to zero and flagged.
+ *
+ * The stack is read exactly once: the pixels are processed in tiles, and the
+ * columns of a tile are gathered plane by plane into a per-thread buffer, so
+ * no temporary proportional to the size of the stack is allocated.
+ * If the library is built with OpenMP support the tiles are processed in
+ * parallel.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em stack or @em combined is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em nframes, @em npix or @em niter is negative,
+ *   or a kappa is not positive
+ * - CPL_ERROR_UNSUPPORTED_MODE if @em method is unknown
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_combine_with_error(
+    const float         *stack,
+    const unsigned char *bpm,
+    cpl_size             nframes,
+    cpl_size             npix,
+    metis_combine_method method,
+    double               read_noise,
+    double               kappa_low,
+    double               kappa_high,
+    cpl_size             niter,
+    float               *combined,
+    float               *error,
+    unsigned char       *rejected)
+{
+  cpl_ensure_code(stack != NULL && combined != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nframes >= 0 && npix >= 0 && niter >= 0,
+                  CPL_ERROR_ILLEGAL_INPUT);
+  cpl_ensure_code(kappa_low > 0.0 && kappa_high > 0.0,
+                  CPL_ERROR_ILLEGAL_INPUT);
+  cpl_ensure_code(method == METIS_COMBINE_ADD ||
+                  method == METIS_COMBINE_AVERAGE ||
+                  method == METIS_COMBINE_MEDIAN ||
+                  method == METIS_COMBINE_SIGCLIP,
+                  CPL_ERROR_UNSUPPORTED_MODE);
+
+  const cpl_size ntiles = (npix + METIS_COMBINE_TILE - 1) / METIS_COMBINE_TILE;
+
+  if (ntiles == 0) {
+      return CPL_ERROR_NONE;
+  }
+
+  /* Only the order statistics need the gathered columns */
+  const int gather = method == METIS_COMBINE_MEDIAN ||
+                     method == METIS_COMBINE_SIGCLIP;
+
+#ifdef _OPENMP
+  const int nthreads = omp_get_max_threads();
+#else
+  const int nthreads = 1;
+#endif
+
+  /* Scratch space for one tile per thread: the running sums of the values
+   * and of the variances, the good sample counts and, if needed, the columns */
+  const size_t nsums = 2 * METIS_COMBINE_TILE * sizeof(double);
+  const size_t ncount = METIS_COMBINE_TILE * sizeof(cpl_size);
+  const size_t ncolumns = gather ? (size_t)METIS_COMBINE_TILE * (size_t)nframes
+                                   * sizeof(float) : 0;
+  const size_t scratch = nsums + ncount + ncolumns;
+  char *buffer = cpl_malloc((size_t)nthreads * scratch);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+  for (cpl_size tile = 0; tile < ntiles; tile++) {
+#ifdef _OPENMP
+      char *own = buffer + (size_t)omp_get_thread_num() * scratch;
+#else
+      char *own = buffer;
+#endif
+      const cpl_size first = tile * METIS_COMBINE_TILE;
+      const cpl_size count = CPL_MIN(METIS_COMBINE_TILE, npix - first);
+
+      metis_combine_tile(stack, bpm, nframes, npix, method,
+                         read_noise, kappa_low, kappa_high, niter,
+                         first, count,
+                         (double *)own,
+                         (double *)own + METIS_COMBINE_TILE,
+                         (cpl_size *)(own + nsums),
+                         gather ? (float *)(own + nsums + ncount) : NULL,
+                         combined, error, rejected);
+  }
+
+  cpl_free(buffer);
+
+  return CPL_ERROR_NONE;
+}
+
+/**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Combine all pixels of a single tile
+ *
+ * @param    stack      the whole stack
+ * @param    bpm        bad pixel flags of the whole stack, or NULL
+ * @param    nframes    number of frames in the stack
+ * @param    npix       number of pixels per frame
+ * @param    method     combination method
+ * @param    read_noise read noise
+ * @param    kappa_low  lower clipping threshold
+ * @param    kappa_high upper clipping threshold
+ * @param    niter      maximum number of clipping iterations
+ * @param    first      index of the first pixel of the tile
+ * @param    count      number of pixels in the tile
+ * @param    sum        scratch, METIS_COMBINE_TILE sums of the values
+ * @param    var        scratch, METIS_COMBINE_TILE sums of the variances
+ * @param    ngood      scratch, METIS_COMBINE_TILE good sample counts
+ * @param    columns    scratch, METIS_COMBINE_TILE columns of @em nframes
+ *                      values, or NULL if the method does not need them
+ * @param    combined   output combined pixels of the whole frame
+ * @param    error      output errors of the whole frame, or NULL
+ * @param    rejected   output flags of the whole frame, or NULL
+ *
+ * The frames are traversed in order and, for each frame, the pixels of the
+ * tile are visited contiguously, so the inner loop streams through memory.
+ * Only the good values are gathered, so each column holds exactly its
+ * @em ngood samples.
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_combine_tile(
+    const float         *stack,
+    const unsigned char *bpm,
+    cpl_size             nframes,
+    cpl_size             npix,
+    metis_combine_method method,
+    double               read_noise,
+    double               kappa_low,
+    double               kappa_high,
+    cpl_size             niter,
+    cpl_size             first,
+    cpl_size             count,
+    double              *sum,
+    double              *var,
+    cpl_size            *ngood,
+    float               *columns,
+    float               *combined,
+    float               *error,
+    unsigned char       *rejected)
+{
+  const double rn2 = read_noise * read_noise;
+
+  for (cpl_size j = 0; j < count; j++) {
+      sum[j] = 0.0;
+      var[j] = 0.0;
+      ngood[j] = 0;
+  }
+
+  for (cpl_size n = 0; n < nframes; n++) {
+      const float *plane = stack + n * npix + first;
+      const unsigned char *flags = bpm != NULL ? bpm + n * npix + first : NULL;
+
+      for (cpl_size j = 0; j < count; j++) {
+          if (flags != NULL && flags[j]) {
+              continue;
+          }
+          sum[j] += plane[j];
+          var[j] += plane[j] + rn2;
+          if (columns != NULL) {
+              columns[j * nframes + ngood[j]] = plane[j];
+          }
+          ngood[j]++;
+      }
+  }
+
+  for (cpl_size j = 0; j < count; j++) {
+      const cpl_size p = first + j;
+      const cpl_size m = ngood[j];
+      double stats[METIS_SIGCLIP_NSTATS];
+      double value = 0.0;
+
+      if (m > 0) {
+          switch (method) {
+          case METIS_COMBINE_ADD:
+              value = sum[j];
+              break;
+          case METIS_COMBINE_AVERAGE:
+              value = sum[j] / (double)m;
+              break;
+          case METIS_COMBINE_MEDIAN:
+              value = metis_sigclip_median(columns + j * nframes, m);
+              break;
+          case METIS_COMBINE_SIGCLIP:
+              metis_sigclip_values(columns + j * nframes, m, NULL,
+                                   METIS_SIGCLIP_MEAN, METIS_SIGCLIP_STDEV,
+                                   kappa_low, kappa_high, niter, stats);
+              value = stats[METIS_SIGCLIP_STAT_CENTRE];
+              break;
+          }
+      }
+
+      combined[p] = (float)value;
+      if (error != NULL) {
+          error[p] = m > 0 ? (float)sqrt(CPL_MAX(var[j] / (double)m, 0.0))
+                           : 0.0f;
+      }
+      if (rejected != NULL) {
+          rejected[p] = m == 0;
+      }
+  }
+}
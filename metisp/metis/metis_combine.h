@@ -0,0 +1,65 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METIS_COMBINE_H
+#define METIS_COMBINE_H
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              New types
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Methods to combine a stack of frames, in the order of `CombineMethodType` */
+typedef enum {
+    METIS_COMBINE_ADD = 0,
+    METIS_COMBINE_AVERAGE,
+    METIS_COMBINE_MEDIAN,
+    METIS_COMBINE_SIGCLIP
+} metis_combine_method;
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+cpl_error_code metis_combine_with_error(
+    const float         *stack,
+    const unsigned char *bpm,
+    cpl_size             nframes,
+    cpl_size             npix,
+    metis_combine_method method,
+    double               read_noise,
+    double               kappa_low,
+    double               kappa_high,
+    cpl_size             niter,
+    float               *combined,
+    float               *error,
+    unsigned char       *rejected);
+
+#endif
@@ -29,18 +29,104 @@
 
 #include "metis_dfs.h"
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*----------------------------------------------------------------------------*/
 /**
  * @defgroup metis_dfs  DFS related functions
  *
- * TBD
+ * Classification of frames by tag and tag-indexed access to framesets.
+ *
+ * The group of every known tag is kept in a registry, an open addressing hash
+ * table, so that classifying a frame costs a single hash of its tag whatever
+ * the number of known tags. The pipeline's own tags are registered on first
+ * use; recipes may add theirs with metis_dfs_register_tags().
  */
 /*----------------------------------------------------------------------------*/
 
 /**@{*/
 
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Number of slots of the registry, a power of two at least twice the number
+ * of tags, so that probe sequences stay short */
+#define METIS_DFS_SLOTS              (2 * METIS_DFS_MAX_TAGS)
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              New types
+ */
+/*----------------------------------------------------------------------------*/
+
+/* A run of frames with the same tag in a tag index */
+typedef struct {
+    const char *tag;
+    cpl_size    first;
+    cpl_size    count;
+} metis_dfs_tag_run;
+
+struct _metis_dfs_tag_index_ {
+    const cpl_frame  **frames;      /* all frames, grouped by tag, in input order within a tag */
+    metis_dfs_tag_run *runs;        /* sorted by tag */
+    cpl_size           nruns;
+};
+
+/* A frame with its tag and position, for sorting */
+typedef struct {
+    const char      *tag;
+    const cpl_frame *frame;
+    cpl_size         position;
+} metis_dfs_tagged_frame;
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+static uint64_t metis_dfs_hash(const char *);
+static cpl_size metis_dfs_find_slot(const char *);
+static cpl_error_code metis_dfs_insert(const metis_dfs_tag_group *);
+static void metis_dfs_ensure_defaults(void);
+static int metis_dfs_compare_tagged(const void *, const void *);
+static const metis_dfs_tag_run *metis_dfs_tag_index_find(const metis_dfs_tag_index *,
+                                                         const char *);
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                          Static variables
+ */
+/*----------------------------------------------------------------------------*/
+
+/* The tags of the pipeline itself */
+static const metis_dfs_tag_group metis_dfs_default_tags[] = {
+    /* RAW frames */
+    {METIS_RAW,                 CPL_FRAME_GROUP_RAW},
+    {METIS_OUT_PROCATG,         CPL_FRAME_GROUP_RAW},
+    /* CALIB frames */
+    {METIS_CALIB_RAW,           CPL_FRAME_GROUP_CALIB},
+    {METIS_OUT_CALIB_PROCATG,   CPL_FRAME_GROUP_CALIB},
+    {METIS_CALIB_FLAT,          CPL_FRAME_GROUP_CALIB},
+    {LINE_INTMON_TABLE,         CPL_FRAME_GROUP_CALIB},
+};
+
+/* The registry: empty slots have a NULL tag */
+static metis_dfs_tag_group metis_dfs_registry[METIS_DFS_SLOTS];
+static cpl_size metis_dfs_ntags = 0;
+static int metis_dfs_initialised = 0;
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions code
+ */
+/*----------------------------------------------------------------------------*/
+
 /*----------------------------------------------------------------------------*/
 /**
  * @brief    Set the group as RAW or CALIB in a frameset
@@ -49,6 +135,8 @@
  *
  * @return   CPL_ERROR_NONE iff OK
  *
+ * Frames without a tag or with a tag unknown to the registry are put in
+ * CPL_FRAME_GROUP_NONE.
  */
 /*----------------------------------------------------------------------------*/
 cpl_error_code metis_dfs_set_groups(cpl_frameset * set)
@@ -72,29 +160,363 @@ cpl_error_code metis_dfs_set_groups(cpl_frameset * set)
                           1 + (int)i, (int)nframes);
           cpl_frame_set_group(cur_frame, CPL_FRAME_GROUP_NONE);
 
-      } else if (!strcmp(tag, METIS_RAW                ) ||
-                 !strcmp(tag, METIS_OUT_PROCATG        ) ){
+      } else {
 
-          /* RAW frames */
-          cpl_frame_set_group(cur_frame, CPL_FRAME_GROUP_RAW);
+          const cpl_frame_group group = metis_dfs_get_group(tag);
 
-      } else if (!strcmp(tag, METIS_CALIB_RAW          ) ||
-                 !strcmp(tag, METIS_OUT_CALIB_PROCATG  ) ||
-                 !strcmp(tag, METIS_CALIB_FLAT     ) ||
-                 !strcmp(tag, LINE_INTMON_TABLE           ) ){
+          if (group == CPL_FRAME_GROUP_NONE) {
+              /* unknown tag frame */
+              cpl_msg_warning(cpl_func, "Frame:%lld with tag:<%s>, unknown!", i, tag);
+          }
+          cpl_frame_set_group(cur_frame, group);
+      }
+  }
 
-          /* CALIB frames */
-          cpl_frame_set_group(cur_frame, CPL_FRAME_GROUP_CALIB);
+  return cpl_error_get_code();
+}
 
-      } else {
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Add tags to the tag registry
+ *
+ * @param    entries    The tags and their groups
+ * @param    nentries   The number of entries
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * The registry keeps pointers to the tags, so they must stay valid for the
+ * lifetime of the process, e.g. string literals. Registering a known tag with
+ * the same group again is harmless. The entries are added in order, so on
+ * error the ones before the offending entry are registered.
+ *
+ * The registry is not locked against concurrent lookups: register all tags
+ * before frames are classified from several threads.
+ *
+ * Possible #_cpl_error_code_ set in this function:
+ * - CPL_ERROR_NULL_INPUT if @a entries or any of its tags is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @a nentries is negative, or if a tag is
+ *   already registered with a different group
+ * - CPL_ERROR_ACCESS_OUT_OF_RANGE if more than METIS_DFS_MAX_TAGS tags
+ *   would be registered
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_dfs_register_tags(
+    const metis_dfs_tag_group *entries,
+    cpl_size                   nentries)
+{
+  cpl_ensure_code(entries != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nentries >= 0, CPL_ERROR_ILLEGAL_INPUT);
 
-          /* unknown tag frame */
-          cpl_msg_warning(cpl_func, "Frame:%lld with tag:<%s>, unknown!", i, tag);
-          cpl_frame_set_group(cur_frame, CPL_FRAME_GROUP_NONE);
+  metis_dfs_ensure_defaults();
+
+  cpl_error_code code = CPL_ERROR_NONE;
+
+#ifdef _OPENMP
+#pragma omp critical (metis_dfs_registry)
+#endif
+  for (cpl_size i = 0; i < nentries && code == CPL_ERROR_NONE; i++) {
+      code = metis_dfs_insert(&entries[i]);
+  }
+
+  return code == CPL_ERROR_NONE ? CPL_ERROR_NONE
+                                : cpl_error_set(cpl_func, code);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Look up the frame group of a tag in the tag registry
+ *
+ * @param    tag    The tag
+ *
+ * @return   The group, or CPL_FRAME_GROUP_NONE if @a tag is NULL or unknown
+ */
+/*----------------------------------------------------------------------------*/
+cpl_frame_group metis_dfs_get_group(const char *tag)
+{
+  if (tag == NULL) {
+      return CPL_FRAME_GROUP_NONE;
+  }
+
+  metis_dfs_ensure_defaults();
+
+  const metis_dfs_tag_group *slot =
+      &metis_dfs_registry[metis_dfs_find_slot(tag)];
+
+  return slot->tag != NULL ? slot->group : CPL_FRAME_GROUP_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Index the frames of a frameset by tag
+ *
+ * @param    set    The frameset to index
+ *
+ * @return   The newly allocated index, or NULL on error
+ *
+ * The index refers to the frames of @a set without copying them, so it must
+ * not outlive @a set, and @a set must not be modified while it is in use.
+ * Frames without a tag are not indexed. Deallocate with
+ * metis_dfs_tag_index_delete().
+ *
+ * Possible #_cpl_error_code_ set in this function:
+ * - CPL_ERROR_NULL_INPUT if @a set is NULL
+ */
+/*----------------------------------------------------------------------------*/
+metis_dfs_tag_index *metis_dfs_tag_index_new(const cpl_frameset *set)
+{
+  cpl_ensure(set != NULL, CPL_ERROR_NULL_INPUT, NULL);
+
+  const cpl_size nframes = cpl_frameset_get_size(set);
+  metis_dfs_tagged_frame *tagged =
+      cpl_malloc((size_t)CPL_MAX(nframes, 1) * sizeof(*tagged));
+  cpl_size ntagged = 0;
+
+  for (cpl_size i = 0; i < nframes; i++) {
+      const cpl_frame *frame = cpl_frameset_get_position_const(set, i);
+      const char      *tag   = cpl_frame_get_tag(frame);
+
+      if (tag != NULL) {
+          tagged[ntagged].tag = tag;
+          tagged[ntagged].frame = frame;
+          tagged[ntagged].position = i;
+          ntagged++;
       }
   }
 
-  return cpl_error_get_code();
+  /* The position breaks ties, so the input order is kept within a tag */
+  qsort(tagged, (size_t)ntagged, sizeof(*tagged), metis_dfs_compare_tagged);
+
+  metis_dfs_tag_index *self = cpl_malloc(sizeof(*self));
+  self->frames = cpl_malloc((size_t)CPL_MAX(ntagged, 1) * sizeof(*self->frames));
+  self->runs = cpl_malloc((size_t)CPL_MAX(ntagged, 1) * sizeof(*self->runs));
+  self->nruns = 0;
+
+  for (cpl_size i = 0; i < ntagged; i++) {
+      self->frames[i] = tagged[i].frame;
+
+      if (i == 0 || strcmp(tagged[i].tag, tagged[i - 1].tag)) {
+          self->runs[self->nruns].tag = tagged[i].tag;
+          self->runs[self->nruns].first = i;
+          self->runs[self->nruns].count = 0;
+          self->nruns++;
+      }
+      self->runs[self->nruns - 1].count++;
+  }
+
+  cpl_free(tagged);
+
+  return self;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Deallocate a tag index
+ *
+ * @param    self   The index, may be NULL
+ *
+ * The frames themselves belong to the indexed frameset and are left alone.
+ */
+/*----------------------------------------------------------------------------*/
+void metis_dfs_tag_index_delete(metis_dfs_tag_index *self)
+{
+  if (self != NULL) {
+      cpl_free(self->frames);
+      cpl_free(self->runs);
+      cpl_free(self);
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Count the frames with a tag
+ *
+ * @param    self   The index
+ * @param    tag    The tag
+ *
+ * @return   The number of frames, zero if there are none, or -1 on error
+ *
+ * Possible #_cpl_error_code_ set in this function:
+ * - CPL_ERROR_NULL_INPUT if @a self or @a tag is NULL
+ */
+/*----------------------------------------------------------------------------*/
+cpl_size metis_dfs_tag_index_count(
+    const metis_dfs_tag_index *self,
+    const char                *tag)
+{
+  cpl_ensure(self != NULL && tag != NULL, CPL_ERROR_NULL_INPUT, -1);
+
+  const metis_dfs_tag_run *run = metis_dfs_tag_index_find(self, tag);
+
+  return run != NULL ? run->count : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Get a frame with a tag
+ *
+ * @param    self       The index
+ * @param    tag        The tag
+ * @param    position   The position among the frames with @a tag, in the
+ *                      order of the indexed frameset
+ *
+ * @return   The frame, owned by the indexed frameset, or NULL on error
+ *
+ * Possible #_cpl_error_code_ set in this function:
+ * - CPL_ERROR_NULL_INPUT if @a self or @a tag is NULL
+ * - CPL_ERROR_ACCESS_OUT_OF_RANGE if there are no more than @a position
+ *   frames with @a tag
+ */
+/*----------------------------------------------------------------------------*/
+const cpl_frame *metis_dfs_tag_index_get(
+    const metis_dfs_tag_index *self,
+    const char                *tag,
+    cpl_size                   position)
+{
+  cpl_ensure(self != NULL && tag != NULL, CPL_ERROR_NULL_INPUT, NULL);
+
+  const metis_dfs_tag_run *run = metis_dfs_tag_index_find(self, tag);
+
+  cpl_ensure(run != NULL && position >= 0 && position < run->count,
+             CPL_ERROR_ACCESS_OUT_OF_RANGE, NULL);
+
+  return self->frames[run->first + position];
 }
 
 /**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    FNV-1a hash of a tag
+ */
+/*----------------------------------------------------------------------------*/
+static uint64_t metis_dfs_hash(const char *tag)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (const unsigned char *c = (const unsigned char *)tag; *c != '\0'; c++) {
+      hash ^= *c;
+      hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Find the registry slot of a tag, or the empty slot it would go to
+ *
+ * The registry is never more than half full, so linear probing terminates.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size metis_dfs_find_slot(const char *tag)
+{
+  cpl_size slot = (cpl_size)(metis_dfs_hash(tag) & (METIS_DFS_SLOTS - 1));
+
+  while (metis_dfs_registry[slot].tag != NULL &&
+         strcmp(metis_dfs_registry[slot].tag, tag)) {
+      slot = (slot + 1) & (METIS_DFS_SLOTS - 1);
+  }
+
+  return slot;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Insert a single entry into the registry, without setting an error
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_error_code metis_dfs_insert(const metis_dfs_tag_group *entry)
+{
+  if (entry->tag == NULL) {
+      return CPL_ERROR_NULL_INPUT;
+  }
+
+  metis_dfs_tag_group *slot = &metis_dfs_registry[metis_dfs_find_slot(entry->tag)];
+
+  if (slot->tag != NULL) {
+      return slot->group == entry->group ? CPL_ERROR_NONE
+                                         : CPL_ERROR_ILLEGAL_INPUT;
+  }
+
+  if (metis_dfs_ntags >= METIS_DFS_MAX_TAGS) {
+      return CPL_ERROR_ACCESS_OUT_OF_RANGE;
+  }
+
+  *slot = *entry;
+  metis_dfs_ntags++;
+
+  return CPL_ERROR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Register the pipeline's own tags, once
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_dfs_ensure_defaults(void)
+{
+#ifdef _OPENMP
+#pragma omp critical (metis_dfs_registry)
+#endif
+  if (!metis_dfs_initialised) {
+      const size_t n = sizeof(metis_dfs_default_tags) /
+                       sizeof(metis_dfs_default_tags[0]);
+
+      for (size_t i = 0; i < n; i++) {
+          (void)metis_dfs_insert(&metis_dfs_default_tags[i]);
+      }
+      metis_dfs_initialised = 1;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Order tagged frames by tag, then by position in the frameset
+ */
+/*----------------------------------------------------------------------------*/
+static int metis_dfs_compare_tagged(const void *a, const void *b)
+{
+  const metis_dfs_tagged_frame *fa = a;
+  const metis_dfs_tagged_frame *fb = b;
+  const int order = strcmp(fa->tag, fb->tag);
+
+  if (order != 0) {
+      return order;
+  }
+
+  return (fa->position > fb->position) - (fa->position < fb->position);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Find the run of frames with a tag by bisection, or NULL
+ */
+/*----------------------------------------------------------------------------*/
+static const metis_dfs_tag_run *metis_dfs_tag_index_find(
+    const metis_dfs_tag_index *self,
+    const char                *tag)
+{
+  cpl_size low = 0;
+  cpl_size high = self->nruns;
+
+  while (low < high) {
+      const cpl_size mid = low + (high - low) / 2;
+      const int order = strcmp(self->runs[mid].tag, tag);
+
+      if (order == 0) {
+          return &self->runs[mid];
+      } else if (order < 0) {
+          low = mid + 1;
+      } else {
+          high = mid;
+      }
+  }
+
+  return NULL;
+}
@@ -49,6 +49,24 @@
 #define METIS_OUT_PROCATG            "METIS_DOCATG_RESULT"
 #define METIS_OUT_CALIB_PROCATG      "METIS_DOCATG_CALIB_RESULT"
 
+/* Maximum number of distinct tags in the tag registry */
+#define METIS_DFS_MAX_TAGS           512
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              New types
+ */
+/*----------------------------------------------------------------------------*/
+
+/* An entry of the tag registry: the frame group of all frames with a tag */
+typedef struct {
+    const char      *tag;
+    cpl_frame_group  group;
+} metis_dfs_tag_group;
+
+/* A read-only view of a frameset, grouped by tag */
+typedef struct _metis_dfs_tag_index_ metis_dfs_tag_index;
+
 /*----------------------------------------------------------------------------*/
 /**
  *                              Functions prototypes
@@ -57,4 +75,23 @@
 
 cpl_error_code metis_dfs_set_groups(cpl_frameset *);
 
+cpl_error_code metis_dfs_register_tags(
+    const metis_dfs_tag_group *entries,
+    cpl_size                   nentries);
+
+cpl_frame_group metis_dfs_get_group(const char *tag);
+
+metis_dfs_tag_index *metis_dfs_tag_index_new(const cpl_frameset *set);
+
+void metis_dfs_tag_index_delete(metis_dfs_tag_index *self);
+
+cpl_size metis_dfs_tag_index_count(
+    const metis_dfs_tag_index *self,
+    const char                *tag);
+
+const cpl_frame *metis_dfs_tag_index_get(
+    const metis_dfs_tag_index *self,
+    const char                *tag,
+    cpl_size                   position);
+
 #endif
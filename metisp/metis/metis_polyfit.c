@@ -0,0 +1,574 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "metis_polyfit.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Number of neighbouring pixels whose normal equations are accumulated together */
+#define METIS_POLYFIT_TILE           512
+
+/* Size of the per-pixel normal equations (number of coefficients) */
+#define METIS_POLYFIT_MAX_NCOEFFS    (METIS_POLYFIT_MAX_DEGREE + 1)
+
+/* Upper bound on the number of Jacobi sweeps in the condition estimate */
+#define METIS_POLYFIT_MAX_SWEEPS     64
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+static int metis_polyfit_is_conditioned(const double *, cpl_size);
+static int metis_polyfit_solve(const double *, const double *, cpl_size,
+                               double *, double *);
+static void metis_polyfit_tile(const double *, const double *, const double *,
+                               cpl_size, cpl_size, cpl_size, cpl_size, cpl_size,
+                               double *, double *, double *,
+                               double *, double *, unsigned char *);
+static void metis_polyfit_pixel(const double *, const double *, cpl_size,
+                                cpl_size, double, double, cpl_size, cpl_size,
+                                double *, double *, unsigned char *);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_polyfit     Per-pixel polynomial fitting
+ *
+ * Weighted least-squares polynomial fits of a stack of samples, one
+ * independent fit per pixel, as needed by the detector linearity calibration.
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Fit a weighted polynomial to every pixel of a sample stack
+ *
+ * @param    x          abscissae, @em nsamples planes of @em npix pixels
+ * @param    y          ordinates, same layout as @em x
+ * @param    w          weights, same layout as @em x (zero excludes a sample)
+ * @param    nsamples   number of samples per pixel
+ * @param    npix       number of pixels per plane
+ * @param    degree     degree of the fitted polynomial
+ * @param    coeffs     output, @em degree + 1 planes of @em npix coefficients,
+ *                      highest degree first (as @c numpy.polyfit)
+ * @param    cov_diag   output, same layout as @em coeffs, the diagonal of the
+ *                      unscaled coefficient covariance matrix, or NULL
+ * @param    ok         output, @em npix flags, non-zero where the fit is
+ *                      well conditioned, or NULL
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * The residuals are multiplied by the weights, so the normal equations carry
+ * the squared weights. To keep them well conditioned the abscissae of every
+ * pixel are divided by their largest absolute value among the weighted samples
+ * before the normal equations are formed, and the solution is transformed back
+ * afterwards.
+ *
+ * The normal equations are accumulated over tiles of neighbouring pixels while
+ * streaming through the sample planes, so no temporary proportional to the
+ * size of the stack is ever allocated. Each system is solved by a Cholesky
+ * decomposition. A fit is flagged as bad (and its coefficients and variances
+ * set to zero) if the 2-norm condition number of its normal equations matrix
+ * reaches the reciprocal of the machine epsilon, or if the decomposition fails.
+ *
+ * If the library is built with OpenMP support the tiles are processed in
+ * parallel.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em x, @em y, @em w or @em coeffs is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em nsamples or @em npix is negative
+ * - CPL_ERROR_UNSUPPORTED_MODE if @em degree is negative or larger than
+ *   METIS_POLYFIT_MAX_DEGREE
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_polyfit_weighted(
+    const double  *x,
+    const double  *y,
+    const double  *w,
+    cpl_size       nsamples,
+    cpl_size       npix,
+    cpl_size       degree,
+    double        *coeffs,
+    double        *cov_diag,
+    unsigned char *ok)
+{
+  cpl_ensure_code(x != NULL && y != NULL && w != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(coeffs != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nsamples >= 0 && npix >= 0, CPL_ERROR_ILLEGAL_INPUT);
+  cpl_ensure_code(degree >= 0 && degree <= METIS_POLYFIT_MAX_DEGREE,
+                  CPL_ERROR_UNSUPPORTED_MODE);
+
+  const cpl_size ntiles = (npix + METIS_POLYFIT_TILE - 1) / METIS_POLYFIT_TILE;
+
+  if (ntiles == 0) {
+      return CPL_ERROR_NONE;
+  }
+
+#ifdef _OPENMP
+  const int nthreads = omp_get_max_threads();
+#else
+  const int nthreads = 1;
+#endif
+
+  /* Scratch space for one tile per thread: the scale of every pixel,
+   * the 2 * degree + 1 power sums and the degree + 1 right-hand sides */
+  const cpl_size scratch = METIS_POLYFIT_TILE * (1 + (2 * degree + 1) + (degree + 1));
+  double *buffer = cpl_malloc((size_t)nthreads * (size_t)scratch * sizeof(*buffer));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+  for (cpl_size tile = 0; tile < ntiles; tile++) {
+#ifdef _OPENMP
+      double *own = buffer + (size_t)omp_get_thread_num() * (size_t)scratch;
+#else
+      double *own = buffer;
+#endif
+      const cpl_size first = tile * METIS_POLYFIT_TILE;
+      const cpl_size count = CPL_MIN(METIS_POLYFIT_TILE, npix - first);
+
+      metis_polyfit_tile(x, y, w, nsamples, npix, degree, first, count,
+                         own,
+                         own + METIS_POLYFIT_TILE,
+                         own + METIS_POLYFIT_TILE * (2 * degree + 2),
+                         coeffs, cov_diag, ok);
+  }
+
+  cpl_free(buffer);
+
+  return CPL_ERROR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Solve per-pixel polynomial normal equations accumulated elsewhere
+ *
+ * @param    sums       the 2 * @em degree + 1 weighted power sums of every
+ *                      pixel, as planes of @em npix values: plane k holds the
+ *                      sum of w^2 (x / reference)^k
+ * @param    rhs        the @em degree + 1 right-hand sides, same layout:
+ *                      plane k holds the sum of w^2 (x / reference)^k y
+ * @param    scale      @em npix abscissa scales, the largest |x| among the
+ *                      weighted samples of every pixel
+ * @param    reference  the abscissa unit the sums were accumulated in
+ * @param    npix       number of pixels per plane
+ * @param    degree     degree of the fitted polynomial
+ * @param    coeffs     output, as for metis_polyfit_weighted()
+ * @param    cov_diag   output, as for metis_polyfit_weighted(), or NULL
+ * @param    ok         output, as for metis_polyfit_weighted(), or NULL
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * This is the second half of metis_polyfit_weighted(), for callers that
+ * stream the samples and only keep the normal equations: the memory then
+ * scales with the degree instead of the number of samples. The sums are
+ * accumulated with any fixed abscissa unit (which should keep the powers in
+ * range), and every system is converted to the per-pixel @em scale before it
+ * is solved, so the conditioning test and the results are the same as those
+ * of metis_polyfit_weighted() on the full stack, up to rounding.
+ *
+ * If the library is built with OpenMP support the pixels are solved in
+ * parallel.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em sums, @em rhs, @em scale or @em coeffs is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em npix is negative or @em reference is not
+ *   positive
+ * - CPL_ERROR_UNSUPPORTED_MODE if @em degree is negative or larger than
+ *   METIS_POLYFIT_MAX_DEGREE
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_polyfit_from_sums(
+    const double  *sums,
+    const double  *rhs,
+    const double  *scale,
+    double         reference,
+    cpl_size       npix,
+    cpl_size       degree,
+    double        *coeffs,
+    double        *cov_diag,
+    unsigned char *ok)
+{
+  cpl_ensure_code(sums != NULL && rhs != NULL && scale != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(coeffs != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(npix >= 0 && reference > 0.0, CPL_ERROR_ILLEGAL_INPUT);
+  cpl_ensure_code(degree >= 0 && degree <= METIS_POLYFIT_MAX_DEGREE,
+                  CPL_ERROR_UNSUPPORTED_MODE);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (cpl_size p = 0; p < npix; p++) {
+      const double s = scale[p] > 0.0 ? scale[p] : 1.0;
+      metis_polyfit_pixel(sums + p, rhs + p, npix, degree, reference / s, s,
+                          npix, p, coeffs, cov_diag, ok);
+  }
+
+  return CPL_ERROR_NONE;
+}
+
+/**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Fit all pixels of a single tile
+ *
+ * @param    x          abscissae of the whole stack
+ * @param    y          ordinates of the whole stack
+ * @param    w          weights of the whole stack
+ * @param    nsamples   number of samples per pixel
+ * @param    npix       number of pixels per plane
+ * @param    degree     degree of the fitted polynomial
+ * @param    first      index of the first pixel of the tile
+ * @param    count      number of pixels in the tile
+ * @param    scale      scratch, METIS_POLYFIT_TILE abscissa scales
+ * @param    sums       scratch, 2 * degree + 1 rows of power sums
+ * @param    rhs        scratch, degree + 1 rows of right-hand sides
+ * @param    coeffs     output coefficients of the whole plane
+ * @param    cov_diag   output variances of the whole plane, or NULL
+ * @param    ok         output flags of the whole plane, or NULL
+ *
+ * The sample planes are traversed in order and, for each plane, the pixels of
+ * the tile are visited contiguously, so the inner loop streams through memory.
+ * The normal equations matrix of a polynomial fit is a Hankel matrix, hence only
+ * the 2 * degree + 1 distinct power sums are accumulated.
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_polyfit_tile(
+    const double  *x,
+    const double  *y,
+    const double  *w,
+    cpl_size       nsamples,
+    cpl_size       npix,
+    cpl_size       degree,
+    cpl_size       first,
+    cpl_size       count,
+    double        *scale,
+    double        *sums,
+    double        *rhs,
+    double        *coeffs,
+    double        *cov_diag,
+    unsigned char *ok)
+{
+  const cpl_size ncoeffs = degree + 1;
+  const cpl_size T = METIS_POLYFIT_TILE;
+
+  /* Per-pixel scale: the largest |x| among samples with non-zero weight */
+  for (cpl_size j = 0; j < count; j++) {
+      scale[j] = 0.0;
+  }
+  for (cpl_size n = 0; n < nsamples; n++) {
+      const cpl_size offset = n * npix + first;
+      for (cpl_size j = 0; j < count; j++) {
+          if (w[offset + j] != 0.0) {
+              scale[j] = CPL_MAX(scale[j], fabs(x[offset + j]));
+          }
+      }
+  }
+  for (cpl_size j = 0; j < count; j++) {
+      if (!(scale[j] > 0.0)) {
+          scale[j] = 1.0;
+      }
+  }
+
+  memset(sums, 0, (size_t)(2 * degree + 1) * (size_t)T * sizeof(*sums));
+  memset(rhs, 0, (size_t)ncoeffs * (size_t)T * sizeof(*rhs));
+
+  /* Accumulate the weighted power sums and right-hand sides */
+  for (cpl_size n = 0; n < nsamples; n++) {
+      const cpl_size offset = n * npix + first;
+      for (cpl_size j = 0; j < count; j++) {
+          const double wv = w[offset + j];
+          if (wv == 0.0) {
+              continue;
+          }
+          const double xs = x[offset + j] / scale[j];
+          const double yv = y[offset + j];
+          double power = wv * wv;
+
+          for (cpl_size k = 0; k < ncoeffs; k++) {
+              sums[k * T + j] += power;
+              rhs[k * T + j] += power * yv;
+              power *= xs;
+          }
+          for (cpl_size k = ncoeffs; k < 2 * degree + 1; k++) {
+              sums[k * T + j] += power;
+              power *= xs;
+          }
+      }
+  }
+
+  /* Solve every pixel and transform back from the scaled abscissae */
+  for (cpl_size j = 0; j < count; j++) {
+      metis_polyfit_pixel(sums + j, rhs + j, T, degree, 1.0, scale[j],
+                          npix, first + j, coeffs, cov_diag, ok);
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Solve the normal equations of a single pixel and store the result
+ *
+ * @param    sums       the first of the 2 * degree + 1 power sums of the pixel
+ * @param    rhs        the first of the degree + 1 right-hand sides of the pixel
+ * @param    stride     distance between consecutive sums (and right-hand sides)
+ * @param    degree     degree of the fitted polynomial
+ * @param    rescale    factor that converts the abscissae the sums were
+ *                      accumulated for into units of @em scale
+ * @param    scale      the abscissa scale the system is solved at
+ * @param    npix       number of pixels per output plane
+ * @param    p          index of the pixel in the output planes
+ * @param    coeffs     output coefficients of the whole plane
+ * @param    cov_diag   output variances of the whole plane, or NULL
+ * @param    ok         output flags of the whole plane, or NULL
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_polyfit_pixel(
+    const double  *sums,
+    const double  *rhs,
+    cpl_size       stride,
+    cpl_size       degree,
+    double         rescale,
+    double         scale,
+    cpl_size       npix,
+    cpl_size       p,
+    double        *coeffs,
+    double        *cov_diag,
+    unsigned char *ok)
+{
+  double a[METIS_POLYFIT_MAX_NCOEFFS * METIS_POLYFIT_MAX_NCOEFFS];
+  double b[METIS_POLYFIT_MAX_NCOEFFS];
+  double c[METIS_POLYFIT_MAX_NCOEFFS];
+  double v[METIS_POLYFIT_MAX_NCOEFFS];
+  double powers[2 * METIS_POLYFIT_MAX_DEGREE + 1];
+  const cpl_size ncoeffs = degree + 1;
+
+  powers[0] = 1.0;
+  for (cpl_size k = 1; k < 2 * degree + 1; k++) {
+      powers[k] = powers[k - 1] * rescale;
+  }
+
+  for (cpl_size r = 0; r < ncoeffs; r++) {
+      b[r] = rhs[r * stride] * powers[r];
+      for (cpl_size s = 0; s < ncoeffs; s++) {
+          a[r * ncoeffs + s] = sums[(r + s) * stride] * powers[r + s];
+      }
+  }
+
+  const int good = metis_polyfit_is_conditioned(a, ncoeffs) &&
+                   metis_polyfit_solve(a, b, ncoeffs, c, v);
+
+  double factor = 1.0;
+  for (cpl_size k = 0; k < ncoeffs; k++) {
+      /* Highest degree first, as numpy.polyfit */
+      const cpl_size plane = (degree - k) * npix + p;
+      coeffs[plane] = good ? c[k] / factor : 0.0;
+      if (cov_diag != NULL) {
+          cov_diag[plane] = good ? v[k] / (factor * factor) : 0.0;
+      }
+      factor *= scale;
+  }
+  if (ok != NULL) {
+      ok[p] = (unsigned char)good;
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Check the conditioning of a symmetric normal equations matrix
+ *
+ * @param    a          the matrix, @em n x @em n, row-major
+ * @param    n          its size
+ *
+ * @return   1 if the 2-norm condition number is below 1 / DBL_EPSILON, else 0
+ *
+ * The eigenvalues are found with the cyclic Jacobi method, which is exact
+ * enough for the tiny systems involved. For a symmetric matrix their absolute
+ * values are the singular values, so the ratio of the extreme ones is the same
+ * condition number as computed by @c numpy.linalg.cond.
+ */
+/*----------------------------------------------------------------------------*/
+static int metis_polyfit_is_conditioned(const double *a, cpl_size n)
+{
+  double m[METIS_POLYFIT_MAX_NCOEFFS * METIS_POLYFIT_MAX_NCOEFFS];
+  memcpy(m, a, (size_t)(n * n) * sizeof(*m));
+
+  for (int sweep = 0; sweep < METIS_POLYFIT_MAX_SWEEPS; sweep++) {
+      double off = 0.0;
+      double total = 0.0;
+      for (cpl_size r = 0; r < n; r++) {
+          for (cpl_size s = 0; s < n; s++) {
+              const double sq = m[r * n + s] * m[r * n + s];
+              total += sq;
+              if (r != s) {
+                  off += sq;
+              }
+          }
+      }
+      if (!isfinite(total)) {
+          return 0;
+      }
+      if (off <= DBL_EPSILON * DBL_EPSILON * total) {
+          break;
+      }
+
+      for (cpl_size p = 0; p < n - 1; p++) {
+          for (cpl_size q = p + 1; q < n; q++) {
+              const double apq = m[p * n + q];
+              if (apq == 0.0) {
+                  continue;
+              }
+              const double theta = (m[q * n + q] - m[p * n + p]) / (2.0 * apq);
+              const double t = (theta >= 0.0 ? 1.0 : -1.0) /
+                               (fabs(theta) + sqrt(theta * theta + 1.0));
+              const double c = 1.0 / sqrt(t * t + 1.0);
+              const double s = t * c;
+
+              for (cpl_size k = 0; k < n; k++) {
+                  const double mkp = m[k * n + p];
+                  const double mkq = m[k * n + q];
+                  m[k * n + p] = c * mkp - s * mkq;
+                  m[k * n + q] = s * mkp + c * mkq;
+              }
+              for (cpl_size k = 0; k < n; k++) {
+                  const double mpk = m[p * n + k];
+                  const double mqk = m[q * n + k];
+                  m[p * n + k] = c * mpk - s * mqk;
+                  m[q * n + k] = s * mpk + c * mqk;
+              }
+          }
+      }
+  }
+
+  double lmin = fabs(m[0]);
+  double lmax = fabs(m[0]);
+  for (cpl_size k = 1; k < n; k++) {
+      lmin = CPL_MIN(lmin, fabs(m[k * n + k]));
+      lmax = CPL_MAX(lmax, fabs(m[k * n + k]));
+  }
+
+  return lmin > 0.0 && lmax / lmin < 1.0 / DBL_EPSILON;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Solve a symmetric positive definite system by Cholesky decomposition
+ *
+ * @param    a          the matrix, @em n x @em n, row-major
+ * @param    b          the right-hand side
+ * @param    n          the size of the system
+ * @param    x          output, the solution
+ * @param    inv_diag   output, the diagonal of the inverse of @em a
+ *
+ * @return   1 on success, 0 if the matrix is not numerically positive definite
+ */
+/*----------------------------------------------------------------------------*/
+static int metis_polyfit_solve(const double *a, const double *b, cpl_size n,
+                               double *x, double *inv_diag)
+{
+  double l[METIS_POLYFIT_MAX_NCOEFFS * METIS_POLYFIT_MAX_NCOEFFS];
+  double li[METIS_POLYFIT_MAX_NCOEFFS * METIS_POLYFIT_MAX_NCOEFFS];
+  double z[METIS_POLYFIT_MAX_NCOEFFS];
+
+  /* a = l * l^T */
+  for (cpl_size r = 0; r < n; r++) {
+      for (cpl_size s = 0; s <= r; s++) {
+          double sum = a[r * n + s];
+          for (cpl_size k = 0; k < s; k++) {
+              sum -= l[r * n + k] * l[s * n + k];
+          }
+          if (r == s) {
+              if (!(sum > 0.0)) {
+                  return 0;
+              }
+              l[r * n + r] = sqrt(sum);
+          } else {
+              l[r * n + s] = sum / l[s * n + s];
+          }
+      }
+  }
+
+  /* Forward and back substitution */
+  for (cpl_size r = 0; r < n; r++) {
+      double sum = b[r];
+      for (cpl_size k = 0; k < r; k++) {
+          sum -= l[r * n + k] * z[k];
+      }
+      z[r] = sum / l[r * n + r];
+  }
+  for (cpl_size r = n - 1; r >= 0; r--) {
+      double sum = z[r];
+      for (cpl_size k = r + 1; k < n; k++) {
+          sum -= l[k * n + r] * x[k];
+      }
+      x[r] = sum / l[r * n + r];
+  }
+
+  /* inv(a) = inv(l)^T * inv(l), so its diagonal is the column norms of inv(l) */
+  for (cpl_size s = 0; s < n; s++) {
+      li[s * n + s] = 1.0 / l[s * n + s];
+      for (cpl_size r = s + 1; r < n; r++) {
+          double sum = 0.0;
+          for (cpl_size k = s; k < r; k++) {
+              sum -= l[r * n + k] * li[k * n + s];
+          }
+          li[r * n + s] = sum / l[r * n + r];
+      }
+  }
+  for (cpl_size s = 0; s < n; s++) {
+      double sum = 0.0;
+      for (cpl_size r = s; r < n; r++) {
+          sum += li[r * n + s] * li[r * n + s];
+      }
+      inv_diag[s] = sum;
+  }
+
+  return 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METIS_POLYFIT_H
+#define METIS_POLYFIT_H
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Highest polynomial degree supported by the per-pixel fitting kernel */
+#define METIS_POLYFIT_MAX_DEGREE     15
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+cpl_error_code metis_polyfit_weighted(
+    const double  *x,
+    const double  *y,
+    const double  *w,
+    cpl_size       nsamples,
+    cpl_size       npix,
+    cpl_size       degree,
+    double        *coeffs,
+    double        *cov_diag,
+    unsigned char *ok);
+
+cpl_error_code metis_polyfit_from_sums(
+    const double  *sums,
+    const double  *rhs,
+    const double  *scale,
+    double         reference,
+    cpl_size       npix,
+    cpl_size       degree,
+    double        *coeffs,
+    double        *cov_diag,
+    unsigned char *ok);
+
+#endif
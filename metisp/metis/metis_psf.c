@@ -0,0 +1,399 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "metis_psf.h"
+#include "metis_sigclip.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Clipping of the background annulus, in units of its MAD-based sigma */
+#define METIS_PSF_KAPPA              3.0
+
+/* Upper bound on the number of clipping iterations of the background annulus */
+#define METIS_PSF_NITER              5
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+static void metis_psf_source(const float *, const unsigned char *,
+                             cpl_size, cpl_size, double, double,
+                             cpl_size, cpl_size, float *, float *, double *);
+static double metis_psf_crossing(const float *, const unsigned char *,
+                                 cpl_size, cpl_size, cpl_size, cpl_size,
+                                 cpl_size, cpl_size, double, double);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_psf     Point source measurements
+ *
+ * Centroids, widths, fluxes and signal-to-noise ratios of point sources,
+ * measured for many sources in many frames at once, as needed for pinholes,
+ * pinhole grids and the image quality of frame sequences.
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Measure point sources in every frame of a stack
+ *
+ * @param    data       @em nframes planes of @em ny rows of @em nx pixels
+ * @param    bpm        bad pixel flags with the same layout as @em data,
+ *                      non-zero excludes a pixel, or NULL if all are good
+ * @param    nframes    number of frames
+ * @param    nx         number of columns of a frame
+ * @param    ny         number of rows of a frame
+ * @param    positions  @em nframes x @em nsources pairs (x, y) of 0-based
+ *                      guesses of the source positions in every frame
+ * @param    nsources   number of sources per frame
+ * @param    half_width half size of the square window a source is measured in
+ * @param    background_width  width of the square annulus around the window
+ *                      the local background is estimated from
+ * @param    stats      output, METIS_PSF_NSTATS planes of @em nframes x
+ *                      @em nsources measurements in the order of
+ *                      metis_psf_statistic
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * The brightest good pixel within @em half_width of the guess is taken as the
+ * peak of a source, and its window is centred there. The local background and
+ * its noise are the median and the MAD-based standard deviation of the annulus,
+ * iteratively clipped at METIS_PSF_KAPPA sigma. Within the window
+ * - the flux is the sum of the background-subtracted good pixels,
+ * - the centroid is the first moment of the positive background-subtracted
+ *   values, and its uncertainty propagates the background noise through it,
+ * - the signal-to-noise ratio is the flux over the noise of the window sum.
+ * The FWHM along the row (column) through the peak is the distance between the
+ * points where the profile first drops below half the peak above background
+ * on either side, interpolated linearly between pixels.
+ *
+ * Measurements that cannot be made are set to NaN: for guesses that are not
+ * finite or lie outside the frame, windows without good pixels, annuli with
+ * fewer than two good pixels, and profiles that do not drop to half their
+ * maximum before the edge of the frame.
+ *
+ * If the library is built with OpenMP support all sources of all frames are
+ * measured in parallel.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em data, @em positions or @em stats is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if a size is negative, or @em half_width or
+ *   @em background_width is smaller than one
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_psf_measure(
+    const float          *data,
+    const unsigned char  *bpm,
+    cpl_size              nframes,
+    cpl_size              nx,
+    cpl_size              ny,
+    const double         *positions,
+    cpl_size              nsources,
+    cpl_size              half_width,
+    cpl_size              background_width,
+    double               *stats)
+{
+  cpl_ensure_code(data != NULL && positions != NULL && stats != NULL,
+                  CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nframes >= 0 && nx >= 0 && ny >= 0 && nsources >= 0,
+                  CPL_ERROR_ILLEGAL_INPUT);
+  cpl_ensure_code(half_width >= 1 && background_width >= 1,
+                  CPL_ERROR_ILLEGAL_INPUT);
+
+  const cpl_size nmeasures = nframes * nsources;
+  const cpl_size npix = nx * ny;
+
+  if (nmeasures == 0) {
+      return CPL_ERROR_NONE;
+  }
+
+#ifdef _OPENMP
+  const int nthreads = omp_get_max_threads();
+#else
+  const int nthreads = 1;
+#endif
+
+  /* Scratch space per thread: the annulus values, twice for the MAD */
+  const cpl_size side = 2 * (half_width + background_width) + 1;
+  const cpl_size scratch = 2 * side * side;
+  float *buffer = cpl_malloc((size_t)nthreads * (size_t)scratch * sizeof(*buffer));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 16)
+#endif
+  for (cpl_size m = 0; m < nmeasures; m++) {
+#ifdef _OPENMP
+      float *own = buffer + (size_t)omp_get_thread_num() * (size_t)scratch;
+#else
+      float *own = buffer;
+#endif
+      const cpl_size frame = m / nsources;
+      double measured[METIS_PSF_NSTATS];
+
+      metis_psf_source(data + frame * npix,
+                       bpm != NULL ? bpm + frame * npix : NULL,
+                       nx, ny, positions[2 * m], positions[2 * m + 1],
+                       half_width, background_width,
+                       own, own + side * side, measured);
+
+      for (int k = 0; k < METIS_PSF_NSTATS; k++) {
+          stats[k * nmeasures + m] = measured[k];
+      }
+  }
+
+  cpl_free(buffer);
+
+  return CPL_ERROR_NONE;
+}
+
+/**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Measure a single source in a single frame
+ *
+ * @param    data       the frame
+ * @param    bpm        bad pixel flags of the frame, or NULL
+ * @param    nx         number of columns
+ * @param    ny         number of rows
+ * @param    x          guess of the column of the source
+ * @param    y          guess of the row of the source
+ * @param    half_width half size of the window
+ * @param    background_width  width of the background annulus
+ * @param    values     scratch for the annulus values
+ * @param    scratch    scratch for the MAD of the annulus values
+ * @param    measured   output, METIS_PSF_NSTATS measurements
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_psf_source(
+    const float          *data,
+    const unsigned char  *bpm,
+    cpl_size              nx,
+    cpl_size              ny,
+    double                x,
+    double                y,
+    cpl_size              half_width,
+    cpl_size              background_width,
+    float                *values,
+    float                *scratch,
+    double               *measured)
+{
+  for (int k = 0; k < METIS_PSF_NSTATS; k++) {
+      measured[k] = NAN;
+  }
+
+  if (!(x > -0.5 && x < nx - 0.5 && y > -0.5 && y < ny - 0.5)) {
+      return;
+  }
+
+  /* Peak: the brightest good pixel within the search window */
+  const cpl_size ix = (cpl_size)floor(x + 0.5);
+  const cpl_size iy = (cpl_size)floor(y + 0.5);
+  cpl_size px = -1;
+  cpl_size py = -1;
+  double peak = -INFINITY;
+
+  for (cpl_size j = CPL_MAX(iy - half_width, 0); j <= CPL_MIN(iy + half_width, ny - 1); j++) {
+      for (cpl_size i = CPL_MAX(ix - half_width, 0); i <= CPL_MIN(ix + half_width, nx - 1); i++) {
+          const cpl_size p = j * nx + i;
+          if ((bpm == NULL || bpm[p] == 0) && isfinite(data[p]) && data[p] > peak) {
+              peak = data[p];
+              px = i;
+              py = j;
+          }
+      }
+  }
+  if (px < 0) {
+      return;
+  }
+
+  /* Local background: the clipped annulus around the window */
+  const cpl_size outer = half_width + background_width;
+  cpl_size n = 0;
+  for (cpl_size j = CPL_MAX(py - outer, 0); j <= CPL_MIN(py + outer, ny - 1); j++) {
+      for (cpl_size i = CPL_MAX(px - outer, 0); i <= CPL_MIN(px + outer, nx - 1); i++) {
+          const cpl_size p = j * nx + i;
+          const int inside = i >= px - half_width && i <= px + half_width &&
+                             j >= py - half_width && j <= py + half_width;
+          if (!inside && (bpm == NULL || bpm[p] == 0) && isfinite(data[p])) {
+              values[n++] = data[p];
+          }
+      }
+  }
+  if (n < 2) {
+      return;
+  }
+
+  double clipped[METIS_SIGCLIP_NSTATS];
+  metis_sigclip_values(values, n, scratch, METIS_SIGCLIP_MEDIAN, METIS_SIGCLIP_MAD,
+                       METIS_PSF_KAPPA, METIS_PSF_KAPPA, METIS_PSF_NITER, clipped);
+  const double background = clipped[METIS_SIGCLIP_STAT_CENTRE];
+  const double noise = clipped[METIS_SIGCLIP_STAT_SIGMA];
+
+  measured[METIS_PSF_BACKGROUND] = background;
+  measured[METIS_PSF_NOISE] = noise;
+  measured[METIS_PSF_PEAK] = peak - background;
+
+  /* Flux and first moments over the window around the peak */
+  const cpl_size ilo = CPL_MAX(px - half_width, 0);
+  const cpl_size ihi = CPL_MIN(px + half_width, nx - 1);
+  const cpl_size jlo = CPL_MAX(py - half_width, 0);
+  const cpl_size jhi = CPL_MIN(py + half_width, ny - 1);
+  double flux = 0.0;
+  double sw = 0.0;
+  double sx = 0.0;
+  double sy = 0.0;
+  cpl_size npix = 0;
+
+  for (cpl_size j = jlo; j <= jhi; j++) {
+      for (cpl_size i = ilo; i <= ihi; i++) {
+          const cpl_size p = j * nx + i;
+          if ((bpm == NULL || bpm[p] == 0) && isfinite(data[p])) {
+              const double v = data[p] - background;
+              flux += v;
+              npix++;
+              if (v > 0.0) {
+                  sw += v;
+                  sx += v * i;
+                  sy += v * j;
+              }
+          }
+      }
+  }
+
+  measured[METIS_PSF_FLUX] = flux;
+  measured[METIS_PSF_SNR] = flux / (noise * sqrt((double)npix));
+
+  if (sw > 0.0) {
+      const double xc = sx / sw;
+      const double yc = sy / sw;
+      double vx = 0.0;
+      double vy = 0.0;
+
+      /* Every weighted pixel carries the background noise */
+      for (cpl_size j = jlo; j <= jhi; j++) {
+          for (cpl_size i = ilo; i <= ihi; i++) {
+              const cpl_size p = j * nx + i;
+              if ((bpm == NULL || bpm[p] == 0) && isfinite(data[p]) &&
+                  data[p] - background > 0.0) {
+                  vx += (i - xc) * (i - xc);
+                  vy += (j - yc) * (j - yc);
+              }
+          }
+      }
+
+      measured[METIS_PSF_XCEN] = xc;
+      measured[METIS_PSF_YCEN] = yc;
+      measured[METIS_PSF_XCEN_ERR] = noise * sqrt(vx) / sw;
+      measured[METIS_PSF_YCEN_ERR] = noise * sqrt(vy) / sw;
+  }
+
+  /* Half-maximum crossings on both sides of the peak */
+  const double level = background + 0.5 * (peak - background);
+  measured[METIS_PSF_FWHM_X] =
+      metis_psf_crossing(data, bpm, nx, ny, px, py, -1, 0, peak, level) +
+      metis_psf_crossing(data, bpm, nx, ny, px, py, +1, 0, peak, level);
+  measured[METIS_PSF_FWHM_Y] =
+      metis_psf_crossing(data, bpm, nx, ny, px, py, 0, -1, peak, level) +
+      metis_psf_crossing(data, bpm, nx, ny, px, py, 0, +1, peak, level);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Distance from the peak at which a profile drops below a level
+ *
+ * @param    data       the frame
+ * @param    bpm        bad pixel flags of the frame, or NULL
+ * @param    nx         number of columns
+ * @param    ny         number of rows
+ * @param    px         column of the peak
+ * @param    py         row of the peak
+ * @param    dx         column step of the profile
+ * @param    dy         row step of the profile
+ * @param    peak       value at the peak
+ * @param    level      the level to cross
+ *
+ * @return   the interpolated distance, or NaN if the profile reaches the edge
+ *           of the frame first
+ *
+ * Bad and non-finite pixels are stepped over, the crossing is then interpolated
+ * between the good pixels on either side of them.
+ */
+/*----------------------------------------------------------------------------*/
+static double metis_psf_crossing(
+    const float          *data,
+    const unsigned char  *bpm,
+    cpl_size              nx,
+    cpl_size              ny,
+    cpl_size              px,
+    cpl_size              py,
+    cpl_size              dx,
+    cpl_size              dy,
+    double                peak,
+    double                level)
+{
+  double previous = peak;
+  cpl_size at = 0;
+
+  for (cpl_size k = 1; ; k++) {
+      const cpl_size i = px + k * dx;
+      const cpl_size j = py + k * dy;
+      if (i < 0 || i >= nx || j < 0 || j >= ny) {
+          return NAN;
+      }
+
+      const cpl_size p = j * nx + i;
+      if ((bpm != NULL && bpm[p] != 0) || !isfinite(data[p])) {
+          continue;
+      }
+      if (data[p] < level) {
+          return at + (previous - level) / (previous - data[p]) * (k - at);
+      }
+      previous = data[p];
+      at = k;
+  }
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METIS_PSF_H
+#define METIS_PSF_H
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Number of measurements reported for every source, in the order of `metis_psf_statistic` */
+#define METIS_PSF_NSTATS             11
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              New types
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Measurements of a single source, in the order of `PSF_STATISTICS` */
+typedef enum {
+    METIS_PSF_XCEN = 0,         /* centroid, column (0-based) */
+    METIS_PSF_YCEN,             /* centroid, row (0-based) */
+    METIS_PSF_XCEN_ERR,         /* 1-sigma uncertainty of the centroid column */
+    METIS_PSF_YCEN_ERR,         /* 1-sigma uncertainty of the centroid row */
+    METIS_PSF_FWHM_X,           /* full width at half maximum along the row */
+    METIS_PSF_FWHM_Y,           /* full width at half maximum along the column */
+    METIS_PSF_FLUX,             /* background-subtracted flux in the window */
+    METIS_PSF_BACKGROUND,       /* local background per pixel */
+    METIS_PSF_NOISE,            /* local background noise per pixel */
+    METIS_PSF_SNR,              /* flux over its background noise */
+    METIS_PSF_PEAK              /* peak value above the background */
+} metis_psf_statistic;
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+cpl_error_code metis_psf_measure(
+    const float          *data,
+    const unsigned char  *bpm,
+    cpl_size              nframes,
+    cpl_size              nx,
+    cpl_size              ny,
+    const double         *positions,
+    cpl_size              nsources,
+    cpl_size              half_width,
+    cpl_size              background_width,
+    double               *stats);
+
+#endif
@@ -0,0 +1,723 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "metis_sigclip.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Number of neighbouring pixels whose stack columns are gathered together */
+#define METIS_SIGCLIP_TILE           512
+
+/* Number of samples from which the statistics of a single set are reduced in
+ * parallel, i.e. only for maps and never for the columns of a stack */
+#define METIS_SIGCLIP_PARALLEL       65536
+
+/* Ratio of the standard deviation to the median absolute deviation of a normal distribution */
+#define METIS_SIGCLIP_MAD_TO_SIGMA   1.482602218505602
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+static cpl_error_code metis_sigclip_check(metis_sigclip_centre,
+                                          metis_sigclip_scale,
+                                          double, double, cpl_size);
+static double metis_sigclip_mean(const float *, cpl_size);
+static double metis_sigclip_centre_of(float *, cpl_size, metis_sigclip_centre);
+static double metis_sigclip_scale_of(float *, cpl_size, float *, double,
+                                     metis_sigclip_centre, metis_sigclip_scale);
+static cpl_size metis_sigclip_gather(const float *, const unsigned char *,
+                                     cpl_size, float *);
+static void metis_sigclip_stack_tile(const float *, const unsigned char *,
+                                     cpl_size, cpl_size,
+                                     metis_sigclip_centre, metis_sigclip_scale,
+                                     double, double, cpl_size,
+                                     cpl_size, cpl_size,
+                                     float *, float *, cpl_size *, double *,
+                                     unsigned char *, double *);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_sigclip     Iterative kappa-sigma clipping
+ *
+ * Rejection of outliers by iterative kappa-sigma clipping, either over all
+ * pixels of a map or along the stack axis of a cube of frames. The centre
+ * is the mean or the median and the scale the standard deviation or the
+ * median absolute deviation of the samples kept so far. Medians are found
+ * by selection, never by sorting.
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Clip the outliers of a map
+ *
+ * @param    data       @em npix values
+ * @param    bpm        bad pixel flags of @em data, non-zero excludes a pixel,
+ *                      or NULL if all are good
+ * @param    npix       number of pixels
+ * @param    centre     estimator of the centre
+ * @param    scale      estimator of the scale
+ * @param    kappa_low  lower clipping threshold, in units of the scale
+ * @param    kappa_high upper clipping threshold, in units of the scale
+ * @param    niter      maximum number of clipping iterations
+ * @param    rejected   output, @em npix flags, non-zero for bad, non-finite
+ *                      and clipped pixels, or NULL
+ * @param    stats      output, METIS_SIGCLIP_NSTATS statistics of the kept
+ *                      pixels in the order of metis_sigclip_statistic, or NULL
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * The good finite pixels are gathered once and clipped as described for
+ * metis_sigclip_values(). The gathering and the final flagging run in
+ * parallel, as do the sums over large sets of samples.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em data is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em npix or @em niter is negative,
+ *   or a kappa is not positive
+ * - CPL_ERROR_UNSUPPORTED_MODE if @em centre or @em scale is unknown
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_sigclip_map(
+    const float          *data,
+    const unsigned char  *bpm,
+    cpl_size              npix,
+    metis_sigclip_centre  centre,
+    metis_sigclip_scale   scale,
+    double                kappa_low,
+    double                kappa_high,
+    cpl_size              niter,
+    unsigned char        *rejected,
+    double               *stats)
+{
+  cpl_ensure_code(data != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(npix >= 0, CPL_ERROR_ILLEGAL_INPUT);
+  const cpl_error_code code = metis_sigclip_check(centre, scale,
+                                                  kappa_low, kappa_high, niter);
+  cpl_ensure_code(code == CPL_ERROR_NONE, code);
+
+  float *values = cpl_malloc(CPL_MAX(npix, 1) * sizeof(*values));
+  float *scratch = scale == METIS_SIGCLIP_MAD
+                   ? cpl_malloc(CPL_MAX(npix, 1) * sizeof(*scratch)) : NULL;
+  double own[METIS_SIGCLIP_NSTATS];
+
+  const cpl_size n = metis_sigclip_gather(data, bpm, npix, values);
+  metis_sigclip_values(values, n, scratch, centre, scale,
+                       kappa_low, kappa_high, niter, own);
+
+  cpl_free(values);
+  cpl_free(scratch);
+
+  if (rejected != NULL) {
+      const double low = own[METIS_SIGCLIP_STAT_LOW];
+      const double high = own[METIS_SIGCLIP_STAT_HIGH];
+
+#ifdef _OPENMP
+#pragma omp parallel for simd schedule(static)
+#endif
+      for (cpl_size p = 0; p < npix; p++) {
+          const unsigned char bad = bpm != NULL ? bpm[p] != 0 : 0;
+          rejected[p] = bad | !((data[p] >= low) & (data[p] <= high));
+      }
+  }
+
+  if (stats != NULL) {
+      for (int k = 0; k < METIS_SIGCLIP_NSTATS; k++) {
+          stats[k] = own[k];
+      }
+  }
+
+  return CPL_ERROR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Clip the outliers of every pixel along the stack axis
+ *
+ * @param    stack      @em nframes planes of @em npix pixels
+ * @param    bpm        bad pixel flags with the same layout as @em stack,
+ *                      non-zero excludes a sample, or NULL if all are good
+ * @param    nframes    number of frames in the stack
+ * @param    npix       number of pixels per frame
+ * @param    centre     estimator of the centre
+ * @param    scale      estimator of the scale
+ * @param    kappa_low  lower clipping threshold, in units of the scale
+ * @param    kappa_high upper clipping threshold, in units of the scale
+ * @param    niter      maximum number of clipping iterations
+ * @param    rejected   output, flags with the same layout as @em stack,
+ *                      non-zero for bad, non-finite and clipped samples,
+ *                      or NULL
+ * @param    stats      output, METIS_SIGCLIP_NSTATS planes of @em npix
+ *                      statistics of the kept samples, in the order of
+ *                      metis_sigclip_statistic, or NULL
+ *
+ * @return   CPL_ERROR_NONE iff OK
+ *
+ * The samples of every pixel are clipped independently, as described for
+ * metis_sigclip_values(). As in metis_combine_with_error(), the pixels are
+ * processed in tiles whose columns are gathered plane by plane into a
+ * per-thread buffer, and the tiles are processed in parallel.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_NULL_INPUT if @em stack is NULL
+ * - CPL_ERROR_ILLEGAL_INPUT if @em nframes, @em npix or @em niter is
+ *   negative, or a kappa is not positive
+ * - CPL_ERROR_UNSUPPORTED_MODE if @em centre or @em scale is unknown
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_sigclip_stack(
+    const float          *stack,
+    const unsigned char  *bpm,
+    cpl_size              nframes,
+    cpl_size              npix,
+    metis_sigclip_centre  centre,
+    metis_sigclip_scale   scale,
+    double                kappa_low,
+    double                kappa_high,
+    cpl_size              niter,
+    unsigned char        *rejected,
+    double               *stats)
+{
+  cpl_ensure_code(stack != NULL, CPL_ERROR_NULL_INPUT);
+  cpl_ensure_code(nframes >= 0 && npix >= 0, CPL_ERROR_ILLEGAL_INPUT);
+  const cpl_error_code code = metis_sigclip_check(centre, scale,
+                                                  kappa_low, kappa_high, niter);
+  cpl_ensure_code(code == CPL_ERROR_NONE, code);
+
+  const cpl_size ntiles = (npix + METIS_SIGCLIP_TILE - 1) / METIS_SIGCLIP_TILE;
+
+  if (ntiles == 0) {
+      return CPL_ERROR_NONE;
+  }
+
+#ifdef _OPENMP
+  const int nthreads = omp_get_max_threads();
+#else
+  const int nthreads = 1;
+#endif
+
+  /* Scratch space for one tile per thread: the clipping bounds, the good
+   * sample counts, the columns and the deviations of a single column */
+  const size_t nbounds = 2 * METIS_SIGCLIP_TILE * sizeof(double);
+  const size_t ncount = METIS_SIGCLIP_TILE * sizeof(cpl_size);
+  const size_t ncolumns = (size_t)METIS_SIGCLIP_TILE * (size_t)nframes
+                          * sizeof(float);
+  const size_t ndeviations = (size_t)CPL_MAX(nframes, 1) * sizeof(float);
+  const size_t scratch = nbounds + ncount + ncolumns + ndeviations;
+  char *buffer = cpl_malloc((size_t)nthreads * scratch);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+  for (cpl_size tile = 0; tile < ntiles; tile++) {
+#ifdef _OPENMP
+      char *own = buffer + (size_t)omp_get_thread_num() * scratch;
+#else
+      char *own = buffer;
+#endif
+      const cpl_size first = tile * METIS_SIGCLIP_TILE;
+      const cpl_size count = CPL_MIN(METIS_SIGCLIP_TILE, npix - first);
+
+      metis_sigclip_stack_tile(stack, bpm, nframes, npix, centre, scale,
+                               kappa_low, kappa_high, niter, first, count,
+                               (float *)(own + nbounds + ncount),
+                               (float *)(own + nbounds + ncount + ncolumns),
+                               (cpl_size *)(own + nbounds),
+                               (double *)own,
+                               rejected, stats);
+  }
+
+  cpl_free(buffer);
+
+  return CPL_ERROR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Clip a set of samples in place
+ *
+ * @param    values     @em n finite samples, reordered and compacted so that
+ *                      the kept samples end up in front
+ * @param    n          number of samples
+ * @param    scratch    scratch space for @em n values, only needed (and
+ *                      otherwise may be NULL) for METIS_SIGCLIP_MAD
+ * @param    centre     estimator of the centre
+ * @param    scale      estimator of the scale
+ * @param    kappa_low  lower clipping threshold, in units of the scale
+ * @param    kappa_high upper clipping threshold, in units of the scale
+ * @param    niter      maximum number of clipping iterations
+ * @param    stats      output, METIS_SIGCLIP_NSTATS statistics of the kept
+ *                      samples in the order of metis_sigclip_statistic,
+ *                      or NULL
+ *
+ * @return   the number of kept samples
+ *
+ * Every iteration keeps the samples within [centre - kappa_low * scale,
+ * centre + kappa_high * scale] of the samples kept so far. The iteration
+ * stops when nothing more is rejected, when fewer than two samples would
+ * remain, or after @em niter iterations. The scale is either the standard
+ * deviation (around the mean, normalised by n - 1) or the median absolute
+ * deviation from the centre, scaled to the standard deviation of a normal
+ * distribution.
+ *
+ * As every iteration only removes samples, the kept samples are exactly the
+ * ones within the reported bounds, so flags can be derived from them later.
+ *
+ * Does not set any CPL error, the caller is expected to check the input.
+ */
+/*----------------------------------------------------------------------------*/
+cpl_size metis_sigclip_values(
+    float                *values,
+    cpl_size              n,
+    float                *scratch,
+    metis_sigclip_centre  centre,
+    metis_sigclip_scale   scale,
+    double                kappa_low,
+    double                kappa_high,
+    cpl_size              niter,
+    double               *stats)
+{
+  double low = -INFINITY;
+  double high = INFINITY;
+  double c = 0.0;
+  double s = 0.0;
+
+  if (n > 0) {
+      c = metis_sigclip_centre_of(values, n, centre);
+      s = metis_sigclip_scale_of(values, n, scratch, c, centre, scale);
+  }
+
+  for (cpl_size iter = 0; iter < niter && n > 1; iter++) {
+      const double lo = c - kappa_low * s;
+      const double hi = c + kappa_high * s;
+
+      cpl_size kept = 0;
+      if (n >= METIS_SIGCLIP_PARALLEL) {
+#ifdef _OPENMP
+#pragma omp parallel for simd reduction(+:kept)
+#endif
+          for (cpl_size i = 0; i < n; i++) {
+              kept += (values[i] >= lo) & (values[i] <= hi);
+          }
+      } else {
+          for (cpl_size i = 0; i < n; i++) {
+              kept += (values[i] >= lo) & (values[i] <= hi);
+          }
+      }
+
+      if (kept == n || kept < 2) {
+          break;
+      }
+
+      cpl_size k = 0;
+      for (cpl_size i = 0; i < n; i++) {
+          if (values[i] >= lo && values[i] <= hi) {
+              values[k++] = values[i];
+          }
+      }
+
+      n = kept;
+      low = CPL_MAX(low, lo);
+      high = CPL_MIN(high, hi);
+      c = metis_sigclip_centre_of(values, n, centre);
+      s = metis_sigclip_scale_of(values, n, scratch, c, centre, scale);
+  }
+
+  if (stats != NULL) {
+      stats[METIS_SIGCLIP_STAT_CENTRE] = c;
+      stats[METIS_SIGCLIP_STAT_SIGMA] = s;
+      stats[METIS_SIGCLIP_STAT_LOW] = low;
+      stats[METIS_SIGCLIP_STAT_HIGH] = high;
+      stats[METIS_SIGCLIP_STAT_KEPT] = (double)n;
+  }
+
+  return n;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Find the k-th smallest value, partially reordering the array
+ *
+ * @param    values     values, reordered so that values[i] <= values[k]
+ *                      for all i < k
+ * @param    n          number of values
+ * @param    k          rank of the requested value, 0 <= k < n
+ *
+ * @return   the k-th smallest value
+ */
+/*----------------------------------------------------------------------------*/
+float metis_sigclip_select(float *values, cpl_size n, cpl_size k)
+{
+  cpl_size lo = 0;
+  cpl_size hi = n - 1;
+
+  while (lo < hi) {
+      const float pivot = values[lo + (hi - lo) / 2];
+      cpl_size i = lo;
+      cpl_size j = hi;
+
+      while (i <= j) {
+          while (values[i] < pivot) i++;
+          while (values[j] > pivot) j--;
+          if (i <= j) {
+              const float t = values[i];
+              values[i] = values[j];
+              values[j] = t;
+              i++;
+              j--;
+          }
+      }
+
+      if (k <= j) {
+          hi = j;
+      } else if (k >= i) {
+          lo = i;
+      } else {
+          break;
+      }
+  }
+
+  return values[k];
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief    Median of a set of values, the mean of the central values if
+ *           @em n is even
+ *
+ * @param    values     @em n values, partially reordered
+ * @param    n          number of values, at least one
+ *
+ * @return   the median
+ */
+/*----------------------------------------------------------------------------*/
+double metis_sigclip_median(float *values, cpl_size n)
+{
+  const double upper = metis_sigclip_select(values, n, n / 2);
+
+  if (n % 2 == 1) {
+      return upper;
+  }
+
+  /* All values below the upper median are now in front of it */
+  float lower = values[0];
+  for (cpl_size i = 1; i < n / 2; i++) {
+      lower = CPL_MAX(lower, values[i]);
+  }
+
+  return 0.5 * ((double)lower + upper);
+}
+
+/**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Check the clipping options shared by all entry points
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_error_code metis_sigclip_check(metis_sigclip_centre centre,
+                                          metis_sigclip_scale scale,
+                                          double kappa_low, double kappa_high,
+                                          cpl_size niter)
+{
+  if (niter < 0 || !(kappa_low > 0.0 && kappa_high > 0.0)) {
+      return CPL_ERROR_ILLEGAL_INPUT;
+  }
+  if ((centre != METIS_SIGCLIP_MEAN && centre != METIS_SIGCLIP_MEDIAN) ||
+      (scale != METIS_SIGCLIP_STDEV && scale != METIS_SIGCLIP_MAD)) {
+      return CPL_ERROR_UNSUPPORTED_MODE;
+  }
+  return CPL_ERROR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Mean of at least one sample
+ */
+/*----------------------------------------------------------------------------*/
+static double metis_sigclip_mean(const float *values, cpl_size n)
+{
+  /* Entering a parallel region costs more than summing a stack column */
+  double sum = 0.0;
+  if (n >= METIS_SIGCLIP_PARALLEL) {
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:sum)
+#endif
+      for (cpl_size i = 0; i < n; i++) {
+          sum += values[i];
+      }
+  } else {
+      for (cpl_size i = 0; i < n; i++) {
+          sum += values[i];
+      }
+  }
+  return sum / (double)n;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Centre of at least one sample, which may be reordered
+ */
+/*----------------------------------------------------------------------------*/
+static double metis_sigclip_centre_of(float *values, cpl_size n,
+                                      metis_sigclip_centre centre)
+{
+  return centre == METIS_SIGCLIP_MEDIAN ? metis_sigclip_median(values, n)
+                                        : metis_sigclip_mean(values, n);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Scale of at least one sample, zero if it cannot be estimated
+ *
+ * The standard deviation is always taken around the mean, the median
+ * absolute deviation around the centre @em c.
+ */
+/*----------------------------------------------------------------------------*/
+static double metis_sigclip_scale_of(float *values, cpl_size n,
+                                     float *scratch, double c,
+                                     metis_sigclip_centre centre,
+                                     metis_sigclip_scale scale)
+{
+  if (scale == METIS_SIGCLIP_MAD) {
+      if (n >= METIS_SIGCLIP_PARALLEL) {
+#ifdef _OPENMP
+#pragma omp parallel for simd
+#endif
+          for (cpl_size i = 0; i < n; i++) {
+              scratch[i] = (float)fabs(values[i] - c);
+          }
+      } else {
+          for (cpl_size i = 0; i < n; i++) {
+              scratch[i] = (float)fabs(values[i] - c);
+          }
+      }
+      return METIS_SIGCLIP_MAD_TO_SIGMA * metis_sigclip_median(scratch, n);
+  }
+
+  if (n < 2) {
+      return 0.0;
+  }
+
+  const double mean = centre == METIS_SIGCLIP_MEAN ? c
+                                                   : metis_sigclip_mean(values, n);
+  double ss = 0.0;
+  if (n >= METIS_SIGCLIP_PARALLEL) {
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:ss)
+#endif
+      for (cpl_size i = 0; i < n; i++) {
+          ss += (values[i] - mean) * (values[i] - mean);
+      }
+  } else {
+      for (cpl_size i = 0; i < n; i++) {
+          ss += (values[i] - mean) * (values[i] - mean);
+      }
+  }
+  return sqrt(ss / (double)(n - 1));
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Gather the good finite pixels of a map, keeping their order
+ *
+ * @return   the number of gathered pixels
+ *
+ * The pixels are counted tile by tile first, so that every tile knows where
+ * to write and the tiles can be gathered in parallel.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size metis_sigclip_gather(const float *data,
+                                     const unsigned char *bpm,
+                                     cpl_size npix, float *values)
+{
+  const cpl_size ntiles = (npix + METIS_SIGCLIP_TILE - 1) / METIS_SIGCLIP_TILE;
+  cpl_size *offsets = cpl_malloc((ntiles + 1) * sizeof(*offsets));
+
+  offsets[0] = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (cpl_size tile = 0; tile < ntiles; tile++) {
+      const cpl_size first = tile * METIS_SIGCLIP_TILE;
+      const cpl_size last = CPL_MIN(first + METIS_SIGCLIP_TILE, npix);
+      cpl_size count = 0;
+
+      for (cpl_size p = first; p < last; p++) {
+          const unsigned char bad = bpm != NULL ? bpm[p] != 0 : 0;
+          count += !bad & (isfinite(data[p]) != 0);
+      }
+      offsets[tile + 1] = count;
+  }
+
+  for (cpl_size tile = 0; tile < ntiles; tile++) {
+      offsets[tile + 1] += offsets[tile];
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (cpl_size tile = 0; tile < ntiles; tile++) {
+      const cpl_size first = tile * METIS_SIGCLIP_TILE;
+      const cpl_size last = CPL_MIN(first + METIS_SIGCLIP_TILE, npix);
+      cpl_size k = offsets[tile];
+
+      for (cpl_size p = first; p < last; p++) {
+          const unsigned char bad = bpm != NULL ? bpm[p] != 0 : 0;
+          if (!bad && isfinite(data[p])) {
+              values[k++] = data[p];
+          }
+      }
+  }
+
+  const cpl_size n = offsets[ntiles];
+  cpl_free(offsets);
+
+  return n;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @internal
+ * @brief    Clip all pixels of a single tile along the stack axis
+ *
+ * @param    stack      the whole stack
+ * @param    bpm        bad pixel flags of the whole stack, or NULL
+ * @param    nframes    number of frames in the stack
+ * @param    npix       number of pixels per frame
+ * @param    centre     estimator of the centre
+ * @param    scale      estimator of the scale
+ * @param    kappa_low  lower clipping threshold
+ * @param    kappa_high upper clipping threshold
+ * @param    niter      maximum number of clipping iterations
+ * @param    first      index of the first pixel of the tile
+ * @param    count      number of pixels in the tile
+ * @param    columns    scratch, METIS_SIGCLIP_TILE columns of @em nframes
+ * @param    deviations scratch, @em nframes values
+ * @param    ngood      scratch, METIS_SIGCLIP_TILE good sample counts
+ * @param    bounds     scratch, METIS_SIGCLIP_TILE pairs of clipping bounds
+ * @param    rejected   output flags of the whole stack, or NULL
+ * @param    stats      output statistics of the whole frame, or NULL
+ *
+ * Only the good finite samples are gathered, so each column holds exactly
+ * its @em ngood samples. The flags are derived from the final bounds of
+ * every pixel in a second pass over the planes of the tile.
+ */
+/*----------------------------------------------------------------------------*/
+static void metis_sigclip_stack_tile(
+    const float          *stack,
+    const unsigned char  *bpm,
+    cpl_size              nframes,
+    cpl_size              npix,
+    metis_sigclip_centre  centre,
+    metis_sigclip_scale   scale,
+    double                kappa_low,
+    double                kappa_high,
+    cpl_size              niter,
+    cpl_size              first,
+    cpl_size              count,
+    float                *columns,
+    float                *deviations,
+    cpl_size             *ngood,
+    double               *bounds,
+    unsigned char        *rejected,
+    double               *stats)
+{
+  for (cpl_size j = 0; j < count; j++) {
+      ngood[j] = 0;
+  }
+
+  for (cpl_size n = 0; n < nframes; n++) {
+      const float *plane = stack + n * npix + first;
+      const unsigned char *flags = bpm != NULL ? bpm + n * npix + first : NULL;
+
+      for (cpl_size j = 0; j < count; j++) {
+          if ((flags != NULL && flags[j]) || !isfinite(plane[j])) {
+              continue;
+          }
+          columns[j * nframes + ngood[j]] = plane[j];
+          ngood[j]++;
+      }
+  }
+
+  for (cpl_size j = 0; j < count; j++) {
+      double own[METIS_SIGCLIP_NSTATS];
+
+      metis_sigclip_values(columns + j * nframes, ngood[j], deviations,
+                           centre, scale, kappa_low, kappa_high, niter, own);
+
+      bounds[2 * j] = own[METIS_SIGCLIP_STAT_LOW];
+      bounds[2 * j + 1] = own[METIS_SIGCLIP_STAT_HIGH];
+
+      if (stats != NULL) {
+          for (int k = 0; k < METIS_SIGCLIP_NSTATS; k++) {
+              stats[k * npix + first + j] = own[k];
+          }
+      }
+  }
+
+  if (rejected == NULL) {
+      return;
+  }
+
+  for (cpl_size n = 0; n < nframes; n++) {
+      const float *plane = stack + n * npix + first;
+      const unsigned char *flags = bpm != NULL ? bpm + n * npix + first : NULL;
+      unsigned char *out = rejected + n * npix + first;
+
+      for (cpl_size j = 0; j < count; j++) {
+          const unsigned char bad = flags != NULL ? flags[j] != 0 : 0;
+          out[j] = bad | !((plane[j] >= bounds[2 * j]) &
+                           (plane[j] <= bounds[2 * j + 1]));
+      }
+  }
+}
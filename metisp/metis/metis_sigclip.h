@@ -0,0 +1,113 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METIS_SIGCLIP_H
+#define METIS_SIGCLIP_H
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Includes
+ */
+/*----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Defines
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Number of statistics reported for every clipped set of samples,
+ * in the order of `metis_sigclip_statistic` */
+#define METIS_SIGCLIP_NSTATS         5
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              New types
+ */
+/*----------------------------------------------------------------------------*/
+
+/* Estimators of the centre of the clipped samples, in the order of `SIGCLIP_CENTRES` */
+typedef enum {
+    METIS_SIGCLIP_MEAN = 0,
+    METIS_SIGCLIP_MEDIAN
+} metis_sigclip_centre;
+
+/* Estimators of the scale of the clipped samples, in the order of `SIGCLIP_SCALES` */
+typedef enum {
+    METIS_SIGCLIP_STDEV = 0,
+    METIS_SIGCLIP_MAD
+} metis_sigclip_scale;
+
+/* Statistics of the samples that survive the clipping */
+typedef enum {
+    METIS_SIGCLIP_STAT_CENTRE = 0,  /* centre of the kept samples */
+    METIS_SIGCLIP_STAT_SIGMA,       /* scale of the kept samples */
+    METIS_SIGCLIP_STAT_LOW,         /* lower clipping bound, -inf if none */
+    METIS_SIGCLIP_STAT_HIGH,        /* upper clipping bound, +inf if none */
+    METIS_SIGCLIP_STAT_KEPT         /* number of kept samples */
+} metis_sigclip_statistic;
+
+/*----------------------------------------------------------------------------*/
+/**
+ *                              Functions prototypes
+ */
+/*----------------------------------------------------------------------------*/
+
+cpl_error_code metis_sigclip_map(
+    const float          *data,
+    const unsigned char  *bpm,
+    cpl_size              npix,
+    metis_sigclip_centre  centre,
+    metis_sigclip_scale   scale,
+    double                kappa_low,
+    double                kappa_high,
+    cpl_size              niter,
+    unsigned char        *rejected,
+    double               *stats);
+
+cpl_error_code metis_sigclip_stack(
+    const float          *stack,
+    const unsigned char  *bpm,
+    cpl_size              nframes,
+    cpl_size              npix,
+    metis_sigclip_centre  centre,
+    metis_sigclip_scale   scale,
+    double                kappa_low,
+    double                kappa_high,
+    cpl_size              niter,
+    unsigned char        *rejected,
+    double               *stats);
+
+cpl_size metis_sigclip_values(
+    float                *values,
+    cpl_size              n,
+    float                *scratch,
+    metis_sigclip_centre  centre,
+    metis_sigclip_scale   scale,
+    double                kappa_low,
+    double                kappa_high,
+    cpl_size              niter,
+    double               *stats);
+
+float metis_sigclip_select(float *values, cpl_size n, cpl_size k);
+double metis_sigclip_median(float *values, cpl_size n);
+
+#endif
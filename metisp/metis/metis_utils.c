@@ -29,6 +29,10 @@
 
 #include <cpl.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "metis_utils.h"
 #include "metis_dfs.h"
 
@@ -65,28 +69,60 @@ const char * metis_get_license(void)
  * @param   frameset      input set of frames
  *
  * @return  cpl_error_code
+ *
+ * The files of all frames are checked concurrently. If several are invalid,
+ * the error reported is the one of the first in the frameset.
  */
 /*----------------------------------------------------------------------------*/
 cpl_error_code metis_check_and_set_groups(
     cpl_frameset *frameset)
 {
+  cpl_ensure_code(frameset != NULL, CPL_ERROR_NULL_INPUT);
+
   /* Check size of frameset for to know if the sof file is not empty */
   cpl_size nframes = cpl_frameset_get_size(frameset);
+  const char **filenames = cpl_malloc((size_t)CPL_MAX(nframes, 1) * sizeof(*filenames));
+  unsigned char *invalid = cpl_calloc((size_t)CPL_MAX(nframes, 1), sizeof(*invalid));
+
+  /* The frameset itself is only walked by this thread */
+  for (cpl_size i = 0; i < nframes; i++) {
+      filenames[i] = cpl_frame_get_filename(cpl_frameset_get_position_const(frameset, i));
+  }
+
+  /* Opening and scanning the files dominates, so they are checked in parallel;
+   * the errors of the worker threads are discarded and reproduced below */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(nframes > 1)
+#endif
   for (cpl_size i = 0; i < nframes; i++) {
 
-      cpl_frame  *frame    = cpl_frameset_get_position(frameset, i);
-      const char *filename = cpl_frame_get_filename(frame);
+      cpl_errorstate prestate = cpl_errorstate_get();
 
       /* Check if the FITS file exist and have correct data,
        * return 0 if the fits file is valid without extensions */
-      if (cpl_fits_count_extensions(filename) < 0){
+      invalid[i] = cpl_fits_count_extensions(filenames[i]) < 0;
+      cpl_errorstate_set(prestate);
+  }
+
+  for (cpl_size i = 0; i < nframes; i++) {
 
+      if (invalid[i]) {
+          const char *filename = filenames[i];
+
+          cpl_free(filenames);
+          cpl_free(invalid);
+
+          /* Check again in this thread to set the error */
+          (void)cpl_fits_count_extensions(filename);
           return cpl_error_set_message(cpl_func, cpl_error_get_code(),
                      "Problem with the file '%s' (%s --> Code %d)",
                      filename, cpl_error_get_message(), cpl_error_get_code());
       }
   }
 
+  cpl_free(filenames);
+  cpl_free(invalid);
+
   /* Identify the RAW, CONF and CALIB frames in the input frameset */
   if (metis_dfs_set_groups(frameset)) {
 
@@ -113,4 +149,33 @@ cpl_error_code metis_check_and_set_groups(
   return CPL_ERROR_NONE;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+ * @brief   Limit the number of threads of the parallel regions of the calling thread
+ *
+ * @param   nthreads      maximum number of threads per parallel region
+ *
+ * @return  cpl_error_code
+ *
+ * The limit applies to the parallel regions started by the calling thread only,
+ * so that several threads calling the kernels concurrently can share the CPUs
+ * instead of each starting as many threads as there are CPUs.
+ * Without OpenMP the kernels are serial and this does nothing.
+ *
+ * Possible cpl_error_code set in this function:
+ * - CPL_ERROR_ILLEGAL_INPUT if nthreads is not positive
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code metis_set_num_threads(
+    int nthreads)
+{
+  cpl_ensure_code(nthreads > 0, CPL_ERROR_ILLEGAL_INPUT);
+
+#ifdef _OPENMP
+  omp_set_num_threads(nthreads);
+#endif
+
+  return CPL_ERROR_NONE;
+}
+
 /**@}*/
@@ -39,5 +39,8 @@ const char * metis_get_license(void) ;
 cpl_error_code metis_check_and_set_groups(
     cpl_frameset *frameset);
 
+cpl_error_code metis_set_num_threads(
+    int nthreads);
+
 
 #endif
@@ -0,0 +1,151 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#include "metis_adi.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_adi_test  Unit test of metis_adi
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_adi_derotate
+ */
+/*----------------------------------------------------------------------------*/
+static void test_adi_derotate(void)
+{
+    const cpl_size nframes = 3;
+    const cpl_size nx = 41;
+    const cpl_size ny = 37;
+    const cpl_size npix = nx * ny;
+    const double xc = 20.0;
+    const double yc = 18.0;
+    const double angles[] = {0.0, 90.0, 33.0};
+
+    float *frames = cpl_malloc(nframes * npix * sizeof(*frames));
+    float *derotated = cpl_malloc(nframes * npix * sizeof(*derotated));
+    cpl_error_code code;
+
+    /* A ripple in the first two frames, a plane (interpolated exactly) in the last */
+    for (cpl_size y = 0; y < ny; y++) {
+        for (cpl_size x = 0; x < nx; x++) {
+            frames[y * nx + x] = (float)(100.0 * sin(0.3 * x + 0.1 * y * y));
+            frames[npix + y * nx + x] = frames[y * nx + x];
+            frames[2 * npix + y * nx + x] = (float)(3.0 * x - 2.0 * y + 5.0);
+        }
+    }
+
+    /* Test with invalid input */
+    code = metis_adi_derotate(NULL, nframes, nx, ny, angles, xc, yc, derotated);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_adi_derotate(frames, nframes, 1, ny, angles, xc, yc, derotated);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Test with valid input */
+    code = metis_adi_derotate(frames, nframes, nx, ny, angles, xc, yc, derotated);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    for (cpl_size y = 0; y < ny; y++) {
+        for (cpl_size x = 0; x < nx; x++) {
+            const double dx = x - xc;
+            const double dy = y - yc;
+
+            /* No rotation at all */
+            cpl_test_abs(derotated[y * nx + x], frames[y * nx + x], 0.0);
+
+            /* A quarter turn maps pixels onto pixels */
+            const double qx = xc - dy;
+            const double qy = yc + dx;
+            if (qx >= 0 && qx <= nx - 1 && qy >= 0 && qy <= ny - 1) {
+                cpl_test_abs(derotated[npix + y * nx + x],
+                             frames[(cpl_size)qy * nx + (cpl_size)qx], 1e-3);
+            } else {
+                cpl_test(isnan(derotated[npix + y * nx + x]));
+            }
+
+            /* A plane is interpolated exactly at any angle */
+            const double c = cos(angles[2] * CPL_MATH_PI / 180.0);
+            const double s = sin(angles[2] * CPL_MATH_PI / 180.0);
+            const double sx = xc + c * dx - s * dy;
+            const double sy = yc + s * dx + c * dy;
+            if (sx >= 0 && sx <= nx - 1 && sy >= 0 && sy <= ny - 1) {
+                cpl_test_abs(derotated[2 * npix + y * nx + x],
+                             3.0 * sx - 2.0 * sy + 5.0, 1e-3);
+            } else {
+                cpl_test(isnan(derotated[2 * npix + y * nx + x]));
+            }
+        }
+    }
+
+    /* A non-finite input pixel only spoils its neighbourhood */
+    cpl_size spoiled = 0;
+    for (cpl_size p = 0; p < npix; p++) {
+        spoiled -= isnan(derotated[2 * npix + p]);
+    }
+
+    frames[2 * npix + 10 * nx + 12] = NAN;
+    code = metis_adi_derotate(frames, nframes, nx, ny, angles, xc, yc, derotated);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    for (cpl_size p = 0; p < npix; p++) {
+        spoiled += isnan(derotated[2 * npix + p]);
+    }
+    cpl_test_leq(1, spoiled);
+    cpl_test_leq(spoiled, 8);
+
+    cpl_free(frames);
+    cpl_free(derotated);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit tests of metis_adi module
+ */
+/*----------------------------------------------------------------------------*/
+
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_adi_derotate();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
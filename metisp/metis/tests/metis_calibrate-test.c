@@ -0,0 +1,243 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#include "metis_calibrate.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_calibrate_test  Unit test of metis_calibrate
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_calibrate_frames
+ */
+/*----------------------------------------------------------------------------*/
+static void test_calibrate_frames(void)
+{
+    /* More pixels than one tile, so that tiling and threading are exercised */
+    const cpl_size nframes = 3;
+    const cpl_size npix = 5000;
+    const cpl_size ncoeffs = 2;
+    const double read_noise = 3.0;
+
+    float *raw = cpl_malloc(nframes * npix * sizeof(*raw));
+    float *dark = cpl_malloc(npix * sizeof(*dark));
+    float *flat = cpl_malloc(npix * sizeof(*flat));
+    float *linearity = cpl_malloc(ncoeffs * npix * sizeof(*linearity));
+    int *dq_static = cpl_calloc(npix, sizeof(*dq_static));
+    float *sci = cpl_malloc(nframes * npix * sizeof(*sci));
+    float *err = cpl_malloc(nframes * npix * sizeof(*err));
+    int *dq = cpl_malloc(nframes * npix * sizeof(*dq));
+    cpl_error_code code;
+
+    for (cpl_size p = 0; p < npix; p++) {
+        dark[p] = 10.0f;
+        flat[p] = 0.5f + (float)(p % 4) * 0.25f;
+        linearity[p] = 1.0e-4f;                 /* r * (1e-4 r + 1) */
+        linearity[npix + p] = 1.0f;
+        for (cpl_size n = 0; n < nframes; n++) {
+            raw[n * npix + p] = (float)(100 * (n + 1));
+        }
+    }
+    dq_static[7] = METIS_DQ_BAD_PIXEL;
+    flat[8] = 0.0f;
+    raw[9] = 60000.0f;
+
+    /* Test with invalid input */
+    code = metis_calibrate_frames(NULL, nframes, npix, dark, flat, NULL, 2.0,
+                                  linearity, ncoeffs, dq_static, read_noise, 50000.0,
+                                  sci, err, dq);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_calibrate_frames(raw, nframes, npix, dark, flat, NULL, 2.0,
+                                  NULL, ncoeffs, dq_static, read_noise, 50000.0,
+                                  sci, err, dq);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_calibrate_frames(raw, nframes, npix, dark, flat, NULL, 2.0,
+                                  linearity, ncoeffs, dq_static, -1.0, 50000.0,
+                                  sci, err, dq);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Test with valid input */
+    code = metis_calibrate_frames(raw, nframes, npix, dark, flat, NULL, 2.0,
+                                  linearity, ncoeffs, dq_static, read_noise, 50000.0,
+                                  sci, err, dq);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    for (cpl_size n = 0; n < nframes; n++) {
+        for (cpl_size p = 10; p < npix; p++) {
+            const double r = 100.0 * (n + 1);
+            const double electrons = (r * (1.0e-4 * r + 1.0) - 10.0) * 2.0;
+            const double f = flat[p];
+            cpl_test_rel(sci[n * npix + p], electrons / f, 1e-6);
+            cpl_test_rel(err[n * npix + p],
+                         sqrt(electrons + read_noise * read_noise) / f, 1e-6);
+            cpl_test_zero(dq[n * npix + p]);
+        }
+    }
+
+    /* Static flags are passed on, invalid and saturated pixels are flagged */
+    cpl_test_eq(dq[7], METIS_DQ_BAD_PIXEL);
+    cpl_test_eq(dq[8], METIS_DQ_INVALID);
+    cpl_test_abs(sci[8], 0.0, 0.0);
+    cpl_test_abs(err[8], 0.0, 0.0);
+    cpl_test_eq(dq[9], METIS_DQ_SATURATED);
+    cpl_test_zero(dq[npix + 9]);
+
+    /* The optional outputs may be omitted, and the frames calibrated in place */
+    code = metis_calibrate_frames(raw, nframes, npix, NULL, NULL, NULL, 1.0,
+                                  NULL, 0, NULL, 0.0, 0.0, raw, NULL, NULL);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_abs(raw[npix + 100], 200.0, 0.0);
+
+    cpl_free(raw);
+    cpl_free(dark);
+    cpl_free(flat);
+    cpl_free(linearity);
+    cpl_free(dq_static);
+    cpl_free(sci);
+    cpl_free(err);
+    cpl_free(dq);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_linearity_correct
+ */
+/*----------------------------------------------------------------------------*/
+static void test_linearity_correct(void)
+{
+    const cpl_size nframes = 2;
+    const cpl_size npix = 3000;
+    const cpl_size ncoeffs = 3;
+    const double c[] = {2.0e-9, 1.0e-5, 1.0};       /* highest degree first */
+    const double s[] = {1.0e-10, 1.0e-7, 1.0e-3};
+
+    float *data = cpl_malloc(nframes * npix * sizeof(*data));
+    float *err = cpl_malloc(nframes * npix * sizeof(*err));
+    int *dq = cpl_calloc(nframes * npix, sizeof(*dq));
+    double *coeffs = cpl_malloc(ncoeffs * npix * sizeof(*coeffs));
+    double *coeffs_err = cpl_malloc(ncoeffs * npix * sizeof(*coeffs_err));
+    int *coeffs_dq = cpl_calloc(npix, sizeof(*coeffs_dq));
+    cpl_error_code code;
+
+    for (cpl_size k = 0; k < ncoeffs; k++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            coeffs[k * npix + p] = c[k];
+            coeffs_err[k * npix + p] = s[k];
+        }
+    }
+    coeffs_dq[5] = 1;
+
+    /* Test with invalid input */
+    code = metis_linearity_correct(NULL, err, dq, nframes, npix,
+                                   coeffs, coeffs_err, ncoeffs, coeffs_dq, CPL_FALSE);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_linearity_correct(data, err, dq, nframes, npix,
+                                   coeffs, coeffs_err, 0, coeffs_dq, CPL_FALSE);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Test with valid input, in both precisions */
+    for (int single = 0; single <= 1; single++) {
+        for (cpl_size i = 0; i < nframes * npix; i++) {
+            data[i] = (float)(1000.0 + 10.0 * i);
+            err[i] = 5.0f;
+            dq[i] = 0;
+        }
+
+        code = metis_linearity_correct(data, err, dq, nframes, npix,
+                                       coeffs, coeffs_err, ncoeffs, coeffs_dq, single);
+        cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+        for (cpl_size i = 0; i < nframes * npix; i++) {
+            const double r = 1000.0 + 10.0 * i;
+            const double y = r * ((c[0] * r + c[1]) * r + c[2]);
+            const double slope = (3.0 * c[0] * r + 2.0 * c[1]) * r + c[2];
+            const double variance = pow(r * r * r * s[0], 2) + pow(r * r * s[1], 2) +
+                                    pow(r * s[2], 2);
+
+            if (i % npix == 5) {
+                /* Flagged coefficients: left as is */
+                cpl_test_abs(data[i], r, 0.0);
+                cpl_test_abs(err[i], 5.0, 0.0);
+                cpl_test_eq(dq[i], METIS_DQ_NONLINEAR);
+            } else {
+                cpl_test_rel(data[i], y, single ? 1e-6 : 1e-7);
+                cpl_test_rel(err[i], sqrt(slope * slope * 25.0 + variance),
+                             single ? 1e-5 : 1e-6);
+                cpl_test_zero(dq[i]);
+            }
+        }
+    }
+
+    /* The optional arrays may be omitted */
+    data[0] = 100.0f;
+    code = metis_linearity_correct(data, NULL, NULL, nframes, npix,
+                                   coeffs, NULL, ncoeffs, NULL, CPL_FALSE);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_rel(data[0], 100.0 * ((c[0] * 100.0 + c[1]) * 100.0 + c[2]), 1e-7);
+
+    cpl_free(data);
+    cpl_free(err);
+    cpl_free(dq);
+    cpl_free(coeffs);
+    cpl_free(coeffs_err);
+    cpl_free(coeffs_dq);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit tests of metis_calibrate module
+ */
+/*----------------------------------------------------------------------------*/
+
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_calibrate_frames();
+    test_linearity_correct();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
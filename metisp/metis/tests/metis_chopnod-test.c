@@ -0,0 +1,234 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#include "metis_chopnod.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_chopnod_test  Unit test of metis_chopnod
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_chopnod_add_frame
+ */
+/*----------------------------------------------------------------------------*/
+static void test_chopnod_add_frame(void)
+{
+    const cpl_size npix = 500;
+    const cpl_size nframes = 4;
+
+    float *sci = cpl_calloc(npix, sizeof(*sci));
+    float *err = cpl_calloc(npix, sizeof(*err));
+    int *dq = cpl_calloc(npix, sizeof(*dq));
+    double *sum = cpl_calloc(npix, sizeof(*sum));
+    double *sum_var = cpl_calloc(npix, sizeof(*sum_var));
+    int *count = cpl_calloc(npix, sizeof(*count));
+    double *total = cpl_calloc(npix, sizeof(*total));
+    double *total_sq = cpl_calloc(npix, sizeof(*total_sq));
+    int *total_count = cpl_calloc(npix, sizeof(*total_count));
+    cpl_error_code code;
+
+    /* Test with invalid input */
+    code = metis_chopnod_add_frame(NULL, err, dq, npix, sum, sum_var, count,
+                                   total, total_sq, total_count);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_chopnod_add_frame(sci, err, dq, npix, sum, sum_var, count,
+                                   total, NULL, total_count);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_chopnod_add_frame(sci, err, dq, -1, sum, sum_var, count,
+                                   total, total_sq, total_count);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Test with valid input: frames n = 0..3 of value p + n and error 2 */
+    for (cpl_size n = 0; n < nframes; n++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            sci[p] = (float)(p + n);
+            err[p] = 2.0f;
+            dq[p] = 0;
+        }
+        /* The first pixel is flagged in one frame, the second is not finite */
+        dq[0] = n == 1;
+        sci[1] = n == 2 ? NAN : sci[1];
+
+        code = metis_chopnod_add_frame(sci, err, dq, npix, sum, sum_var, count,
+                                       total, total_sq, total_count);
+        cpl_test_eq_error(code, CPL_ERROR_NONE);
+    }
+
+    cpl_test_eq(count[0], 3);
+    cpl_test_abs(sum[0], 0.0 + 2.0 + 3.0, 0.0);
+    cpl_test_eq(count[1], 3);
+    cpl_test_abs(sum[1], 1.0 + 2.0 + 4.0, 0.0);
+
+    for (cpl_size p = 2; p < npix; p++) {
+        cpl_test_eq(count[p], nframes);
+        cpl_test_abs(sum[p], nframes * p + 6.0, 0.0);
+        cpl_test_abs(sum_var[p], nframes * 4.0, 0.0);
+        cpl_test_eq(total_count[p], nframes);
+        cpl_test_abs(total[p], sum[p], 0.0);
+        cpl_test_abs(total_sq[p], nframes * (double)p * p + 12.0 * p + 14.0, 1e-6);
+    }
+
+    /* The sums over the sequence and the errors are optional */
+    code = metis_chopnod_add_frame(sci, NULL, NULL, npix, sum, sum_var, count,
+                                   NULL, NULL, NULL);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_eq(count[2], nframes + 1);
+    cpl_test_abs(sum_var[2], nframes * 4.0, 0.0);
+    cpl_test_eq(total_count[2], nframes);
+
+    cpl_free(sci);
+    cpl_free(err);
+    cpl_free(dq);
+    cpl_free(sum);
+    cpl_free(sum_var);
+    cpl_free(count);
+    cpl_free(total);
+    cpl_free(total_sq);
+    cpl_free(total_count);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_chopnod_add_cycle
+ */
+/*----------------------------------------------------------------------------*/
+static void test_chopnod_add_cycle(void)
+{
+    const cpl_size npix = 300;
+    const cpl_size ncycles = 6;
+
+    float *difference = cpl_calloc(npix, sizeof(*difference));
+    float *variance = cpl_calloc(npix, sizeof(*variance));
+    double *reference = cpl_calloc(npix, sizeof(*reference));
+    double *sum = cpl_calloc(npix, sizeof(*sum));
+    double *sum_sq = cpl_calloc(npix, sizeof(*sum_sq));
+    double *sum_var = cpl_calloc(npix, sizeof(*sum_var));
+    int *count = cpl_calloc(npix, sizeof(*count));
+    int *rejected = cpl_calloc(npix, sizeof(*rejected));
+    cpl_error_code code;
+
+    /* Test with invalid input */
+    code = metis_chopnod_add_cycle(difference, variance, npix, NULL, 5.0,
+                                   sum, sum_sq, NULL, count, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_chopnod_add_cycle(difference, variance, npix, NULL, -1.0,
+                                   sum, sum_sq, sum_var, count, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Test with valid input: cycles alternating around 10 by one sigma,
+       with a glitch in cycle 3 of every other pixel */
+    for (cpl_size n = 0; n < ncycles; n++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            difference[p] = (float)(10.0 + (n % 2 ? 1.0 : -1.0));
+            variance[p] = 1.0f;
+            if (n == 3 && p % 2 == 0) {
+                difference[p] = 100.0f;
+            }
+        }
+        difference[npix - 1] = n == 4 ? NAN : difference[npix - 1];
+
+        code = metis_chopnod_add_cycle(difference, variance, npix, NULL, 5.0,
+                                       sum, sum_sq, sum_var, count, rejected);
+        cpl_test_eq_error(code, CPL_ERROR_NONE);
+    }
+
+    for (cpl_size p = 0; p < npix - 1; p++) {
+        cpl_test_eq(rejected[p], p % 2 == 0);
+        cpl_test_eq(count[p], ncycles - rejected[p]);
+        cpl_test_abs(sum_var[p], (double)count[p], 0.0);
+        if (p % 2) {
+            cpl_test_abs(sum[p], 10.0 * ncycles, 1e-9);
+            cpl_test_abs(sum_sq[p], 101.0 * ncycles, 1e-9);
+        }
+    }
+
+    /* A non-finite difference is neither accepted nor rejected */
+    cpl_test_eq(count[npix - 1] + rejected[npix - 1], ncycles - 1);
+
+    /* An explicit reference replaces the running mean, a NaN one accepts */
+    for (cpl_size p = 0; p < npix; p++) {
+        difference[p] = 20.0f;
+        reference[p] = p % 3 == 0 ? 20.0 : p % 3 == 1 ? 0.0 : NAN;
+    }
+    cpl_size before = count[1] + count[2] + count[3];
+    code = metis_chopnod_add_cycle(difference, variance, npix, reference, 5.0,
+                                   sum, sum_sq, sum_var, count, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_eq(count[1] + count[2] + count[3], before + 2);
+    cpl_test_eq(rejected[1], 1);
+
+    /* Without rejection every finite value is accepted */
+    before = count[1];
+    code = metis_chopnod_add_cycle(difference, variance, npix, reference, 0.0,
+                                   sum, sum_sq, sum_var, count, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_eq(count[1], before + 1);
+
+    cpl_free(difference);
+    cpl_free(variance);
+    cpl_free(reference);
+    cpl_free(sum);
+    cpl_free(sum_sq);
+    cpl_free(sum_var);
+    cpl_free(count);
+    cpl_free(rejected);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit tests of metis_chopnod module
+ */
+/*----------------------------------------------------------------------------*/
+
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_chopnod_add_frame();
+    test_chopnod_add_cycle();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
@@ -0,0 +1,152 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#include "metis_combine.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_combine_test  Unit test of metis_combine
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_combine_with_error
+ */
+/*----------------------------------------------------------------------------*/
+static void test_combine_with_error(void)
+{
+    /* More pixels than one tile, so that tiling and threading are exercised */
+    const cpl_size nframes = 5;
+    const cpl_size npix = 1000;
+    const double read_noise = 2.0;
+
+    float *stack = cpl_malloc(nframes * npix * sizeof(*stack));
+    unsigned char *bpm = cpl_calloc(nframes * npix, sizeof(*bpm));
+    float *combined = cpl_malloc(npix * sizeof(*combined));
+    float *error = cpl_malloc(npix * sizeof(*error));
+    unsigned char *rejected = cpl_malloc(npix * sizeof(*rejected));
+    cpl_error_code code;
+
+    /* Frame n holds 10 * (n + 1) + p, except for one outlier at pixel 0 */
+    for (cpl_size n = 0; n < nframes; n++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            stack[n * npix + p] = (float)(10 * (n + 1) + p);
+        }
+    }
+    stack[2 * npix] = 1.0e6f;
+
+    /* Pixel 1 loses its first frame, pixel 2 loses all of them */
+    bpm[1] = 1;
+    for (cpl_size n = 0; n < nframes; n++) {
+        bpm[n * npix + 2] = 1;
+    }
+
+    /* Test with invalid input */
+    code = metis_combine_with_error(NULL, bpm, nframes, npix, METIS_COMBINE_AVERAGE,
+                                    read_noise, 3.0, 3.0, 5, combined, error, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_combine_with_error(stack, bpm, nframes, npix, (metis_combine_method)42,
+                                    read_noise, 3.0, 3.0, 5, combined, error, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_UNSUPPORTED_MODE);
+
+    code = metis_combine_with_error(stack, bpm, nframes, npix, METIS_COMBINE_SIGCLIP,
+                                    read_noise, 0.0, 3.0, 5, combined, error, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Average */
+    code = metis_combine_with_error(stack, bpm, nframes, npix, METIS_COMBINE_AVERAGE,
+                                    read_noise, 3.0, 3.0, 5, combined, error, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    for (cpl_size p = 3; p < npix; p++) {
+        cpl_test_rel(combined[p], 30.0 + p, 1e-6);
+        cpl_test_rel(error[p], sqrt(30.0 + p + read_noise * read_noise), 1e-6);
+        cpl_test_zero(rejected[p]);
+    }
+    cpl_test_rel(combined[1], 35.0 + 1, 1e-6);
+    cpl_test_rel(error[1], sqrt(35.0 + 1 + read_noise * read_noise), 1e-6);
+    cpl_test_abs(combined[2], 0.0, 0.0);
+    cpl_test_abs(error[2], 0.0, 0.0);
+    cpl_test(rejected[2]);
+
+    /* Sum */
+    code = metis_combine_with_error(stack, bpm, nframes, npix, METIS_COMBINE_ADD,
+                                    read_noise, 3.0, 3.0, 5, combined, error, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_rel(combined[3], 5 * (30.0 + 3), 1e-6);
+    cpl_test_rel(combined[1], 4 * (35.0 + 1), 1e-6);
+
+    /* Median, with an odd and an even number of good samples */
+    code = metis_combine_with_error(stack, bpm, nframes, npix, METIS_COMBINE_MEDIAN,
+                                    read_noise, 3.0, 3.0, 5, combined, NULL, NULL);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_rel(combined[0], 40.0, 1e-6);
+    cpl_test_rel(combined[1], 35.0 + 1, 1e-6);
+    cpl_test_rel(combined[500], 30.0 + 500, 1e-6);
+
+    /* Sigma clipping removes the outlier, but leaves regular pixels alone */
+    code = metis_combine_with_error(stack, NULL, nframes, npix, METIS_COMBINE_SIGCLIP,
+                                    read_noise, 1.5, 1.5, 5, combined, NULL, rejected);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_rel(combined[0], (10.0 + 20.0 + 40.0 + 50.0) / 4.0, 1e-6);
+    cpl_test_rel(combined[700], 30.0 + 700, 1e-6);
+    cpl_test_zero(rejected[2]);
+
+    cpl_free(stack);
+    cpl_free(bpm);
+    cpl_free(combined);
+    cpl_free(error);
+    cpl_free(rejected);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit tests of metis_combine module
+ */
+/*----------------------------------------------------------------------------*/
+
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_combine_with_error();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
@@ -100,6 +100,112 @@ static void test_set_groups(void)
     return;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_dfs_register_tags and metis_dfs_get_group
+ */
+/*----------------------------------------------------------------------------*/
+static void test_register_tags(void)
+{
+    const metis_dfs_tag_group entries[] = {
+        {"METIS_TEST_RAW",   CPL_FRAME_GROUP_RAW},
+        {"METIS_TEST_CALIB", CPL_FRAME_GROUP_CALIB},
+    };
+    const metis_dfs_tag_group conflicting[] = {
+        {"METIS_TEST_RAW",   CPL_FRAME_GROUP_CALIB},
+    };
+    cpl_error_code code;
+
+    /* Test with invalid input */
+    code = metis_dfs_register_tags(NULL, 1);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_dfs_register_tags(entries, -1);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* The pipeline's own tags are known from the start */
+    cpl_test_eq(metis_dfs_get_group(METIS_RAW), CPL_FRAME_GROUP_RAW);
+    cpl_test_eq(metis_dfs_get_group(METIS_CALIB_FLAT), CPL_FRAME_GROUP_CALIB);
+    cpl_test_eq(metis_dfs_get_group("METIS_TEST_RAW"), CPL_FRAME_GROUP_NONE);
+    cpl_test_eq(metis_dfs_get_group(NULL), CPL_FRAME_GROUP_NONE);
+
+    /* Test with valid input, twice: registering again is harmless */
+    code = metis_dfs_register_tags(entries, 2);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    code = metis_dfs_register_tags(entries, 2);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    cpl_test_eq(metis_dfs_get_group("METIS_TEST_RAW"), CPL_FRAME_GROUP_RAW);
+    cpl_test_eq(metis_dfs_get_group("METIS_TEST_CALIB"), CPL_FRAME_GROUP_CALIB);
+
+    /* A tag cannot change its group */
+    code = metis_dfs_register_tags(conflicting, 1);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+    cpl_test_eq(metis_dfs_get_group("METIS_TEST_RAW"), CPL_FRAME_GROUP_RAW);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_dfs_tag_index
+ */
+/*----------------------------------------------------------------------------*/
+static void test_tag_index(void)
+{
+    const char *const tag[] = {METIS_RAW,
+                               METIS_CALIB_FLAT,
+                               METIS_RAW,
+                               METIS_RAW};
+    const size_t N = sizeof(tag) / sizeof(tag[0]);
+
+    cpl_frameset *frames = cpl_frameset_new();
+    metis_dfs_tag_index *index;
+
+    /* Test with invalid input */
+    index = metis_dfs_tag_index_new(NULL);
+    cpl_test_error(CPL_ERROR_NULL_INPUT);
+    cpl_test_null(index);
+
+    for (size_t i = 0; i < N; i++) {
+        cpl_frame *frame = cpl_frame_new();
+
+        cpl_frame_set_filename(frame, "frame.fits");
+        cpl_frame_set_tag(frame, tag[i]);
+        cpl_frameset_insert(frames, frame);
+    }
+
+    /* Test with valid input */
+    index = metis_dfs_tag_index_new(frames);
+    cpl_test_error(CPL_ERROR_NONE);
+    cpl_test_nonnull(index);
+
+    cpl_test_eq(metis_dfs_tag_index_count(index, METIS_RAW), 3);
+    cpl_test_eq(metis_dfs_tag_index_count(index, METIS_CALIB_FLAT), 1);
+    cpl_test_eq(metis_dfs_tag_index_count(index, METIS_CALIB_RAW), 0);
+
+    /* The frames are those of the frameset, in its order */
+    cpl_test_eq_ptr(metis_dfs_tag_index_get(index, METIS_RAW, 0),
+                    cpl_frameset_get_position_const(frames, 0));
+    cpl_test_eq_ptr(metis_dfs_tag_index_get(index, METIS_RAW, 1),
+                    cpl_frameset_get_position_const(frames, 2));
+    cpl_test_eq_ptr(metis_dfs_tag_index_get(index, METIS_RAW, 2),
+                    cpl_frameset_get_position_const(frames, 3));
+    cpl_test_eq_ptr(metis_dfs_tag_index_get(index, METIS_CALIB_FLAT, 0),
+                    cpl_frameset_get_position_const(frames, 1));
+
+    cpl_test_null(metis_dfs_tag_index_get(index, METIS_RAW, 3));
+    cpl_test_error(CPL_ERROR_ACCESS_OUT_OF_RANGE);
+    cpl_test_null(metis_dfs_tag_index_get(index, METIS_CALIB_RAW, 0));
+    cpl_test_error(CPL_ERROR_ACCESS_OUT_OF_RANGE);
+
+    metis_dfs_tag_index_delete(index);
+    metis_dfs_tag_index_delete(NULL);
+    cpl_frameset_delete(frames);
+
+    return;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Unit tests of metis_dfs module
@@ -111,6 +217,8 @@ int main(void)
     cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
 
     test_set_groups();
+    test_register_tags();
+    test_tag_index();
 
     return cpl_test_end(0);
 }
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#include "metis_polyfit.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_polyfit_test  Unit test of metis_polyfit
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_polyfit_weighted
+ */
+/*----------------------------------------------------------------------------*/
+static void test_polyfit_weighted(void)
+{
+    /* More pixels than one tile, so that tiling and threading are exercised */
+    const cpl_size nsamples = 8;
+    const cpl_size npix = 1000;
+    const cpl_size degree = 2;
+    const double truth[] = {3.0e-6, -0.02, 4.0};     /* highest degree first */
+
+    double *x = cpl_malloc(nsamples * npix * sizeof(*x));
+    double *y = cpl_malloc(nsamples * npix * sizeof(*y));
+    double *w = cpl_malloc(nsamples * npix * sizeof(*w));
+    double *coeffs = cpl_malloc((degree + 1) * npix * sizeof(*coeffs));
+    double *cov_diag = cpl_malloc((degree + 1) * npix * sizeof(*cov_diag));
+    unsigned char *ok = cpl_malloc(npix * sizeof(*ok));
+    cpl_error_code code;
+
+    /* Noiseless samples of the same quadratic, at pixel-dependent abscissae */
+    for (cpl_size n = 0; n < nsamples; n++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            const double xv = 1000.0 * (n + 1) + 3.0 * p;
+            x[n * npix + p] = xv;
+            y[n * npix + p] = (truth[0] * xv + truth[1]) * xv + truth[2];
+            w[n * npix + p] = 1.0 + 0.1 * n;
+        }
+    }
+
+    /* Only two samples at the last pixel: under-determined */
+    for (cpl_size n = 2; n < nsamples; n++) {
+        w[n * npix + npix - 1] = 0.0;
+    }
+
+    /* Test with invalid input */
+    code = metis_polyfit_weighted(NULL, y, w, nsamples, npix, degree, coeffs, cov_diag, ok);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_polyfit_weighted(x, y, w, nsamples, npix, METIS_POLYFIT_MAX_DEGREE + 1,
+                                  coeffs, cov_diag, ok);
+    cpl_test_eq_error(code, CPL_ERROR_UNSUPPORTED_MODE);
+
+    /* Test with valid input */
+    code = metis_polyfit_weighted(x, y, w, nsamples, npix, degree, coeffs, cov_diag, ok);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    for (cpl_size p = 0; p < npix - 1; p++) {
+        cpl_test(ok[p]);
+        for (cpl_size k = 0; k <= degree; k++) {
+            cpl_test_rel(coeffs[k * npix + p], truth[k], 1e-8);
+            cpl_test_leq(0.0, cov_diag[k * npix + p]);
+        }
+    }
+
+    /* The under-determined pixel is flagged and zeroed */
+    cpl_test_zero(ok[npix - 1]);
+    for (cpl_size k = 0; k <= degree; k++) {
+        cpl_test_abs(coeffs[k * npix + npix - 1], 0.0, 0.0);
+        cpl_test_abs(cov_diag[k * npix + npix - 1], 0.0, 0.0);
+    }
+
+    /* The optional outputs may be omitted */
+    code = metis_polyfit_weighted(x, y, w, nsamples, npix, degree, coeffs, NULL, NULL);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_rel(coeffs[degree * npix], truth[degree], 1e-8);
+
+    cpl_free(x);
+    cpl_free(y);
+    cpl_free(w);
+    cpl_free(coeffs);
+    cpl_free(cov_diag);
+    cpl_free(ok);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_polyfit_from_sums
+ */
+/*----------------------------------------------------------------------------*/
+static void test_polyfit_from_sums(void)
+{
+    const cpl_size nsamples = 10;
+    const cpl_size npix = 700;
+    const cpl_size degree = 2;
+    const double reference = 22000.0;
+
+    double *x = cpl_malloc(nsamples * npix * sizeof(*x));
+    double *y = cpl_malloc(nsamples * npix * sizeof(*y));
+    double *w = cpl_malloc(nsamples * npix * sizeof(*w));
+    double *sums = cpl_calloc((2 * degree + 1) * npix, sizeof(*sums));
+    double *rhs = cpl_calloc((degree + 1) * npix, sizeof(*rhs));
+    double *scale = cpl_calloc(npix, sizeof(*scale));
+    double *expected = cpl_malloc((degree + 1) * npix * sizeof(*expected));
+    double *expected_var = cpl_malloc((degree + 1) * npix * sizeof(*expected_var));
+    double *coeffs = cpl_malloc((degree + 1) * npix * sizeof(*coeffs));
+    double *cov_diag = cpl_malloc((degree + 1) * npix * sizeof(*cov_diag));
+    unsigned char *expected_ok = cpl_malloc(npix * sizeof(*expected_ok));
+    unsigned char *ok = cpl_malloc(npix * sizeof(*ok));
+    cpl_error_code code;
+
+    /* Noisy samples of a slowly varying correction, as in the linearity fit */
+    for (cpl_size n = 0; n < nsamples; n++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            const double xv = 1500.0 * (n + 1) + 7.0 * p;
+            x[n * npix + p] = xv;
+            y[n * npix + p] = 1.0 + 2.0e-6 * xv + 1.0e-3 * sin((double)(n * npix + p));
+            w[n * npix + p] = 1.0 / (1.0 + 0.01 * n);
+        }
+    }
+    /* A pixel with a single sample is under-determined */
+    for (cpl_size n = 1; n < nsamples; n++) {
+        w[n * npix] = 0.0;
+    }
+
+    /* Stream through the samples, keeping only the normal equations */
+    for (cpl_size n = 0; n < nsamples; n++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            const double wv = w[n * npix + p];
+            if (wv == 0.0) {
+                continue;
+            }
+            const double xs = x[n * npix + p] / reference;
+            double power = wv * wv;
+            for (cpl_size k = 0; k < 2 * degree + 1; k++) {
+                sums[k * npix + p] += power;
+                if (k <= degree) {
+                    rhs[k * npix + p] += power * y[n * npix + p];
+                }
+                power *= xs;
+            }
+            scale[p] = CPL_MAX(scale[p], fabs(x[n * npix + p]));
+        }
+    }
+
+    /* Test with invalid input */
+    code = metis_polyfit_from_sums(NULL, rhs, scale, reference, npix, degree,
+                                   coeffs, cov_diag, ok);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_polyfit_from_sums(sums, rhs, scale, 0.0, npix, degree,
+                                   coeffs, cov_diag, ok);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    code = metis_polyfit_from_sums(sums, rhs, scale, reference, npix, -1,
+                                   coeffs, cov_diag, ok);
+    cpl_test_eq_error(code, CPL_ERROR_UNSUPPORTED_MODE);
+
+    /* Test with valid input: the same results as the fit of the full stack */
+    code = metis_polyfit_weighted(x, y, w, nsamples, npix, degree,
+                                  expected, expected_var, expected_ok);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    code = metis_polyfit_from_sums(sums, rhs, scale, reference, npix, degree,
+                                   coeffs, cov_diag, ok);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    cpl_test_zero(ok[0]);
+    for (cpl_size p = 0; p < npix; p++) {
+        cpl_test_eq(ok[p], expected_ok[p]);
+        for (cpl_size k = 0; k <= degree; k++) {
+            cpl_test_abs(coeffs[k * npix + p], expected[k * npix + p],
+                         1e-6 * fabs(expected[k * npix + p]));
+            cpl_test_abs(cov_diag[k * npix + p], expected_var[k * npix + p],
+                         1e-6 * fabs(expected_var[k * npix + p]));
+        }
+    }
+
+    cpl_free(x);
+    cpl_free(y);
+    cpl_free(w);
+    cpl_free(sums);
+    cpl_free(rhs);
+    cpl_free(scale);
+    cpl_free(expected);
+    cpl_free(expected_var);
+    cpl_free(coeffs);
+    cpl_free(cov_diag);
+    cpl_free(expected_ok);
+    cpl_free(ok);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit tests of metis_polyfit module
+ */
+/*----------------------------------------------------------------------------*/
+
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_polyfit_weighted();
+    test_polyfit_from_sums();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
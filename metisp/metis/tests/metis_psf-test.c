@@ -0,0 +1,153 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#include "metis_psf.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_psf_test  Unit test of metis_psf
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_psf_measure
+ */
+/*----------------------------------------------------------------------------*/
+static void test_psf_measure(void)
+{
+    const cpl_size nx = 120;
+    const cpl_size ny = 90;
+    const cpl_size nframes = 2;
+    const cpl_size nsources = 3;
+    const double sigma = 2.0;
+    const double amplitude = 1000.0;
+    const double background = 50.0;
+    /* Sources in the first frame; the second frame is shifted by (1.5, -0.75) */
+    const double truth[] = {30.3, 25.6, 80.0, 40.2, 61.7, 70.4};
+
+    float *data = cpl_malloc(nframes * nx * ny * sizeof(*data));
+    unsigned char *bpm = cpl_calloc(nframes * nx * ny, sizeof(*bpm));
+    double *positions = cpl_malloc(2 * nframes * nsources * sizeof(*positions));
+    double *stats = cpl_malloc(METIS_PSF_NSTATS * nframes * nsources * sizeof(*stats));
+    cpl_error_code code;
+
+    for (cpl_size f = 0; f < nframes; f++) {
+        for (cpl_size j = 0; j < ny; j++) {
+            for (cpl_size i = 0; i < nx; i++) {
+                /* A deterministic ripple of unit amplitude stands in for the noise */
+                double v = background + sin(0.7 * i + 1.3 * j + f);
+                for (cpl_size s = 0; s < nsources; s++) {
+                    const double dx = i - truth[2 * s] - 1.5 * f;
+                    const double dy = j - truth[2 * s + 1] + 0.75 * f;
+                    v += amplitude * exp(-0.5 * (dx * dx + dy * dy) / (sigma * sigma));
+                }
+                data[(f * ny + j) * nx + i] = (float)v;
+            }
+        }
+        /* Guesses a pixel or two off */
+        for (cpl_size s = 0; s < nsources; s++) {
+            positions[2 * (f * nsources + s)] = floor(truth[2 * s]) + 1.0;
+            positions[2 * (f * nsources + s) + 1] = floor(truth[2 * s + 1]) - 1.0;
+        }
+    }
+
+    /* A hot bad pixel next to the first source is ignored */
+    const cpl_size hot = (cpl_size)floor(truth[1] + 0.5) * nx + (cpl_size)floor(truth[0] + 0.5) + 3;
+    data[hot] = 1.0e6;
+    bpm[hot] = 1;
+
+    /* Test with invalid input */
+    code = metis_psf_measure(NULL, bpm, nframes, nx, ny, positions, nsources, 8, 4, stats);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_psf_measure(data, bpm, nframes, nx, ny, positions, nsources, 0, 4, stats);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Test with valid input */
+    code = metis_psf_measure(data, bpm, nframes, nx, ny, positions, nsources, 8, 4, stats);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    const cpl_size nmeasures = nframes * nsources;
+    for (cpl_size f = 0; f < nframes; f++) {
+        for (cpl_size s = 0; s < nsources; s++) {
+            const cpl_size m = f * nsources + s;
+            cpl_test_abs(stats[METIS_PSF_XCEN * nmeasures + m], truth[2 * s] + 1.5 * f, 0.05);
+            cpl_test_abs(stats[METIS_PSF_YCEN * nmeasures + m], truth[2 * s + 1] - 0.75 * f, 0.05);
+            cpl_test_lt(0.0, stats[METIS_PSF_XCEN_ERR * nmeasures + m]);
+            cpl_test_lt(stats[METIS_PSF_XCEN_ERR * nmeasures + m], 0.05);
+            cpl_test_lt(0.0, stats[METIS_PSF_YCEN_ERR * nmeasures + m]);
+            cpl_test_abs(stats[METIS_PSF_FWHM_X * nmeasures + m], 2.3548 * sigma, 0.4);
+            cpl_test_abs(stats[METIS_PSF_FWHM_Y * nmeasures + m], 2.3548 * sigma, 0.4);
+            cpl_test_rel(stats[METIS_PSF_FLUX * nmeasures + m],
+                         2.0 * CPL_MATH_PI * sigma * sigma * amplitude, 0.02);
+            cpl_test_abs(stats[METIS_PSF_BACKGROUND * nmeasures + m], background, 0.2);
+            cpl_test_lt(0.5, stats[METIS_PSF_NOISE * nmeasures + m]);
+            cpl_test_lt(stats[METIS_PSF_NOISE * nmeasures + m], 1.5);
+            cpl_test_lt(100.0, stats[METIS_PSF_SNR * nmeasures + m]);
+        }
+    }
+
+    /* Guesses outside the frame cannot be measured */
+    positions[0] = -3.0;
+    code = metis_psf_measure(data, NULL, 1, nx, ny, positions, 1, 8, 4, stats);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    for (int k = 0; k < METIS_PSF_NSTATS; k++) {
+        cpl_test(isnan(stats[k]));
+    }
+
+    cpl_free(data);
+    cpl_free(bpm);
+    cpl_free(positions);
+    cpl_free(stats);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit tests of metis_psf module
+ */
+/*----------------------------------------------------------------------------*/
+
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_psf_measure();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
@@ -0,0 +1,258 @@
+/*
+ * This file is part of the METIS Pipeline
+ * Copyright (C) 2002-2017 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <cpl.h>
+
+#include <math.h>
+
+#include "metis_sigclip.h"
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup metis_sigclip_test  Unit test of metis_sigclip
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_sigclip_median and metis_sigclip_values
+ */
+/*----------------------------------------------------------------------------*/
+static void test_sigclip_values(void)
+{
+    float odd[] = {5.0, 1.0, 4.0, 2.0, 3.0};
+    float even[] = {4.0, 1.0, 3.0, 2.0};
+    float values[] = {10.0, 11.0, 9.0, 10.5, 9.5, 10.0, 100.0, -50.0};
+    float scratch[8];
+    double stats[METIS_SIGCLIP_NSTATS];
+
+    cpl_test_abs(metis_sigclip_median(odd, 5), 3.0, 0.0);
+    cpl_test_abs(metis_sigclip_median(even, 4), 2.5, 0.0);
+
+    /* Both outliers go, and the bounds separate them from the kept values */
+    cpl_test_eq(metis_sigclip_values(values, 8, scratch,
+                                     METIS_SIGCLIP_MEDIAN, METIS_SIGCLIP_MAD,
+                                     3.0, 3.0, 5, stats), 6);
+    cpl_test_abs(stats[METIS_SIGCLIP_STAT_CENTRE], 10.0, 0.0);
+    cpl_test_abs(stats[METIS_SIGCLIP_STAT_KEPT], 6.0, 0.0);
+    cpl_test_lt(stats[METIS_SIGCLIP_STAT_LOW], 9.0);
+    cpl_test_lt(-50.0, stats[METIS_SIGCLIP_STAT_LOW]);
+    cpl_test_lt(11.0, stats[METIS_SIGCLIP_STAT_HIGH]);
+    cpl_test_lt(stats[METIS_SIGCLIP_STAT_HIGH], 100.0);
+
+    /* Without iterations nothing is clipped */
+    cpl_test_eq(metis_sigclip_values(values, 6, NULL,
+                                     METIS_SIGCLIP_MEAN, METIS_SIGCLIP_STDEV,
+                                     3.0, 3.0, 0, stats), 6);
+    cpl_test(isinf(stats[METIS_SIGCLIP_STAT_LOW]));
+    cpl_test(isinf(stats[METIS_SIGCLIP_STAT_HIGH]));
+    cpl_test_abs(stats[METIS_SIGCLIP_STAT_CENTRE], 10.0, 1e-12);
+
+    /* A single value is kept as it is */
+    cpl_test_eq(metis_sigclip_values(values, 1, NULL,
+                                     METIS_SIGCLIP_MEAN, METIS_SIGCLIP_STDEV,
+                                     3.0, 3.0, 5, stats), 1);
+    cpl_test_abs(stats[METIS_SIGCLIP_STAT_SIGMA], 0.0, 0.0);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_sigclip_map
+ */
+/*----------------------------------------------------------------------------*/
+static void test_sigclip_map(void)
+{
+    /* More pixels than are reduced serially, so that threading is exercised */
+    const cpl_size npix = 100000;
+
+    float *data = cpl_malloc(npix * sizeof(*data));
+    unsigned char *bpm = cpl_calloc(npix, sizeof(*bpm));
+    unsigned char *rejected = cpl_malloc(npix * sizeof(*rejected));
+    double stats[METIS_SIGCLIP_NSTATS];
+    cpl_error_code code;
+
+    /* A flat ramp between 99 and 101, with hot, cold, bad and invalid pixels */
+    for (cpl_size p = 0; p < npix; p++) {
+        data[p] = 99.0 + 2.0 * (double)(p % 1000) / 999.0;
+    }
+    data[10] = 1e4;
+    data[20] = -1e4;
+    data[30] = NAN;
+    data[40] = 5e3;
+    bpm[40] = 1;
+
+    /* Test with invalid input */
+    code = metis_sigclip_map(NULL, bpm, npix, METIS_SIGCLIP_MEDIAN,
+                             METIS_SIGCLIP_MAD, 3.0, 3.0, 5, rejected, stats);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_sigclip_map(data, bpm, npix, METIS_SIGCLIP_MEDIAN,
+                             METIS_SIGCLIP_MAD, 0.0, 3.0, 5, rejected, stats);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    code = metis_sigclip_map(data, bpm, npix, METIS_SIGCLIP_MEDIAN,
+                             (metis_sigclip_scale)7, 3.0, 3.0, 5,
+                             rejected, stats);
+    cpl_test_eq_error(code, CPL_ERROR_UNSUPPORTED_MODE);
+
+    /* Test with valid input, with either pair of estimators */
+    for (int robust = 0; robust < 2; robust++) {
+        code = metis_sigclip_map(data, bpm, npix,
+                                 robust ? METIS_SIGCLIP_MEDIAN : METIS_SIGCLIP_MEAN,
+                                 robust ? METIS_SIGCLIP_MAD : METIS_SIGCLIP_STDEV,
+                                 3.0, 3.0, 5, rejected, stats);
+        cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+        cpl_test(rejected[10]);
+        cpl_test(rejected[20]);
+        cpl_test(rejected[30]);
+        cpl_test(rejected[40]);
+
+        cpl_size nrejected = 0;
+        for (cpl_size p = 0; p < npix; p++) {
+            nrejected += rejected[p] != 0;
+        }
+        cpl_test_eq(nrejected, 4);
+
+        cpl_test_abs(stats[METIS_SIGCLIP_STAT_CENTRE], 100.0, 1e-3);
+        cpl_test_abs(stats[METIS_SIGCLIP_STAT_KEPT], (double)(npix - 4), 0.0);
+        /* The standard deviation of a uniform distribution of width 2 */
+        cpl_test_rel(stats[METIS_SIGCLIP_STAT_SIGMA],
+                     robust ? 1.4826 * 0.5 : 2.0 / sqrt(12.0), 1e-2);
+    }
+
+    /* The outputs may be omitted */
+    code = metis_sigclip_map(data, NULL, npix, METIS_SIGCLIP_MEDIAN,
+                             METIS_SIGCLIP_STDEV, 3.0, 3.0, 5, NULL, NULL);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    cpl_free(data);
+    cpl_free(bpm);
+    cpl_free(rejected);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit test of metis_sigclip_stack
+ */
+/*----------------------------------------------------------------------------*/
+static void test_sigclip_stack(void)
+{
+    /* More pixels than one tile, so that tiling and threading are exercised */
+    const cpl_size nframes = 7;
+    const cpl_size npix = 1000;
+
+    float *stack = cpl_malloc(nframes * npix * sizeof(*stack));
+    unsigned char *bpm = cpl_calloc(nframes * npix, sizeof(*bpm));
+    unsigned char *rejected = cpl_malloc(nframes * npix * sizeof(*rejected));
+    double *stats = cpl_malloc(METIS_SIGCLIP_NSTATS * npix * sizeof(*stats));
+    cpl_error_code code;
+
+    for (cpl_size n = 0; n < nframes; n++) {
+        for (cpl_size p = 0; p < npix; p++) {
+            stack[n * npix + p] = (float)p + 0.1 * (double)(n % 3);
+        }
+    }
+
+    /* A cosmic in every pixel of the third frame, a bad sample in the first */
+    for (cpl_size p = 0; p < npix; p++) {
+        stack[2 * npix + p] += 1e4;
+        bpm[p] = 1;
+    }
+
+    /* Nothing good at the last pixel */
+    for (cpl_size n = 0; n < nframes; n++) {
+        bpm[n * npix + npix - 1] = 1;
+    }
+
+    /* Test with invalid input */
+    code = metis_sigclip_stack(NULL, bpm, nframes, npix, METIS_SIGCLIP_MEDIAN,
+                               METIS_SIGCLIP_MAD, 3.0, 3.0, 5, rejected, stats);
+    cpl_test_eq_error(code, CPL_ERROR_NULL_INPUT);
+
+    code = metis_sigclip_stack(stack, bpm, -1, npix, METIS_SIGCLIP_MEDIAN,
+                               METIS_SIGCLIP_MAD, 3.0, 3.0, 5, rejected, stats);
+    cpl_test_eq_error(code, CPL_ERROR_ILLEGAL_INPUT);
+
+    /* Test with valid input */
+    code = metis_sigclip_stack(stack, bpm, nframes, npix, METIS_SIGCLIP_MEDIAN,
+                               METIS_SIGCLIP_MAD, 3.0, 3.0, 5, rejected, stats);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+
+    for (cpl_size p = 0; p < npix - 1; p++) {
+        for (cpl_size n = 0; n < nframes; n++) {
+            cpl_test_eq(rejected[n * npix + p], n == 0 || n == 2);
+        }
+        cpl_test_abs(stats[METIS_SIGCLIP_STAT_CENTRE * npix + p],
+                     (double)p + 0.1, 1e-3);
+        cpl_test_abs(stats[METIS_SIGCLIP_STAT_KEPT * npix + p], 5.0, 0.0);
+    }
+
+    for (cpl_size n = 0; n < nframes; n++) {
+        cpl_test(rejected[n * npix + npix - 1]);
+    }
+    cpl_test_abs(stats[METIS_SIGCLIP_STAT_KEPT * npix + npix - 1], 0.0, 0.0);
+
+    /* The outputs may be omitted */
+    code = metis_sigclip_stack(stack, NULL, nframes, npix, METIS_SIGCLIP_MEAN,
+                               METIS_SIGCLIP_STDEV, 2.0, 2.0, 5, NULL, stats);
+    cpl_test_eq_error(code, CPL_ERROR_NONE);
+    cpl_test_abs(stats[METIS_SIGCLIP_STAT_KEPT * npix], 6.0, 0.0);
+
+    cpl_free(stack);
+    cpl_free(bpm);
+    cpl_free(rejected);
+    cpl_free(stats);
+
+    return;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unit tests of metis_sigclip module
+ */
+/*----------------------------------------------------------------------------*/
+
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_sigclip_values();
+    test_sigclip_map();
+    test_sigclip_stack();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
@@ -28,6 +28,8 @@ from cpl.core import (Image as CplImage,
                       Msg)
 
 from pymetis.engine.dataitems import Hdu
+from pymetis.engine.dataitems.fitsindex import HduIndex, fits_index
+from pymetis.engine.dataitems.writer import Compression, NO_COMPRESSION, write_extensions
 
 
 class EnhancedImage:
@@ -115,16 +117,16 @@ class EnhancedImage:
         layers = ', '.join(self._describe_layer(hdu) for hdu in self.as_list())
         return f"<EnhancedImage {self.prefix!r} {width}×{height}: {layers}>"
 
-    def save(self, filename: str) -> None:
+    def save(self, filename: str, *, compression: Compression = NO_COMPRESSION) -> None:
         """
         Append all present layers as extensions to ``filename``.
 
         The file is expected to already exist with a primary HDU (this mirrors
         `DataItem.save_extensions`, which creates the primary header first and
         then appends each `Hdu`). Absent layers are simply skipped.
+        With ``compression``, the layers are tile-compressed; the DQ layer always losslessly.
         """
-        for hdu in self.as_list():
-            hdu.save(filename)
+        write_extensions(filename, self.as_list(), compression=compression)
 
     @classmethod
     def load(cls, filename: str, prefix: str) -> Self:
@@ -136,21 +138,16 @@ class EnhancedImage:
         Each layer is read as an `Image` (NAXIS == 2) or an `ImageList`
         (NAXIS == 3), matching how `DataItem.load` infers the HDU class.
         """
-        # Map every extension name to its index and header.
-        extensions: dict[str, tuple[int, CplPropertyList]] = {}
-        index = 0
-        while True:
-            try:
-                header = CplPropertyList.load(filename, index)
-            except cpl.core.DataNotFoundError:
-                break
-            if index > 0:
-                try:
-                    extensions[header['EXTNAME'].value] = (index, header)
-                except KeyError:
+        # Map every extension name to its HDU; only the headers of the layers actually read are loaded.
+        index = fits_index(filename)
+        extensions: dict[str, HduIndex] = {}
+        for hdu in index:
+            if hdu.index > 0:
+                if hdu.extname is None:
                     Msg.debug(cls.__qualname__,
-                              f"HDU {index} in {filename} has no EXTNAME, skipping")
-            index += 1
+                              f"HDU {hdu.index} in {filename} has no EXTNAME, skipping")
+                else:
+                    extensions[hdu.extname] = hdu
 
         def read_layer(
             suffix: str,
@@ -160,11 +157,11 @@ class EnhancedImage:
             if extname not in extensions:
                 return None, None
 
-            extno, header = extensions[extname]
+            hdu = extensions[extname]
             # FITS stores a 2D plane as NAXIS == 2 and a stack as NAXIS == 3.
-            klass = CplImageList if header['NAXIS'].value == 3 else CplImage
-            data = klass.load(filename, pixel_type, extno)
-            return data, header
+            klass = CplImageList if hdu.naxis == 3 else CplImage
+            data = klass.load(filename, pixel_type, hdu.index)
+            return data, index.header(hdu.index)
 
         image, header_image = read_layer(cls.sci_suffix)
         if image is None:
@@ -0,0 +1,123 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+from dataclasses import dataclass
+from typing import Iterable, Optional, Self
+
+import numpy as np
+
+
+@dataclass(frozen=True)
+class FrameStatistics:
+    """ Summary statistics of the good pixels of a single frame. """
+    median: float
+    mean: float
+    stdev: float
+    min: float
+    max: float
+
+
+class StackMoments:
+    """
+    Per-pixel statistics along the stack axis, accumulated one frame at a time.
+
+    Keeps the number of good samples, the mean and the sum of squared deviations (Welford's algorithm),
+    the extrema and the number of rejected samples of every pixel, plus summary statistics of every frame.
+    Memory use is independent of the number of frames, so the frames can be streamed from disk,
+    and the frames themselves are never modified.
+    """
+    def __init__(self, shape: tuple[int, int]):
+        self.shape = shape
+        self.count = np.zeros(shape, dtype=np.int64)
+        self.rejected = np.zeros(shape, dtype=np.int64)
+        self.min = np.full(shape, np.inf)
+        self.max = np.full(shape, -np.inf)
+        self.frames: list[FrameStatistics] = []
+        self._mean = np.zeros(shape)
+        self._m2 = np.zeros(shape)
+
+    @classmethod
+    def from_frames(cls, frames: Iterable[np.ndarray | tuple[np.ndarray, Optional[np.ndarray]]]) -> Self:
+        """
+        Accumulate the statistics of an iterable of frames, or of (frame, bad pixel mask) pairs.
+        The iterable is consumed lazily, so a generator reading one frame at a time works too.
+        """
+        moments = None
+        for item in frames:
+            frame, bpm = item if isinstance(item, tuple) else (item, None)
+            if moments is None:
+                moments = cls(frame.shape)
+            moments.add(frame, bpm)
+
+        if moments is None:
+            raise ValueError("Cannot compute stack statistics without any frames")
+
+        return moments
+
+    def add(self, frame: np.ndarray, bpm: Optional[np.ndarray] = None) -> None:
+        """ Add a frame to the statistics. Pixels flagged in `bpm` are counted as rejected and otherwise ignored. """
+        assert frame.shape == self.shape, \
+            f"Frame shape {frame.shape} does not match the stack shape {self.shape}"
+
+        values = np.asarray(frame, dtype=np.float64)
+        good = np.ones(self.shape, dtype=bool) if bpm is None else ~np.asarray(bpm, dtype=bool)
+
+        self.count += good
+        self.rejected += ~good
+
+        delta = np.where(good, values - self._mean, 0.0)
+        self._mean += delta / np.maximum(self.count, 1)
+        self._m2 += delta * np.where(good, values - self._mean, 0.0)
+
+        np.fmin(self.min, values, out=self.min, where=good)
+        np.fmax(self.max, values, out=self.max, where=good)
+
+        selected = values[good]
+        if selected.size == 0:
+            self.frames.append(FrameStatistics(np.nan, np.nan, np.nan, np.nan, np.nan))
+        else:
+            self.frames.append(FrameStatistics(
+                median=float(np.median(selected)),
+                mean=float(selected.mean()),
+                stdev=float(selected.std(ddof=1)) if selected.size > 1 else 0.0,
+                min=float(selected.min()),
+                max=float(selected.max()),
+            ))
+
+    @property
+    def nframes(self) -> int:
+        return len(self.frames)
+
+    @property
+    def mean(self) -> np.ndarray:
+        """ Per-pixel mean of the good samples (NaN where there are none). """
+        return np.where(self.count > 0, self._mean, np.nan)
+
+    def variance(self, ddof: int = 0) -> np.ndarray:
+        """ Per-pixel variance of the good samples (NaN where there are not more than `ddof`). """
+        return np.where(self.count > ddof, self._m2 / np.maximum(self.count - ddof, 1), np.nan)
+
+    def stdev(self, ddof: int = 0) -> np.ndarray:
+        """ Per-pixel standard deviation of the good samples. """
+        return np.sqrt(self.variance(ddof))
+
+    @property
+    def mean_square(self) -> np.ndarray:
+        """ Per-pixel mean of the squared good samples. """
+        return self.variance() + self.mean ** 2
@@ -0,0 +1,174 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import hashlib
+import threading
+from collections import OrderedDict
+from typing import ClassVar, Optional, Self, Sequence
+
+import numpy as np
+
+
+class TraceGeometry:
+    """
+    Sparse pixel-to-trace index of a set of spectral traces on a detector.
+
+    Every trace is cut into spans, one per detector column it crosses, that cover the rows
+    ``int(y) - below`` up to (but excluding) ``int(y) + above`` around the trace centre `y`.
+    The spans are stored as flat arrays (trace, column, first row, last row) together with the flat pixel
+    index and span of every covered pixel, so that extracting, collapsing or painting all traces
+    is a single linear scan over those arrays instead of a Python loop over traces and columns.
+
+    Building the index is the expensive part; use `for_traces` to share it between all users of the same
+    traces (e.g. the RSRF and wavelength calibration of one distortion product).
+    """
+    _cache: ClassVar[OrderedDict[bytes, 'TraceGeometry']] = OrderedDict()
+    _cache_size: ClassVar[int] = 16
+    _lock: ClassVar[threading.Lock] = threading.Lock()
+
+    def __init__(self,
+                 traces: Sequence[tuple[np.ndarray, np.ndarray]],
+                 shape: tuple[int, int],
+                 *,
+                 below: int,
+                 above: int,
+                 partial: bool = True):
+        """
+        Parameters
+        ----------
+        traces:
+            For every trace, the arrays of x and y coordinates of its centre, as returned by `IfuDistortionTable.read`.
+        shape:
+            Shape (rows, columns) of the detector.
+        below, above:
+            Extent of every span below and above the trace centre.
+        partial:
+            If True, spans crossing the detector edge are clipped to it, otherwise they are dropped altogether.
+        """
+        self.shape = shape
+        self.ntraces = len(traces)
+        height, width = shape
+
+        lengths = [len(x) for x, _ in traces]
+        trace = np.repeat(np.arange(self.ntraces, dtype=np.int32), lengths)
+        column = np.concatenate([np.asarray(x) for x, _ in traces]).astype(np.int64) if traces else np.empty(0, int)
+        centre = np.concatenate([np.asarray(y) for _, y in traces]).astype(np.int64) if traces else np.empty(0, int)
+
+        first, last = centre - below, centre + above
+        inside = (column >= 0) & (column < width)
+        if partial:
+            first, last = np.clip(first, 0, height), np.clip(last, 0, height)
+            inside &= last > first
+        else:
+            inside &= (first >= 0) & (last <= height) & (last > first)
+
+        self.trace = trace[inside]
+        self.column = column[inside].astype(np.int32)
+        self.first = first[inside].astype(np.int32)
+        self.last = last[inside].astype(np.int32)
+
+        # Expand the spans to pixels: span `s` owns pixels offsets[s] to offsets[s + 1]
+        counts = (self.last - self.first).astype(np.int64)
+        self.offsets = np.zeros(len(counts) + 1, dtype=np.int64)
+        np.cumsum(counts, out=self.offsets[1:])
+        self.span = np.repeat(np.arange(len(counts), dtype=np.int32), counts)
+        rows = np.repeat(self.first.astype(np.int64), counts) \
+            + np.arange(self.offsets[-1]) - np.repeat(self.offsets[:-1], counts)
+        index_type = np.int32 if height * width < 2 ** 31 else np.int64
+        self.pixels = (rows * width + np.repeat(self.column, counts)).astype(index_type)
+
+    @classmethod
+    def for_traces(cls,
+                   traces: Sequence[tuple[np.ndarray, np.ndarray]],
+                   shape: tuple[int, int],
+                   *,
+                   below: int,
+                   above: int,
+                   partial: bool = True) -> Self:
+        """ Return the geometry for these traces and spans, reusing a previously built identical one. """
+        digest = hashlib.blake2b(digest_size=16)
+        for x, y in traces:
+            digest.update(np.ascontiguousarray(x, dtype=np.float64).tobytes())
+            digest.update(np.ascontiguousarray(y, dtype=np.float64).tobytes())
+            digest.update(b'|')
+        key = digest.digest() + repr((tuple(shape), below, above, partial)).encode()
+
+        with cls._lock:
+            if (geometry := cls._cache.get(key)) is not None:
+                cls._cache.move_to_end(key)
+                return geometry
+
+        geometry = cls(traces, shape, below=below, above=above, partial=partial)
+
+        with cls._lock:
+            cls._cache[key] = geometry
+            while len(cls._cache) > cls._cache_size:
+                cls._cache.popitem(last=False)
+        return geometry
+
+    @property
+    def nspans(self) -> int:
+        return len(self.column)
+
+    def collapse(self,
+                 data: np.ndarray,
+                 mask: Optional[np.ndarray] = None,
+                 *,
+                 average: bool = True) -> np.ndarray:
+        """
+        Collapse every span of `data` along the rows, ignoring pixels flagged in `mask`.
+
+        Returns
+        -------
+        np.ndarray
+            Array of shape (traces, columns) holding the mean (or sum) of every span.
+            Columns not crossed by a trace are zero, spans without any good pixel are NaN (mean) or zero (sum).
+        """
+        values = data.ravel()[self.pixels].astype(np.float64)
+        if mask is not None:
+            good = ~mask.ravel()[self.pixels].astype(bool)
+            values *= good
+        else:
+            good = np.ones(len(self.pixels), dtype=bool)
+
+        sums = np.bincount(self.span, weights=values, minlength=self.nspans)
+        if average:
+            counts = np.bincount(self.span, weights=good, minlength=self.nspans)
+            with np.errstate(invalid='ignore', divide='ignore'):
+                sums = np.where(counts > 0, sums / np.maximum(counts, 1), np.nan)
+
+        collapsed = np.zeros((self.ntraces, self.shape[1]), dtype=np.float64)
+        collapsed[self.trace, self.column] = sums
+        return collapsed
+
+    def paint(self,
+              values: np.ndarray,
+              *,
+              out: Optional[np.ndarray] = None) -> np.ndarray:
+        """
+        Paint the traces onto an image: every pixel of every span gets the value of its column,
+        taken from `values` of shape (columns,) or (traces, columns). Pixels outside the traces are left untouched.
+        """
+        if out is None:
+            out = np.zeros(self.shape, dtype=np.float64)
+
+        values = np.asarray(values)
+        per_span = values[self.column] if values.ndim == 1 else values[self.trace, self.column]
+        np.put(out, self.pixels, per_span[self.span])
+        return out
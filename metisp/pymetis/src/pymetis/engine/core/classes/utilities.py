@@ -17,15 +17,256 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
+import contextlib
+import contextvars
+import functools
+import json
+import os
+import threading
 import time
-from typing import Self
+from pathlib import Path
+from typing import Any, Callable, ContextManager, Iterator, Optional, Self
+
+from pymetis.engine.core.functions.resources import current_rss, io_counters, peak_rss, reset_peak_rss
 
 
 class Stopwatch:
-    """Time a block and expose the result as ``.elapsed`` (seconds)."""
+    """Time a block and expose the result as ``.elapsed`` (wall, seconds) and ``.cpu`` (CPU of this thread)."""
     def __enter__(self) -> Self:
         self._start = time.perf_counter()
+        self._cpu_start = time.thread_time()
         return self
 
     def __exit__(self, *exc) -> None:
         self.elapsed = time.perf_counter() - self._start
+        self.cpu = time.thread_time() - self._cpu_start
+
+
+class Span(Stopwatch):
+    """
+    A named, nested `Stopwatch` of a `Profiler`. Besides the times it records the I/O done while it was open,
+    and as `peak_rss` how far the resident memory rose above the one at its entry.
+
+    I/O and memory are process-wide quantities: spans open concurrently in several threads
+    (e.g. parallel detectors) all see each other's reads and writes and allocations.
+    The peak is measured by resetting the high-water mark of the process whenever a span opens;
+    where this is not supported, it may also include memory held before the span was opened.
+    """
+    # Spans open in any thread, whose peak must survive the reset of the high-water mark by another span
+    _open: set['Span'] = set()
+    _lock = threading.Lock()
+
+    def __init__(self, name: str, parent: Optional['Span'] = None, **args: Any):
+        self.name = name
+        self.parent = parent
+        self.args = args
+        self.children: list[Span] = []
+        self.thread = threading.get_native_id()
+        self.elapsed: Optional[float] = None
+        self.cpu: Optional[float] = None
+        self.io: dict[str, int] = {}
+        self.peak_rss: Optional[int] = None
+
+    def __enter__(self) -> Self:
+        with Span._lock:
+            # Keep the peak reached so far for the spans still open before the high-water mark is reset
+            peak = peak_rss()
+            for span in Span._open:
+                span._peak = max(span._peak, peak)
+            reset_peak_rss()
+            self._peak = 0
+            self._rss_start = current_rss() or 0
+            Span._open.add(self)
+
+        self._io_start = io_counters()
+        return super().__enter__()
+
+    def __exit__(self, *exc) -> None:
+        super().__exit__(*exc)
+        io_end = io_counters()
+        self.io = {key: io_end[key] - self._io_start[key] for key in io_end}
+
+        with Span._lock:
+            Span._open.discard(self)
+            self.peak_rss = max(self.peak(), self._rss_start) - self._rss_start
+
+    def peak(self) -> int:
+        """ Return the peak resident memory of the process since this span was opened, in bytes. """
+        return max(self._peak, peak_rss())
+
+    def walk(self) -> Iterator['Span']:
+        """ Iterate over this span and all of its descendants, depth first. """
+        yield self
+        for child in self.children:
+            yield from child.walk()
+
+    def as_dict(self) -> dict[str, Any]:
+        return {
+            'name': self.name,
+            'args': self.args,
+            'thread': self.thread,
+            'wall': self.elapsed,
+            'cpu': self.cpu,
+            'io': self.io,
+            'peak_rss': self.peak_rss,
+            'children': [child.as_dict() for child in self.children],
+        }
+
+
+# The innermost open span of the active profiler, or None if no profiler is active in this context
+_current_span: contextvars.ContextVar[Optional[Span]] = contextvars.ContextVar('current_span', default=None)
+
+
+class Profiler:
+    """
+    Hierarchical profiler of a recipe run: a tree of named `Span`s rooted at the recipe itself.
+
+    Code anywhere in the pipeline opens spans with `profile` (or `profiled`) without a reference to the profiler;
+    they are attached to the profiler that is active in the current context, and cost next to nothing if there is none.
+    Worker threads only see the spans of their submitter if they run in a copy of its context,
+    see `contextvars.copy_context`.
+    """
+    def __init__(self, name: str, *, enabled: bool = True):
+        self.enabled = enabled
+        self.root = Span(name)
+        self._origin = time.perf_counter()
+        self._cpu_origin = time.process_time()
+        if enabled:
+            self.root.__enter__()
+
+    @contextlib.contextmanager
+    def activate(self) -> Iterator[Self]:
+        """ Make this profiler collect the spans opened within the block (in this context). """
+        if not self.enabled:
+            yield self
+            return
+
+        token = _current_span.set(self.root)
+        try:
+            yield self
+        finally:
+            _current_span.reset(token)
+
+    def finish(self) -> None:
+        """ Close the root span. Spans opened afterwards are ignored. """
+        if self.enabled and self.root.elapsed is None:
+            self.root.__exit__(None, None, None)
+
+    def totals(self) -> dict[str, dict[str, float]]:
+        """
+        Aggregate the spans by name: count, wall and CPU time, and bytes read and written.
+        A span nested in another span of the same name (e.g. an input loading its items) is not counted twice.
+        """
+        totals: dict[str, dict[str, float]] = {}
+
+        def visit(span: Span, open_names: frozenset[str]) -> None:
+            if span.elapsed is not None and span.name not in open_names:
+                total = totals.setdefault(span.name, dict.fromkeys(['count', 'wall', 'cpu', 'read', 'written'], 0))
+                total['count'] += 1
+                total['wall'] += span.elapsed
+                total['cpu'] += span.cpu
+                total['read'] += span.io.get('rchar', 0)
+                total['written'] += span.io.get('wchar', 0)
+            for child in span.children:
+                visit(child, open_names | {span.name})
+
+        for child in self.root.children:
+            visit(child, frozenset())
+
+        return totals
+
+    def as_chrome_trace(self) -> dict[str, Any]:
+        """
+        Represent the closed spans in the Chrome trace event format, as understood by `chrome://tracing`
+        and Perfetto. The full span tree and the aggregated totals are attached as `otherData`.
+        """
+        pid = os.getpid()
+        events = [
+            {
+                'name': span.name,
+                'cat': 'pymetis',
+                'ph': 'X',
+                'ts': (span._start - self._origin) * 1e6,
+                'dur': span.elapsed * 1e6,
+                'pid': pid,
+                'tid': span.thread,
+                'args': span.args | {'cpu': span.cpu, 'peak_rss': span.peak_rss} | span.io,
+            }
+            for span in self.root.walk() if span.elapsed is not None
+        ]
+
+        return {
+            'traceEvents': events,
+            'displayTimeUnit': 'ms',
+            'otherData': {
+                'recipe': self.root.name,
+                'spans': self.root.as_dict(),
+                'totals': self.totals(),
+            },
+        }
+
+    def write(self, path: Path | str) -> Path:
+        """ Write the profile as a Chrome trace JSON sidecar file. """
+        path = Path(path)
+        path.write_text(json.dumps(self.as_chrome_trace(), indent=1, default=str))
+        return path
+
+    def summary(self) -> list[tuple[str, Any, str]]:
+        """
+        Summarise the profile so far as (keyword, float value, comment) triples, e.g. for product headers:
+        wall and CPU time of the whole run, the wall time spent in every kind of span,
+        bytes read and written, and the peak resident memory since the recipe started.
+        """
+        now = time.perf_counter()
+        io = io_counters()
+        summary = [
+            ('ESO DRS PROFILE WALL', now - self.root._start, "[s] Wall time of the recipe"),
+            ('ESO DRS PROFILE CPU', time.process_time() - self._cpu_origin, "[s] CPU time, all threads"),
+            ('ESO DRS PROFILE READ', (io['rchar'] - self.root._io_start['rchar']) / 2 ** 20, "[MiB] Data read"),
+            ('ESO DRS PROFILE WRITTEN', (io['wchar'] - self.root._io_start['wchar']) / 2 ** 20, "[MiB] Data written"),
+            ('ESO DRS PROFILE PEAKRSS', self.root.peak() / 2 ** 20, "[MiB] Peak resident memory"),
+        ]
+        for name, total in self.totals().items():
+            summary.append((f'ESO DRS PROFILE {name.upper()} WALL', total['wall'],
+                            f"[s] Wall time in {total['count']} {name} spans"))
+        return summary
+
+
+def profile(name: str, **args: Any) -> ContextManager[Optional[Span]]:
+    """
+    Open a span called `name` under the innermost open span of the active profiler.
+    If no profiler is active, this is a no-op and yields None.
+    Extra keyword arguments are recorded with the span (they should be JSON-serializable).
+    """
+    parent = _current_span.get()
+    if parent is None:
+        return contextlib.nullcontext()
+
+    return _span(Span(name, parent, **args))
+
+
+@contextlib.contextmanager
+def _span(span: Span) -> Iterator[Span]:
+    span.parent.children.append(span)
+    token = _current_span.set(span)
+    try:
+        with span:
+            yield span
+    finally:
+        _current_span.reset(token)
+
+
+def profiled(name: str) -> Callable[[Callable], Callable]:
+    """ Decorator that runs every call of the function in a span called `name`, see `profile`. """
+    def decorator(function: Callable) -> Callable:
+        @functools.wraps(function)
+        def wrapper(*args, **kwargs):
+            if _current_span.get() is None:
+                return function(*args, **kwargs)
+
+            with profile(name, function=function.__qualname__):
+                return function(*args, **kwargs)
+
+        return wrapper
+
+    return decorator
@@ -0,0 +1,295 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import contextlib
+import tempfile
+from dataclasses import dataclass
+from pathlib import Path
+from typing import Literal, Optional
+
+import numpy as np
+
+from pymetis.engine.core.functions.combine import combine_with_error
+from pymetis.engine.core.native import libmetis, CPL_ERROR_NONE
+
+# Methods to combine the processed frames of a sequence with
+ADI_COMBINE_METHODS = ('average', 'median')
+
+AdiCombineMethod = Literal['average', 'median']
+
+# Extra dimensions of the random subspace, and passes over the sequence that sharpen it, in the PCA
+DEFAULT_OVERSAMPLING = 10
+DEFAULT_POWER_ITERATIONS = 2
+
+
+@dataclass(frozen=True)
+class AdiResult:
+    """
+    Products of an ADI reduction, all images (H, W) unless noted otherwise.
+
+    - speckle: combination of the modelled stellar PSF of every frame (mean frame plus its principal components),
+      in the detector orientation
+    - derotated: combination of the derotated input frames, without PSF subtraction
+    - derotated_psfsub: combination of the derotated residuals after PSF subtraction
+    - coverage: number of frames contributing to every pixel of the derotated products
+    - basis: the principal components, (ncomp, H, W), and their singular values, (ncomp,)
+    - angles, centre: the derotation, field rotation of every frame (N,) and the centre (x, y)
+    """
+    speckle: np.ndarray
+    derotated: np.ndarray
+    derotated_psfsub: np.ndarray
+    coverage: np.ndarray
+    basis: np.ndarray
+    singular_values: np.ndarray
+    angles: np.ndarray
+    centre: tuple[float, float]
+
+
+def derotate(frames: np.ndarray,
+             angles: np.ndarray,
+             *,
+             centre: Optional[tuple[float, float]] = None,
+             out: Optional[np.ndarray] = None) -> np.ndarray:
+    """
+    Derotate every frame of a cube (N, H, W) by its field rotation `angles` (N,), in degrees, counter-clockwise,
+    around `centre` (x, y), by default the centre of the frame. A source at the centre plus an offset rotated by
+    `angles[n]` in frame n lands at the centre plus that offset in every derotated frame.
+
+    Pixels are interpolated bilinearly; those that fall outside the input frame or next to a non-finite pixel
+    are NaN. Uses the multithreaded `metis_adi_derotate` kernel from `libmetis` if available,
+    otherwise NumPy, one frame at a time. Both paths produce the same results up to floating-point rounding.
+    """
+    frames = np.ascontiguousarray(frames, dtype=np.float32)
+    angles = np.ascontiguousarray(np.broadcast_to(np.asarray(angles, dtype=np.float64), frames.shape[:1]))
+    nframes, height, width = frames.shape
+    xc, yc = ((width - 1) / 2, (height - 1) / 2) if centre is None else centre
+
+    if width < 2 or height < 2:
+        raise ValueError(f"Cannot interpolate frames of {height}x{width} pixels")
+    if out is None:
+        out = np.empty_like(frames)
+
+    if (library := libmetis()) is not None:
+        code = library.metis_adi_derotate(frames, nframes, width, height, angles, xc, yc, out)
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"metis_adi_derotate failed with CPL error code {code}")
+        return out
+
+    rows, columns = np.indices((height, width), dtype=np.float64)
+    dx, dy = columns - xc, rows - yc
+    for frame, angle, result in zip(frames, angles, out):
+        theta = np.deg2rad(angle)
+        c, s = np.cos(theta), np.sin(theta)
+        # Offsets from the output pixel, so that zero rotation is exact, as in libmetis
+        sx = columns + (c - 1.0) * dx - s * dy
+        sy = rows + s * dx + (c - 1.0) * dy
+        inside = (sx >= -1e-9) & (sx <= width - 1 + 1e-9) & (sy >= -1e-9) & (sy <= height - 1 + 1e-9)
+        sx = np.clip(sx, 0, width - 1)
+        sy = np.clip(sy, 0, height - 1)
+        x0 = np.minimum(sx.astype(np.intp), width - 2)
+        y0 = np.minimum(sy.astype(np.intp), height - 2)
+        fx, fy = sx - x0, sy - y0
+        f = frame.astype(np.float64)
+        value = ((1.0 - fy) * ((1.0 - fx) * f[y0, x0] + fx * f[y0, x0 + 1])
+                 + fy * ((1.0 - fx) * f[y0 + 1, x0] + fx * f[y0 + 1, x0 + 1]))
+        result[...] = np.where(inside, value, np.nan)
+
+    return out
+
+
+def _centred(frames: np.ndarray, mean: np.ndarray) -> np.ndarray:
+    """ Frames (n, H, W) as (n, H*W) rows minus the flattened mean frame, with non-finite pixels set to zero. """
+    values = frames.reshape(len(frames), -1).astype(np.float64) - mean
+    values[~np.isfinite(values)] = 0.0
+    return values
+
+
+def _blocks(count: int, size: int) -> list[slice]:
+    return [slice(start, min(start + size, count)) for start in range(0, count, size)]
+
+
+def mean_frame(cube: np.ndarray, *, chunk: int = 32) -> np.ndarray:
+    """ Mean of the finite values of every pixel of a cube (N, H, W), reading `chunk` frames at a time. """
+    total = np.zeros(cube.shape[1:], dtype=np.float64)
+    count = np.zeros(cube.shape[1:], dtype=np.int64)
+    for block in _blocks(len(cube), chunk):
+        values = cube[block].astype(np.float64)
+        good = np.isfinite(values)
+        total += np.where(good, values, 0.0).sum(axis=0)
+        count += good.sum(axis=0)
+    return np.divide(total, count, out=np.full_like(total, np.nan), where=count > 0)
+
+
+def pca_basis(cube: np.ndarray,
+              ncomp: int,
+              *,
+              mean: Optional[np.ndarray] = None,
+              chunk: int = 32,
+              oversampling: int = DEFAULT_OVERSAMPLING,
+              power_iterations: int = DEFAULT_POWER_ITERATIONS,
+              seed: int = 0) -> tuple[np.ndarray, np.ndarray]:
+    """
+    Compute the `ncomp` leading principal components (ncomp, H, W) of the frames of a cube (N, H, W)
+    about their `mean` frame, and their singular values, with a randomised SVD.
+
+    The frames are only ever read `chunk` at a time, in 2 + `power_iterations` passes, so `cube` may be
+    a memory map of a sequence that does not fit into memory; besides the chunk, only a few matrices
+    of (H * W, ncomp + oversampling) are held. Non-finite pixels are treated as equal to the mean.
+    The basis is deterministic for a given `seed` and orthonormal.
+    """
+    nframes = len(cube)
+    npix = int(np.prod(cube.shape[1:]))
+    if not 0 <= ncomp <= min(nframes, npix):
+        raise ValueError(f"Cannot compute {ncomp} principal components of {nframes} frames of {npix} pixels")
+
+    if mean is None:
+        mean = mean_frame(cube, chunk=chunk)
+    mean = np.nan_to_num(mean.reshape(-1))
+    blocks = _blocks(nframes, chunk)
+
+    if ncomp == 0:
+        return np.zeros((0, *cube.shape[1:]), dtype=np.float32), np.zeros(0)
+
+    # Sample the range of the frame space with random combinations of the frames, then refine it
+    size = min(ncomp + oversampling, nframes, npix)
+    omega = np.random.default_rng(seed).standard_normal((nframes, size))
+    sample = np.zeros((npix, size))
+    for block in blocks:
+        sample += _centred(cube[block], mean).T @ omega[block]
+
+    for _ in range(power_iterations):
+        q, _ = np.linalg.qr(sample)
+        sample = np.zeros_like(sample)
+        for block in blocks:
+            values = _centred(cube[block], mean)
+            sample += values.T @ (values @ q)
+
+    q, _ = np.linalg.qr(sample)
+    projected = np.empty((nframes, size))
+    for block in blocks:
+        projected[block] = _centred(cube[block], mean) @ q
+
+    _, singular, vt = np.linalg.svd(projected, full_matrices=False)
+    basis = (q @ vt[:ncomp].T).T
+    return basis.reshape(ncomp, *cube.shape[1:]).astype(np.float32), singular[:ncomp]
+
+
+def adi_pca(cube: np.ndarray,
+            angles: np.ndarray,
+            *,
+            ncomp: int = 5,
+            method: AdiCombineMethod = 'median',
+            centre: Optional[tuple[float, float]] = None,
+            chunk: int = 32,
+            scratch: Optional[str | Path] = None,
+            rows: int = 64,
+            oversampling: int = DEFAULT_OVERSAMPLING,
+            power_iterations: int = DEFAULT_POWER_ITERATIONS,
+            seed: int = 0) -> AdiResult:
+    """
+    Reduce an angular differential imaging sequence (N, H, W) with field rotation `angles` (N,), in degrees:
+    model the stellar PSF of every frame as the mean frame plus its projection onto the `ncomp` leading
+    principal components of the sequence (just the mean frame for `ncomp` = 0), subtract it,
+    derotate the residuals around `centre` and combine them with `method`.
+
+    The sequence is processed `chunk` frames at a time, so `cube` may be a memory map of a sequence
+    that does not fit into memory. The mean combination is accumulated on the fly; the median needs all
+    processed frames, which are then kept in `scratch` (a directory for memory-mapped files)
+    if given, otherwise in memory, and combined in stripes of `rows` rows.
+
+    Pixels not covered by any frame are NaN in the derotated products.
+
+    Raises
+    ------
+    ValueError
+        If an unknown combine method is used, or the angles do not match the frames.
+    """
+    if method not in ADI_COMBINE_METHODS:
+        raise ValueError(f"Unknown combine method {method!r}")
+
+    angles = np.asarray(angles, dtype=np.float64)
+    if angles.shape != cube.shape[:1]:
+        raise ValueError(f"Got {angles.shape} angles for {len(cube)} frames")
+
+    nframes, height, width = cube.shape
+    if centre is None:
+        centre = ((width - 1) / 2, (height - 1) / 2)
+    mean = mean_frame(cube, chunk=chunk)
+    basis, singular = pca_basis(cube, ncomp, mean=mean, chunk=chunk, oversampling=oversampling,
+                                power_iterations=power_iterations, seed=seed)
+    vectors = basis.reshape(len(basis), height * width).astype(np.float64)
+    flat_mean = np.nan_to_num(mean.reshape(-1))
+
+    with tempfile.TemporaryDirectory(dir=scratch) if scratch is not None else contextlib.nullcontext() as directory:
+        if method == 'median':
+            def storage(name: str) -> np.ndarray:
+                if directory is None:
+                    return np.empty(cube.shape, dtype=np.float32)
+                return np.lib.format.open_memmap(Path(directory) / f"{name}.npy", mode='w+',
+                                                 dtype=np.float32, shape=cube.shape)
+            stacks = [storage(name) for name in ('speckle', 'derotated', 'derotated_psfsub')]
+        else:
+            sums = [np.zeros((height, width)) for _ in range(3)]
+            counts = [np.zeros((height, width), dtype=np.int64) for _ in range(3)]
+
+        for block in _blocks(nframes, chunk):
+            frames = np.asarray(cube[block], dtype=np.float32)
+            centred = _centred(frames, flat_mean)
+            model = ((centred @ vectors.T) @ vectors + flat_mean).reshape(frames.shape).astype(np.float32)
+            residual = frames - model
+
+            processed = (model,
+                         derotate(frames, angles[block], centre=centre),
+                         derotate(residual, angles[block], centre=centre))
+
+            for index, values in enumerate(processed):
+                if method == 'median':
+                    stacks[index][block] = values
+                else:
+                    good = np.isfinite(values)
+                    sums[index] += np.where(good, values, 0.0).sum(axis=0)
+                    counts[index] += good.sum(axis=0)
+
+        if method == 'median':
+            results = []
+            counts = []
+            for stack in stacks:
+                combined = np.empty((height, width), dtype=np.float32)
+                count = np.zeros((height, width), dtype=np.int64)
+                for block in _blocks(height, rows):
+                    values = np.ascontiguousarray(stack[:, block])
+                    bad = ~np.isfinite(values)
+                    combined[block], _, _ = combine_with_error(values, 'median', bpm=bad)
+                    count[block] = nframes - bad.sum(axis=0)
+                results.append(combined)
+                counts.append(count)
+        else:
+            results = [total / np.where(count > 0, count, 1) for total, count in zip(sums, counts)]
+
+    speckle, derotated, derotated_psfsub = (np.where(count > 0, result, np.nan).astype(np.float32)
+                                            for result, count in zip(results, counts))
+
+    return AdiResult(speckle=speckle,
+                     derotated=derotated,
+                     derotated_psfsub=derotated_psfsub,
+                     coverage=counts[2].astype(np.int32),
+                     basis=basis,
+                     singular_values=singular,
+                     angles=angles,
+                     centre=centre)
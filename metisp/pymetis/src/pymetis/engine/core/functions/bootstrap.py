@@ -0,0 +1,83 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+from concurrent.futures import ThreadPoolExecutor
+from typing import Callable, Optional
+
+import numpy as np
+
+from pymetis.engine.core.functions.resources import max_workers
+
+
+def bootstrap_seed(seed: Optional[int]) -> int:
+    """
+    Return the seed to use for a bootstrap: the given one, or fresh entropy if it is None or negative.
+    The returned value should be recorded, as it reproduces the bootstrap exactly.
+    """
+    if seed is None or seed < 0:
+        return int(np.random.SeedSequence().entropy)
+    return int(seed)
+
+
+def bootstrap_moments(samples: np.ndarray,
+                      statistic: Callable[[np.ndarray], float],
+                      *,
+                      draws: int,
+                      seed: int,
+                      workers: Optional[int] = None,
+                      block: int = 65536) -> np.ndarray:
+    """
+    Bootstrap a statistic that depends on the data only through the means of a set of sample vectors.
+
+    Every draw resamples the `n` columns of `samples` (k, n) with replacement, computes the resampled mean
+    of every row from the multiplicity of each column (so the data are never copied or fancy-indexed)
+    and evaluates `statistic` on the vector of k means.
+
+    Every draw has its own random stream spawned from `seed`, so the result is bitwise reproducible
+    regardless of the number of `workers` (by default all available CPUs) that run the draws in parallel.
+    Means are accumulated in double precision over blocks of `block` columns.
+
+    Returns
+    -------
+    np.ndarray
+        The statistic of every draw, in the order of the draws.
+    """
+    if draws < 1:
+        raise ValueError(f"At least one bootstrap draw is required, got {draws}")
+
+    samples = np.atleast_2d(samples)
+    size = samples.shape[1]
+    streams = np.random.SeedSequence(seed).spawn(draws)
+
+    def draw(stream: np.random.SeedSequence) -> float:
+        rng = np.random.default_rng(stream)
+        multiplicity = np.bincount(rng.integers(0, size, size=size), minlength=size).astype(np.float64)
+
+        sums = np.zeros(samples.shape[0], dtype=np.float64)
+        for start in range(0, size, block):
+            chunk = samples[:, start:start + block].astype(np.float64, copy=False)
+            sums += chunk @ multiplicity[start:start + block]
+        return statistic(sums / size)
+
+    workers = min(draws, workers if workers is not None else max_workers())
+    if workers == 1:
+        return np.array([draw(stream) for stream in streams])
+
+    with ThreadPoolExecutor(max_workers=workers, thread_name_prefix='bootstrap') as executor:
+        return np.array(list(executor.map(draw, streams)))
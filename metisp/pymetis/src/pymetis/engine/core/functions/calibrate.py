@@ -0,0 +1,339 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+from typing import Literal, Optional
+
+import numpy as np
+
+from pymetis.engine.core.native import libmetis, address, CPL_ERROR_NONE
+
+# Bits of the data quality layer, as `metis_dq_flag` in libmetis
+DQ_GOOD = 0
+DQ_BAD_PIXEL = 1 << 0           # flagged in a bad pixel map
+DQ_NONLINEAR = 1 << 1           # no valid nonlinearity correction
+DQ_SATURATED = 1 << 2           # raw value at or above saturation
+DQ_INVALID = 1 << 3             # non-finite value or non-positive flat
+
+# Largest relative rounding error of the nonlinearity correction accepted in single precision,
+# well below the quantisation of 16-bit raw data
+SINGLE_PRECISION_TOLERANCE = 1e-6
+
+Precision = Literal['auto', 'single', 'double']
+
+
+def calibrate_frames(raw: np.ndarray,
+                     *,
+                     dark: Optional[np.ndarray] = None,
+                     flat: Optional[np.ndarray] = None,
+                     gain: float | np.ndarray = 1.0,
+                     linearity: Optional[np.ndarray] = None,
+                     linearity_dq: Optional[np.ndarray] = None,
+                     dq: Optional[np.ndarray] = None,
+                     read_noise: float = 0.0,
+                     saturation: Optional[float] = None,
+                     precision: Precision = 'auto',
+                     rows: int = 64) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+    """
+    Apply the detector calibrations to a stack of raw frames (N, H, W) in ADU in a single pass,
+    and return the calibrated frames in electrons together with their errors and data quality layers,
+    all of shape (N, H, W).
+
+    Every raw value r is corrected for nonlinearity as r * P(r), with the per-pixel polynomial
+    given by the coefficient planes `linearity` (P, H, W, highest degree first), dark subtracted,
+    multiplied by the `gain` in e-/ADU (a scalar or a map) and divided by the `flat`.
+    The error is sqrt(max(s, 0) + read_noise**2) / flat, with s the signal in electrons before flat fielding.
+    The data quality layer combines the static flags `dq` (H, W) with `DQ_SATURATED` for raw values
+    at or above `saturation` and `DQ_INVALID` for non-finite values and non-positive flats;
+    invalid pixels are set to zero, with zero error.
+
+    Pixels flagged in `linearity_dq` (H, W) are not corrected for nonlinearity and flagged `DQ_NONLINEAR`.
+    The nonlinearity correction is part of the single pass if it may be evaluated in single precision
+    (see `correct_nonlinearity` for the meaning of `precision`); otherwise it is applied in double precision
+    in a separate pass first.
+
+    Uses the multithreaded `metis_calibrate_frames` kernel from `libmetis` if available,
+    which writes all three layers in one traversal of the raw frames. Otherwise falls back to NumPy,
+    applied to blocks of `rows` rows. Both paths produce the same results up to floating-point rounding.
+    """
+    n, h, w = raw.shape
+    for name, plane in (('dark', dark), ('flat', flat), ('static DQ', dq)):
+        if plane is not None:
+            assert plane.shape == (h, w), f"The {name} must have the shape of a frame (got {plane.shape}, expected {(h, w)})"
+    if linearity is not None:
+        assert linearity.ndim == 3 and linearity.shape[1:] == (h, w), \
+            f"Nonlinearity coefficients must be planes of the shape of a frame (got {linearity.shape})"
+
+    gain_map = np.asarray(gain) if np.ndim(gain) > 0 else None
+    sci = np.zeros((n, h, w), dtype=np.float32)
+    err = np.zeros((n, h, w), dtype=np.float32)
+    flags = np.zeros((n, h, w), dtype=np.int32)
+
+    if linearity is None:
+        _calibrate(raw, sci, err, flags, dark=dark, flat=flat, gain=gain, gain_map=gain_map, linearity=None,
+                   dq=dq, read_noise=read_noise, saturation=saturation, rows=rows)
+        return sci, err, flags
+
+    valid = np.ones((h, w), dtype=bool) if linearity_dq is None else np.asarray(linearity_dq) == 0
+    if precision == 'auto':
+        single = single_precision_suffices(linearity, _level(raw), valid=valid)
+    else:
+        single = precision == 'single'
+
+    if single:
+        # Flagged pixels get the identity r * 1 as their correction, so they pass through the single pass unchanged
+        coeffs = np.array(linearity, dtype=np.float32)
+        coeffs[:, ~valid] = 0.0
+        coeffs[-1, ~valid] = 1.0
+        static = np.where(valid, 0, DQ_NONLINEAR).astype(np.int32)
+        if dq is not None:
+            static |= np.asarray(dq, dtype=np.int32)
+        _calibrate(raw, sci, err, flags, dark=dark, flat=flat, gain=gain, gain_map=gain_map, linearity=coeffs,
+                   dq=static, read_noise=read_noise, saturation=saturation, rows=rows)
+        return sci, err, flags
+
+    # Saturation refers to the raw values, so it is checked before they are corrected in place of the output
+    if saturation is not None and saturation > 0:
+        flags |= np.where(raw >= saturation, DQ_SATURATED, 0).astype(np.int32)
+    sci[:] = raw
+    flags |= correct_nonlinearity(sci, linearity, coeffs_dq=~valid, precision='double', rows=rows)
+    corrected = np.zeros_like(flags)
+    _calibrate(sci, sci, err, corrected, dark=dark, flat=flat, gain=gain, gain_map=gain_map, linearity=None,
+               dq=dq, read_noise=read_noise, saturation=None, rows=rows)
+    flags |= corrected
+    return sci, err, flags
+
+
+def _calibrate(raw: np.ndarray,
+               sci: np.ndarray,
+               err: np.ndarray,
+               flags: np.ndarray,
+               *,
+               dark: Optional[np.ndarray],
+               flat: Optional[np.ndarray],
+               gain: float | np.ndarray,
+               gain_map: Optional[np.ndarray],
+               linearity: Optional[np.ndarray],
+               dq: Optional[np.ndarray],
+               read_noise: float,
+               saturation: Optional[float],
+               rows: int) -> None:
+    """ Fill `sci`, `err` and `flags` in a single pass, see `calibrate_frames`. `sci` may be `raw`. """
+    n, h, w = raw.shape
+
+    if (library := libmetis()) is not None:
+        def plane(array, dtype=np.float32):
+            return None if array is None else np.ascontiguousarray(array, dtype=dtype)
+
+        inputs = dict(dark=plane(dark), flat=plane(flat), gain=plane(gain_map),
+                      linearity=plane(linearity), dq=plane(dq, np.int32))
+        code = library.metis_calibrate_frames(
+            np.ascontiguousarray(raw, dtype=np.float32),
+            n, h * w,
+            address(inputs['dark']), address(inputs['flat']),
+            address(inputs['gain']), 1.0 if gain_map is not None else float(gain),
+            address(inputs['linearity']), 0 if linearity is None else linearity.shape[0],
+            address(inputs['dq']),
+            read_noise,
+            0.0 if saturation is None else saturation,
+            sci, address(err), address(flags),
+        )
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"metis_calibrate_frames failed with CPL error code {code}")
+        return
+
+    rn2 = np.float32(read_noise ** 2)
+    level = np.float32(np.inf if saturation is None or saturation <= 0 else saturation)
+
+    with np.errstate(invalid='ignore', divide='ignore', over='ignore'):
+        for start in range(0, h, rows):
+            block = slice(start, min(start + rows, h))
+            r = raw[:, block].astype(np.float32)
+
+            if linearity is None:
+                value = r.copy()
+            else:
+                value = np.broadcast_to(linearity[0, block].astype(np.float32), r.shape).copy()
+                for coefficient in linearity[1:, block].astype(np.float32):
+                    value = value * r + coefficient
+                value *= r
+
+            if dark is not None:
+                value -= dark[block].astype(np.float32)
+            value *= np.float32(gain) if gain_map is None else gain_map[block].astype(np.float32)
+
+            f = np.float32(1.0) if flat is None else flat[block].astype(np.float32)
+            sigma = np.sqrt(np.maximum(value, 0) + rn2) / f
+            value = value / f
+
+            invalid = ~np.isfinite(r) | ~np.isfinite(value) | ~np.isfinite(sigma) | ~(f > 0)
+            q = np.zeros(r.shape, dtype=np.int32) if dq is None else np.broadcast_to(dq[block], r.shape).astype(np.int32)
+            q |= np.where(r >= level, DQ_SATURATED, 0) | np.where(invalid, DQ_INVALID, 0)
+
+            sci[:, block] = np.where(invalid, 0.0, value)
+            err[:, block] = np.where(invalid, 0.0, sigma)
+            flags[:, block] = q
+
+
+def linearity_condition(coeffs: np.ndarray,
+                        level: float,
+                        *,
+                        samples: int = 5) -> np.ndarray:
+    """
+    Return the largest condition number sum(|c_k| r^k) / |P(r)| of every pixel's polynomial (coefficient planes
+    `coeffs` (P, H, W), highest degree first) at `samples` points evenly spaced in (0, `level`].
+    The relative rounding error of Horner's scheme is bounded by about 2 P u times this number,
+    with u the unit roundoff of the arithmetic.
+    """
+    condition = np.zeros(coeffs.shape[1:])
+    with np.errstate(divide='ignore', invalid='ignore', over='ignore'):
+        for r in np.linspace(level / samples, level, samples):
+            value = np.zeros(coeffs.shape[1:])
+            magnitude = np.zeros(coeffs.shape[1:])
+            for plane in coeffs:
+                value = value * r + plane
+                magnitude = magnitude * r + np.abs(plane)
+            condition = np.fmax(condition, magnitude / np.abs(value))
+    return condition
+
+
+def _level(stack: np.ndarray) -> float:
+    """ Largest absolute value of a stack, ignoring NaN, without a temporary of the size of the stack. """
+    return float(max(np.nanmax(stack, initial=0.0), -np.nanmin(stack, initial=0.0)))
+
+
+def single_precision_suffices(coeffs: np.ndarray,
+                              level: float,
+                              *,
+                              valid: Optional[np.ndarray] = None,
+                              tolerance: float = SINGLE_PRECISION_TOLERANCE) -> bool:
+    """
+    Decide whether the nonlinearity correction with coefficients `coeffs` (P, H, W) may be evaluated
+    in single precision for values up to `level`, i.e. whether its rounding error bound stays below `tolerance`
+    for all `valid` (H, W) pixels.
+    """
+    if level == 0.0:
+        return True
+
+    condition = linearity_condition(coeffs, level)
+    if valid is not None:
+        condition = condition[valid]
+    bound = 2 * len(coeffs) * np.finfo(np.float32).eps * np.max(condition, initial=1.0)
+    return bool(np.isfinite(bound) and bound <= tolerance)
+
+
+def correct_nonlinearity(stack: np.ndarray,
+                         coeffs: np.ndarray,
+                         *,
+                         error: Optional[np.ndarray] = None,
+                         coeffs_error: Optional[np.ndarray] = None,
+                         coeffs_dq: Optional[np.ndarray] = None,
+                         dq: Optional[np.ndarray] = None,
+                         precision: Precision = 'auto',
+                         rows: int = 64) -> np.ndarray:
+    """
+    Correct a stack of frames (N, H, W) for detector nonlinearity in place and return its data quality layers.
+
+    Every value r becomes r * P(r), with the per-pixel polynomial given by the coefficient planes
+    `coeffs` (P, H, W, highest degree first), as produced by `metis_det_lingain`. The `error` (N, H, W)
+    is propagated in place, adding the errors `coeffs_error` of the coefficients in quadrature.
+    Pixels flagged in `coeffs_dq` (H, W) and finite values whose correction is not finite are left as they are
+    and flagged `DQ_NONLINEAR` in `dq` (N, H, W), which is updated in place or created if not given.
+
+    The polynomials are evaluated in single precision if `precision` is `single`, or if it is `auto`
+    and `single_precision_suffices` for the largest value of the stack; otherwise in double precision.
+
+    `stack` and `error` have to be contiguous float32 arrays. Uses the multithreaded `metis_linearity_correct`
+    kernel from `libmetis` if available, otherwise falls back to NumPy, applied to blocks of `rows` rows.
+    """
+    assert stack.dtype == np.float32 and stack.flags.c_contiguous, \
+        "The stack is corrected in place and must be a contiguous float32 array"
+    n, h, w = stack.shape
+    assert coeffs.ndim == 3 and coeffs.shape[1:] == (h, w), \
+        f"Nonlinearity coefficients must be planes of the shape of a frame (got {coeffs.shape})"
+    if error is not None:
+        assert error.shape == stack.shape and error.dtype == np.float32 and error.flags.c_contiguous, \
+            "The error is propagated in place and must be a contiguous float32 array of the shape of the stack"
+    if coeffs_error is not None:
+        assert coeffs_error.shape == coeffs.shape, "Coefficient errors must have the shape of the coefficients"
+
+    if dq is None:
+        dq = np.zeros(stack.shape, dtype=np.int32)
+    assert dq.shape == stack.shape and dq.dtype == np.int32 and dq.flags.c_contiguous, \
+        "The data quality layers are updated in place and must be a contiguous int32 array of the shape of the stack"
+
+    coeffs = np.ascontiguousarray(coeffs, dtype=np.float64)
+    coeffs_error = None if coeffs_error is None else np.ascontiguousarray(coeffs_error, dtype=np.float64)
+    flags = None if coeffs_dq is None else np.ascontiguousarray(coeffs_dq != 0, dtype=np.int32)
+
+    if precision == 'auto':
+        valid = None if flags is None else flags == 0
+        single = single_precision_suffices(coeffs, _level(stack), valid=valid)
+    else:
+        single = precision == 'single'
+
+    if (library := libmetis()) is not None:
+        code = library.metis_linearity_correct(
+            stack, address(error), address(dq),
+            n, h * w,
+            coeffs, address(coeffs_error), len(coeffs),
+            address(flags), int(single),
+        )
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"metis_linearity_correct failed with CPL error code {code}")
+        return dq
+
+    dtype = np.float32 if single else np.float64
+
+    with np.errstate(invalid='ignore', over='ignore'):
+        for start in range(0, h, rows):
+            block = slice(start, min(start + rows, h))
+            r = stack[:, block].astype(dtype)
+            c = coeffs[:, block].astype(dtype)
+
+            value = np.broadcast_to(c[0], r.shape).copy()
+            slope = np.zeros_like(r)
+            for plane in c[1:]:
+                slope = slope * r + value
+                value = value * r + plane
+            slope = value + r * slope
+            value = r * value
+
+            if coeffs_error is None:
+                variance = np.zeros_like(r)
+            else:
+                s = coeffs_error[:, block].astype(dtype)
+                variance = np.broadcast_to(s[0] ** 2, r.shape).copy()
+                for plane in s[1:]:
+                    variance = variance * r * r + plane ** 2
+                variance *= r * r
+
+            value, slope, variance = (x.astype(np.float32) for x in (value, slope, variance))
+            e = np.zeros(r.shape, dtype=np.float32) if error is None else error[:, block]
+            propagated = np.sqrt(slope * slope * e * e + variance)
+
+            bad = np.isfinite(stack[:, block]) & (~np.isfinite(value) | ~np.isfinite(slope) | ~np.isfinite(propagated))
+            if flags is not None:
+                bad |= flags[block] != 0
+
+            stack[:, block] = np.where(bad, stack[:, block], value)
+            if error is not None:
+                error[:, block] = np.where(bad, e, propagated)
+            dq[:, block] |= np.where(bad, DQ_NONLINEAR, 0).astype(np.int32)
+
+    return dq
@@ -0,0 +1,278 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import warnings
+from dataclasses import dataclass
+from typing import Iterable, Optional
+
+import numpy as np
+
+from pymetis.engine.core.native import libmetis, address, CPL_ERROR_NONE
+
+# Names of the two chop and the two nod positions, as in the headers
+POSITIONS = ('A', 'B')
+
+# Beams of a cycle, named by their nod and chop position and indexed by 2 * nod + chop;
+# the double difference of the four beams A, B, C, D is (A - B) - (C - D)
+BEAMS = ('AA', 'AB', 'BA', 'BB')
+BEAM_SIGNS = (1.0, -1.0, -1.0, 1.0)
+
+# Rejection threshold in units of the propagated error, and number of first cycles whose median is their reference
+DEFAULT_KAPPA = 5.0
+DEFAULT_WARMUP = 3
+
+
+def _position(value, kind: str) -> int:
+    name = str(value).strip().upper()
+    if name not in POSITIONS:
+        raise ValueError(f"Unknown {kind} position {value!r}, expected one of {POSITIONS}")
+    return POSITIONS.index(name)
+
+
+def classify_frames(chop: Iterable, nod: Iterable) -> tuple[np.ndarray, np.ndarray]:
+    """
+    Assign every frame of a chop-nod sequence, given its chop and nod positions ('A' or 'B') in the order
+    of observation, to its beam (see `BEAMS`) and its cycle. Returns both as integer arrays (N,).
+
+    A cycle is a run of frames at one nod position followed by a run at the other, each of any length
+    (so both ABAB and ABBA nodding work); it ends where the nod returns to the position it started at.
+    """
+    chops = np.array([_position(value, 'chop') for value in chop], dtype=np.int64)
+    nods = np.array([_position(value, 'nod') for value in nod], dtype=np.int64)
+    if len(chops) != len(nods):
+        raise ValueError(f"Got {len(chops)} chop positions for {len(nods)} nod positions")
+
+    returns = np.zeros(len(nods), dtype=np.int64)
+    if len(nods) > 0:
+        returns[1:] = (nods[1:] == nods[0]) & (nods[:-1] != nods[0])
+    return 2 * nods + chops, np.cumsum(returns)
+
+
+@dataclass(frozen=True)
+class ChopNodResult:
+    """
+    Products of a chop-nod reduction, all images (H, W) unless noted otherwise.
+
+    - image: mean double difference of the accepted cycles
+    - error: its error, propagated from the errors of the calibrated frames
+    - scatter: its error, from the scatter of the accepted cycles (NaN with fewer than two)
+    - coverage, rejected: number of accepted and rejected cycles of every pixel
+    - beam_noise: frame-to-frame standard deviation of every beam, (4, H, W)
+    - ncycles, nskipped: number of complete cycles, and of incomplete ones that were left out
+    """
+    image: np.ndarray
+    error: np.ndarray
+    scatter: np.ndarray
+    coverage: np.ndarray
+    rejected: np.ndarray
+    beam_noise: np.ndarray
+    ncycles: int
+    nskipped: int
+
+
+class ChopNodAccumulator:
+    """
+    Double differences of a chop-nod sequence of calibrated frames, accumulated one frame at a time.
+
+    The frames of the current cycle are summed per beam; when the next cycle starts, the means of the beams
+    are differenced to (A - B) - (C - D) with their propagated variance, and every pixel of the difference
+    deviating from its reference by more than `kappa` times its error is rejected for this cycle.
+    The reference of the first `warmup` cycles is their median, which they are held back for;
+    after that it is the mean of the cycles accepted so far. Cycles lacking a beam are left out.
+
+    Only running sums are kept, so memory does not depend on the number of frames or cycles.
+    Uses the `metis_chopnod_add_frame` and `metis_chopnod_add_cycle` kernels from `libmetis` if available,
+    otherwise NumPy. Both paths produce the same results up to floating-point rounding.
+    """
+    def __init__(self,
+                 shape: tuple[int, int],
+                 *,
+                 kappa: float = DEFAULT_KAPPA,
+                 warmup: int = DEFAULT_WARMUP):
+        if kappa < 0:
+            raise ValueError(f"Rejection threshold must not be negative, got {kappa}")
+
+        self.shape = shape
+        self.kappa = float(kappa)
+        self.warmup = max(int(warmup), 0)
+        npix = shape[0] * shape[1]
+
+        # The beams of the current cycle
+        self.cycle: Optional[int] = None
+        self.beam_sum = np.zeros((len(BEAMS), npix), dtype=np.float64)
+        self.beam_var = np.zeros((len(BEAMS), npix), dtype=np.float64)
+        self.beam_count = np.zeros((len(BEAMS), npix), dtype=np.int32)
+
+        # The beams over the whole sequence
+        self.total = np.zeros((len(BEAMS), npix), dtype=np.float64)
+        self.total_sq = np.zeros((len(BEAMS), npix), dtype=np.float64)
+        self.total_count = np.zeros((len(BEAMS), npix), dtype=np.int32)
+
+        # The double differences of the accepted cycles
+        self.sum = np.zeros(npix, dtype=np.float64)
+        self.sum_sq = np.zeros(npix, dtype=np.float64)
+        self.sum_var = np.zeros(npix, dtype=np.float64)
+        self.count = np.zeros(npix, dtype=np.int32)
+        self.rejected = np.zeros(npix, dtype=np.int32)
+
+        self.ncycles = 0
+        self.nskipped = 0
+        self._held: list[tuple[np.ndarray, np.ndarray]] = []
+
+    def add(self,
+            sci: np.ndarray,
+            err: Optional[np.ndarray],
+            dq: Optional[np.ndarray],
+            *,
+            beam: int,
+            cycle: int) -> None:
+        """
+        Add a calibrated frame (H, W) with its error and data quality layer, either of which may be None.
+        Frames have to arrive in the order of their cycles, as numbered by `classify_frames`.
+        """
+        if self.cycle is not None and cycle < self.cycle:
+            raise ValueError(f"Frame of cycle {cycle} after cycle {self.cycle}, frames must arrive in order")
+        if self.cycle is not None and cycle != self.cycle:
+            self._close_cycle()
+        self.cycle = cycle
+
+        sci = np.ascontiguousarray(sci, dtype=np.float32).reshape(-1)
+        err = None if err is None else np.ascontiguousarray(err, dtype=np.float32).reshape(-1)
+        dq = None if dq is None else np.ascontiguousarray(dq, dtype=np.int32).reshape(-1)
+        sums = (self.beam_sum[beam], self.beam_var[beam], self.beam_count[beam])
+        totals = (self.total[beam], self.total_sq[beam], self.total_count[beam])
+
+        if (library := libmetis()) is not None:
+            code = library.metis_chopnod_add_frame(sci, address(err), address(dq), sci.size,
+                                                   *sums, *(address(total) for total in totals))
+            if code != CPL_ERROR_NONE:
+                raise RuntimeError(f"metis_chopnod_add_frame failed with CPL error code {code}")
+            return
+
+        good = np.isfinite(sci) if dq is None else np.isfinite(sci) & (dq == 0)
+        value = np.where(good, sci, 0.0).astype(np.float64)
+        sums[0][:] += value
+        sums[1][:] += 0.0 if err is None else np.where(good, np.square(err, dtype=np.float64), 0.0)
+        sums[2][:] += good
+        totals[0][:] += value
+        totals[1][:] += value * value
+        totals[2][:] += good
+
+    def add_frames(self,
+                   sci: np.ndarray,
+                   err: Optional[np.ndarray],
+                   dq: Optional[np.ndarray],
+                   beams: Iterable[int],
+                   cycles: Iterable[int]) -> None:
+        """ Add a stack of calibrated frames (N, H, W), as produced by `calibrate_frames`, see `add`. """
+        for index, (beam, cycle) in enumerate(zip(beams, cycles)):
+            self.add(sci[index],
+                     None if err is None else err[index],
+                     None if dq is None else dq[index],
+                     beam=int(beam), cycle=int(cycle))
+
+    def _close_cycle(self) -> None:
+        """ Difference the beams of the current cycle and pass it on (or hold it back), then start afresh. """
+        if not self.beam_count.any(axis=1).all():
+            self.nskipped += 1
+        else:
+            self.ncycles += 1
+            with np.errstate(invalid='ignore', divide='ignore'):
+                means = self.beam_sum / self.beam_count
+                variances = self.beam_var / np.square(self.beam_count, dtype=np.float64)
+            difference = np.tensordot(BEAM_SIGNS, means, axes=1).astype(np.float32)
+            variance = variances.sum(axis=0).astype(np.float32)
+
+            if self.ncycles > self.warmup:
+                self._add_cycle(difference, variance, None)
+            else:
+                self._held.append((difference, variance))
+                if len(self._held) == self.warmup:
+                    self._release()
+
+        self.beam_sum[:] = 0.0
+        self.beam_var[:] = 0.0
+        self.beam_count[:] = 0
+
+    def _release(self) -> None:
+        """ Pass on the cycles held back, with their median as the reference. """
+        if not self._held:
+            return
+        with warnings.catch_warnings():
+            # Pixels without any finite difference have no reference, as intended
+            warnings.simplefilter('ignore', RuntimeWarning)
+            reference = np.nanmedian([difference for difference, _ in self._held], axis=0).astype(np.float64)
+        for difference, variance in self._held:
+            self._add_cycle(difference, variance, reference)
+        self._held = []
+
+    def _add_cycle(self, difference: np.ndarray, variance: np.ndarray, reference: Optional[np.ndarray]) -> None:
+        if (library := libmetis()) is not None:
+            code = library.metis_chopnod_add_cycle(difference, variance, difference.size,
+                                                   address(reference), self.kappa,
+                                                   self.sum, self.sum_sq, self.sum_var, self.count, self.rejected)
+            if code != CPL_ERROR_NONE:
+                raise RuntimeError(f"metis_chopnod_add_cycle failed with CPL error code {code}")
+            return
+
+        value = difference.astype(np.float64)
+        var = variance.astype(np.float64)
+        with np.errstate(invalid='ignore', divide='ignore'):
+            expected = reference if reference is not None else \
+                np.where(self.count > 0, self.sum / np.maximum(self.count, 1), np.nan)
+            outlier = (self.kappa > 0) & (var > 0) & np.isfinite(expected) & \
+                (np.abs(value - expected) > self.kappa * np.sqrt(var))
+        finite = np.isfinite(value)
+        accepted = finite & ~outlier
+
+        self.rejected += finite & outlier
+        self.sum += np.where(accepted, value, 0.0)
+        self.sum_sq += np.where(accepted, value * value, 0.0)
+        self.sum_var += np.where(accepted & np.isfinite(var), var, 0.0)
+        self.count += accepted
+
+    def result(self) -> ChopNodResult:
+        """ Close the last cycle and return the combined double difference and the noise maps. """
+        if self.cycle is not None:
+            self._close_cycle()
+            self.cycle = None
+        self._release()
+
+        shape = self.shape
+        with np.errstate(invalid='ignore', divide='ignore'):
+            mean = self.sum / self.count
+            error = np.sqrt(self.sum_var) / self.count
+            spread = (self.sum_sq - self.count * mean ** 2) / (self.count - 1)
+            scatter = np.where(self.count > 1, np.sqrt(np.maximum(spread, 0.0) / self.count), np.nan)
+
+            beam_mean = self.total / self.total_count
+            beam_spread = (self.total_sq - self.total_count * beam_mean ** 2) / (self.total_count - 1)
+            beam_noise = np.where(self.total_count > 1, np.sqrt(np.maximum(beam_spread, 0.0)), np.nan)
+
+        empty = self.count == 0
+        return ChopNodResult(
+            image=np.where(empty, np.nan, mean).astype(np.float32).reshape(shape),
+            error=np.where(empty, np.nan, error).astype(np.float32).reshape(shape),
+            scatter=scatter.astype(np.float32).reshape(shape),
+            coverage=self.count.reshape(shape).copy(),
+            rejected=self.rejected.reshape(shape).copy(),
+            beam_noise=beam_noise.astype(np.float32).reshape(len(BEAMS), *shape),
+            ncycles=self.ncycles,
+            nskipped=self.nskipped,
+        )
@@ -0,0 +1,151 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+from typing import Literal, Optional
+
+import numpy as np
+
+from pymetis.engine.core.native import libmetis, address, CPL_ERROR_NONE
+
+# Supported combination methods, in the order of `metis_combine_method` in libmetis
+COMBINE_METHODS = ('add', 'average', 'median', 'sigclip')
+
+CombineMethod = Literal['add', 'average', 'median', 'sigclip']
+
+
+def combine_with_error(stack: np.ndarray,
+                       method: CombineMethod,
+                       read_noise: Optional[float] = None,
+                       *,
+                       bpm: Optional[np.ndarray] = None,
+                       kappa_low: float = 3.0,
+                       kappa_high: float = 3.0,
+                       iterations: int = 5,
+                       rows: int = 64) -> tuple[np.ndarray, Optional[np.ndarray], np.ndarray]:
+    """
+    Combine a stack of frames (N, H, W) pixel by pixel and propagate the error in a single pass.
+    Returns the combined image (H, W), the error (H, W, or None if `read_noise` is None)
+    and the mask of pixels without any good sample (H, W).
+
+    Samples flagged in `bpm` (N, H, W) are excluded. The methods are the sum (`add`), mean (`average`),
+    `median` and the mean after iterative clipping at `kappa_low` / `kappa_high` standard deviations
+    around the mean (`sigclip`). The error is sqrt(sum(s + read_noise**2) / n) over the n good samples,
+    with negative variances clipped to zero.
+
+    Uses the multithreaded `metis_combine_with_error` kernel from `libmetis` if available,
+    which reads the stack only once and allocates no temporaries of the size of the stack.
+    Otherwise falls back to NumPy, applied to blocks of `rows` rows. Both paths produce the same results
+    up to floating-point rounding.
+
+    Raises
+    ------
+    ValueError
+        If an unknown combine method is used.
+    """
+    if method not in COMBINE_METHODS:
+        raise ValueError(f"Unknown stacking method {method!r}")
+
+    if bpm is not None:
+        assert bpm.shape == stack.shape, \
+            f"Bad pixel mask must have the same shape as the stack (got {bpm.shape} and {stack.shape})"
+
+    n, h, w = stack.shape
+    combined = np.zeros((h, w), dtype=np.float32)
+    error = np.zeros((h, w), dtype=np.float32) if read_noise is not None else None
+
+    if (library := libmetis()) is not None:
+        rejected = np.zeros((h, w), dtype=np.uint8)
+        flags = None if bpm is None else np.ascontiguousarray(bpm, dtype=np.uint8)
+        code = library.metis_combine_with_error(
+            np.ascontiguousarray(stack, dtype=np.float32),
+            address(flags),
+            n, h * w, COMBINE_METHODS.index(method),
+            0.0 if read_noise is None else read_noise,
+            kappa_low, kappa_high, iterations,
+            combined, address(error), address(rejected),
+        )
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"metis_combine_with_error failed with CPL error code {code}")
+        return combined, error, rejected.astype(bool)
+
+    rejected = np.zeros((h, w), dtype=bool)
+    rn2 = 0.0 if read_noise is None else read_noise ** 2
+
+    for start in range(0, h, rows):
+        block = slice(start, min(start + rows, h))
+        values = stack[:, block].astype(np.float64)
+        good = np.ones_like(values, dtype=bool) if bpm is None else ~bpm[:, block].astype(bool)
+
+        count = good.sum(axis=0)
+        total = np.where(good, values, 0.0).sum(axis=0)
+        empty = count == 0
+
+        match method:
+            case 'add':
+                result = total
+            case 'average':
+                result = total / np.where(empty, 1, count)
+            case 'median':
+                result = np.zeros_like(total)
+                if not empty.all():
+                    result[~empty] = np.nanmedian(np.where(good, values, np.nan)[:, ~empty], axis=0)
+            case 'sigclip':
+                result = _sigclip_mean(values, good, count, total,
+                                       kappa_low=kappa_low, kappa_high=kappa_high, iterations=iterations)
+
+        combined[block] = np.where(empty, 0.0, result)
+        rejected[block] = empty
+
+        if error is not None:
+            variance = np.where(good, values + rn2, 0.0).sum(axis=0) / np.where(empty, 1, count)
+            error[block] = np.where(empty, 0.0, np.sqrt(np.maximum(variance, 0.0)))
+
+    return combined, error, rejected
+
+
+def _sigclip_mean(values: np.ndarray,
+                  good: np.ndarray,
+                  count: np.ndarray,
+                  total: np.ndarray,
+                  *,
+                  kappa_low: float,
+                  kappa_high: float,
+                  iterations: int) -> np.ndarray:
+    """
+    Vectorized counterpart of the clipping in `metis_combine_with_error`: a pixel keeps its previous set
+    of samples once an iteration would reject nothing or leave fewer than two samples.
+    """
+    keep = good.copy()
+    mean = total / np.maximum(count, 1)
+
+    for _ in range(iterations):
+        deviation = np.where(keep, values - mean, 0.0)
+        sigma = np.sqrt((deviation ** 2).sum(axis=0) / np.maximum(count - 1, 1))
+        inside = keep & (values >= mean - kappa_low * sigma) & (values <= mean + kappa_high * sigma)
+        kept = inside.sum(axis=0)
+
+        update = (count > 1) & (kept != count) & (kept >= 2)
+        if not update.any():
+            break
+
+        keep = np.where(update, inside, keep)
+        mean = np.where(update, np.where(inside, values, 0.0).sum(axis=0) / np.maximum(kept, 1), mean)
+        count = np.where(update, kept, count)
+
+    return mean
@@ -0,0 +1,300 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+from dataclasses import dataclass
+from typing import Optional
+
+import numpy as np
+
+from pymetis.engine.core.functions.adi import AdiResult, derotate
+
+# Significance of the detection limits of a contrast curve, in units of the noise
+DEFAULT_SIGMA = 5.0
+
+
+@dataclass(frozen=True)
+class RadialProfile:
+    """
+    Statistics of the finite pixels of an image in concentric annuli, arrays of (nannuli,):
+    mid radius in pixels, mean, standard deviation and number of pixels of every annulus.
+    Annuli without pixels have NaN statistics.
+    """
+    radius: np.ndarray
+    mean: np.ndarray
+    sigma: np.ndarray
+    count: np.ndarray
+
+
+@dataclass(frozen=True)
+class ContrastCurve:
+    """
+    Detection limits of an ADI reduction, arrays of (nseparations,):
+    separation in pixels, noise of an aperture sum, throughput of the reduction
+    and the contrast of the faintest companion detected at `sigma` times the noise, relative to the star.
+    """
+    separation: np.ndarray
+    noise: np.ndarray
+    throughput: np.ndarray
+    contrast: np.ndarray
+
+    @property
+    def magnitudes(self) -> np.ndarray:
+        """ The contrast as a magnitude difference, NaN where no finite positive contrast is reached. """
+        with np.errstate(divide='ignore', invalid='ignore'):
+            return np.where(self.contrast > 0, -2.5 * np.log10(self.contrast), np.nan)
+
+
+def _radii(shape: tuple[int, int], centre: Optional[tuple[float, float]]) -> np.ndarray:
+    height, width = shape
+    xc, yc = ((width - 1) / 2, (height - 1) / 2) if centre is None else centre
+    rows, columns = np.indices(shape, dtype=np.float64)
+    return np.hypot(columns - xc, rows - yc)
+
+
+def radial_profile(image: np.ndarray,
+                   *,
+                   centre: Optional[tuple[float, float]] = None,
+                   width: float = 1.0) -> RadialProfile:
+    """
+    Compute the mean and standard deviation of `image` in annuli of `width` pixels around `centre`
+    (x, y), by default the centre of the image. All annuli are binned at once, in a single pass.
+    """
+    radii = _radii(image.shape, centre)
+    good = np.isfinite(image)
+    index = (radii[good] / width).astype(np.intp)
+    values = image[good].astype(np.float64)
+
+    nannuli = int(radii.max() / width) + 1
+    count = np.bincount(index, minlength=nannuli)
+    total = np.bincount(index, values, minlength=nannuli)
+    with np.errstate(divide='ignore', invalid='ignore'):
+        mean = total / count
+        spread = np.bincount(index, (values - mean[index]) ** 2, minlength=nannuli)
+        sigma = np.sqrt(spread / (count - 1))
+    sigma[count < 2] = np.nan
+
+    return RadialProfile(radius=(np.arange(nannuli) + 0.5) * width, mean=mean, sigma=sigma, count=count)
+
+
+def small_sample_correction(separation: np.ndarray, fwhm: float) -> np.ndarray:
+    """
+    Inflation of the noise measured at `separation` pixels, where only 2 pi r / `fwhm` independent
+    resolution elements fit into the annulus (Student t correction, as in Mawet et al. 2014).
+    """
+    elements = np.maximum(2 * np.pi * np.asarray(separation, dtype=np.float64) / fwhm, 2.0)
+    return np.sqrt(1.0 + 1.0 / (elements - 1.0))
+
+
+def snr_map(image: np.ndarray,
+            *,
+            fwhm: float,
+            centre: Optional[tuple[float, float]] = None) -> np.ndarray:
+    """
+    Signal-to-noise ratio of every pixel of a PSF-subtracted image: its excess over the mean of its annulus
+    of one `fwhm` width, in units of the standard deviation of the annulus inflated by
+    :func:`small_sample_correction`. The annuli are binned once for the whole image.
+    """
+    profile = radial_profile(image, centre=centre, width=fwhm)
+    index = (_radii(image.shape, centre) / fwhm).astype(np.intp)
+    noise = profile.sigma * small_sample_correction(profile.radius, fwhm)
+    with np.errstate(divide='ignore', invalid='ignore'):
+        return ((image - profile.mean[index]) / noise[index]).astype(np.float32)
+
+
+def aperture_sums(image: np.ndarray, radius: float) -> np.ndarray:
+    """
+    Sum of `image` in a circular aperture of `radius` pixels around every pixel, as a single FFT convolution.
+    Non-finite pixels count as zero.
+    """
+    height, width = image.shape
+    half = int(np.ceil(radius))
+    offsets = np.arange(-half, half + 1)
+    disc = (np.hypot(*np.meshgrid(offsets, offsets)) <= radius).astype(np.float64)
+
+    shape = (height + 2 * half, width + 2 * half)
+    product = np.fft.rfft2(np.nan_to_num(image.astype(np.float64), nan=0.0, posinf=0.0, neginf=0.0), shape) \
+        * np.fft.rfft2(disc, shape)
+    return np.fft.irfft2(product, shape)[half:half + height, half:half + width]
+
+
+def render_companions(shape: tuple[int, int],
+                      psf: np.ndarray,
+                      positions: np.ndarray,
+                      fluxes: np.ndarray) -> np.ndarray:
+    """
+    Render point sources with the `psf` template (odd-sized, peak at its centre) scaled by `fluxes`
+    at the (x, y) `positions`, with the sub-pixel offsets applied as Fourier phase shifts, all at once.
+    Sources that do not fit entirely into the image are clipped at its edges.
+    """
+    height, width = shape
+    size_y, size_x = psf.shape
+    half_y, half_x = size_y // 2, size_x // 2
+    positions = np.asarray(positions, dtype=np.float64).reshape(-1, 2)
+    whole = np.round(positions).astype(np.intp)
+    fraction = positions - whole
+
+    # Shift the template by all sub-pixel offsets in one batch
+    fy = np.fft.fftfreq(size_y)[:, None]
+    fx = np.fft.fftfreq(size_x)[None, :]
+    phase = np.exp(-2j * np.pi * (fraction[:, 0, None, None] * fx + fraction[:, 1, None, None] * fy))
+    stamps = np.fft.ifft2(np.fft.fft2(psf)[None] * phase).real * np.asarray(fluxes, dtype=np.float64)[:, None, None]
+
+    image = np.zeros(shape)
+    for stamp, (x, y) in zip(stamps, whole):
+        x0, y0 = x - half_x, y - half_y
+        ys, xs = slice(max(y0, 0), min(y0 + size_y, height)), slice(max(x0, 0), min(x0 + size_x, width))
+        if ys.start < ys.stop and xs.start < xs.stop:
+            image[ys, xs] += stamp[ys.start - y0:ys.stop - y0, xs.start - x0:xs.stop - x0]
+    return image
+
+
+def fake_companion_throughput(reduction: AdiResult,
+                              separations: np.ndarray,
+                              *,
+                              psf: np.ndarray,
+                              aperture: float,
+                              branches: int = 4,
+                              chunk: int = 32) -> np.ndarray:
+    """
+    Measure the throughput of an ADI reduction at `separations` (pixels) by injecting fake companions,
+    returned as (branches, nseparations) ratios of the recovered to the injected flux in an aperture
+    of `aperture` pixels radius.
+
+    All separations are injected at once, on `branches` radial lines at evenly spaced position angles,
+    so the separations must be a few FWHM apart. The `reduction` is the result of `adi_pca`, whose principal
+    components and derotation are reused as they are: since subtracting
+    the mean frame and the projection onto a fixed basis, derotating and averaging are all linear, the
+    companions are processed on their own, without the sequence they would be injected into,
+    and the PCA is never recomputed. With the median combination of the science frames this is the usual
+    linear approximation of its throughput.
+    """
+    angles = reduction.angles
+    nframes = len(angles)
+    ncomp, height, width = reduction.basis.shape
+    xc, yc = reduction.centre
+    vectors = reduction.basis.reshape(ncomp, height * width).astype(np.float64)
+    separations = np.asarray(separations, dtype=np.float64)
+    blocks = [slice(start, min(start + chunk, nframes)) for start in range(0, nframes, chunk)]
+
+    throughput = np.full((branches, len(separations)), np.nan)
+    for branch in range(branches):
+        theta = 2 * np.pi * branch / branches
+        positions = np.stack([xc + separations * np.cos(theta), yc + separations * np.sin(theta)], axis=-1)
+        sky = render_companions((height, width), psf, positions, np.ones(len(separations)))
+
+        def frames(block: slice) -> np.ndarray:
+            """ The companions as they appear in the detector frames of `block`. """
+            count = block.stop - block.start
+            return derotate(np.broadcast_to(sky.astype(np.float32), (count, height, width)),
+                            -angles[block], centre=(xc, yc))
+
+        # Subtracting the mean frame of the sequence also removes the mean of the companions
+        mean = np.zeros(height * width)
+        for block in blocks:
+            mean += np.nan_to_num(frames(block).reshape(-1, height * width), nan=0.0).sum(axis=0, dtype=np.float64)
+        mean /= nframes
+
+        processed = np.zeros((height, width))
+        count = np.zeros((height, width), dtype=np.int64)
+        for block in blocks:
+            centred = np.nan_to_num(frames(block).reshape(-1, height * width), nan=0.0) - mean
+            residual = centred - (centred @ vectors.T) @ vectors
+            derotated = derotate(residual.reshape(-1, height, width).astype(np.float32), angles[block],
+                                 centre=(xc, yc))
+            good = np.isfinite(derotated)
+            processed += np.where(good, derotated, 0.0).sum(axis=0)
+            count += good.sum(axis=0)
+        processed /= np.maximum(count, 1)
+
+        recovered = aperture_sums(processed, aperture)
+        injected = aperture_sums(sky, aperture)
+        rows = np.clip(np.round(positions[:, 1]).astype(np.intp), 0, height - 1)
+        columns = np.clip(np.round(positions[:, 0]).astype(np.intp), 0, width - 1)
+        with np.errstate(divide='ignore', invalid='ignore'):
+            throughput[branch] = recovered[rows, columns] / injected[rows, columns]
+
+    return throughput
+
+
+def contrast_curve(residual: np.ndarray,
+                   separations: np.ndarray,
+                   throughput: np.ndarray,
+                   *,
+                   psf: np.ndarray,
+                   star_flux: float,
+                   aperture: float,
+                   fwhm: float,
+                   sigma: float = DEFAULT_SIGMA,
+                   centre: Optional[tuple[float, float]] = None) -> ContrastCurve:
+    """
+    Compute the `sigma` detection limits of a PSF-subtracted, derotated image `residual` at `separations`.
+
+    The noise is the standard deviation of the aperture sums of `aperture` pixels radius in annuli of one
+    `fwhm`, inflated by :func:`small_sample_correction`; the contrast is `sigma` times that noise over the
+    flux that a companion of the brightness of the star (total flux `star_flux`, shaped like `psf`
+    normalised to unit sum) would leave in the aperture after the `throughput` (nseparations,) of the reduction.
+    """
+    separations = np.asarray(separations, dtype=np.float64)
+    profile = radial_profile(np.where(np.isfinite(residual), aperture_sums(residual, aperture), np.nan),
+                             centre=centre, width=fwhm)
+    noise = np.interp(separations, profile.radius, profile.sigma, left=np.nan, right=np.nan)
+    noise *= small_sample_correction(separations, fwhm)
+
+    half = psf.shape[0] // 2
+    enclosed = aperture_sums(psf / psf.sum(), aperture)[half, psf.shape[1] // 2]
+    with np.errstate(divide='ignore', invalid='ignore'):
+        contrast = sigma * noise / (np.asarray(throughput) * star_flux * enclosed)
+
+    return ContrastCurve(separation=separations, noise=noise, throughput=np.asarray(throughput), contrast=contrast)
+
+
+def gaussian_psf(fwhm: float, size: Optional[int] = None) -> np.ndarray:
+    """ A circular Gaussian PSF template of `fwhm` pixels, odd-sized and normalised to unit sum. """
+    sigma = fwhm / (2 * np.sqrt(2 * np.log(2)))
+    half = int(np.ceil(4 * sigma)) if size is None else size // 2
+    offsets = np.arange(-half, half + 1)
+    psf = np.exp(-np.add.outer(offsets ** 2, offsets ** 2) / (2 * sigma ** 2))
+    return psf / psf.sum()
+
+
+@dataclass(frozen=True)
+class StellarPsf:
+    """
+    The unocculted PSF of a star: a template (odd-sized, peak at its centre, normalised to unit sum),
+    and the total flux and the peak of the star, in the units of the image it was measured in.
+    """
+    template: np.ndarray
+    flux: float
+    peak: float
+
+
+def stellar_psf(image: np.ndarray, fwhm: float, size: Optional[int] = None) -> StellarPsf:
+    """
+    Measure the PSF of the brightest source of an off-axis `image`: a stamp of `size` pixels
+    (by default three `fwhm` to either side) around its peak, after subtracting the median of the image
+    as the background. Parts of the stamp outside the image count as zero.
+    """
+    half = int(np.ceil(3 * fwhm)) if size is None else size // 2
+    data = np.asarray(image, dtype=np.float64)
+    data = np.nan_to_num(data - np.nanmedian(data), nan=0.0, posinf=0.0, neginf=0.0)
+    y, x = np.unravel_index(np.argmax(data), data.shape)
+
+    stamp = np.pad(data, half)[y:y + 2 * half + 1, x:x + 2 * half + 1]
+    flux = float(stamp.sum())
+    return StellarPsf(template=stamp / flux, flux=flux, peak=float(stamp[half, half]))
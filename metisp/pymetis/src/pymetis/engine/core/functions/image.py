@@ -20,6 +20,8 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 from typing import Optional
 
+import numpy as np
+
 import cpl
 from cpl.core import (Image as CplImage,
                       Type as CplType,
@@ -38,3 +40,23 @@ def zeros_like(image: CplImage, new_type: Optional[CplType] = None):
         return temp
     else:
         return temp.cast(new_type)
+
+
+def as_cpl_image(array: np.ndarray) -> CplImage:
+    """
+    Wrap a NumPy array (e.g. a plane of a memory-mapped or native-type stack) as a CPL Image.
+
+    CPL only knows int32, float32 and float64 pixels in native byte order, so narrower integer types
+    are widened to int32, wider ones to float64, and everything is converted to a contiguous native array first.
+    """
+    if array.dtype.kind in 'iub' and np.can_cast(array.dtype, np.int32):
+        dtype = np.int32
+    elif array.dtype.kind in 'iu':
+        dtype = np.float64
+    elif array.dtype.kind == 'f' and array.dtype.itemsize <= 4:
+        dtype = np.float32
+    elif array.dtype.kind == 'f':
+        dtype = np.float64
+    else:
+        raise TypeError(f"Cannot convert an array of {array.dtype} to a CPL Image")
+    return CplImage(np.ascontiguousarray(array, dtype=dtype))
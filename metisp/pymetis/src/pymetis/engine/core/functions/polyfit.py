@@ -22,6 +22,8 @@ import numpy as np
 from cpl.core import (Image as CplImage,
                       Type as CplType)
 
+from pymetis.engine.core.native import libmetis, address, CPL_ERROR_NONE
+
 
 def weighted_polyfit(x: np.ndarray,
                      y: np.ndarray,
@@ -93,4 +95,150 @@ def weighted_polyfit(x: np.ndarray,
 
     coeffs_poly = np.moveaxis(coeffs, -1, 0)[::-1]  # (P, H, W)
     cov_poly = np.moveaxis(cov, (-2, -1), (0, 1))[::-1, ::-1]  # (P, P, H, W)
-    return coeffs_poly, cov_poly, ok
\ No newline at end of file
+    return coeffs_poly, cov_poly, ok
+
+
+def weighted_polyfit_diagonal(x: np.ndarray,
+                              y: np.ndarray,
+                              deg: int,
+                              *,
+                              weights: np.ndarray = None,
+                              rows: int = 64) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+    """
+    Per-pixel weighted polynomial fit, returning only the diagonal of the covariance.
+    Returns coeffs (P, H, W, highest degree first), variances (P, H, W), ok mask (H, W).
+
+    Uses the multithreaded `metis_polyfit_weighted` kernel from `libmetis` if available,
+    which accumulates the normal equations tile by tile and never expands the samples.
+    Otherwise falls back to :func:`weighted_polyfit`, applied to blocks of `rows` rows
+    so that its temporaries stay bounded. Both paths produce the same results
+    up to floating-point rounding.
+    """
+    assert x.shape == y.shape, \
+        f"Shapes of x and y must match (got {x.shape} and {y.shape})"
+
+    if weights is None:
+        weights = np.ones_like(x)
+    assert weights.shape == x.shape, \
+        f"Weights must have the same shape as data if defined"
+
+    n, h, w = x.shape
+    coeffs = np.zeros((deg + 1, h, w), dtype=np.float64)
+    variances = np.zeros((deg + 1, h, w), dtype=np.float64)
+
+    if (library := libmetis()) is not None:
+        ok = np.zeros((h, w), dtype=np.uint8)
+        code = library.metis_polyfit_weighted(
+            np.ascontiguousarray(x, dtype=np.float64),
+            np.ascontiguousarray(y, dtype=np.float64),
+            np.ascontiguousarray(weights, dtype=np.float64),
+            n, h * w, deg,
+            coeffs, address(variances), address(ok),
+        )
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"metis_polyfit_weighted failed with CPL error code {code}")
+        return coeffs, variances, ok.astype(bool)
+
+    ok = np.zeros((h, w), dtype=bool)
+    for start in range(0, h, rows):
+        block = slice(start, min(start + rows, h))
+        p, cov, good = weighted_polyfit(x[:, block], y[:, block], deg, weights=weights[:, block])
+        coeffs[:, block] = p
+        variances[:, block] = np.moveaxis(np.diagonal(cov, axis1=0, axis2=1), -1, 0)
+        ok[block] = good
+
+    return coeffs, variances, ok
+
+
+class NormalEquations:
+    """
+    Per-pixel weighted polynomial normal equations, accumulated one sample plane at a time.
+
+    This is the streaming counterpart of :func:`weighted_polyfit_diagonal`: only the 2 * deg + 1 power sums,
+    the deg + 1 right-hand sides and the abscissa scale of every pixel are kept, so memory scales with
+    the degree instead of the number of samples, and the planes may be produced and dropped one by one.
+
+    The sums are accumulated in float64 with abscissae divided by the fixed `reference`, which only has to keep
+    the powers in range (e.g. the largest abscissa expected). Before solving, every system is converted
+    to the largest |x| among the weighted samples of its pixel, exactly as the full-stack fit scales it,
+    so both produce the same results up to floating-point rounding.
+    """
+    def __init__(self, shape: tuple[int, int], deg: int, *, reference: float = 1.0):
+        if not reference > 0:
+            raise ValueError(f"Abscissa reference must be positive, got {reference}")
+
+        self.deg = deg
+        self.reference = float(reference)
+        self.sums = np.zeros((2 * deg + 1, *shape), dtype=np.float64)
+        self.rhs = np.zeros((deg + 1, *shape), dtype=np.float64)
+        self.scale = np.zeros(shape, dtype=np.float64)
+        self.count = np.zeros(shape, dtype=np.int32)
+
+    def add(self, x: np.ndarray, y: np.ndarray, weights: np.ndarray) -> None:
+        """
+        Add one sample per pixel. Zero weights exclude the sample, whatever its (possibly non-finite) x and y.
+        """
+        used = weights != 0
+        xs = np.where(used, x / self.reference, 0.0)
+        power = np.where(used, weights * weights, 0.0)
+        weighted = power * np.where(used, y, 0.0)
+
+        for k in range(2 * self.deg + 1):
+            self.sums[k] += power
+            if k <= self.deg:
+                self.rhs[k] += weighted
+                weighted *= xs
+            power *= xs
+
+        np.maximum(self.scale, np.where(used, np.abs(x), 0.0), out=self.scale)
+        self.count += used
+
+    def solve(self, *, rows: int = 64) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+        """
+        Solve every pixel. Returns coeffs (P, H, W, highest degree first), variances (P, H, W) and ok mask (H, W),
+        as :func:`weighted_polyfit_diagonal` does for the full stack of samples.
+
+        Uses the `metis_polyfit_from_sums` kernel from `libmetis` if available,
+        otherwise solves blocks of `rows` rows with NumPy.
+        """
+        deg = self.deg
+        h, w = self.scale.shape
+        coeffs = np.zeros((deg + 1, h, w), dtype=np.float64)
+        variances = np.zeros((deg + 1, h, w), dtype=np.float64)
+
+        if (library := libmetis()) is not None:
+            ok = np.zeros((h, w), dtype=np.uint8)
+            code = library.metis_polyfit_from_sums(
+                self.sums, self.rhs, self.scale, self.reference,
+                h * w, deg,
+                coeffs, address(variances), address(ok),
+            )
+            if code != CPL_ERROR_NONE:
+                raise RuntimeError(f"metis_polyfit_from_sums failed with CPL error code {code}")
+            return coeffs, variances, ok.astype(bool)
+
+        ok = np.zeros((h, w), dtype=bool)
+        exponents = np.arange(2 * deg + 1)
+        for start in range(0, h, rows):
+            block = slice(start, min(start + rows, h))
+            scale = np.where(self.scale[block] > 0, self.scale[block], 1.0)        # (rows, W)
+            rescale = (self.reference / scale)[..., None] ** exponents              # (rows, W, 2 * deg + 1)
+
+            sums = np.moveaxis(self.sums[:, block], 0, -1) * rescale
+            A = sums[..., np.add.outer(np.arange(deg + 1), np.arange(deg + 1))]     # (rows, W, P, P)
+            b = np.moveaxis(self.rhs[:, block], 0, -1) * rescale[..., :deg + 1]     # (rows, W, P)
+
+            good = np.linalg.cond(A) < 1.0 / np.finfo(np.float64).eps
+            coeffs_s = np.zeros_like(b)
+            var_s = np.zeros_like(b)
+            if good.any():
+                coeffs_s[good] = np.linalg.solve(A[good], b[good][..., None])[..., 0]
+                var_s[good] = np.diagonal(np.linalg.inv(A[good]), axis1=-2, axis2=-1)
+
+            # Transform back from the scaled abscissae, highest degree first
+            powers = scale[..., None] ** np.arange(deg + 1)
+            coeffs[:, block] = np.moveaxis(coeffs_s / powers, -1, 0)[::-1]
+            variances[:, block] = np.moveaxis(var_s / powers ** 2, -1, 0)[::-1]
+            ok[block] = good
+
+        return coeffs, variances, ok
@@ -0,0 +1,271 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+from dataclasses import dataclass
+from typing import Optional
+
+import numpy as np
+
+from pymetis.engine.core.functions.sigclip import sigma_clip
+from pymetis.engine.core.native import libmetis, CPL_ERROR_NONE, address
+
+# Measurements of every source, in the order of `metis_psf_statistic` in libmetis
+PSF_STATISTICS = ('xcen', 'ycen', 'xcen_err', 'ycen_err', 'fwhm_x', 'fwhm_y',
+                  'flux', 'background', 'noise', 'snr', 'peak')
+
+# Clipping of the background annulus, as `METIS_PSF_KAPPA` and `METIS_PSF_NITER` in libmetis
+BACKGROUND_KAPPA = 3.0
+BACKGROUND_ITERATIONS = 5
+
+
+@dataclass(frozen=True)
+class PsfMeasurements:
+    """
+    Measurements of point sources, in the order of `metis_psf_statistic`: arrays of shape (nsources,)
+    for a single image, (nframes, nsources) for a cube. All positions are 0-based (column, row) pixel coordinates.
+    Measurements that could not be made are NaN.
+
+    - xcen, ycen: centroid, the first moment of the positive background-subtracted values in the window
+    - xcen_err, ycen_err: their 1-sigma uncertainties, from the background noise
+    - fwhm_x, fwhm_y: full width at half maximum along the row and the column through the peak
+    - flux: background-subtracted flux in the window
+    - background, noise: clipped median and MAD-based sigma of the annulus around the window, per pixel
+    - snr: flux over the background noise of the window sum
+    - peak: value of the brightest pixel above the background
+    """
+    xcen: np.ndarray
+    ycen: np.ndarray
+    xcen_err: np.ndarray
+    ycen_err: np.ndarray
+    fwhm_x: np.ndarray
+    fwhm_y: np.ndarray
+    flux: np.ndarray
+    background: np.ndarray
+    noise: np.ndarray
+    snr: np.ndarray
+    peak: np.ndarray
+
+    @property
+    def positions(self) -> np.ndarray:
+        """ The centroids as (..., 2) pairs (x, y), e.g. as guesses for another measurement. """
+        return np.stack([self.xcen, self.ycen], axis=-1)
+
+
+def detect_sources(image: np.ndarray,
+                   *,
+                   threshold: float,
+                   mask: Optional[np.ndarray] = None,
+                   separation: float = 5.0,
+                   max_sources: Optional[int] = None) -> np.ndarray:
+    """
+    Find the point sources of an image: the local maxima more than `threshold` clipped sigmas above
+    the clipped median of the image, brightest first. Of maxima closer than `separation` pixels only
+    the brightest is kept, and at most `max_sources` are returned.
+
+    Returns the (nsources, 2) pixel positions (x, y) of the peaks, usable as guesses for :func:`measure_psfs`.
+    """
+    values = np.asarray(image, dtype=np.float32)
+    good = np.isfinite(values) if mask is None else np.isfinite(values) & ~np.asarray(mask, dtype=bool)
+
+    _, stats = sigma_clip(values, mask=~good, centre='median', scale='mad')
+    level = stats.centre + threshold * stats.sigma
+
+    # A local maximum is at least as bright as all its 8 neighbours, bad pixels never win
+    padded = np.pad(np.where(good, values, -np.inf), 1, constant_values=-np.inf)
+    height, width = values.shape
+    peaks = good & (values > level)
+    for dy in (-1, 0, 1):
+        for dx in (-1, 0, 1):
+            if dx or dy:
+                peaks &= values >= padded[1 + dy:1 + dy + height, 1 + dx:1 + dx + width]
+
+    rows, columns = np.nonzero(peaks)
+    order = np.argsort(-values[rows, columns], kind='stable')
+    candidates = np.stack([columns[order], rows[order]], axis=-1).astype(np.float64)
+
+    kept = []
+    for candidate in candidates:
+        if max_sources is not None and len(kept) >= max_sources:
+            break
+        if not kept or np.min(np.hypot(*(np.asarray(kept) - candidate).T)) >= separation:
+            kept.append(candidate)
+
+    return np.asarray(kept, dtype=np.float64).reshape(-1, 2)
+
+
+def measure_psfs(data: np.ndarray,
+                 positions: Optional[np.ndarray] = None,
+                 *,
+                 threshold: Optional[float] = None,
+                 mask: Optional[np.ndarray] = None,
+                 half_width: int = 7,
+                 background_width: int = 4,
+                 separation: Optional[float] = None,
+                 max_sources: Optional[int] = None) -> PsfMeasurements:
+    """
+    Measure centroids, FWHM, flux, local background, SNR and centroid uncertainties of many point sources
+    in an image (H, W) or in every frame of a cube (N, H, W), all in a single call.
+
+    The sources are given either by `positions`, (nsources, 2) guesses (x, y) shared by all frames
+    or (N, nsources, 2) per frame, or found by :func:`detect_sources` with `threshold`
+    (on the mean of a cube, then measured in every frame). Every source is measured in a window of
+    `half_width` pixels around the brightest pixel near its guess, its background in a square annulus
+    `background_width` pixels wide around that window. `mask` flags bad pixels, in the shape of `data`
+    or of a single frame.
+
+    Uses the multithreaded `metis_psf_measure` kernel from `libmetis` if available,
+    otherwise measures the sources one by one with NumPy. Both paths produce the same results
+    up to floating-point rounding.
+
+    Raises
+    ------
+    ValueError
+        If neither or both of `positions` and `threshold` are given, or the shapes do not match.
+    """
+    if (positions is None) == (threshold is None):
+        raise ValueError("Sources must be given either by their positions or by a detection threshold")
+    if half_width < 1 or background_width < 1:
+        raise ValueError(f"Window and background annulus must be at least one pixel wide, "
+                         f"got {half_width} and {background_width}")
+
+    single = data.ndim == 2
+    cube = np.ascontiguousarray(data[None] if single else data, dtype=np.float32)
+    nframes, height, width = cube.shape
+
+    flags = None
+    if mask is not None:
+        flags = np.asarray(mask, dtype=bool)
+        if flags.shape == (height, width):
+            flags = np.broadcast_to(flags, cube.shape)
+        elif flags.shape != cube.shape:
+            raise ValueError(f"Mask of shape {flags.shape} does not match data of shape {data.shape}")
+        flags = np.ascontiguousarray(flags, dtype=np.uint8)
+
+    if positions is None:
+        image = cube[0] if nframes == 1 else np.mean(cube, axis=0)
+        positions = detect_sources(image, threshold=threshold,
+                                   mask=None if flags is None else flags.any(axis=0),
+                                   separation=2 * half_width + 1 if separation is None else separation,
+                                   max_sources=max_sources)
+
+    positions = np.asarray(positions, dtype=np.float64)
+    if positions.ndim == 2:
+        positions = np.broadcast_to(positions, (nframes, *positions.shape))
+    if positions.ndim != 3 or positions.shape[0] != nframes or positions.shape[2] != 2:
+        raise ValueError(f"Positions of shape {positions.shape} do not match {nframes} frames")
+    positions = np.ascontiguousarray(positions)
+    nsources = positions.shape[1]
+
+    stats = np.full((len(PSF_STATISTICS), nframes, nsources), np.nan)
+
+    if (library := libmetis()) is not None:
+        code = library.metis_psf_measure(cube, address(flags), nframes, width, height,
+                                         positions, nsources, half_width, background_width, stats)
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"metis_psf_measure failed with CPL error code {code}")
+    else:
+        for frame in range(nframes):
+            bad = None if flags is None else flags[frame].astype(bool)
+            for source in range(nsources):
+                stats[:, frame, source] = _measure_source(cube[frame], bad, *positions[frame, source],
+                                                          half_width, background_width)
+
+    if single:
+        stats = stats[:, 0]
+    return PsfMeasurements(*stats)
+
+
+def _measure_source(image: np.ndarray,
+                    bad: Optional[np.ndarray],
+                    x: float,
+                    y: float,
+                    half_width: int,
+                    background_width: int) -> np.ndarray:
+    """ Measure a single source as `metis_psf_measure` does, see there for the details. """
+    measured = np.full(len(PSF_STATISTICS), np.nan)
+    height, width = image.shape
+    if not (-0.5 < x < width - 0.5 and -0.5 < y < height - 0.5):
+        return measured
+
+    good = np.isfinite(image) if bad is None else np.isfinite(image) & ~bad
+
+    def box(cx: int, cy: int, half: int) -> tuple[slice, slice]:
+        return slice(max(cy - half, 0), min(cy + half, height - 1) + 1), slice(max(cx - half, 0), min(cx + half, width - 1) + 1)
+
+    # Peak: the brightest good pixel within the search window, the first one in row-major order on ties
+    search = box(int(np.floor(x + 0.5)), int(np.floor(y + 0.5)), half_width)
+    candidates = np.where(good[search], image[search], -np.inf)
+    if not good[search].any():
+        return measured
+    py, px = np.unravel_index(np.argmax(candidates), candidates.shape)
+    py, px = py + search[0].start, px + search[1].start
+    peak = float(image[py, px])
+
+    # Local background: the clipped annulus around the window
+    outer = box(px, py, half_width + background_width)
+    rows, columns = np.mgrid[outer]
+    annulus = good[outer] & ((np.abs(columns - px) > half_width) | (np.abs(rows - py) > half_width))
+    if annulus.sum() < 2:
+        return measured
+    _, clipped = sigma_clip(image[outer][annulus], centre='median', scale='mad',
+                            kappa_low=BACKGROUND_KAPPA, kappa_high=BACKGROUND_KAPPA, iterations=BACKGROUND_ITERATIONS)
+    background, noise = clipped.centre, clipped.sigma
+
+    window = box(px, py, half_width)
+    rows, columns = np.mgrid[window]
+    used = good[window]
+    values = image[window].astype(np.float64) - background
+    flux = values[used].sum()
+    positive = used & (values > 0)
+    weights = values[positive]
+
+    measured[PSF_STATISTICS.index('background')] = background
+    measured[PSF_STATISTICS.index('noise')] = noise
+    measured[PSF_STATISTICS.index('peak')] = peak - background
+    measured[PSF_STATISTICS.index('flux')] = flux
+    with np.errstate(divide='ignore', invalid='ignore'):
+        measured[PSF_STATISTICS.index('snr')] = flux / (noise * np.sqrt(used.sum()))
+
+    if (total := weights.sum()) > 0:
+        xc = (weights * columns[positive]).sum() / total
+        yc = (weights * rows[positive]).sum() / total
+        measured[PSF_STATISTICS.index('xcen')] = xc
+        measured[PSF_STATISTICS.index('ycen')] = yc
+        measured[PSF_STATISTICS.index('xcen_err')] = noise * np.sqrt(((columns[positive] - xc) ** 2).sum()) / total
+        measured[PSF_STATISTICS.index('ycen_err')] = noise * np.sqrt(((rows[positive] - yc) ** 2).sum()) / total
+
+    # Half-maximum crossings on both sides of the peak
+    level = background + 0.5 * (peak - background)
+    measured[PSF_STATISTICS.index('fwhm_x')] = (_crossing(image[py, px::-1], good[py, px::-1], peak, level) +
+                                               _crossing(image[py, px:], good[py, px:], peak, level))
+    measured[PSF_STATISTICS.index('fwhm_y')] = (_crossing(image[py::-1, px], good[py::-1, px], peak, level) +
+                                               _crossing(image[py:, px], good[py:, px], peak, level))
+    return measured
+
+
+def _crossing(profile: np.ndarray, good: np.ndarray, peak: float, level: float) -> float:
+    """ Distance from the start of `profile` (the peak) at which it first drops below `level`, NaN if it never does. """
+    below = np.flatnonzero(good[1:] & (profile[1:] < level))
+    if below.size == 0:
+        return np.nan
+    k = below[0] + 1
+    above = np.flatnonzero(good[1:k])
+    at = above[-1] + 1 if above.size > 0 else 0
+    previous = profile[at] if at > 0 else peak
+    return at + (previous - level) / (previous - profile[k]) * (k - at)
@@ -0,0 +1,134 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import os
+import resource
+import sys
+from typing import Optional
+
+
+# Environment variable that may cap the number of worker threads used by the pipeline
+MAX_WORKERS_VARIABLE = 'PYMETIS_MAX_WORKERS'
+
+# Counters reported by `io_counters`
+IO_COUNTERS = ('rchar', 'wchar', 'read_bytes', 'write_bytes')
+
+
+def available_memory() -> Optional[int]:
+    """
+    Return the memory available to new allocations without swapping, in bytes,
+    or None if it cannot be determined on this platform.
+
+    Prefers `MemAvailable` from /proc/meminfo, which also counts reclaimable page cache,
+    and falls back to the number of free physical pages.
+    """
+    try:
+        with open('/proc/meminfo') as meminfo:
+            for line in meminfo:
+                if line.startswith('MemAvailable:'):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+
+    try:
+        return os.sysconf('SC_AVPHYS_PAGES') * os.sysconf('SC_PAGE_SIZE')
+    except (ValueError, OSError, AttributeError):
+        return None
+
+
+def max_workers() -> int:
+    """
+    Return the number of worker threads the pipeline may use:
+    the number of CPUs available to this process, capped by the environment variable `PYMETIS_MAX_WORKERS`.
+    """
+    try:
+        count = len(os.sched_getaffinity(0))
+    except AttributeError:
+        count = os.cpu_count() or 1
+
+    if (explicit := os.environ.get(MAX_WORKERS_VARIABLE)) is not None:
+        count = min(count, int(explicit))
+
+    return max(1, count)
+
+
+def peak_rss() -> int:
+    """
+    Return the peak resident set size of this process so far, in bytes.
+
+    Prefers `VmHWM` from /proc/self/status, which may be reset by writing '5' to /proc/self/clear_refs,
+    and falls back to `ru_maxrss`, which may not.
+    """
+    try:
+        with open('/proc/self/status') as status:
+            for line in status:
+                if line.startswith('VmHWM:'):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+
+    # `ru_maxrss` is in kilobytes on Linux, but in bytes on macOS
+    maxrss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return maxrss if sys.platform == 'darwin' else maxrss * 1024
+
+
+def current_rss() -> Optional[int]:
+    """ Return the current resident set size of this process in bytes, or None if it is not available. """
+    try:
+        with open('/proc/self/status') as status:
+            for line in status:
+                if line.startswith('VmRSS:'):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+
+    return None
+
+
+def reset_peak_rss() -> bool:
+    """
+    Reset the peak resident set size reported by `peak_rss` to the current one, if the kernel supports it
+    (Linux only). Return whether it was reset.
+    """
+    try:
+        with open('/proc/self/clear_refs', 'w') as clear_refs:
+            clear_refs.write('5')
+        return True
+    except OSError:
+        return False
+
+
+def io_counters() -> dict[str, int]:
+    """
+    Return the cumulative I/O counters of this process from /proc/self/io, or zeros where it is not available:
+
+    - `rchar`, `wchar`: bytes passed to read(2), write(2) and friends, including hits in the page cache;
+    - `read_bytes`, `write_bytes`: bytes actually fetched from or sent to the storage layer.
+    """
+    counters = dict.fromkeys(IO_COUNTERS, 0)
+    try:
+        with open('/proc/self/io') as io:
+            for line in io:
+                key, value = line.split(':')
+                if key in counters:
+                    counters[key] = int(value)
+    except OSError:
+        pass
+
+    return counters
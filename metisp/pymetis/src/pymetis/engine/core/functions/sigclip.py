@@ -0,0 +1,219 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import warnings
+from dataclasses import dataclass
+from typing import Literal, Optional
+
+import numpy as np
+
+from pymetis.engine.core.native import libmetis, address, CPL_ERROR_NONE
+
+# Supported estimators, in the order of `metis_sigclip_centre` and `metis_sigclip_scale` in libmetis
+SIGCLIP_CENTRES = ('mean', 'median')
+SIGCLIP_SCALES = ('stdev', 'mad')
+
+SigclipCentre = Literal['mean', 'median']
+SigclipScale = Literal['stdev', 'mad']
+
+# Ratio of the standard deviation to the median absolute deviation of a normal distribution
+MAD_TO_SIGMA = 1.482602218505602
+
+
+@dataclass(frozen=True)
+class ClippedStatistics:
+    """
+    Statistics of the samples that survived sigma clipping, in the order of `metis_sigclip_statistic`:
+    scalars when a whole map was clipped at once, arrays of the shape of a frame when clipping along a stack.
+    Exactly the good samples within [low, high] are kept; the bounds are infinite if nothing had to be clipped.
+    """
+    centre: float | np.ndarray
+    sigma: float | np.ndarray
+    low: float | np.ndarray
+    high: float | np.ndarray
+    kept: int | np.ndarray
+
+
+def sigma_clip(data: np.ndarray,
+               *,
+               mask: Optional[np.ndarray] = None,
+               axis: Optional[Literal[0]] = None,
+               centre: SigclipCentre = 'median',
+               scale: SigclipScale = 'stdev',
+               kappa_low: float = 3.0,
+               kappa_high: float = 3.0,
+               iterations: int = 5,
+               rows: int = 64) -> tuple[np.ndarray, ClippedStatistics]:
+    """
+    Iterative kappa-sigma clipping, either of all samples of `data` together (`axis=None`, e.g. a 2D map)
+    or of every pixel of a stack (N, H, W) along the stack (`axis=0`), like `astropy.stats.sigma_clip`.
+    Returns the mask of rejected samples (the shape of `data`) and the statistics of the kept ones.
+
+    Samples flagged in `mask` and non-finite samples never take part and are always rejected.
+    Every iteration keeps the samples within [centre - kappa_low * sigma, centre + kappa_high * sigma]
+    of the samples kept so far, where the centre is the `mean` or the `median` and the scale the standard
+    deviation around the mean (`stdev`) or the normalised median absolute deviation from the centre (`mad`).
+    The iteration stops when nothing more is rejected, when fewer than two samples would remain,
+    or after `iterations` iterations.
+
+    Uses the multithreaded `metis_sigclip_map` / `metis_sigclip_stack` kernels from `libmetis` if available,
+    which find medians by selection instead of sorting and create no masked-array copies.
+    Otherwise falls back to NumPy, along the stack applied to blocks of `rows` rows.
+    Both paths produce the same results up to floating-point rounding.
+
+    Raises
+    ------
+    ValueError
+        If an unknown estimator or axis is used.
+    """
+    if centre not in SIGCLIP_CENTRES:
+        raise ValueError(f"Unknown centre estimator {centre!r}")
+    if scale not in SIGCLIP_SCALES:
+        raise ValueError(f"Unknown scale estimator {scale!r}")
+    if axis not in (None, 0):
+        raise ValueError(f"Can only clip all samples together or along the first axis, not along {axis!r}")
+
+    if mask is not None:
+        assert mask.shape == data.shape, \
+            f"Mask must have the same shape as the data (got {mask.shape} and {data.shape})"
+
+    if (library := libmetis()) is not None:
+        values = np.ascontiguousarray(data, dtype=np.float32)
+        flags = None if mask is None else np.ascontiguousarray(mask, dtype=np.uint8)
+        rejected = np.zeros(values.shape, dtype=np.uint8)
+        options = (SIGCLIP_CENTRES.index(centre), SIGCLIP_SCALES.index(scale), kappa_low, kappa_high, iterations)
+
+        if axis is None:
+            stats = np.zeros(5)
+            code = library.metis_sigclip_map(values, address(flags), values.size, *options,
+                                             address(rejected), address(stats))
+        else:
+            stats = np.zeros((5, *values.shape[1:]))
+            code = library.metis_sigclip_stack(values, address(flags), values.shape[0], stats[0].size, *options,
+                                               address(rejected), address(stats))
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"sigma clipping failed with CPL error code {code}")
+
+        return rejected.astype(bool), _statistics(stats, scalar=axis is None)
+
+    if axis is None:
+        return _sigma_clip_map(data, mask, centre=centre, scale=scale,
+                               kappa_low=kappa_low, kappa_high=kappa_high, iterations=iterations)
+
+    rejected = np.zeros(data.shape, dtype=bool)
+    stats = np.zeros((5, *data.shape[1:]))
+
+    for start in range(0, data.shape[1], rows):
+        block = (slice(None), slice(start, start + rows))
+        values = data[block].astype(np.float64)
+        good = np.isfinite(values) if mask is None else np.isfinite(values) & ~mask[block].astype(bool)
+
+        keep, stats[block] = _sigma_clip_columns(values, good, centre=centre, scale=scale,
+                                                 kappa_low=kappa_low, kappa_high=kappa_high, iterations=iterations)
+        rejected[block] = ~keep
+
+    return rejected, _statistics(stats, scalar=False)
+
+
+def _statistics(stats: np.ndarray, *, scalar: bool) -> ClippedStatistics:
+    """ Unpack the statistics as laid out by the kernels, with Python scalars for a whole map. """
+    centres, sigmas, lows, highs, kept = stats
+    if scalar:
+        return ClippedStatistics(float(centres), float(sigmas), float(lows), float(highs), int(kept))
+    return ClippedStatistics(centres, sigmas, lows, highs, kept.astype(int))
+
+
+def _estimate(values: np.ndarray,
+              keep: np.ndarray,
+              count: np.ndarray,
+              *,
+              centre: SigclipCentre,
+              scale: SigclipScale) -> tuple[np.ndarray, np.ndarray]:
+    """ Centre and scale of the kept samples along the first axis, zero where they cannot be estimated. """
+    with warnings.catch_warnings():
+        warnings.simplefilter('ignore', RuntimeWarning)         # All-NaN slices of pixels without samples
+
+        if centre == 'median':
+            location = np.nan_to_num(np.nanmedian(np.where(keep, values, np.nan), axis=0))
+        else:
+            location = np.where(keep, values, 0.0).sum(axis=0) / np.maximum(count, 1)
+
+        if scale == 'mad':
+            deviation = np.abs(values - location)
+            spread = MAD_TO_SIGMA * np.nan_to_num(np.nanmedian(np.where(keep, deviation, np.nan), axis=0))
+        else:
+            mean = location if centre == 'mean' else np.where(keep, values, 0.0).sum(axis=0) / np.maximum(count, 1)
+            squares = np.where(keep, (values - mean) ** 2, 0.0).sum(axis=0)
+            spread = np.where(count > 1, np.sqrt(squares / np.maximum(count - 1, 1)), 0.0)
+
+    return location, spread
+
+
+def _sigma_clip_columns(values: np.ndarray,
+                        good: np.ndarray,
+                        *,
+                        centre: SigclipCentre,
+                        scale: SigclipScale,
+                        kappa_low: float,
+                        kappa_high: float,
+                        iterations: int) -> tuple[np.ndarray, np.ndarray]:
+    """
+    Vectorized counterpart of `metis_sigclip_values`, applied to every column along the first axis:
+    a column keeps its previous set of samples once an iteration would reject nothing or leave fewer than two.
+    Returns the kept samples and the statistics, stacked in the order of `ClippedStatistics`.
+    """
+    keep = good.copy()
+    count = keep.sum(axis=0)
+    location, spread = _estimate(values, keep, count, centre=centre, scale=scale)
+    low = np.full(location.shape, -np.inf)
+    high = np.full(location.shape, np.inf)
+
+    for _ in range(iterations):
+        lo = location - kappa_low * spread
+        hi = location + kappa_high * spread
+        inside = keep & (values >= lo) & (values <= hi)
+        kept = inside.sum(axis=0)
+
+        update = (count > 1) & (kept != count) & (kept >= 2)
+        if not update.any():
+            break
+
+        keep = np.where(update, inside, keep)
+        count = np.where(update, kept, count)
+        low = np.where(update, np.maximum(low, lo), low)
+        high = np.where(update, np.minimum(high, hi), high)
+
+        new_location, new_spread = _estimate(values, keep, count, centre=centre, scale=scale)
+        location = np.where(update, new_location, location)
+        spread = np.where(update, new_spread, spread)
+
+    return keep, np.stack([location, spread, low, high, count])
+
+
+def _sigma_clip_map(data: np.ndarray,
+                    mask: Optional[np.ndarray],
+                    **options) -> tuple[np.ndarray, ClippedStatistics]:
+    """ Clip all good samples of `data` together, as a single column. """
+    values = data.astype(np.float64)
+    good = np.isfinite(values) if mask is None else np.isfinite(values) & ~mask.astype(bool)
+
+    _, stats = _sigma_clip_columns(values[good][:, None], good[good][:, None], **options)
+    statistics = _statistics(stats[:, 0], scalar=True)
+    rejected = ~good | ~((values >= statistics.low) & (values <= statistics.high))
+    return rejected, statistics
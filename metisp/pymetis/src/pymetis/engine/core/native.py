@@ -0,0 +1,257 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import ctypes
+import ctypes.util
+import functools
+import os
+from typing import Optional
+
+import numpy as np
+
+
+# Environment variable that may point directly to the compiled pipeline library,
+# or disable it altogether (and use the pure Python implementations) if set to an empty string
+LIBRARY_PATH_VARIABLE = 'PYMETIS_LIBMETIS'
+
+# `cpl_error_code` value for success
+CPL_ERROR_NONE = 0
+
+cpl_size = ctypes.c_int64
+
+double_array = np.ctypeslib.ndpointer(dtype=np.float64, flags='C_CONTIGUOUS')
+float_array = np.ctypeslib.ndpointer(dtype=np.float32, flags='C_CONTIGUOUS')
+int_array = np.ctypeslib.ndpointer(dtype=np.int32, flags='C_CONTIGUOUS')
+optional_double_array = ctypes.c_void_p
+optional_float_array = ctypes.c_void_p
+optional_flag_array = ctypes.c_void_p
+optional_int_array = ctypes.c_void_p
+
+# Kernels that must all be exported by a library for it to be accepted
+SYMBOLS = (
+    'metis_polyfit_weighted',
+    'metis_polyfit_from_sums',
+    'metis_combine_with_error',
+    'metis_calibrate_frames',
+    'metis_linearity_correct',
+    'metis_sigclip_map',
+    'metis_sigclip_stack',
+    'metis_psf_measure',
+    'metis_adi_derotate',
+    'metis_chopnod_add_frame',
+    'metis_chopnod_add_cycle',
+    'metis_set_num_threads',
+)
+
+
+def _candidates() -> list[str]:
+    """
+    List the places to look for the pipeline library, most specific first:
+    an explicit path from the environment, then whatever the dynamic linker resolves.
+    An empty path in the environment disables the library.
+    """
+    candidates = []
+    if (explicit := os.environ.get(LIBRARY_PATH_VARIABLE)) is not None:
+        if explicit == '':
+            return []
+        candidates.append(explicit)
+    if (found := ctypes.util.find_library('metis')) is not None:
+        candidates.append(found)
+    candidates.append('libmetis.so')
+    return candidates
+
+
+def _declare(library: ctypes.CDLL) -> None:
+    """ Declare the signatures of all the kernels used from Python. """
+    library.metis_polyfit_weighted.restype = ctypes.c_int
+    library.metis_polyfit_weighted.argtypes = [
+        double_array, double_array, double_array,       # x, y, w
+        cpl_size, cpl_size, cpl_size,                   # nsamples, npix, degree
+        double_array,                                   # coeffs
+        optional_double_array,                          # cov_diag
+        optional_flag_array,                            # ok
+    ]
+
+    library.metis_polyfit_from_sums.restype = ctypes.c_int
+    library.metis_polyfit_from_sums.argtypes = [
+        double_array, double_array, double_array,       # sums, rhs, scale
+        ctypes.c_double,                                # reference
+        cpl_size, cpl_size,                             # npix, degree
+        double_array,                                   # coeffs
+        optional_double_array,                          # cov_diag
+        optional_flag_array,                            # ok
+    ]
+
+    library.metis_combine_with_error.restype = ctypes.c_int
+    library.metis_combine_with_error.argtypes = [
+        float_array,                                    # stack
+        optional_flag_array,                            # bpm
+        cpl_size, cpl_size,                             # nframes, npix
+        ctypes.c_int,                                   # method
+        ctypes.c_double,                                # read_noise
+        ctypes.c_double, ctypes.c_double,               # kappa_low, kappa_high
+        cpl_size,                                       # niter
+        float_array,                                    # combined
+        optional_float_array,                           # error
+        optional_flag_array,                            # rejected
+    ]
+
+    library.metis_calibrate_frames.restype = ctypes.c_int
+    library.metis_calibrate_frames.argtypes = [
+        float_array,                                    # raw
+        cpl_size, cpl_size,                             # nframes, npix
+        optional_float_array,                           # dark
+        optional_float_array,                           # flat
+        optional_float_array,                           # gain
+        ctypes.c_double,                                # gain_value
+        optional_float_array,                           # linearity
+        cpl_size,                                       # ncoeffs
+        optional_int_array,                             # dq_static
+        ctypes.c_double,                                # read_noise
+        ctypes.c_double,                                # saturation
+        float_array,                                    # sci
+        optional_float_array,                           # err
+        optional_int_array,                             # dq
+    ]
+
+    library.metis_linearity_correct.restype = ctypes.c_int
+    library.metis_linearity_correct.argtypes = [
+        float_array,                                    # data
+        optional_float_array,                           # err
+        optional_int_array,                             # dq
+        cpl_size, cpl_size,                             # nframes, npix
+        double_array,                                   # coeffs
+        optional_double_array,                          # coeffs_err
+        cpl_size,                                       # ncoeffs
+        optional_int_array,                             # coeffs_dq
+        ctypes.c_int,                                   # single
+    ]
+
+    library.metis_sigclip_map.restype = ctypes.c_int
+    library.metis_sigclip_map.argtypes = [
+        float_array,                                    # data
+        optional_flag_array,                            # bpm
+        cpl_size,                                       # npix
+        ctypes.c_int, ctypes.c_int,                     # centre, scale
+        ctypes.c_double, ctypes.c_double,               # kappa_low, kappa_high
+        cpl_size,                                       # niter
+        optional_flag_array,                            # rejected
+        optional_double_array,                          # stats
+    ]
+
+    library.metis_sigclip_stack.restype = ctypes.c_int
+    library.metis_sigclip_stack.argtypes = [
+        float_array,                                    # stack
+        optional_flag_array,                            # bpm
+        cpl_size, cpl_size,                             # nframes, npix
+        ctypes.c_int, ctypes.c_int,                     # centre, scale
+        ctypes.c_double, ctypes.c_double,               # kappa_low, kappa_high
+        cpl_size,                                       # niter
+        optional_flag_array,                            # rejected
+        optional_double_array,                          # stats
+    ]
+
+    library.metis_psf_measure.restype = ctypes.c_int
+    library.metis_psf_measure.argtypes = [
+        float_array,                                    # data
+        optional_flag_array,                            # bpm
+        cpl_size, cpl_size, cpl_size,                   # nframes, nx, ny
+        double_array,                                   # positions
+        cpl_size,                                       # nsources
+        cpl_size, cpl_size,                             # half_width, background_width
+        double_array,                                   # stats
+    ]
+
+    library.metis_adi_derotate.restype = ctypes.c_int
+    library.metis_adi_derotate.argtypes = [
+        float_array,                                    # frames
+        cpl_size, cpl_size, cpl_size,                   # nframes, nx, ny
+        double_array,                                   # angles
+        ctypes.c_double, ctypes.c_double,               # xc, yc
+        float_array,                                    # derotated
+    ]
+
+    library.metis_chopnod_add_frame.restype = ctypes.c_int
+    library.metis_chopnod_add_frame.argtypes = [
+        float_array,                                    # sci
+        optional_float_array,                           # err
+        optional_int_array,                             # dq
+        cpl_size,                                       # npix
+        double_array, double_array, int_array,          # sum, sum_var, count
+        optional_double_array,                          # total
+        optional_double_array,                          # total_sq
+        optional_int_array,                             # total_count
+    ]
+
+    library.metis_chopnod_add_cycle.restype = ctypes.c_int
+    library.metis_chopnod_add_cycle.argtypes = [
+        float_array, float_array,                       # difference, variance
+        cpl_size,                                       # npix
+        optional_double_array,                          # reference
+        ctypes.c_double,                                # kappa
+        double_array, double_array, double_array,       # sum, sum_sq, sum_var
+        int_array, int_array,                           # count, rejected
+    ]
+
+    library.metis_set_num_threads.restype = ctypes.c_int
+    library.metis_set_num_threads.argtypes = [
+        ctypes.c_int,                                   # nthreads
+    ]
+
+
+@functools.cache
+def libmetis() -> Optional[ctypes.CDLL]:
+    """
+    Load the compiled pipeline library `libmetis` and declare its kernels.
+
+    Several unrelated libraries are called `libmetis` (most notably the graph partitioner),
+    so a candidate is only accepted if it exports the symbols we need.
+    Returns `None` if no suitable library is found, callers are expected to fall back
+    to a pure Python implementation then.
+    """
+    for candidate in _candidates():
+        try:
+            library = ctypes.CDLL(candidate)
+        except OSError:
+            continue
+
+        if not all(hasattr(library, symbol) for symbol in SYMBOLS):
+            continue
+
+        _declare(library)
+        return library
+
+    return None
+
+
+def address(array: Optional[np.ndarray]) -> Optional[int]:
+    """ Return the data pointer of an optional output array, as expected for `void *` arguments. """
+    return None if array is None else array.ctypes.data
+
+
+def set_num_threads(nthreads: int) -> None:
+    """
+    Limit the OpenMP threads of the kernels called from the current thread to `nthreads`,
+    e.g. to share the CPUs between several threads calling them concurrently.
+    Does nothing if the library is not available.
+    """
+    if (library := libmetis()) is not None:
+        code = library.metis_set_num_threads(nthreads)
+        if code != CPL_ERROR_NONE:
+            raise RuntimeError(f"metis_set_num_threads failed with CPL error code {code}")
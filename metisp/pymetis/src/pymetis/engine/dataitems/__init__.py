@@ -19,6 +19,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 
 from .dataitem import DataItem
+from .fitsindex import FitsIndex, fits_index, load_header
 from .image import ImageDataItem
 from .table import TableDataItem
 from .hdu import Hdu
@@ -26,5 +27,6 @@ from .productset import PipelineProductSet
 
 
 __all__ = [
-    'DataItem', 'ImageDataItem', 'TableDataItem', 'Hdu', 'PipelineProductSet'
+    'DataItem', 'ImageDataItem', 'TableDataItem', 'Hdu', 'PipelineProductSet',
+    'FitsIndex', 'fits_index', 'load_header',
 ]
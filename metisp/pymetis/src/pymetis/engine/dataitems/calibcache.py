@@ -0,0 +1,252 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import contextlib
+import fcntl
+import functools
+import hashlib
+import itertools
+import os
+import tempfile
+import threading
+from pathlib import Path
+from typing import Callable, Iterator, Optional
+
+import numpy as np
+
+from cpl.core import Msg
+
+from pymetis.engine.core.functions.resources import available_memory
+
+
+# Environment variables that configure the cache shared by all recipe processes on a node
+CACHE_DIRECTORY_VARIABLE = 'PYMETIS_CACHE_DIR'
+CACHE_SIZE_VARIABLE = 'PYMETIS_CACHE_SIZE'        # in bytes; 0 disables the cache
+
+# Default size limit, further capped to a quarter of the available memory if the store lives in RAM
+DEFAULT_CACHE_SIZE = 2 * 2 ** 30
+
+# Number of bytes hashed at once
+HASH_CHUNK_SIZE = 16 * 2 ** 20
+
+
+def content_hash(path: str | Path) -> str:
+    """ Hash the full content of a file, so that identical copies under different names share entries. """
+    digest = hashlib.blake2b(digest_size=20)
+    with open(path, 'rb') as file:
+        while chunk := file.read(HASH_CHUNK_SIZE):
+            digest.update(chunk)
+    return digest.hexdigest()
+
+
+class CalibrationCache:
+    """
+    A store of decoded calibration planes, shared by all recipe processes on a node.
+
+    Entries are keyed by the hash of the file content and the extension, and kept as `.npy` files
+    that are memory-mapped on use, so a hit costs no more than copying the pages (usually from RAM,
+    as the default store lives in /dev/shm). The content hash of every file is remembered by its
+    path, size, inode and modification time, so unchanged files are only ever hashed once;
+    in the store, alongside the entries of that content, and in the process.
+
+    The total size of the entries and remembered hashes is kept under `limit` bytes by evicting
+    the least recently used ones first, and a remembered hash goes with the last entry of its content.
+    Writers hold an exclusive lock on the store; readers only map files, which remain
+    valid even if another process evicts them in the meantime.
+    """
+    def __init__(self, directory: str | Path, limit: int):
+        self.directory = Path(directory)
+        self.limit = limit
+        self.hits = 0
+        self.misses = 0
+        self._hashes: dict[tuple, str] = {}
+        self._lock = threading.Lock()
+
+        (self.directory / 'hashes').mkdir(parents=True, exist_ok=True)
+
+    @contextlib.contextmanager
+    def _exclusive(self) -> Iterator[None]:
+        """ Hold the lock of the store, against both other threads and other processes. """
+        with self._lock, open(self.directory / 'lock', 'a') as lock:
+            fcntl.flock(lock, fcntl.LOCK_EX)
+            try:
+                yield
+            finally:
+                fcntl.flock(lock, fcntl.LOCK_UN)
+
+    @staticmethod
+    def _version(path: str | Path) -> tuple:
+        """ Identify a version of a file by its path, size, inode and modification time. """
+        path = os.path.realpath(path)
+        status = os.stat(path)
+        return path, status.st_size, status.st_ino, status.st_mtime_ns
+
+    def _remembered(self, version: tuple) -> Path:
+        """ File in the store holding the content hash of a version of a file, for later processes. """
+        return self.directory / 'hashes' / hashlib.blake2b(repr(version).encode(), digest_size=20).hexdigest()
+
+    def file_hash(self, path: str | Path) -> str:
+        """ Return the content hash of a file, computing it only if this version of the file has not been seen. """
+        return self._hash(self._version(path))
+
+    def _hash(self, version: tuple) -> str:
+        with self._lock:
+            if (cached := self._hashes.get(version)) is not None:
+                return cached
+
+        try:
+            digest = self._remembered(version).read_text().strip()
+        except OSError:
+            digest = content_hash(version[0])
+
+        with self._lock:
+            self._hashes[version] = digest
+        return digest
+
+    def _entry(self, digest: str, extension: int | str) -> Path:
+        name = hashlib.blake2b(str(extension).encode(), digest_size=8).hexdigest()
+        return self.directory / f"{digest}-{name}.npy"
+
+    def _write_atomically(self, path: Path, write: Callable) -> None:
+        """ Write a file under a temporary name and rename it, so that no reader ever sees it incomplete. """
+        handle, temporary = tempfile.mkstemp(dir=self.directory, prefix='.', suffix='.tmp')
+        try:
+            with os.fdopen(handle, 'wb') as file:
+                write(file)
+            os.replace(temporary, path)
+        except BaseException:
+            with contextlib.suppress(OSError):
+                os.unlink(temporary)
+            raise
+
+    def get(self,
+            path: str | Path,
+            extension: int | str,
+            loader: Callable[[], np.ndarray]) -> np.ndarray:
+        """
+        Return the decoded plane `extension` of the file at `path` as a read-only array.
+
+        On a miss, the plane is obtained from `loader`, stored (if it fits) and returned as loaded.
+        """
+        version = self._version(path)
+        digest = self._hash(version)
+        entry = self._entry(digest, extension)
+        remembered = self._remembered(version)
+
+        try:
+            data = np.load(entry, mmap_mode='r', allow_pickle=False)
+            os.utime(entry)                 # Mark as recently used
+            with contextlib.suppress(OSError):
+                os.utime(remembered)
+            self.hits += 1
+            Msg.debug(self.__class__.__qualname__, f"Cache hit for '{extension}' of {path}")
+            return data
+        except (OSError, ValueError):
+            pass
+
+        self.misses += 1
+        data = np.asarray(loader())
+
+        if data.nbytes <= self.limit:
+            with self._exclusive():
+                self._write_atomically(entry, lambda file: np.save(file, data, allow_pickle=False))
+                if not remembered.exists():
+                    self._write_atomically(remembered, lambda file: file.write(digest.encode()))
+                self._evict()
+            Msg.debug(self.__class__.__qualname__, f"Cached '{extension}' of {path} ({data.nbytes} bytes)")
+
+        return data
+
+    def _files(self) -> Iterator[Path]:
+        """ All entries and remembered hashes in the store. """
+        return itertools.chain(self.directory.glob('*.npy'), (self.directory / 'hashes').iterdir())
+
+    def _evict(self) -> None:
+        """
+        Remove the least recently used files until the store fits into its limit again,
+        and the remembered hashes of contents without any entry left. Needs the lock.
+        """
+        files = []
+        for file in self._files():
+            with contextlib.suppress(OSError):
+                status = file.stat()
+                files.append((status.st_mtime_ns, status.st_size, file))
+
+        total = sum(size for _, size, _ in files)
+        for _, size, file in sorted(files, key=lambda item: item[0]):
+            if total <= self.limit:
+                break
+            with contextlib.suppress(OSError):
+                file.unlink()
+                total -= size
+                Msg.debug(self.__class__.__qualname__, f"Evicted {file.name}")
+
+        digests = {entry.name.partition('-')[0] for entry in self.directory.glob('*.npy')}
+        for remembered in (self.directory / 'hashes').iterdir():
+            with contextlib.suppress(OSError):
+                if remembered.read_text().strip() not in digests:
+                    remembered.unlink()
+
+    @property
+    def size(self) -> int:
+        """ Total size of all entries and remembered hashes currently in the store, in bytes. """
+        total = 0
+        for file in self._files():
+            with contextlib.suppress(OSError):
+                total += file.stat().st_size
+        return total
+
+    def clear(self) -> None:
+        with self._exclusive():
+            for file in self._files():
+                with contextlib.suppress(OSError):
+                    file.unlink()
+
+
+def _default_directory() -> Path:
+    """ Prefer the shared memory file system of the node, so that entries never hit the disk. """
+    root = Path('/dev/shm')
+    if not (root.is_dir() and os.access(root, os.W_OK)):
+        root = Path(tempfile.gettempdir())
+    return root / f"pymetis-cache-{os.getuid()}"
+
+
+def _default_limit(directory: Path) -> int:
+    limit = DEFAULT_CACHE_SIZE
+    if str(directory).startswith('/dev/shm') and (memory := available_memory()) is not None:
+        limit = min(limit, memory // 4)
+    return limit
+
+
+@functools.cache
+def calibration_cache() -> Optional[CalibrationCache]:
+    """
+    Return the calibration cache of this process, configured from the environment,
+    or None if it is disabled (`PYMETIS_CACHE_SIZE=0`) or its directory cannot be used.
+    """
+    directory = Path(os.environ.get(CACHE_DIRECTORY_VARIABLE) or _default_directory())
+    limit = int(os.environ.get(CACHE_SIZE_VARIABLE) or _default_limit(directory))
+    if limit <= 0:
+        return None
+
+    try:
+        return CalibrationCache(directory, limit)
+    except OSError as e:
+        Msg.warning(__name__, f"Calibration cache disabled, cannot use {directory}: {e}")
+        return None
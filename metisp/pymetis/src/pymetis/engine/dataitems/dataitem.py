@@ -23,10 +23,15 @@ import re
 from pathlib import Path
 from typing import Optional, Self, final, Union, ClassVar
 
+import numpy as np
+
 import cpl
 from cpl.core import Msg, Image, Table, ImageList, PropertyList as CplPropertyList
 
+from .fitsindex import fits_index
 from .hdu import Hdu
+from .writer import Compression, NO_COMPRESSION, write_extensions
+from pymetis.engine.core.classes.utilities import profiled
 from pymetis.engine.core.functions.format import partial_format
 from pymetis.engine.core.parameter import ParameterList
 from pymetis.engine.core.parametrizable import ParametrizableItem
@@ -192,6 +197,7 @@ class DataItem(ParametrizableItem, abstract=True):
                   f"and {len(self._hdus) - 1} extensions")
 
     @classmethod
+    @profiled('load_header')
     def load(cls,
              frame: cpl.ui.Frame) -> Self:
         """
@@ -209,66 +215,81 @@ class DataItem(ParametrizableItem, abstract=True):
         structure = {}
         hdus = []
 
-        index = 0
-        while True:
-            try:
-                header = CplPropertyList.load(frame.file, index)
+        # The file is scanned only once, and headers already seen by any other input are reused
+        index = fits_index(frame.file)
 
-                # FixMe: This is a mess... XTENSION should probably not be there.
-                if index == 0:
-                    extname = 'PRIMARY'
-                else:
+        for hdu in index:
+            header = index.header(hdu.index)
+
+            # FixMe: This is a mess... XTENSION should probably not be there.
+            if hdu.index == 0:
+                extname = 'PRIMARY'
+            else:
+                try:
+                    extname = header['EXTNAME'].value
+                except KeyError:
                     try:
-                        extname = header['EXTNAME'].value
+                        # FixMe: this is not reliable but XTENSION is sometimes found in the simulated data
+                        extname = header['XTENSION'].value
                     except KeyError:
-                        try:
-                            # FixMe: this is not reliable but XTENSION is sometimes found in the simulated data
-                            extname = header['XTENSION'].value
-                        except KeyError:
-                            extname = 'PRIMARY'
-
-                subschema = {prop.name: prop.value for prop in header}
-                subtype = {
-                    'IMAGE': Image,
-                    'BINTABLE': Table,
-                    None: None,
-                }[subschema.get('XTENSION', None)]
-
-                if (subtype is None) | (subtype is Image):
-                    if subschema.get('NAXIS', None) == 2:
-                        subtype = Image
-                        Msg.warning(cls.__qualname__,
-                                    f"Found that NAXIS = 2, determining that this HDU should be an Image")
-                    elif subschema.get('NAXIS', None) == 3:
-                        subtype = ImageList
-                        Msg.warning(cls.__qualname__,
-                                    f"Found that NAXIS = 3, determining that this HDU should be an ImageList")
-
-                structure[extname] = subschema
-                structure['klass'] = subtype
-                structure['extno'] = index
-
-                Msg.debug(cls.__qualname__, f"Subtype is {subtype}, structure is {structure}")
-                hdus.append(Hdu(header, None, name=extname, klass=subtype, extno=index))
-
-                Msg.debug(cls.__qualname__, f"Loaded HDU {index} ('{extname}')")
-
-            except cpl.core.DataNotFoundError:
-                if index == 0:
+                        extname = 'PRIMARY'
+
+            subschema = {prop.name: prop.value for prop in header}
+            subtype = {
+                'IMAGE': Image,
+                'BINTABLE': Table,
+                None: None,
+            }[subschema.get('XTENSION', None)]
+
+            if hdu.is_compressed:
+                # Tile-compressed images are stored as binary tables, but read as images
+                subtype = ImageList if hdu.naxis == 3 else Image
+            elif (subtype is None) | (subtype is Image):
+                if subschema.get('NAXIS', None) == 2:
+                    subtype = Image
                     Msg.warning(cls.__qualname__,
-                                f"No HDUs could be found in {frame.file}")
-                else:
-                    Msg.debug(cls.__qualname__,
-                              f"HDU {index} not present, finished loading")
-                break
-            index += 1
+                                f"Found that NAXIS = 2, determining that this HDU should be an Image")
+                elif subschema.get('NAXIS', None) == 3:
+                    subtype = ImageList
+                    Msg.warning(cls.__qualname__,
+                                f"Found that NAXIS = 3, determining that this HDU should be an ImageList")
+
+            structure[extname] = subschema
+            structure['klass'] = subtype
+            structure['extno'] = hdu.index
+
+            Msg.debug(cls.__qualname__, f"Subtype is {subtype}, structure is {structure}")
+            hdus.append(Hdu(header, None, name=extname, klass=subtype, extno=hdu.index))
+
+            Msg.debug(cls.__qualname__, f"Loaded HDU {hdu.index} ('{extname}')")
 
-        primary_header = cpl.core.PropertyList.load(frame.file, 0)
+        primary_header = index.header(0)
 
         return klass(primary_header, *hdus, filename=frame.file)
 
+    def shape(self,
+              extension: int | str) -> tuple[int, int]:
+        """
+        Return the shape (rows, columns) of an image extension as declared in its header,
+        without loading any pixel data.
+
+        Raises
+        ------
+        KeyError
+            If the requested extension is not available or its header does not describe an image
+        """
+        header = self[extension].header
+        try:
+            # Tile-compressed images declare the shape of the image separately from that of the table
+            return header['ZNAXIS2'].value, header['ZNAXIS1'].value
+        except KeyError:
+            return header['NAXIS2'].value, header['NAXIS1'].value
+
+    @profiled('load_data')
     def load_data(self,
-                  extension: int | str) -> Image | Table | ImageList | None:
+                  extension: int | str,
+                  *,
+                  rows: Optional[tuple[int, int]] = None) -> Image | Table | ImageList | None:
         """
         Load the associated data (image or a table).
 
@@ -278,6 +299,9 @@ class DataItem(ParametrizableItem, abstract=True):
         ----------
         extension: int | str
            The extensions, either an integer index or a string EXTNAME.
+        rows: tuple[int, int] | None
+           If provided, only load the half-open range of image rows [first, last) from the file.
+           Only supported for Image extensions.
 
         Returns
         -------
@@ -292,7 +316,18 @@ class DataItem(ParametrizableItem, abstract=True):
 
         try:
             if self[extension].klass == Image:
-                return self[extension].klass.load(self.filename, cpl.core.Type.FLOAT, self._hdus[extension].extno)
+                if rows is None:
+                    return self[extension].klass.load(self.filename, cpl.core.Type.FLOAT, self._hdus[extension].extno)
+                else:
+                    first, last = rows
+                    _, width = self.shape(extension)
+                    # CPL windows are inclusive at both ends
+                    window = cpl.core.Window(0, first, width - 1, last - 1)
+                    return self[extension].klass.load(self.filename, cpl.core.Type.FLOAT, self._hdus[extension].extno,
+                                                      area=window)
+            elif rows is not None:
+                raise TypeError(f"Loading a range of rows is only supported for images, "
+                                f"but extension '{extension}' is {self[extension].klass}")
             elif self[extension].klass == Table:
                 return self[extension].klass.load(self.filename, self._hdus[extension].extno)
             elif self[extension].klass == ImageList:
@@ -304,6 +339,52 @@ class DataItem(ParametrizableItem, abstract=True):
                       f"Failed to load data from extension '{extension}' from file {self.filename}")
             raise exc
 
+    def data_dtype(self,
+                   extension: int | str) -> np.dtype:
+        """
+        Return the native type of the physical pixel values of an image extension, as declared in its header.
+        Images that cannot be read directly are loaded through CPL as `float32`.
+        """
+        hdu = fits_index(self.filename)[self[extension].extno]
+        return hdu.dtype if hdu.is_image or hdu.is_compressed else np.dtype(np.float32)
+
+    def map_data(self,
+                 extension: int | str) -> np.ndarray:
+        """
+        Memory-map an uncompressed image extension as a read-only NumPy array in its stored type,
+        without copying or converting anything. Pixels are only read from disk when accessed.
+
+        Note that BSCALE and BZERO are not applied to the mapped values;
+        use `read_data_into` to obtain physical values in a type of your choice.
+
+        Raises
+        ------
+        KeyError
+            If the requested extension is not available
+        TypeError
+            If the extension does not contain an uncompressed image
+        """
+        return fits_index(self.filename).memmap(self[extension].extno)
+
+    @profiled('load_data')
+    def read_data_into(self,
+                       extension: int | str,
+                       out: np.ndarray,
+                       *,
+                       rows: Optional[tuple[int, int]] = None) -> np.ndarray:
+        """
+        Read the physical pixel values of an image extension straight from the mapped file into `out`,
+        for instance a plane of a preallocated stack. Tile-compressed images are decompressed on the way,
+        only the tiles overlapping `rows` if given. Falls back to `load_data` for images that cannot be mapped.
+        """
+        index = fits_index(self.filename)
+        hdu = index[self[extension].extno]
+        if hdu.is_image or hdu.is_compressed:
+            return index.read_into(hdu.index, out, rows=rows)
+
+        np.copyto(out, self.load_data(extension, rows=rows).as_array(), casting='unsafe')
+        return out
+
     @property
     def used(self) -> bool:
         """ Return whether this data item is actually used in the product. """
@@ -379,7 +460,8 @@ class DataItem(ParametrizableItem, abstract=True):
              recipe: 'PipelineRecipeImpl',
              parameters: ParameterList,
              *,
-             output_file_name: Optional[str] = None) -> None:
+             output_file_name: Optional[str] = None,
+             compression: Compression = NO_COMPRESSION) -> None:
         """
         Save the data item. Implementation depends on the type of the data.
         The body of this method is always called and saves the primary header.
@@ -390,6 +472,8 @@ class DataItem(ParametrizableItem, abstract=True):
             Extra parameters passed to the pipeline recipe.
         :param: output_file_name
             If not None, override the default file name with this.
+        :param: compression
+            How to tile-compress the image extensions, not at all by default.
         """
 
         # TODO: to_cplui is broken in pyesorex 1.0.3, so it is removed; need to put it back someday.
@@ -426,13 +510,17 @@ class DataItem(ParametrizableItem, abstract=True):
             filename,
         )
 
-        self.save_extensions(filename)
+        self.save_extensions(filename, compression=compression)
 
     def save_extensions(self,
-                        filename: str) -> None:
-        """ Save extension data to the same file. Implementation depends on the type of the data. """
-        for name, hdu in self.hdus.items():
-            hdu.save(filename)
+                        filename: str,
+                        *,
+                        compression: Compression = NO_COMPRESSION) -> None:
+        """
+        Save extension data to the same file, streaming all image extensions through a single file handle.
+        Implementation of the others depends on the type of the data.
+        """
+        write_extensions(filename, self.hdus.values(), compression=compression)
 
     def as_dict(self) -> dict[str, str]:
         return {
@@ -0,0 +1,406 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import copy
+import functools
+import math
+import os
+import threading
+from collections import OrderedDict
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Any, Iterator, Optional
+
+import numpy as np
+from astropy.io import fits
+
+import cpl
+from cpl.core import PropertyList as CplPropertyList
+
+
+BLOCK_SIZE = 2880
+CARD_SIZE = 80
+
+# On-disk (big-endian) pixel types of uncompressed images, by BITPIX
+STORED_DTYPES = {
+    8: np.dtype('u1'),
+    16: np.dtype('>i2'),
+    32: np.dtype('>i4'),
+    64: np.dtype('>i8'),
+    -32: np.dtype('>f4'),
+    -64: np.dtype('>f8'),
+}
+
+# Conventional BZERO offsets that turn a stored type into the opposite-signed integer type
+SIGN_OFFSETS = {
+    (8, -128): np.dtype('i1'),
+    (16, 32768): np.dtype('u2'),
+    (32, 2147483648): np.dtype('u4'),
+    (64, 9223372036854775808): np.dtype('u8'),
+}
+
+
+def _parse_value(text: str) -> Any:
+    """
+    Parse the value field of a header card (everything after the value indicator):
+    a quoted string, a logical, an integer or a float. Anything else is returned as stripped text.
+    """
+    text = text.strip()
+    if text.startswith("'"):
+        # Quotes inside a string are escaped by doubling them
+        value, position = [], 1
+        while position < len(text):
+            if text[position] == "'":
+                if text[position + 1:position + 2] == "'":
+                    value.append("'")
+                    position += 2
+                    continue
+                break
+            value.append(text[position])
+            position += 1
+        return ''.join(value).rstrip()
+
+    token = text.split('/', 1)[0].strip()
+    if token == 'T':
+        return True
+    if token == 'F':
+        return False
+    try:
+        return int(token)
+    except ValueError:
+        pass
+    try:
+        return float(token.replace('D', 'E'))
+    except ValueError:
+        return token
+
+
+def _parse_card(card: str) -> Optional[tuple[str, Any]]:
+    """ Split a header card into a keyword and a value, or return None for cards without a value. """
+    if card.startswith('HIERARCH '):
+        keyword, separator, value = card[9:].partition('=')
+        return (keyword.strip(), _parse_value(value)) if separator else None
+
+    keyword = card[:8].strip()
+    if card[8:10] != '= ' or not keyword:
+        return None
+    return keyword, _parse_value(card[10:])
+
+
+@dataclass
+class HduIndex:
+    """
+    Location and structure of a single HDU, as found by scanning its header once.
+    The full set of header cards is only parsed on first access to `keywords`.
+    """
+    index: int
+    header_offset: int
+    data_offset: int
+    data_size: int
+    bitpix: int
+    shape: tuple[int, ...]                  # NAXIS1, NAXIS2, ... in FITS order
+    xtension: Optional[str]
+    extname: Optional[str]
+    cards: bytes = field(repr=False)
+    zbitpix: Optional[int] = None           # ZBITPIX and ZNAXISn of a tile-compressed image, see `is_compressed`
+    zshape: tuple[int, ...] = ()
+
+    @property
+    def is_compressed(self) -> bool:
+        """ Whether this HDU holds a tile-compressed image, stored as a binary table with ZIMAGE = T. """
+        return self.xtension == 'BINTABLE' and len(self.zshape) > 0 and self.zbitpix in STORED_DTYPES
+
+    @property
+    def image_shape(self) -> tuple[int, ...]:
+        """ Shape of the image in FITS order, that of the uncompressed image for compressed HDUs. """
+        return self.zshape if self.is_compressed else self.shape
+
+    @property
+    def image_bitpix(self) -> int:
+        return self.zbitpix if self.is_compressed else self.bitpix
+
+    @property
+    def naxis(self) -> int:
+        """ Number of image axes, also for compressed images. """
+        return len(self.image_shape)
+
+    @property
+    def is_image(self) -> bool:
+        """ Whether this HDU holds an uncompressed image that can be mapped directly. """
+        return self.xtension in (None, 'IMAGE') and self.naxis > 0 and self.bitpix in STORED_DTYPES
+
+    @property
+    def stored_dtype(self) -> np.dtype:
+        """ Type of the pixel values as stored in the file (or before compression), before BSCALE and BZERO are applied. """
+        return STORED_DTYPES[self.image_bitpix]
+
+    @property
+    def scaling(self) -> tuple[float, float]:
+        """ The linear scaling (BSCALE, BZERO) from stored to physical values. """
+        return self.keywords.get('BSCALE', 1), self.keywords.get('BZERO', 0)
+
+    @property
+    def dtype(self) -> np.dtype:
+        """
+        Native type of the physical pixel values: the stored type for unscaled data,
+        the unsigned (or signed) counterpart for the usual sign offsets, and floating point otherwise.
+        """
+        bscale, bzero = self.scaling
+        if (bscale, bzero) == (1, 0):
+            return self.stored_dtype.newbyteorder('=')
+        if bscale == 1 and (dtype := SIGN_OFFSETS.get((self.image_bitpix, bzero))) is not None:
+            return dtype
+        return np.dtype(np.float64 if abs(self.image_bitpix) == 64 else np.float32)
+
+    @functools.cached_property
+    def keywords(self) -> dict[str, Any]:
+        """ All keywords with a value, in the order of the header (later duplicates win). """
+        text = self.cards.decode('ascii', errors='replace')
+        parsed = (_parse_card(text[start:start + CARD_SIZE]) for start in range(0, len(text), CARD_SIZE))
+        return dict(card for card in parsed if card is not None)
+
+
+class FitsIndex:
+    """
+    The structure of a FITS file: offsets, names, types and shapes of all HDUs,
+    found by reading every header block exactly once and skipping over the data.
+
+    Full CPL headers are loaded on demand, at most once per HDU, and handed out as copies.
+    Tile-compressed images are decompressed through a single astropy handle, opened on first use.
+    Use `fits_index` to share indices between all users in the process.
+    """
+    def __init__(self, path: str | Path):
+        self.path = str(path)
+        self.hdus: list[HduIndex] = self._scan(self.path)
+        self._headers: dict[int, CplPropertyList] = {}
+        self._lock = threading.Lock()
+        self._hdulist: Optional[fits.HDUList] = None
+        self._hdulist_lock = threading.Lock()
+
+    @staticmethod
+    def _scan(path: str) -> list[HduIndex]:
+        hdus = []
+        size = os.path.getsize(path)
+
+        with open(path, 'rb') as file:
+            offset = 0
+            while offset + BLOCK_SIZE <= size:
+                file.seek(offset)
+                cards = bytearray()
+                structure = {}
+                end = False
+
+                while not end:
+                    block = file.read(BLOCK_SIZE)
+                    if len(block) < BLOCK_SIZE:
+                        raise cpl.core.BadFileFormatError(f"Truncated FITS header in {path} at byte {offset}")
+                    if not cards and not block.startswith(b'SIMPLE' if not hdus else b'XTENSION'):
+                        if not hdus:
+                            raise cpl.core.BadFileFormatError(f"{path} is not a FITS file")
+                        return hdus         # Trailing bytes that are not an extension
+
+                    for start in range(0, BLOCK_SIZE, CARD_SIZE):
+                        card = block[start:start + CARD_SIZE]
+                        if card.startswith(b'END     ') or card.rstrip() == b'END':
+                            end = True
+                            break
+                        cards += card
+                        # Only the structural keywords are parsed while scanning
+                        if card[:1] in b'BNPGXEZ' and (parsed := _parse_card(card.decode('ascii', errors='replace'))):
+                            if parsed[0] in ('BITPIX', 'NAXIS', 'PCOUNT', 'GCOUNT', 'XTENSION', 'EXTNAME',
+                                             'ZIMAGE', 'ZBITPIX', 'ZNAXIS') \
+                                    or parsed[0].startswith(('NAXIS', 'ZNAXIS')):
+                                structure.setdefault(parsed[0], parsed[1])
+
+                data_offset = file.tell()
+                bitpix = int(structure.get('BITPIX', 8))
+                shape = tuple(int(structure.get(f'NAXIS{axis}', 0)) for axis in range(1, int(structure.get('NAXIS', 0)) + 1))
+                if structure.get('ZIMAGE') is True:
+                    zshape = tuple(int(structure.get(f'ZNAXIS{axis}', 0))
+                                   for axis in range(1, int(structure.get('ZNAXIS', 0)) + 1))
+                else:
+                    zshape = ()
+                # For binary tables (and so compressed images) PCOUNT is the size of the heap
+                if shape:
+                    data_size = abs(bitpix) // 8 * int(structure.get('GCOUNT', 1)) \
+                        * (int(structure.get('PCOUNT', 0)) + math.prod(shape))
+                else:
+                    data_size = 0
+
+                hdus.append(HduIndex(
+                    index=len(hdus),
+                    header_offset=offset,
+                    data_offset=data_offset,
+                    data_size=data_size,
+                    bitpix=bitpix,
+                    shape=shape,
+                    xtension=structure.get('XTENSION'),
+                    extname=structure.get('EXTNAME'),
+                    cards=bytes(cards),
+                    zbitpix=structure.get('ZBITPIX') if zshape else None,
+                    zshape=zshape,
+                ))
+
+                offset = data_offset + math.ceil(data_size / BLOCK_SIZE) * BLOCK_SIZE
+
+        if not hdus:
+            raise cpl.core.BadFileFormatError(f"No HDUs could be found in {path}")
+        return hdus
+
+    def __len__(self) -> int:
+        return len(self.hdus)
+
+    def __iter__(self) -> Iterator[HduIndex]:
+        return iter(self.hdus)
+
+    def __getitem__(self, item: int | str) -> HduIndex:
+        """ Get an HDU by its index or by its EXTNAME. """
+        if isinstance(item, int):
+            return self.hdus[item]
+
+        for hdu in self.hdus:
+            if hdu.extname == item:
+                return hdu
+        raise KeyError(f"No extension '{item}' in {self.path}")
+
+    def memmap(self, item: int | str) -> np.ndarray:
+        """
+        Map the stored pixel values of an uncompressed image HDU as a read-only array in (..., rows, columns) order.
+        Nothing is read until the pixels are accessed. BSCALE and BZERO are *not* applied, see `read_into`.
+
+        Raises
+        ------
+        TypeError
+            If the HDU does not contain an uncompressed image
+        """
+        hdu = self[item]
+        if not hdu.is_image:
+            raise TypeError(f"HDU {hdu.index} of {self.path} is not an uncompressed image")
+        return np.memmap(self.path, dtype=hdu.stored_dtype, mode='r', offset=hdu.data_offset, shape=hdu.shape[::-1])
+
+    def section(self, item: int | str, rows: Optional[tuple[int, int]] = None) -> np.ndarray:
+        """
+        Decompress the physical pixel values of a tile-compressed image HDU, optionally only
+        the half-open range of rows [first, last) (of every plane). Only the tiles overlapping
+        the requested rows are read and decompressed.
+
+        Raises
+        ------
+        TypeError
+            If the HDU does not contain a tile-compressed image
+        """
+        hdu = self[item]
+        if not hdu.is_compressed:
+            raise TypeError(f"HDU {hdu.index} of {self.path} is not a tile-compressed image")
+
+        window = (Ellipsis, slice(*rows), slice(None)) if rows is not None else Ellipsis
+
+        # The astropy file handle is shared, so reads must not interleave
+        with self._hdulist_lock:
+            if self._hdulist is None:
+                self._hdulist = fits.open(self.path, memmap=False, lazy_load_hdus=True)
+            return self._hdulist[hdu.index].section[window]
+
+    def read_into(self,
+                  item: int | str,
+                  out: np.ndarray,
+                  *,
+                  rows: Optional[tuple[int, int]] = None) -> np.ndarray:
+        """
+        Copy the physical pixel values of an image HDU directly from the mapped file into `out`,
+        converting from the stored type (and byte order) and applying BSCALE and BZERO on the way.
+        Tile-compressed images are decompressed instead, see `section`.
+
+        If `rows` is given, only the half-open range of rows [first, last) is read.
+        """
+        hdu = self[item]
+        if hdu.is_compressed:
+            np.copyto(out, self.section(hdu.index, rows), casting='unsafe')
+            return out
+
+        stored = self.memmap(hdu.index)
+        if rows is not None:
+            stored = stored[..., rows[0]:rows[1], :]
+        bscale, bzero = hdu.scaling
+
+        if (bscale, bzero) == (1, 0):
+            np.copyto(out, stored, casting='unsafe')
+        elif out.dtype == hdu.dtype and (hdu.bitpix, bzero) in SIGN_OFFSETS:
+            # The conventional offsets only flip the sign bit of the opposite-signed reinterpretation
+            flipped = np.dtype(stored.dtype.str[0] + ('u' if stored.dtype.kind == 'i' else 'i') + stored.dtype.str[2:])
+            sign_bit = np.array(1 << (8 * stored.itemsize - 1)).astype(flipped)
+            np.bitwise_xor(stored.view(flipped), sign_bit, out=out, casting='unsafe')
+        elif out.dtype.kind == 'f':
+            np.multiply(stored, bscale, out=out, casting='unsafe')
+            np.add(out, bzero, out=out)
+        elif np.can_cast(hdu.dtype, out.dtype):
+            np.add(stored, np.int64(bzero), out=out, casting='unsafe')
+        else:
+            raise TypeError(f"Cannot read scaled data of HDU {hdu.index} of {self.path} into {out.dtype}")
+        return out
+
+    def header(self, item: int | str) -> CplPropertyList:
+        """
+        Return the CPL header of an HDU. It is loaded from the file on first use only;
+        every call returns an independent copy that the caller is free to modify.
+        """
+        index = self[item].index
+        with self._lock:
+            if (header := self._headers.get(index)) is None:
+                header = self._headers[index] = CplPropertyList.load(self.path, index)
+        return copy.deepcopy(header)
+
+
+# Indices hold the parsed headers and possibly an open file, so only the most recently used ones are kept
+CACHE_SIZE = 256
+
+_cache: OrderedDict[str, tuple[tuple[int, int], FitsIndex]] = OrderedDict()
+_cache_lock = threading.Lock()
+
+
+def fits_index(path: str | Path) -> FitsIndex:
+    """
+    Return the structure index of a FITS file, shared by the whole process.
+
+    Indices are keyed by the real path and validated against the size and modification time of the file,
+    so a file rewritten in the meantime is scanned again. Only the `CACHE_SIZE` most recently used are kept.
+    """
+    path = os.path.realpath(path)
+    status = os.stat(path)
+    key = (status.st_size, status.st_mtime_ns)
+
+    with _cache_lock:
+        cached = _cache.get(path)
+        if cached is not None and cached[0] == key:
+            _cache.move_to_end(path)
+            return cached[1]
+
+    index = FitsIndex(path)
+
+    with _cache_lock:
+        _cache[path] = (key, index)
+        _cache.move_to_end(path)
+        while len(_cache) > CACHE_SIZE:
+            _cache.popitem(last=False)
+    return index
+
+
+def load_header(path: str | Path, item: int | str = 0) -> CplPropertyList:
+    """ Shorthand for loading a (by default the primary) header through the shared index. """
+    return fits_index(path).header(item)
@@ -0,0 +1,307 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import contextvars
+import math
+import re
+from concurrent.futures import Future, ThreadPoolExecutor
+from dataclasses import dataclass
+from typing import Any, BinaryIO, Callable, Iterable, Optional
+
+import numpy as np
+from astropy.io import fits
+
+from cpl.core import Image as CplImage, ImageList as CplImageList, Msg
+
+from .fitsindex import BLOCK_SIZE, CARD_SIZE, STORED_DTYPES
+from .hdu import Hdu
+
+
+# Blank cards left free at the end of every extension header written by `write_extensions`,
+# so that keywords (e.g. CHECKSUM and DATASUM) can be added later without moving the data
+RESERVED_CARDS = 8
+
+# Keywords that describe the structure of an HDU: they are derived from the data, never copied from a header
+# (also those of the binary table that holds a tile-compressed image, in case one is saved again)
+STRUCTURAL_KEYWORDS = re.compile(r'^(SIMPLE|XTENSION|BITPIX|NAXIS\d*|EXTEND|PCOUNT|GCOUNT|END|'
+                                 r'BSCALE|BZERO|BLANK|CHECKSUM|DATASUM|'
+                                 r'TFIELDS|TTYPE\d+|TFORM\d+|THEAP|'
+                                 r'ZIMAGE|ZSIMPLE|ZTENSION|ZEXTEND|ZBLOCKED|ZPCOUNT|ZGCOUNT|ZCMPTYPE|ZBITPIX|'
+                                 r'ZNAXIS\d*|ZTILE\d+|ZNAME\d+|ZVAL\d+|ZMASKCMP|ZQUANTIZ|ZDITHER0|'
+                                 r'ZHECKSUM|ZDATASUM)$')
+
+# Number of bytes of pixel data converted to big-endian and written at once
+CHUNK_SIZE = 16 * 2 ** 20
+
+BITPIX = {dtype.newbyteorder('='): bitpix for bitpix, dtype in STORED_DTYPES.items()}
+
+
+@dataclass(frozen=True)
+class Compression:
+    """
+    How image extensions are tile-compressed by `write_extensions`.
+
+    Integer images (data quality, bad pixel and count maps) are always compressed losslessly with Rice.
+    Floating point images are either quantised to `quantize_level` levels per noise sigma
+    (with subtractive dithering that keeps exact zeros) and then Rice compressed, or left exact
+    and compressed with GZIP on shuffled bytes, as Rice cannot compress floats losslessly.
+
+    Every tile spans `tile_rows` full rows of a single plane, so that reading a stripe of rows,
+    as `load_data(rows=...)` does, only decompresses the few tiles overlapping it.
+    """
+    mode: str = 'none'
+    quantize_level: float = 16.0
+    tile_rows: int = 32
+
+    MODES = ('none', 'lossless', 'quantised')
+
+    def __post_init__(self):
+        if self.mode not in self.MODES:
+            raise ValueError(f"Unknown compression mode '{self.mode}', expected one of {self.MODES}")
+        if self.tile_rows < 1:
+            raise ValueError(f"Tiles must have at least one row, got {self.tile_rows}")
+
+    @property
+    def enabled(self) -> bool:
+        return self.mode != 'none'
+
+    def tile_shape(self, data: np.ndarray) -> tuple[int, ...]:
+        """ Shape of the tiles for `data`, in NumPy order. """
+        return (1,) * (data.ndim - 2) + (min(self.tile_rows, data.shape[-2]), data.shape[-1])
+
+    def options(self, data: np.ndarray) -> dict[str, Any]:
+        """ Arguments of `astropy.io.fits.CompImageHDU` for compressing `data`. """
+        options = dict(tile_shape=self.tile_shape(data))
+        if data.dtype.kind in 'iu':
+            # Rice is only defined for integers up to 32 bits
+            options.update(compression_type='RICE_1' if data.dtype.itemsize <= 4 else 'GZIP_2')
+        elif self.mode == 'quantised':
+            options.update(compression_type='RICE_1', quantize_level=self.quantize_level,
+                           quantize_method=fits.hdu.compressed.SUBTRACTIVE_DITHER_2, dither_seed=1)
+        else:
+            options.update(compression_type='GZIP_2', quantize_level=0.0)
+        return options
+
+
+NO_COMPRESSION = Compression()
+
+
+def _format_value(value: Any) -> str:
+    """ Format a value as in the value field of a card, or raise ValueError if FITS cannot represent it. """
+    if isinstance(value, (bool, np.bool_)):
+        return f"{'T' if value else 'F':>20s}"
+    if isinstance(value, (int, np.integer)):
+        return f"{value:>20d}"
+    if isinstance(value, (float, np.floating)):
+        if not math.isfinite(value):
+            raise ValueError(f"Value {value} cannot be represented in a FITS header")
+        text = f"{value:.16G}"
+        if '.' not in text and 'E' not in text:
+            text += '.'
+        return f"{text:>20s}"
+    if isinstance(value, str):
+        escaped = value.replace("'", "''")
+        return f"'{escaped:<8s}'"
+    raise ValueError(f"Value {value!r} of type {type(value)} cannot be represented in a FITS header")
+
+
+def format_card(name: str, value: Any, comment: Optional[str] = None) -> bytes:
+    """
+    Format a single 80-character header card, using the HIERARCH convention for long keywords.
+
+    Raises
+    ------
+    ValueError
+        If the card does not fit into 80 characters (e.g. a long string) or the value cannot be represented.
+    """
+    if name in ('COMMENT', 'HISTORY', ''):
+        card = f"{name:<8s}{'' if value is None else value}"
+    else:
+        key = f"{name:<8s}= " if len(name) <= 8 and ' ' not in name else f"HIERARCH {name} = "
+        card = key + _format_value(value)
+
+        if len(card) > CARD_SIZE:
+            raise ValueError(f"Card {name} = {value!r} does not fit into {CARD_SIZE} characters")
+
+        if comment:
+            card = f"{card} / {comment}"[:CARD_SIZE]
+
+    if len(card) > CARD_SIZE:
+        raise ValueError(f"Card {name} does not fit into {CARD_SIZE} characters")
+
+    return card.ljust(CARD_SIZE).encode('ascii')
+
+
+def _image_data(hdu: Hdu) -> Optional[np.ndarray]:
+    """ The pixels of an image or image list HDU in FITS axis order, or None if it is something else. """
+    if hdu.klass == CplImage:
+        data = np.asarray(hdu.data)
+    elif hdu.klass == CplImageList:
+        data = np.stack([np.asarray(image) for image in hdu.data])
+    else:
+        return None
+
+    return data if data.dtype.newbyteorder('=') in BITPIX else None
+
+
+def _property_cards(hdu: Hdu) -> list[bytes]:
+    """ Cards of all the properties of `hdu.header` that do not describe the structure of the data. """
+    return [format_card(prop.name, prop.value, prop.comment)
+            for prop in hdu.header if not STRUCTURAL_KEYWORDS.match(prop.name)]
+
+
+def encode_header(hdu: Hdu, data: np.ndarray, *, reserved_cards: int = RESERVED_CARDS) -> bytes:
+    """
+    Encode the complete header of an image extension with `data`: the structural keywords,
+    the properties of `hdu.header`, `reserved_cards` blank cards and END, padded to whole blocks.
+
+    Raises
+    ------
+    ValueError
+        If any property cannot be represented as a single card.
+    """
+    cards = [
+        format_card('XTENSION', 'IMAGE', 'Image extension'),
+        format_card('BITPIX', BITPIX[data.dtype.newbyteorder('=')]),
+        format_card('NAXIS', data.ndim),
+        *[format_card(f'NAXIS{axis}', length) for axis, length in enumerate(reversed(data.shape), start=1)],
+        format_card('PCOUNT', 0),
+        format_card('GCOUNT', 1),
+        *_property_cards(hdu),
+    ]
+
+    cards += [b' ' * CARD_SIZE] * reserved_cards
+    cards.append(b'END'.ljust(CARD_SIZE))
+
+    header = b''.join(cards)
+    return header + b' ' * (-len(header) % BLOCK_SIZE)
+
+
+def _write_data(handle: BinaryIO, data: np.ndarray) -> None:
+    """ Write the pixels big-endian in chunks, so that no full-size byte-swapped copy is made, and pad the block. """
+    stored = data.dtype.newbyteorder('>')
+    flat = data.reshape(-1)
+    step = max(1, CHUNK_SIZE // stored.itemsize)
+
+    for first in range(0, flat.size, step):
+        handle.write(flat[first:first + step].astype(stored, copy=False).tobytes())
+
+    handle.write(b'\0' * (-flat.size * stored.itemsize % BLOCK_SIZE))
+
+
+def compress_hdu(hdu: Hdu, data: np.ndarray, compression: Compression) -> fits.CompImageHDU:
+    """
+    Build the tile-compressed counterpart of an image extension with `data`.
+
+    Raises
+    ------
+    ValueError
+        If any property cannot be represented as a single card.
+    """
+    header = fits.Header.fromstring(b''.join(_property_cards(hdu)).decode('ascii'))
+    return fits.CompImageHDU(data, header, name=hdu.name, **compression.options(data))
+
+
+def write_extensions(filename: str,
+                     hdus: Iterable[Hdu],
+                     *,
+                     reserved_cards: int = RESERVED_CARDS,
+                     compression: Compression = NO_COMPRESSION) -> None:
+    """
+    Append `hdus` as extensions to the existing FITS file `filename`, in order.
+
+    Images and image lists are streamed through a single open file handle, with every header encoded
+    in full (including `reserved_cards` spare cards) before it is written, so nothing is ever rewritten.
+    If `compression` is enabled, they are tile-compressed instead and appended through a single
+    astropy handle, see `Compression`.
+    Anything this writer cannot represent (tables, unusual pixel types, headers with values that need
+    more than one card) is appended by CPL instead, as `Hdu.save` does.
+    """
+    handle: Optional[BinaryIO | fits.HDUList] = None
+
+    try:
+        for hdu in hdus:
+            data = _image_data(hdu)
+            encoded = None
+            if data is not None:
+                try:
+                    encoded = compress_hdu(hdu, data, compression) if compression.enabled \
+                        else encode_header(hdu, data, reserved_cards=reserved_cards)
+                except ValueError as e:
+                    Msg.debug(__name__, f"Falling back to CPL for HDU '{hdu.name}': {e}")
+
+            if encoded is None:
+                if handle is not None:
+                    handle.close()
+                    handle = None
+                hdu.save(filename)
+                continue
+
+            if compression.enabled:
+                Msg.debug(__name__, f"Appending HDU '{hdu.name}' to '{filename}' with {compression.mode} compression")
+                if handle is None:
+                    handle = fits.open(filename, mode='append')
+                handle.append(encoded)
+                handle.flush()
+            else:
+                Msg.debug(__name__, f"Streaming HDU '{hdu.name}' to '{filename}'")
+                if handle is None:
+                    handle = open(filename, 'ab')
+                handle.write(encoded)
+                _write_data(handle, data)
+    finally:
+        if handle is not None:
+            handle.close()
+
+
+class ProductWriter:
+    """
+    Save products on a single background thread, in the order they were submitted,
+    so that writing the finished products overlaps with computing the remaining ones.
+
+    Every job runs in a copy of the submitter's context, so its profiler spans nest where it was submitted.
+    Exceptions are raised from `wait`, which must be called before the products are used.
+    """
+    def __init__(self, name: str = 'writer'):
+        self._name = name
+        self._executor: Optional[ThreadPoolExecutor] = None
+        self._futures: list[Future] = []
+
+    def submit(self, function: Callable[..., Any], *args, **kwargs) -> Future:
+        if self._executor is None:
+            self._executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix=self._name)
+
+        future = self._executor.submit(contextvars.copy_context().run, function, *args, **kwargs)
+        self._futures.append(future)
+        return future
+
+    @property
+    def pending(self) -> int:
+        return sum(not future.done() for future in self._futures)
+
+    def wait(self) -> None:
+        """ Wait until all submitted jobs are done and raise the exception of the first failed one, if any. """
+        try:
+            for future in self._futures:
+                future.result()
+        finally:
+            self._futures = []
+            if self._executor is not None:
+                self._executor.shutdown(wait=True, cancel_futures=True)
+                self._executor = None
@@ -17,6 +17,7 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
+import threading
 from abc import abstractmethod
 from typing import Any, Optional, final, Union, ClassVar
 
@@ -84,6 +85,9 @@ class PipelineInput:
         and promote to the most specialized derived class
         depending on the input frameset.
         """
+        # Guards lazy loading of the structure, as detectors may be processed concurrently
+        self._lock = threading.RLock()
+
         assert self.Item is not None, \
             f"Pipeline input {self.__class__.__qualname__} has no defined data item"
 
@@ -17,7 +17,10 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
-from typing import Any, Optional, Self
+from typing import Any, Generator, Optional, Self
+
+import numpy as np
+from numpy.typing import DTypeLike
 
 import cpl
 
@@ -59,21 +62,25 @@ class MultiplePipelineInput(PipelineInput):
         """
         Msg.info(self.__class__.__name__,
                  f"Loading {self.Item.__qualname__} items")
-        if len(self.items) != 0:
-            Msg.debug(self.__class__.__qualname__,
-                      f"Input already loaded, skipping")
-        else:
-            self.items = []
+        with self._lock:
+            if len(self.items) != 0:
+                Msg.debug(self.__class__.__qualname__,
+                          f"Input already loaded, skipping")
+            else:
+                items = []
 
-            for idx, frame in enumerate(self.frameset):
-                Msg.info(self.__class__.__qualname__,
-                         f" - loading input frame #{idx}: {frame.file!r}")
-                self.items.append(self.Item.load(frame))
+                for idx, frame in enumerate(self.frameset):
+                    Msg.info(self.__class__.__qualname__,
+                             f" - loading input frame #{idx}: {frame.file!r}")
+                    items.append(self.Item.load(frame))
+
+                # Only publish the complete list, so that a concurrent reader never sees a partial one
+                self.items = items
 
-            Msg.info(self.__class__.__qualname__,
-                     f"Input Items loaded: {self.items}")
+                Msg.info(self.__class__.__qualname__,
+                         f"Input Items loaded: {self.items}")
 
-            self.use() # FixMe: for now anything that is actually loaded is marked as used
+                self.use() # FixMe: for now anything that is actually loaded is marked as used
 
     def load_data(self, extension: int | str = None) -> ImageList:
         """
@@ -107,6 +114,106 @@ class MultiplePipelineInput(PipelineInput):
 
         return ImageList(images)
 
+    def shape(self, extension: int | str) -> tuple[int, int]:
+        """
+        Return the common shape (rows, columns) of the requested image extension of all items,
+        as declared in their headers. No pixel data are loaded.
+
+        Raises
+        ------
+        cpl.core.BadFileFormatError
+            If the items do not all have the same shape
+        """
+        self.load_structure()
+
+        shapes = [item.shape(extension) for item in self.items]
+        if len(set(shapes)) != 1:
+            msg = f"Image shapes inconsistent: {shapes}"
+            raise cpl.core.BadFileFormatError(msg)
+
+        return shapes[0]
+
+    def iterate_data(self, extension: int | str) -> Generator[Image, None, None]:
+        """
+        Load the requested extension from the items one at a time,
+        so that only a single frame is held in memory at any time.
+        """
+        self.load_structure()
+
+        Msg.info(self.__class__.__qualname__,
+                 f"Streaming extension '{extension}' from multiple frames {self.frameset}")
+
+        for item in self.items:
+            yield item.load_data(extension)
+
+    def load_cube(self,
+                  extension: int | str,
+                  *,
+                  dtype: Optional[DTypeLike] = None,
+                  out: Optional[np.ndarray] = None) -> np.ndarray:
+        """
+        Load the requested extension from all items into a single contiguous (N, H, W) NumPy cube.
+
+        Every plane is filled directly from the memory-mapped file, so no intermediate CPL images
+        or per-frame arrays are created and the raw sequence exists only once in memory.
+
+        Parameters
+        ----------
+        extension:
+            The extension of the items to load, by number or by ``EXTNAME``.
+        dtype:
+            Type of the cube. By default the common native type of all items, e.g. ``uint16`` for raw frames.
+        out:
+            An optional preallocated array of shape (N, H, W) to be filled instead.
+
+        Returns
+        -------
+        np.ndarray
+            The cube; use `pymetis.engine.core.functions.image.as_cpl_image` on a plane if CPL needs it.
+        """
+        height, width = self.shape(extension)
+
+        if out is None:
+            if dtype is None:
+                dtype = np.result_type(*[item.data_dtype(extension) for item in self.items])
+            out = np.empty((len(self.items), height, width), dtype=dtype)
+        elif out.shape != (len(self.items), height, width):
+            raise ValueError(f"Cube of shape {out.shape} does not fit {len(self.items)} frames of {height}x{width}")
+
+        Msg.info(self.__class__.__qualname__,
+                 f"Loading extension '{extension}' from multiple frames {self.frameset} "
+                 f"into a {out.dtype} cube")
+
+        for plane, item in zip(out, self.items):
+            item.read_data_into(extension, plane)
+
+        return out
+
+    def load_data_stripes(self,
+                          extension: int | str,
+                          rows: int) -> Generator[tuple[int, int, ImageList], None, None]:
+        """
+        Load the requested extension from all items in horizontal stripes of at most `rows` rows,
+        so that only one stripe of every frame is held in memory at any time.
+
+        Yields
+        ------
+        (first, last, cpl.core.ImageList)
+            The half-open range of rows [first, last) and the stripes of all frames covering it.
+        """
+        height, _ = self.shape(extension)
+
+        if rows < 1:
+            raise ValueError(f"Stripe height must be at least one row, got {rows}")
+
+        Msg.info(self.__class__.__qualname__,
+                 f"Loading extension '{extension}' from multiple frames {self.frameset} "
+                 f"in stripes of {rows} rows")
+
+        for first in range(0, height, rows):
+            last = min(first + rows, height)
+            yield first, last, ImageList([item.load_data(extension, rows=(first, last)) for item in self.items])
+
     def set_cpl_attributes(self):
         """
         Set the required CPL attributes from the associated ``DataItem``.
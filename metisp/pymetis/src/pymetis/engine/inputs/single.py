@@ -23,7 +23,9 @@ import cpl
 
 from cpl.core import Msg, Image, Table
 
+from pymetis.engine.core.functions.image import as_cpl_image
 from pymetis.engine.dataitems import DataItem
+from pymetis.engine.dataitems.calibcache import calibration_cache
 from pymetis.engine.inputs.input import PipelineInput
 
 
@@ -61,22 +63,34 @@ class SinglePipelineInput(PipelineInput):
 
 
     def load_structure(self) -> None:
-        if self.item is not None:
-            Msg.debug(self.__class__.__qualname__,
-                      f"Input already loaded, skipping")
-        else:
-            Msg.info(self.__class__.__qualname__,
-                     f"Loading single input frame {self.frame.file!r}")
+        with self._lock:
+            if self.item is not None:
+                Msg.debug(self.__class__.__qualname__,
+                          f"Input already loaded, skipping")
+            else:
+                Msg.info(self.__class__.__qualname__,
+                         f"Loading single input frame {self.frame.file!r}")
 
-            self.item = self.Item.load(self.frame)
-            self.use() # FixMe: for now anything that is actually loaded is marked as used (proof-of-concept)
+                self.item = self.Item.load(self.frame)
+                self.use() # FixMe: for now anything that is actually loaded is marked as used (proof-of-concept)
 
     def load_data(self, extension: str = None) -> Union[Image, Table]:
+        """
+        Load an extension of the frame. Images of calibration frames are served by the calibration cache
+        shared with other recipe processes (see `CalibrationCache`), so repeated loads of the same masters
+        are not decoded again.
+        """
         self.load_structure()
 
         Msg.info(self.__class__.__qualname__,
                  f"Loading extension '{extension}' from a single frame {self.frame.file}")
 
+        if (extension is not None
+                and self.Item.frame_group() == cpl.ui.Frame.FrameGroup.CALIB
+                and self.item[extension].klass == Image
+                and (cache := calibration_cache()) is not None):
+            return as_cpl_image(cache.get(self.frame.file, extension, lambda: self.item.load_data(extension)))
+
         return self.item.load_data(extension)
 
     def set_cpl_attributes(self):
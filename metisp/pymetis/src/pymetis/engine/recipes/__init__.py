@@ -18,7 +18,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
 from .recipe import Recipe
-from .impl import RecipeImpl
+from .impl import RecipeImpl, component
 
 
-__all__ = ['Recipe', 'RecipeImpl']
+__all__ = ['Recipe', 'RecipeImpl', 'component']
@@ -16,21 +16,42 @@ You should have received a copy of the GNU General Public License
 along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
+import contextvars
+import os
 import pprint
+import threading
 from abc import abstractmethod, ABC
-from typing import Dict, Any, final, Optional
+from concurrent.futures import ThreadPoolExecutor
+from typing import Dict, Any, final, Optional, ClassVar, Iterable
 
 import cpl
 from cpl.core import Msg
 
+from pymetis.engine.core.classes.utilities import Profiler, profile
+from pymetis.engine.core.functions.resources import available_memory, max_workers
+from pymetis.engine.core.native import set_num_threads
 from pymetis.engine.core.parameter import ParameterList
 from pymetis.engine.core.parametrizable import Parametrizable
 
 from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
+from pymetis.engine.dataitems.writer import Compression, ProductWriter
 from pymetis.engine.inputs.inputset import PipelineInputSet
 from pymetis.engine.qc import QcParameterSet, QcParameter
 
 
+# The detector being processed by `process_detectors` in the current context, or None outside of it
+_current_detector: contextvars.ContextVar[Optional[int]] = contextvars.ContextVar('current_detector', default=None)
+
+
+def component(name: str) -> str:
+    """
+    Return the message component `name`, tagged with the detector being processed in the current context if any,
+    so that the messages of concurrently processed detectors can be told apart.
+    """
+    detector = _current_detector.get()
+    return name if detector is None else f"{name}[DET{detector}]"
+
+
 class RecipeImpl(Parametrizable, ABC):
     """
     An abstract base class for all recipe implementations.
@@ -44,6 +65,19 @@ class RecipeImpl(Parametrizable, ABC):
     # Available parameters are a class variable. This must be present, even if empty.
     parameters = ParameterList([])
 
+    # Whether `process_detectors` may process the detectors concurrently.
+    # Recipes opt in once their `_process_single_detector` only reads shared state.
+    _parallel_detectors: ClassVar[bool] = False
+
+    # Rough ratio of the peak memory needed to process a detector to the size of its share of the input files
+    _detector_memory_factor: ClassVar[float] = 4.0
+
+    # Promoted subclasses, keyed by the implementation and the tag parameters, see `promoted`
+    _promoted: ClassVar[dict[tuple, type['RecipeImpl']]] = {}
+    _promoted_lock: ClassVar[threading.Lock] = threading.Lock()
+    # Tag parameters a promoted subclass was created with, None for the classes defined in code
+    _promotion: ClassVar[Optional[dict[str, Any]]] = None
+
     def __init__(self,
                  recipe: 'Recipe',
                  frameset: cpl.ui.FrameSet,
@@ -60,17 +94,22 @@ class RecipeImpl(Parametrizable, ABC):
         self.header: cpl.core.PropertyList | None = None
         self.products: set[DataItem] = set()
         self.product_frames = cpl.ui.FrameSet()
+        self.writer = ProductWriter(f"{recipe.name}-writer")
+        self._submitted: set[DataItem] = set()
+
+        self.import_settings(settings)                  # Import and process the provided settings dict
+        self.profiler = Profiler(self.name, enabled=self.profiling_enabled())
 
         self.frameset: cpl.ui.FrameSet = frameset
-        self.inputset: PipelineInputSet = self.InputSet(frameset)         # Create an appropriate InputSet object
-        self.inputset.validate()                        # Verify that they are valid (maybe with `schema` too?)
+        with self.profiler.activate(), profile('inputs'):
+            self.inputset: PipelineInputSet = self.InputSet(frameset)     # Create an appropriate InputSet object
+            self.inputset.validate()                    # Verify that they are valid (maybe with `schema` too?)
 
         # Promote the implementation to the correct subclass, based on
         # - tag parameters (from defined mixins, class-based)
         # - tag matches (from the loaded frameset, instance-based)
         # ToDo: Decide what to do in case of a conflict between those two
-        self.promote(**(self.tag_parameters() | self.inputset.tag_matches))
-        self.import_settings(settings)                  # Import and process the provided settings dict
+        self.__class__ = self.promoted(**(self.tag_parameters() | self.inputset.tag_matches))
         self.inputset.print_debug()
         Msg.debug(self.__class__.__qualname__,
                   f"{'-' * 40} Recipe initialization complete {'-' * 40}")
@@ -108,6 +147,31 @@ class RecipeImpl(Parametrizable, ABC):
             Msg.error(cls.__qualname__, e)
             raise e
 
+    @classmethod
+    def promoted(cls, **parameters) -> type['RecipeImpl']:
+        """
+        Return a subclass of this implementation, with its own copies of `ProductSet` and `Qc` promoted
+        to `parameters`. Unlike calling `promote` directly, this leaves the class itself untouched,
+        so that one process can run the recipe any number of times with differently tagged inputs.
+        The subclasses are cached, so every combination of tag parameters is only promoted once.
+        """
+        if cls._promotion is not None:
+            cls = cls.__bases__[0]
+
+        key = (cls, tuple(sorted((name, str(value)) for name, value in parameters.items())))
+        with cls._promoted_lock:
+            if (promoted := cls._promoted.get(key)) is None:
+                promoted = type(cls.__name__, (cls,), {
+                    '__qualname__': cls.__qualname__,
+                    '__module__': cls.__module__,
+                    'ProductSet': type("ProductSet", (cls.ProductSet,), {}),
+                    'Qc': type("Qc", (cls.Qc,), {}),
+                    '_promotion': dict(parameters),
+                })
+                promoted.promote(**parameters)
+                cls._promoted[key] = promoted
+        return promoted
+
     def run(self) -> cpl.ui.FrameSet:
         """
         The main function of the recipe implementation. It mirrors the signature of `Recipe.run`
@@ -119,18 +183,26 @@ class RecipeImpl(Parametrizable, ABC):
         """
 
         try:
-            self.products: set[DataItem] = self.process()   # Do all the actual processing
-            self._save_products()                           # Save the output products
-
-            return self.build_product_frameset()            # Return the output as a pycpl FrameSet
+            with self.profiler.activate():
+                with profile('process'):
+                    self.products: set[DataItem] = self.process()   # Do all the actual processing
+                self._save_products()                               # Save the output products
+                product_frameset = self.build_product_frameset()    # Wait for them and build a pycpl FrameSet
+
+            self._save_profile()
+            return product_frameset
         except cpl.core.DataNotFoundError as e:
             Msg.error(self.__class__.__qualname__,
                       f"Data not found error: {e.message}")
+            self._abandon_products()
             raise e
         except Exception as e:
             Msg.error(self.__class__.__qualname__,
                       f"Unexpected exception occurred: {e}")
+            self._abandon_products()
             raise e
+        finally:
+            self.profiler.finish()
 
     def import_settings(self, settings: Dict[str, Any]) -> None:
         """
@@ -146,6 +218,33 @@ class RecipeImpl(Parametrizable, ABC):
                             f"but class {self.__class__.__qualname__} "
                             f"has no parameter named {key}.")
 
+    def profiling_enabled(self) -> bool:
+        """ Whether the user asked for the run to be profiled, see `Profiler`. """
+        try:
+            return bool(self.parameters[f"{self.name}.profile"].value)
+        except KeyError:
+            return False
+
+    def compression(self) -> Compression:
+        """ How the user asked for the image extensions of the products to be compressed, see `Compression`. """
+        try:
+            return Compression(self.parameters[f"{self.name}.compress"].value)
+        except KeyError:
+            return Compression()
+
+    def _save_profile(self) -> None:
+        """ Close the profile and write it as a JSON sidecar (Chrome trace format) next to the products. """
+        if not self.profiler.enabled:
+            return
+
+        self.profiler.finish()
+        path = self.profiler.write(f"{self.name}_profile.json")
+        Msg.info(self.__class__.__qualname__,
+                 f"Profile written to {path}")
+        for name, total in self.profiler.totals().items():
+            Msg.info(self.__class__.__qualname__,
+                     f"   {name:<24} {total['count']:6d} x {total['wall']:10.3f} s wall {total['cpu']:10.3f} s CPU")
+
     @abstractmethod
     def process(self) -> set[DataItem]:
         """
@@ -179,6 +278,94 @@ class RecipeImpl(Parametrizable, ABC):
         """
         return set()
 
+    def process_detectors(self, detectors: Iterable[int]) -> list[Any]:
+        """
+        Run `self._process_single_detector` for every detector and return the results in the order of `detectors`.
+
+        If the recipe opted in with `_parallel_detectors`, the detectors are dispatched to a pool of threads,
+        at most as many as there are CPUs and as fit in the available memory, see `detector_workers`.
+        The CPUs are split between them: every worker limits the OpenMP threads of the pipeline kernels
+        it calls to its share. Otherwise, the detectors are processed one by one.
+        If any detector fails, the pending ones are cancelled and the exception of the first failed detector
+        (in the order of `detectors`) is raised, exactly as in the serial case.
+        Messages logged with `component` while a detector is processed are tagged with the detector.
+        """
+        detectors = list(detectors)
+        workers = self.detector_workers(len(detectors)) if self._parallel_detectors else 1
+
+        if workers <= 1:
+            return [self._profile_single_detector(detector) for detector in detectors]
+
+        threads = max(1, max_workers() // workers)
+        Msg.info(self.__class__.__qualname__,
+                 f"Processing {len(detectors)} detectors with {workers} worker threads, "
+                 f"{threads} threads each")
+
+        with ThreadPoolExecutor(max_workers=workers, thread_name_prefix=self.name) as executor:
+            # Every worker runs in a copy of the current context, so that its spans nest under the current one
+            futures = {detector: executor.submit(contextvars.copy_context().run,
+                                                 self._profile_single_detector, detector, threads)
+                       for detector in detectors}
+            results = []
+            for detector, future in futures.items():
+                try:
+                    results.append(future.result())
+                except Exception as e:
+                    Msg.error(self.__class__.__qualname__,
+                              f"Processing of detector {detector} failed: {e}")
+                    for pending in futures.values():
+                        pending.cancel()
+                    raise e
+
+        return results
+
+    def _profile_single_detector(self, detector: int, threads: Optional[int] = None) -> Any:
+        if threads is not None:
+            set_num_threads(threads)
+
+        token = _current_detector.set(detector)
+        try:
+            with profile('detector', detector=detector):
+                return self._process_single_detector(detector)
+        finally:
+            _current_detector.reset(token)
+
+    def _process_single_detector(self, detector: int) -> Any:
+        """
+        Process a single detector. Recipes that work detector by detector override this
+        and call `process_detectors` from `process`.
+        """
+        raise NotImplementedError(f"{self.__class__.__qualname__} does not process individual detectors")
+
+    def detector_workers(self, count: int) -> int:
+        """
+        Determine how many of `count` detectors may be processed concurrently:
+        no more than there are CPUs (see `max_workers`) and no more than fit into the available memory,
+        assuming every detector needs `detector_memory_footprint` bytes.
+        """
+        workers = min(count, max_workers())
+
+        footprint = self.detector_memory_footprint(count)
+        if footprint > 0 and (available := available_memory()) is not None:
+            workers = min(workers, available // footprint)
+
+        return max(1, workers)
+
+    def detector_memory_footprint(self, count: int) -> int:
+        """
+        Estimate the peak memory needed to process a single one of `count` detectors, in bytes:
+        its share of all the input files, times `_detector_memory_factor` for conversion to floating point
+        and temporaries. Recipes with a better estimate are welcome to override this.
+        """
+        total = 0
+        for frame in self.frameset:
+            try:
+                total += os.path.getsize(frame.file)
+            except OSError:
+                pass
+
+        return int(self._detector_memory_factor * total / max(count, 1))
+
     def collect_qc_parameters(self, *qc_parameters: QcParameter) -> cpl.core.PropertyList:
         out = cpl.core.PropertyList()
         for qcparam in qc_parameters:
@@ -186,25 +373,65 @@ class RecipeImpl(Parametrizable, ABC):
 
         return out
 
+    @final
+    def submit_product(self, product: DataItem) -> None:
+        """
+        Hand a finished product over to the background writer, so that it is saved while `process`
+        goes on computing the others. Recipes with several products call this from `process`
+        as soon as each of them is complete. The product must not be modified afterwards.
+        It still has to be returned from `process`; `_save_products` will not save it again.
+        """
+        if product in self._submitted:
+            return
+
+        Msg.debug(self.__class__.__qualname__,
+                  f"   {product.name():<40} {product._get_file_name()}")
+
+        # The summary covers everything up to submission
+        if self.profiler.enabled:
+            for keyword, value, comment in self.profiler.summary():
+                product.primary_header.append(cpl.core.Property(keyword, cpl.core.Type.DOUBLE, value, comment))
+
+        self._submitted.add(product)
+        self.writer.submit(self._save_product, product)
+
+    def _save_product(self, product: DataItem) -> None:
+        with profile('save', product=product.name()):
+            product.save(recipe=self, parameters=self.parameters, compression=self.compression())
+
     @final
     def _save_products(self) -> None:
         """
-        Save and register the created products.
+        Save and register the created products, on the background writer.
         """
         assert self.products is not None, "Products have not been created yet!"
 
         Msg.debug(self.__class__.__qualname__,
                   f"Saving {len(self.products)} products:")
+
         for product in self.products:
-            Msg.debug(self.__class__.__qualname__,
-                      f"   {product.name():<40} {product._get_file_name()}")
-            product.save(recipe=self, parameters=self.parameters)
+            self.submit_product(product)
+
+    def _abandon_products(self) -> None:
+        """
+        After a failure, let the background writer finish the products submitted so far,
+        so that no thread outlives the recipe. Errors in saving them are only reported,
+        the exception that stopped the recipe takes precedence.
+        """
+        try:
+            self.writer.wait()
+        except Exception as e:
+            Msg.error(self.__class__.__qualname__,
+                      f"Saving a product failed as well: {e}")
 
     @final
     def build_product_frameset(self) -> cpl.ui.FrameSet:
         """
         Gather all the products and build a FrameSet from their frames so that it can be returned from `run`.
+        Waits for the background writer to save all of them first.
         """
+        self.writer.wait()
+
         Msg.debug(self.__class__.__qualname__,
                   "Building the product frameset")
         return cpl.ui.FrameSet([product.as_frame() for product in self.products])
@@ -23,8 +23,9 @@ from typing import Any, Generator, Self, ClassVar
 import cpl
 from astropy.utils import classproperty
 
-from ..core.parameter import ParameterList
+from ..core.parameter import ParameterList, ParameterValue, ParameterEnum
 from ..dataitems import DataItem
+from ..dataitems.writer import Compression
 from ..qc import QcParameter
 from ..recipes.impl import RecipeImpl
 from ..inputs import PipelineInput
@@ -70,9 +71,37 @@ class Recipe(cpl.ui.PyRecipe):
 
     def __init_subclass__(cls, **kwargs):
         super().__init_subclass__(**kwargs)
+        cls.parameters = cls._with_common_parameters(cls.parameters)
         cls._description: str = cls._build_description()
         cls._registry[cls._name] = cls
 
+    @classmethod
+    def _with_common_parameters(cls, parameters: ParameterList) -> ParameterList:
+        """
+        Add the parameters understood by every recipe to the recipe's own list.
+        Common parameters inherited from a parent recipe are replaced, as their context is the parent's name.
+        """
+        common = ('profile', 'compress')
+        own = [param for param in parameters if param.name not in [f"{param.context}.{name}" for name in common]]
+        return ParameterList([
+            *own,
+            ParameterValue(
+                name=rf"{cls._name}.profile",
+                context=cls._name,
+                description="Profile the recipe: write a Chrome trace of the time, I/O and memory spent "
+                            "in its stages to <recipe>_profile.json and summarise it in the product headers.",
+                default=False,
+            ),
+            ParameterEnum(
+                name=rf"{cls._name}.compress",
+                context=cls._name,
+                description="Tile-compress the image extensions of the products: integer maps are always "
+                            "compressed losslessly, floating point images either losslessly or quantised.",
+                default="none",
+                alternatives=Compression.MODES,
+            ),
+        ])
+
     @classproperty
     def description(cls) -> str:
         return cls._description
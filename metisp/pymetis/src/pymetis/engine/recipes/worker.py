@@ -0,0 +1,305 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import argparse
+import contextlib
+import importlib
+import json
+import os
+import pickle
+import socketserver
+import sys
+import time
+import traceback
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Any, BinaryIO, Iterator, Optional, Sequence
+
+import cpl
+from cpl.core import Msg
+
+from pymetis.engine.recipes.recipe import Recipe
+
+
+# Modules imported once at startup, so that every job finds the recipe registry filled
+DEFAULT_PRELOAD = ('pymetis.instruments.metis.recipes',)
+
+# CPL message levels a job may ask for in its log file
+LOG_LEVELS = ('debug', 'info', 'warning', 'error', 'off')
+
+
+class RequestError(ValueError):
+    """ A request that cannot be turned into a job. """
+
+
+def read_sof(path: str | Path) -> list[tuple[str, str]]:
+    """ Read a set-of-frames file: one `<path> <tag>` per line, lines starting with `#` are comments. """
+    return [(tokens[0], tokens[1])
+            for tokens in (line.split() for line in Path(path).read_text().splitlines())
+            if len(tokens) >= 2 and not tokens[0].startswith('#')]
+
+
+@dataclass
+class Job:
+    """
+    A single recipe invocation requested from the worker.
+
+    Relative paths (of the frames, of the SOF and of the log file) are relative to `output_dir`,
+    which is also the working directory of the recipe, so that a job behaves as `pyesorex` started there.
+    """
+    recipe: str
+    frames: list[tuple[str, str]]
+    parameters: dict[str, Any] = field(default_factory=dict)
+    output_dir: Path = field(default_factory=Path.cwd)
+    log_file: Optional[Path] = None
+    log_level: str = 'info'
+    id: Any = None
+
+    @classmethod
+    def from_request(cls, request: dict[str, Any]) -> 'Job':
+        """
+        Build a job from a decoded request, see `Worker` for its fields.
+        Raises `RequestError` if the request is malformed or names an unknown recipe.
+        """
+        if not isinstance(request, dict):
+            raise RequestError(f"Request must be an object, not {type(request).__name__}")
+
+        if (recipe := request.get('recipe')) is None:
+            raise RequestError("Request does not name a recipe")
+        if recipe not in Recipe._registry:
+            raise RequestError(f"Unknown recipe '{recipe}'")
+
+        output_dir = Path(request.get('output_dir') or Path.cwd()).resolve()
+
+        match request.get('sof'):
+            case str() as sof:
+                try:
+                    frames = read_sof(output_dir / sof)
+                except OSError as e:
+                    raise RequestError(f"Cannot read the SOF: {e}") from e
+            case list() as sof if all(isinstance(item, list) and len(item) == 2 for item in sof):
+                frames = [(str(path), str(tag)) for path, tag in sof]
+            case _:
+                raise RequestError("Request must list its frames in 'sof', "
+                                   "either as the path to a SOF file or as [path, tag] pairs")
+
+        parameters = request.get('parameters') or {}
+        if not isinstance(parameters, dict):
+            raise RequestError("Recipe parameters must be an object mapping their names to values")
+
+        if (log_level := request.get('log_level', 'info')) not in LOG_LEVELS:
+            raise RequestError(f"Unknown log level '{log_level}', expected one of {', '.join(LOG_LEVELS)}")
+
+        log_file = output_dir / request.get('log_file', f"{recipe}.log")
+
+        return cls(recipe, frames, parameters, output_dir, log_file, log_level, request.get('id'))
+
+    def response(self, status: str, **fields) -> dict[str, Any]:
+        return {'id': self.id, 'recipe': self.recipe, 'status': status,
+                'log_file': str(self.log_file)} | fields
+
+
+@contextlib.contextmanager
+def job_log(path: Path, level: str) -> Iterator[None]:
+    """ Send the CPL messages of one job to its own log file, and close it afterwards. """
+    Msg.set_log_name(str(path))
+    Msg.set_log_level(getattr(Msg.SeverityLevel, level.upper()))
+    try:
+        yield
+    finally:
+        Msg.stop_log()
+
+
+def execute(job: Job) -> dict[str, Any]:
+    """
+    Run a job within the current process and describe its outcome.
+    Besides the response, the outcome contains the tag parameters the implementation was promoted with,
+    under `_promotion`, so that the worker can keep the promoted classes warm for later jobs.
+    """
+    start = time.perf_counter()
+    previous = os.getcwd()
+    job.output_dir.mkdir(parents=True, exist_ok=True)
+    os.chdir(job.output_dir)
+
+    try:
+        with job_log(job.log_file, job.log_level):
+            frameset = cpl.ui.FrameSet()
+            for path, tag in job.frames:
+                frameset.append(cpl.ui.Frame(path, tag=tag))
+
+            recipe = Recipe._registry[job.recipe]()
+            # Parameters live in the recipe class, do not let the settings of earlier jobs leak into this one
+            for parameter in recipe.parameters:
+                parameter.value = parameter.default
+
+            try:
+                products = recipe.run(frameset, job.parameters)
+            except Exception as e:
+                Msg.error(job.recipe, f"Recipe failed: {e}\n{traceback.format_exc()}")
+                return job.response('error', type=type(e).__name__, error=str(e),
+                                    wall_time=time.perf_counter() - start)
+
+            return job.response(
+                'ok',
+                products=[{'file': str((job.output_dir / product.file).resolve()), 'tag': product.tag}
+                          for product in products],
+                wall_time=time.perf_counter() - start,
+                _promotion=type(recipe.implementation)._promotion,
+            )
+    finally:
+        os.chdir(previous)
+
+
+class Worker:
+    """
+    A long-lived process that runs recipes on request, so that the interpreter start-up, the imports
+    and the construction of the recipe class hierarchy are paid for only once instead of for every job.
+
+    Requests and responses are JSON objects, one per line. A request contains
+        - `recipe`: the name of the recipe, e.g. "metis_det_dark",
+        - `sof`: the path to a SOF file, or a list of [path, tag] pairs,
+        - `parameters` (optional): recipe parameters by their full name, as `pyesorex` settings,
+        - `output_dir` (optional): the working directory of the job, where the products are written,
+        - `log_file` (optional): the CPL log file of the job, `<recipe>.log` by default,
+        - `log_level` (optional): the level of messages written to the log file, "info" by default,
+        - `id` (optional): anything, returned as is in the response.
+    The response has `status` either "ok", with the absolute paths and tags of the products in `products`,
+    or "error", with the exception `type` and message in `error`. A failing job never stops the worker.
+
+    By default, every job is run in a process forked from the worker. The child inherits all imported modules
+    and promoted classes, while the CPL error state, the log file, the working directory and anything
+    the recipe leaves behind (in class attributes, caches or native memory) die with it.
+    The tag parameters each job was promoted with are sent back, and the worker promotes the same
+    classes for itself, so that later children already find them in the cache (see `RecipeImpl.promoted`).
+    With `isolate=False` jobs run in the worker itself, which is only sensible for debugging.
+    """
+    def __init__(self, *, isolate: bool = True, preload: Sequence[str] = DEFAULT_PRELOAD):
+        for module in preload:
+            importlib.import_module(module)
+        self.isolate = isolate
+        self.jobs = 0
+
+        Msg.info(self.__class__.__qualname__,
+                 f"Worker ready with {len(Recipe._registry)} recipes, "
+                 f"running jobs {'in forked processes' if isolate else 'in process'}")
+
+    def handle(self, line: bytes | str) -> dict[str, Any]:
+        """ Process a single request line and return the response. """
+        request = None
+        try:
+            request = json.loads(line)
+            job = Job.from_request(request)
+        except ValueError as e:
+            identifier = request.get('id') if isinstance(request, dict) else None
+            return {'id': identifier, 'status': 'error', 'type': type(e).__name__, 'error': str(e)}
+
+        self.jobs += 1
+        outcome = self._fork(job) if self.isolate else execute(job)
+
+        if (promotion := outcome.pop('_promotion', None)) is not None:
+            Recipe._registry[job.recipe].Impl.promoted(**promotion)
+        return outcome
+
+    def _fork(self, job: Job) -> dict[str, Any]:
+        """ Run a job in a child process and collect its outcome through a pipe. """
+        receiver, sender = os.pipe()
+        if (pid := os.fork()) == 0:
+            os.close(receiver)
+            try:
+                outcome = execute(job)
+            except BaseException as e:
+                outcome = job.response('error', type=type(e).__name__, error=str(e))
+            with os.fdopen(sender, 'wb') as pipe:
+                pickle.dump(outcome, pipe)
+            os._exit(0)
+
+        os.close(sender)
+        with os.fdopen(receiver, 'rb') as pipe:
+            data = pipe.read()
+        _, status = os.waitpid(pid, 0)
+
+        if not data:
+            return job.response('error', type='ChildProcessError',
+                                error=f"Job process died with status {os.waitstatus_to_exitcode(status)}")
+        return pickle.loads(data)
+
+    def serve(self, requests: BinaryIO, responses: BinaryIO) -> None:
+        """ Answer requests, one per line, until the input is exhausted. """
+        for line in requests:
+            if not line.strip():
+                continue
+            response = self.handle(line)
+            responses.write(json.dumps(response, default=str).encode() + b'\n')
+            responses.flush()
+
+    def serve_stdio(self) -> None:
+        """
+        Serve requests from the standard input. Anything the recipes print is diverted to the standard error,
+        so that the standard output carries only the responses.
+        """
+        responses = os.fdopen(os.dup(sys.stdout.fileno()), 'wb')
+        sys.stdout.flush()
+        os.dup2(sys.stderr.fileno(), sys.stdout.fileno())
+        self.serve(sys.stdin.buffer, responses)
+
+    def serve_socket(self, path: Path) -> None:
+        """ Serve requests from clients connecting to a Unix domain socket at `path`, one client at a time. """
+        worker = self
+
+        class Handler(socketserver.StreamRequestHandler):
+            def handle(self) -> None:
+                worker.serve(self.rfile, self.wfile)
+
+        with contextlib.suppress(FileNotFoundError):
+            path.unlink()
+        with socketserver.UnixStreamServer(str(path), Handler) as server:
+            Msg.info(self.__class__.__qualname__, f"Listening on {path}")
+            try:
+                server.serve_forever()
+            finally:
+                path.unlink(missing_ok=True)
+
+
+def main(argv: Optional[Sequence[str]] = None) -> int:
+    parser = argparse.ArgumentParser(
+        prog='python -m pymetis.engine.recipes.worker',
+        description="Run recipes on request in a warm process. Requests are read as JSON lines "
+                    "from the standard input, or from clients of a Unix domain socket.",
+    )
+    parser.add_argument('--socket', type=Path, default=None,
+                        help="Listen on a Unix domain socket at this path instead of the standard input")
+    parser.add_argument('--inline', action='store_true',
+                        help="Run the jobs in the worker itself instead of forked processes (no isolation)")
+    parser.add_argument('--preload', action='append', default=None,
+                        help=f"Module to import at startup, may be repeated (default: {', '.join(DEFAULT_PRELOAD)})")
+    arguments = parser.parse_args(argv)
+
+    worker = Worker(isolate=not arguments.inline, preload=arguments.preload or DEFAULT_PRELOAD)
+    try:
+        if arguments.socket is None:
+            worker.serve_stdio()
+        else:
+            worker.serve_socket(arguments.socket)
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
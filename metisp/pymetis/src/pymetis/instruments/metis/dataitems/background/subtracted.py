@@ -51,7 +51,15 @@ class LmSciBackgroundSubtracted(TargetSciMixin, LmBackgroundSubtracted):
 
 
 class NBackgroundSubtracted(BandNMixin, BackgroundSubtracted):
-    pass
+    # Chop-nod double differences also carry their errors and the noise of every beam, by nod and chop position
+    _schema = BackgroundSubtracted._schema | {
+        'DET1.ERR': Image,
+        'DET1.DQ': Image,
+        'DET1.NOISE.AA': Image,
+        'DET1.NOISE.AB': Image,
+        'DET1.NOISE.BA': Image,
+        'DET1.NOISE.BB': Image,
+    }
 
 
 class NStdBackgroundSubtracted(TargetStdMixin, NBackgroundSubtracted):
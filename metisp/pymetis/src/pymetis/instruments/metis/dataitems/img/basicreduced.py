@@ -35,6 +35,8 @@ class BasicReduced(ImageDataItem, abstract=True):
     _schema = {
         'PRIMARY': None,
         'DET1.DATA': Image,
+        'DET1.ERR': Image,
+        'DET1.DQ': Image,
     }
 
 
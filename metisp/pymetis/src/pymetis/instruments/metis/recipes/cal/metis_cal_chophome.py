@@ -18,6 +18,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
 import cpl
+import numpy as np
 from cpl.core import Msg
 
 from pymetis.engine.core.parameter import ParameterList, ParameterEnum, ParameterRange
@@ -25,6 +26,7 @@ from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
 from pymetis.engine.qc import QcParameterSet
 from pymetis.engine.recipes import Recipe
 from pymetis.engine.core.functions.dummy import create_dummy_header
+from pymetis.engine.core.functions.psf import measure_psfs
 
 from pymetis.instruments.metis.mixins import BandLmMixin, Detector2rgMixin
 from pymetis.instruments.metis.dataitems.chophome import LmChophomeRaw, LmChophomeCombined, LmChophomeBackground
@@ -148,48 +150,41 @@ class MetisCalChophomeImpl(BandLmMixin, Detector2rgMixin, RawImageProcessor, Met
         -------
         A dictionary with parameters:
         - xcen, ycen : [pix] location of the centroid of the pinhole image
+        - xcenstd, ycenstd : [pix] uncertainty of the centroid, from the background noise
         - fwhm_x, fwhm_y: [pix] full-width at half maximum of the pinhole
                                 image in x- and y-direction
-        - snr: signal-to-noise ratio determined as total flux in window divided
-               by pixel stdev times number of pixels in window
+        - snr: signal-to-noise ratio determined as total background-subtracted flux in window
+               divided by the local background noise of the window sum
 
 
         Note
         ----
-        The function uses a fairly rough algorithm. Its robustness depends on the
+        The pinhole is measured by `measure_psfs`, with the background estimated
+        in an annulus around the window. Its robustness depends on the
         pinhole image having high signal-to-noise without being saturated.
         """
         # Rough location: brightest pixel
         y0, x0 = cimg.get_maxpos()
 
-        # Analyse window around maximum position
-        llx = max(x0 - hwidth, 0)
-        lly = max(y0 - hwidth, 0)
-        urx = min(x0 + hwidth, cimg.shape[1] - 1)
-        ury = min(y0 + hwidth, cimg.shape[0] - 1)
-        win = (llx, lly, urx, ury)
+        data = np.asarray(cimg.as_array(), dtype=np.float32)
+        mask = None if cimg.bpm is None else np.asarray(cimg.bpm, dtype=bool)
+        psf = measure_psfs(data, np.array([[x0, y0]]), mask=mask, half_width=hwidth)
 
-        xcen, ycen = cimg.get_centroid_x(window=win), cimg.get_centroid_y(window=win)
-        fwhm_y, fwhm_x = cimg.get_fwhm(y0, x0)
-
-        # Signal-to-noise ratio using flux over the window and pixel noise over the image
-        flux = cimg.get_flux(win)
-        noise = cimg.get_stdev() * 2 * hwidth
-
-        if fwhm_x is None or fwhm_y is None:
+        fwhm_x, fwhm_y = float(psf.fwhm_x[0]), float(psf.fwhm_y[0])
+        if not (np.isfinite(fwhm_x) and np.isfinite(fwhm_y)):
             Msg.warning(cls.__qualname__,
                         "Detection of pinhole failed")
             fwhm_x = 999.0
             fwhm_y = 999.0
 
         return {
-            "xcen": xcen,
-            "ycen": ycen,
+            "xcen": float(psf.xcen[0]),
+            "ycen": float(psf.ycen[0]),
             "fwhm_x": fwhm_x,
             "fwhm_y": fwhm_y,
-            "xcenstd": 0.0, # ToDo fix
-            "ycenstd": 0.0, # ToDo fix
-            "snr": flux / noise
+            "xcenstd": float(psf.xcen_err[0]),
+            "ycenstd": float(psf.ycen_err[0]),
+            "snr": float(psf.snr[0]),
         }
 
 
@@ -210,7 +205,8 @@ class MetisCalChophome(Recipe):
     _matched_keywords: set[str] = {'DET.DIT', 'DET.NDIT'}
     _algorithm = """
     The position of the pinhole image on the detector is measured from the
-    stacked background-subtracted images. The measured position is compared
+    stacked background-subtracted images, around their brightest pixel
+    (centroid with its uncertainty, FWHM and SNR against the local background). The measured position is compared
     to the WFS metrology to give the chopper home position.
     """
 
@@ -18,15 +18,17 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 import copy
 
-from pymetis.engine.core.parameter import ParameterList, ParameterEnum
+import numpy as np
+
+from pymetis.engine.core.parameter import ParameterList, ParameterEnum, ParameterRange, ParameterValue
 
 # import the dataitems we use
 from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
 from pymetis.engine.qc import QcParameter, QcParameterSet
 from pymetis.instruments.metis.dataitems.distortion import LmDistortionTable
 from pymetis.instruments.metis.dataitems.img.basicreduced import LmSciCalibrated
-#from pymetis.instruments.metis.dataitems.hci import LmOffAxisPsfRaw, LmOnAxisPsfTemplate
-from pymetis.instruments.metis.dataitems.hci.hci import LmRavcCalibrated, LmCvcCalibrated
+#from pymetis.instruments.metis.dataitems.hci import LmOnAxisPsfTemplate
+from pymetis.instruments.metis.dataitems.hci.hci import LmRavcCalibrated, LmCvcCalibrated, LmOffAxisPsfRaw
 from pymetis.instruments.metis.dataitems.hci.hci import AdiCalibrated
 
 
@@ -36,17 +38,21 @@ from pymetis.instruments.metis.dataitems.hci.hci import LmRavcSciDerotated
 from pymetis.instruments.metis.dataitems.hci.hci import LmRavcSciContrastRadprof, LmRavcSciContrastAdi, LmRavcSciThroughput
 from pymetis.instruments.metis.dataitems.hci.hci import LmRavcSciCoverage, LmRavcSciSnr, LmRavcPsfMedian
 from pymetis.engine.recipes import Recipe
-from pymetis.instruments.metis.recipes.prefab import RawImageProcessor
-from pymetis.engine.inputs import RawInput
+from pymetis.instruments.metis.recipes.prefab.img.adi import MetisBaseImgAdiImpl
+from pymetis.instruments.metis.inputs import RawInput
 from pymetis.engine.core.functions.dummy import create_dummy_header, create_dummy_image, create_dummy_table
+from pymetis.engine.core.functions.image import as_cpl_image
+from pymetis.instruments.metis.mixins import Detector2rgMixin, CgrphRavcMixin
 
 
-class MetisLmRavcSciCalibrateImpl(RawImageProcessor):
-    class InputSet(RawImageProcessor.InputSet):
+class MetisLmRavcSciCalibrateImpl(MetisBaseImgAdiImpl):
+    class InputSet(MetisBaseImgAdiImpl.InputSet):
         class RawInput(RawInput):
             Item = LmSciCalibrated
-        #class LmOffAxisPsfRaw(RawInput):
-        #    Item = OffAxisPsf
+
+        class OffAxisPsfInput(MetisBaseImgAdiImpl.InputSet.OffAxisPsfInput):
+            Item = LmOffAxisPsfRaw
+
         #class LmOnAxisPsfTemplate(RawInput):
         #    Item = OnAxisPsfTemplate
 
@@ -66,35 +72,35 @@ class MetisLmRavcSciCalibrateImpl(RawImageProcessor):
         LmSciPsfMedian = LmRavcPsfMedian
 
     class Qc(QcParameterSet):
-        class SciNExp(QcParameter):
+        class SciNExp(Detector2rgMixin, CgrphRavcMixin, QcParameter):
             _name_template = "QC {detector} {cgrph} SCI NEXP"
             _type = int
             _unit = "1"
             _default = None
             _description_template = "Effective number of exposures used to create the ADI data products"
 
-        class SciSnrMean(QcParameter):
+        class SciSnrMean(Detector2rgMixin, CgrphRavcMixin, QcParameter):
             _name_template = "QC {detector} {cgrph} SCI SNR MEAN"
             _type = float
             _unit = "1"
             _default = None
             _description_template = "Mean value in ADI SNR map"
 
-        class SciSnrPeak(QcParameter):
+        class SciSnrPeak(Detector2rgMixin, CgrphRavcMixin, QcParameter):
             _name_template = "QC {detector} {cgrph} SCI SNR PEAK"
             _type = float
             _unit = "1"
             _default = None
             _description_template = "Peak value in ADI SNR map"
 
-        class SciContrastRawLamd(QcParameter):
+        class SciContrastRawLamd(Detector2rgMixin, CgrphRavcMixin, QcParameter):
             _name_template = "QC {detector} {cgrph} SCI CONTRAST RAW LAMD"
             _type = float
             _unit = "mag"
             _default = None
             _description_template = "Raw contrast curve value at separation LAMD LDD"
 
-        class SciContrastAdiLamd(QcParameter):
+        class SciContrastAdiLamd(Detector2rgMixin, CgrphRavcMixin, QcParameter):
             _name_template = "QC {detector} {cgrph} SCI CONTRAST ADI LAMD"
             _type = float
             _unit = "mag"
@@ -109,7 +115,8 @@ class MetisLmRavcSciCalibrateImpl(RawImageProcessor):
             _description_template = "FWHM of the PSF in frame {nn}"
 
     def process(self) -> set[DataItem]:
-        image = self.inputset.raw.load_data('DET1.DATA')[0]
+        adi = self.reduce_adi()
+        image = self.inputset.raw.items[0].load_data('DET1.DATA')
         #image = create_dummy_image()
         table = create_dummy_table()
 
@@ -119,16 +126,11 @@ class MetisLmRavcSciCalibrateImpl(RawImageProcessor):
         header_lmCentroidTable = create_dummy_header()
         header_lmSciSpeckle = create_dummy_header()
         header_lmSciHifilt = create_dummy_header()
-        header_lmSciDerotatedPsfsub = create_dummy_header()
+        header_lmSciDerotatedPsfsub = self.collect_qc_parameters(self.Qc.SciNExp(len(adi.angles)))
         header_lmSciDerotated = create_dummy_header()
-        header_lmSciContrastRadprof = create_dummy_header()
-        header_lmSciContrastAdi = create_dummy_header()
-        header_lmSciThroughput = create_dummy_header()
         header_lmSciCoverage = create_dummy_header()
-        header_lmSciSnr = create_dummy_header()
         header_lmSciPsfMedian = create_dummy_header()
 
-
         product_lmSciCalibrated = self.ProductSet.LmSciCalibrated(
                 copy.deepcopy(primary_header),
                 Hdu(header_lmSciCalibrated, image, name='DET1.DATA'),
@@ -143,7 +145,7 @@ class MetisLmRavcSciCalibrateImpl(RawImageProcessor):
         )
         product_lmSciSpeckle = self.ProductSet.LmSciSpeckle(
                 copy.deepcopy(primary_header),
-                Hdu(header_lmSciSpeckle, image, name='DET1.DATA'),
+                Hdu(header_lmSciSpeckle, as_cpl_image(adi.speckle), name='DET1.DATA'),
         )
         product_lmSciHifilt = self.ProductSet.LmSciHifilt(
                 copy.deepcopy(primary_header),
@@ -151,53 +153,77 @@ class MetisLmRavcSciCalibrateImpl(RawImageProcessor):
         )
         product_lmSciDerotatedPsfsub = self.ProductSet.LmSciDerotatedPsfsub(
                 copy.deepcopy(primary_header),
-                Hdu(header_lmSciDerotatedPsfsub, image, name='DET1.DATA'),
+                Hdu(header_lmSciDerotatedPsfsub, as_cpl_image(adi.derotated_psfsub), name='DET1.DATA'),
         )
         product_lmSciDerotated = self.ProductSet.LmSciDerotated(
                 copy.deepcopy(primary_header),
-                Hdu(header_lmSciDerotated, image, name='DET1.DATA'),
-        )
-        product_lmSciContrastRadprof = self.ProductSet.LmSciContrastRadprof(
-                copy.deepcopy(primary_header),
-                Hdu(header_lmSciContrastRadprof, table, name='DET1.DATA'),
-        )
-        product_lmSciContrastAdi = self.ProductSet.LmSciContrastAdi(
-                copy.deepcopy(primary_header),
-                Hdu(header_lmSciContrastAdi, table, name='DET1.DATA'),
-        )
-        product_lmSciThroughput = self.ProductSet.LmSciThroughput(
-                copy.deepcopy(primary_header),
-                Hdu(header_lmSciThroughput, table, name='DET1.DATA'),
+                Hdu(header_lmSciDerotated, as_cpl_image(adi.derotated), name='DET1.DATA'),
         )
         product_lmSciCoverage = self.ProductSet.LmSciCoverage(
                 copy.deepcopy(primary_header),
-                Hdu(header_lmSciCoverage, image, name='DET1.DATA'),
-        )
-        product_lmSciSnr = self.ProductSet.LmSciSnr(
-                copy.deepcopy(primary_header),
-                Hdu(header_lmSciSnr, image, name='DET1.DATA'),
+                Hdu(header_lmSciCoverage, as_cpl_image(adi.coverage), name='DET1.DATA'),
         )
         product_lmSciPsfMedian = self.ProductSet.LmSciPsfMedian(
                 copy.deepcopy(primary_header),
                 Hdu(header_lmSciPsfMedian, image, name='DET1.DATA'),
         )
 
-        return {
+        reduced = {
             product_lmSciCalibrated,
             product_lmSciCentred,
             product_lmCentroidTable,
+            product_lmSciSpeckle,
             product_lmSciHifilt,
             product_lmSciDerotatedPsfsub,
             product_lmSciDerotated,
+            product_lmSciCoverage,
+            product_lmSciPsfMedian,
+        }
+
+        # The reduced sequence is final: save it while the fake companions are injected and processed
+        for product in reduced:
+            self.submit_product(product)
+
+        contrast = self.evaluate_contrast(adi)
+        table_radprof, table_contrast, table_throughput = self.contrast_tables(contrast)
+
+        # QC contrasts at the requested separation
+        separation = self.parameters[f"{self.name}.contrast.separation"].value * contrast.lamd
+        with np.errstate(divide='ignore', invalid='ignore'):
+            contrast_raw = -2.5 * np.log10(np.interp(separation, contrast.raw.radius, contrast.raw.mean))
+        contrast_adi = np.interp(separation, contrast.curve.separation, contrast.curve.magnitudes) \
+            if len(contrast.curve.separation) else np.nan
+
+        header_lmSciContrastRadprof = self.collect_qc_parameters(self.Qc.SciContrastRawLamd(float(contrast_raw)))
+        header_lmSciContrastAdi = self.collect_qc_parameters(self.Qc.SciContrastAdiLamd(float(contrast_adi)))
+        header_lmSciThroughput = create_dummy_header()
+        header_lmSciSnr = self.collect_qc_parameters(self.Qc.SciSnrMean(float(np.nanmean(contrast.snr))),
+                                                     self.Qc.SciSnrPeak(float(np.nanmax(contrast.snr))))
+
+        product_lmSciContrastRadprof = self.ProductSet.LmSciContrastRadprof(
+                copy.deepcopy(primary_header),
+                Hdu(header_lmSciContrastRadprof, table_radprof, name='DET1.DATA'),
+        )
+        product_lmSciContrastAdi = self.ProductSet.LmSciContrastAdi(
+                copy.deepcopy(primary_header),
+                Hdu(header_lmSciContrastAdi, table_contrast, name='DET1.DATA'),
+        )
+        product_lmSciThroughput = self.ProductSet.LmSciThroughput(
+                copy.deepcopy(primary_header),
+                Hdu(header_lmSciThroughput, table_throughput, name='DET1.DATA'),
+        )
+        product_lmSciSnr = self.ProductSet.LmSciSnr(
+                copy.deepcopy(primary_header),
+                Hdu(header_lmSciSnr, as_cpl_image(contrast.snr), name='DET1.DATA'),
+        )
+
+        return reduced | {
             product_lmSciContrastRadprof,
             product_lmSciContrastAdi,
             product_lmSciThroughput,
-            product_lmSciCoverage,
             product_lmSciSnr,
-            product_lmSciPsfMedian
         }
 
-
 class MetisLmRavcSciCalibrated(Recipe):
     _name: str = "metis_img_adi_cgrph"
     _version: str = "0.1"
@@ -206,9 +232,65 @@ class MetisLmRavcSciCalibrated(Recipe):
     _synopsis: str = "ADI postprocssing"
 
     _matched_keywords: set[str] = {'DRS.FILTER'}
-    _algorithm = """TODO"""
+    _algorithm = """Model the stellar PSF of every frame as the mean frame plus its projection onto
+        the leading principal components of the sequence (randomised SVD, streamed from disk if needed)
+        Subtract the model, derotate the residuals by the parallactic angle and combine them
+        Also combine the PSF models (speckle) and the derotated frames without subtraction
+        Measure the throughput with fake companions injected in one batch and processed with the same
+            principal components and derotation, without reducing the sequence again
+        Compute the raw and 5 sigma post-ADI contrast curves and the SNR map from annular statistics,
+            relative to the star in the off-axis PSF (NaN if it is not given)
+        Remaining products: TODO"""
 
-    parameters = ParameterList([])
+    parameters = ParameterList([
+        ParameterRange(
+            name=f"{_name}.adi.ncomp",
+            context=_name,
+            description="Number of principal components of the PSF model, 0 for classical ADI",
+            default=5,
+            min=0,
+            max=200,
+        ),
+        ParameterEnum(
+            name=f"{_name}.adi.method",
+            context=_name,
+            description="Name of the method used to combine the derotated frames",
+            default="median",
+            alternatives=("average", "median"),
+        ),
+        ParameterValue(
+            name=f"{_name}.adi.memory",
+            context=_name,
+            description="Memory budget for the sequence held at once; larger ones are streamed from disk [MB]",
+            default=4096,
+        ),
+        ParameterValue(
+            name=f"{_name}.contrast.lamd",
+            context=_name,
+            description="Size of lambda/D, the resolution element of the contrast curves [pix]",
+            default=3.7,
+        ),
+        ParameterRange(
+            name=f"{_name}.contrast.branches",
+            context=_name,
+            description="Number of radial lines of fake companions used to measure the throughput",
+            default=4,
+            min=1,
+            max=36,
+        ),
+        ParameterValue(
+            name=f"{_name}.contrast.sigma",
+            context=_name,
+            description="Significance of the detection limits of the contrast curve",
+            default=5.0,
+        ),
+        ParameterValue(
+            name=f"{_name}.contrast.separation",
+            context=_name,
+            description="Separation of the contrast QC parameters [lambda/D]",
+            default=5.0,
+        ),
+    ])
 
     Impl = MetisLmRavcSciCalibrateImpl
 
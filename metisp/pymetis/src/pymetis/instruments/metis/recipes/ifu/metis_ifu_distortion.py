@@ -142,6 +142,8 @@ def create_distortion_table(ext: Literal[1, 2, 3, 4]) -> cpl.core.Table:
 
 
 class MetisIfuDistortionImpl(DetectorIfuMixin, DarkImageProcessor, MetisRecipeImpl):
+    _parallel_detectors = True
+
     class InputSet(DarkImageProcessor.InputSet):
         class MasterDarkInput(MasterDarkInput):
             pass
@@ -223,7 +225,7 @@ class MetisIfuDistortionImpl(DetectorIfuMixin, DarkImageProcessor, MetisRecipeIm
         header_table = create_dummy_header()
         header_reduced = create_dummy_header()
 
-        output = [self._process_single_detector(det) for det in [1, 2, 3, 4]]
+        output = self.process_detectors([1, 2, 3, 4])
 
         product_distortion = self.ProductSet.DistortionTable(
             header_table,
@@ -42,6 +42,8 @@ from pymetis.instruments.metis.qc.reduce import IfuReduceMeanBkg, IfuReduceMeanS
 
 
 class MetisIfuReduceImpl(BandIfuMixin, DetectorIfuMixin, DarkImageProcessor, MetisRecipeImpl):
+    _parallel_detectors = True
+
     class InputSet(DarkImageProcessor.InputSet):
         class RawInput(RawInput):
             Item = IfuRaw
@@ -114,7 +116,7 @@ class MetisIfuReduceImpl(BandIfuMixin, DetectorIfuMixin, DarkImageProcessor, Met
         header_reduced_cube = create_dummy_header()
         header_combined_cube = create_dummy_header()
 
-        output = [self._process_single_detector(det) for det in [1, 2, 3, 4]]
+        output = self.process_detectors([1, 2, 3, 4])
         primary_header = cpl.core.PropertyList()
         raw_images = self.inputset.raw.load_data('DET1.DATA')
         image = self.combine_images(raw_images, "add")
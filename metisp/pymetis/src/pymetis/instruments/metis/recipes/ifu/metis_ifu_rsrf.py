@@ -17,19 +17,24 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
-from typing import Literal
+import hashlib
+import threading
+from collections import OrderedDict
+from typing import ClassVar, Literal, Self
 
 import cpl
 import numpy as np
+from numpy.typing import DTypeLike
 # is this legal?
 from astropy.table import QTable
 from cpl.core import Msg
 
+from pymetis.engine.core.classes.traces import TraceGeometry
 from pymetis.engine.core.functions.dummy import create_dummy_header
-from pymetis.engine.core.parameter import ParameterList, ParameterEnum, ParameterRange
+from pymetis.engine.core.parameter import ParameterList, ParameterEnum, ParameterRange, ParameterValue
 from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
 from pymetis.engine.qc import QcParameterSet, QcParameter
-from pymetis.engine.recipes import Recipe, RecipeImpl
+from pymetis.engine.recipes import Recipe, RecipeImpl, component
 
 from pymetis.instruments.metis.dataitems.badpixmap import BadPixMapIfu
 from pymetis.instruments.metis.dataitems.distortion import IfuDistortionTable
@@ -49,11 +54,12 @@ from pymetis.instruments.metis.qc.reduce import IfuReduceMeanStray, IfuReduceNba
 from pymetis.instruments.metis.recipes.base import MetisRecipeImpl
 from pymetis.instruments.metis.recipes.prefab.darkimage import DarkImageProcessor
 
-ma = np.ma
 EXT = 4  # TODO: update to read multi-extension files and index by EXTNAME instead of integer
 
 
 class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, MetisRecipeImpl):
+    _parallel_detectors = True
+
     class InputSet(DarkImageProcessor.InputSet):
         class RawInput(RawInput):
             Item = IfuRsrfRaw
@@ -145,28 +151,28 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
         wavecal_img = self.inputset.wavecal.load_data(extension=rf'DET{det}')
 
         # create master WCU_OFF background image
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                     f"Creating WCU_OFF background image...")
         background_hdr = cpl.core.PropertyList()
         background_hdr.append(cpl.core.Property("EXTNAME", cpl.core.Type.STRING, rf'DET{det}'))
 
         # self.inputset.background.frameset.dump() # debug
-        bg_images = self.inputset.rsrf_wcu_off.use().load_data(extension=rf'DET{det}.DATA')
-        background_img = self.combine_images(bg_images, self.stackmethod)
+        background_img = self.combine_images_streamed(self.inputset.rsrf_wcu_off.use(), rf'DET{det}.DATA',
+                                                      self.stackmethod, memory_limit=self.memory_limit)
 
         # TODO: define usedframes?
         # TODO: Add product keywords - currently none defined in DRLD
 
         # create 2D flat image (raw images are added together)
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                     f"Creating 2D spectral flat image...")
         spec_flat_hdr = cpl.core.PropertyList()
         spec_flat_hdr.append(cpl.core.Property("EXTNAME", cpl.core.Type.STRING, rf'DET{det}'))
 
         # load RSRF_RAW images, subtract the background and stack them
-        raw_images = self.inputset.raw.use().load_data(extension=rf'DET{det}.DATA')
-        raw_images.subtract_image(background_img)
-        spec_flat_img = self.combine_images(raw_images, self.stackmethod)
+        spec_flat_img = self.combine_images_streamed(self.inputset.raw.use(), rf'DET{det}.DATA',
+                                                     self.stackmethod, memory_limit=self.memory_limit,
+                                                     preprocess=self.subtract_stripe(background_img))
         # propagate badpixel mask
         spec_flat_img.reject_from_mask(badpix_map)
         # TODO: propagate errors
@@ -180,7 +186,7 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
         bb_temp = 800
 
         # create black-body image
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                     f"Creating black-body image...")
         bb_img = create_ifu_blackbody_image(wavecal_img, bb_temp)
 
@@ -188,7 +194,7 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
         raw_level = spec_flat_img.get_max()
         bb_level = bb_img.get_median()
         if bb_level == 0:
-            Msg.warning(self.__class__.__qualname__,
+            Msg.warning(component(self.__class__.__qualname__),
                 "Zero median value for blackbody image, skipping normalisation")
         else:
             bb_img.multiply_scalar(raw_level / bb_level)
@@ -210,7 +216,7 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
         )
 
         # create bad pixel map product
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                     f"Creating bad pixel map...")
         # TODO: FUNC: create updated bad pixel map
         badpix_hdr = cpl.core.PropertyList()
@@ -230,7 +236,7 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
         )
 
         # extract 1D RSRF curves
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                     f"Extracting 1D RSRF curves...")
         rsrf_1d_list = extract_ifu_1d_spectra(spec_flat_img, trace_list,
                                               trace_width=self.extract_hwidth)
@@ -244,7 +250,7 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
         scale = np.mean(rsrf_med)
 
         if scale == 0:
-            Msg.warning(self.__class__.__qualname__,
+            Msg.warning(component(self.__class__.__qualname__),
                 "Zero average scale for RSRF curves, skipping normalisation")
         else:
             for rsrf_1d in rsrf_1d_list:
@@ -274,9 +280,10 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
 
         # load parameters
         self.stackmethod = self.parameters[f"{self.name}.stacking.method"].value
+        self.memory_limit = self.parameters[f"{self.name}.stacking.memory"].value
         self.extract_hwidth = self.parameters[f"{self.name}.extract.hwidth"].value
 
-        output = [self._process_single_detector(det) for det in [1, 2, 3, 4]]
+        output = self.process_detectors([1, 2, 3, 4])
 
         Msg.info(self.__class__.__qualname__,
                     f"Finalising recipe products...")
@@ -307,20 +314,63 @@ class MetisIfuRsrfImpl(DetectorIfuMixin, BandIfuMixin, DarkImageProcessor, Metis
         return {product_background, product_master_flat_ifu, product_rsrf_ifu, product_badpix_map_ifu}
 
 
+class WavelengthLookup:
+    """
+    Index of a wavelength calibration image: the sorted unique wavelengths of all valid pixels
+    and, for every valid pixel, the position of its wavelength in that grid.
+
+    Anything evaluated on the unique grid can then be painted onto the whole image in a single pass.
+    """
+    _cache: ClassVar[OrderedDict[bytes, 'WavelengthLookup']] = OrderedDict()
+    _cache_size: ClassVar[int] = 8
+    _lock: ClassVar[threading.Lock] = threading.Lock()
+
+    def __init__(self, wdata: np.ndarray):
+        self.shape = wdata.shape
+        self.valid = wdata > 0
+        self.wavelengths, self.index = np.unique(wdata[self.valid], return_inverse=True)
+
+    @classmethod
+    def for_image(cls, wdata: np.ndarray) -> Self:
+        """
+        Return the lookup for a wavecal image, reusing the one built for an identical image before
+        (e.g. for another blackbody temperature), so that the search is only ever done once per wavecal product.
+        """
+        key = hashlib.blake2b(np.ascontiguousarray(wdata).tobytes(), digest_size=16).digest() \
+            + repr((wdata.shape, wdata.dtype.str)).encode()
+
+        with cls._lock:
+            if (lookup := cls._cache.get(key)) is not None:
+                cls._cache.move_to_end(key)
+                return lookup
+
+        lookup = cls(wdata)
+
+        with cls._lock:
+            cls._cache[key] = lookup
+            while len(cls._cache) > cls._cache_size:
+                cls._cache.popitem(last=False)
+        return lookup
+
+    def paint(self, values: np.ndarray, dtype: DTypeLike = np.float64) -> np.ndarray:
+        """ Map values given on the unique wavelength grid to an image; invalid pixels are set to zero. """
+        image = np.zeros(self.shape, dtype=dtype)
+        image[self.valid] = np.asarray(values)[self.index]
+        return image
+
+
 def create_ifu_blackbody_image(wavecal_img, bb_temp) -> cpl.core.Image:
     """
     Create a blackbody image from the RSRF image and the wavelength calibration image.
+
+    The blackbody is evaluated only once per unique wavelength and then mapped to all pixels at once.
     """
 
     wdata = wavecal_img.as_array()
 
-    # create a new image to hold the black-body spectrum
-    # each pixel will hold the BB flux at the wavelength of that pixel
-    bb_data = np.zeros_like(wdata)
-
     # create wavelength lookup table [im um]
-    wlookup = np.unique(wdata)[1:]  # remove the first element (0)
-    wavelengths = cpl.core.Vector(wlookup / 1e6)  # Wavelengths in meters
+    lookup = WavelengthLookup.for_image(wdata)
+    wavelengths = cpl.core.Vector(lookup.wavelengths / 1e6)  # Wavelengths in meters
 
     # Calculate the black-body flux at each wavelength
     flux = cpl.drs.photom.fill_blackbody(cpl.drs.photom.Unit.LESS,  # output unit
@@ -328,16 +378,8 @@ def create_ifu_blackbody_image(wavecal_img, bb_temp) -> cpl.core.Image:
                                          cpl.drs.photom.Unit.LENGTH,  # input unit
                                          bb_temp)  # Temperature in Kelvin
 
-    # convert lookup table to vector for binary search functionality
-    wlookup = cpl.core.Vector(wlookup)
-
-    # fill the BB data array with the flux values
-    for i in range(bb_data.shape[0]):
-        for j in range(bb_data.shape[1]):
-            if wdata[i, j] > 0:  # only fill valid pixels
-                # find the index of the closest wavelength in the lookup table
-                # and assign the corresponding flux value
-                bb_data[i, j] = flux[wlookup.binary_search(wdata[i, j])]
+    # each valid pixel holds the BB flux at the wavelength of that pixel
+    bb_data = lookup.paint(np.asarray(flux), dtype=wdata.dtype)
 
     # mask the zero values with the bad-pixel mask to avoid division by zero
     bb_img = cpl.core.Image(bb_data)
@@ -365,24 +407,14 @@ def extract_ifu_1d_spectra(img, trace_list, trace_width: int = 10) -> list:
         A list of 1D spectra extracted from the image.
     """
 
-    # copy data to np.masked_array for processing
-    rej_mask = np.array(img.bpm)  # set bad pixels
-    mdata = ma.masked_array(img.as_array(), mask=rej_mask)
-    imwidth = img.width
+    # TODO: check that traces are within the image bounds (spans are currently clipped to the image)
+    geometry = TraceGeometry.for_traces(trace_list, (img.height, img.width),
+                                        below=trace_width, above=trace_width)
 
-    # TODO: check that traces are within the image bounds
+    # create a list of 1D RSRF curves (width is the image width), averaging the good pixels of every span
+    collapsed = geometry.collapse(img.as_array(), np.array(img.bpm))
 
-    # create a list of 1D RSRF curves (width is the image width)
-    rsrf_1d_list = []
-    for trace in trace_list:
-        x_arr, y_arr = trace[0], trace[1]
-        rsrf_1d = np.zeros(imwidth, dtype=float)
-        for i, x in enumerate(x_arr):
-            yc = y_arr[i]
-            rsrf_1d[int(x)] = mdata[int(yc - trace_width):int(yc + trace_width), int(x)].mean()
-        rsrf_1d_list.append(rsrf_1d)
-
-    return rsrf_1d_list
+    return list(collapsed)
 
 
 class MetisIfuRsrf(Recipe):
@@ -418,6 +450,14 @@ class MetisIfuRsrf(Recipe):
             alternatives=("average", "median"),
             cli_alias="stacking.method",
         ),
+        # --stacking.memory
+        ParameterValue(
+            name=f"{_name}.stacking.memory",
+            context=_name,
+            description="Memory budget for the raw frames held at once while stacking [MB]",
+            cli_alias="stacking.memory",
+            default=2048,
+        ),
         # --extract.hwidth
         ParameterRange(
             name=f"{_name}.extract.hwidth",
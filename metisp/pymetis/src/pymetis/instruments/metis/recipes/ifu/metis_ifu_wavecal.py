@@ -23,6 +23,7 @@ from pymetis.engine.core.parameter import ParameterList, ParameterEnum, Paramete
 
 import numpy as np
 
+from pymetis.engine.core.classes.traces import TraceGeometry
 from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
 from pymetis.engine.qc import QcParameter, QcParameterSet
 from pymetis.engine.core.functions.dummy import create_dummy_header
@@ -37,6 +38,8 @@ from pymetis.instruments.metis.recipes.prefab.darkimage import DarkImageProcesso
 
 
 class MetisIfuWavecalImpl(BandIfuMixin, DetectorIfuMixin, DarkImageProcessor, MetisRecipeImpl):
+    _parallel_detectors = True
+
     class InputSet(DarkImageProcessor.InputSet):
         class RawInput(RawInput):
             Item = IfuWavecalRaw
@@ -109,22 +112,13 @@ class MetisIfuWavecalImpl(BandIfuMixin, DetectorIfuMixin, DarkImageProcessor, Me
         wend =   np.array([3.5823, 3.5547, 3.5541, 3.5820]) # in microns
         wdelta = (wend - wstart) / (imsize_x - 1)
         # linear dispersion model
-        wavelen = np.zeros(imsize_x, dtype=float)
-        for i in range(imsize_x):
-            wavelen[i] = wstart[detector - 1] + i * wdelta[detector - 1]
+        wavelen = wstart[detector - 1] + np.arange(imsize_x) * wdelta[detector - 1]
 
-        # create wavecal image based on distortion table
+        # create wavecal image based on distortion table, painting whole trace spans that fit on the detector
         trc_h = 57 # total trace height is twice this [pix]
-        wc_image = np.zeros(combined_image.shape, dtype=float)
-        for i, trace in enumerate(trace_list):
-            x_coords, y_coords = trace
-            for x, y in zip(x_coords.astype(int), y_coords.astype(int)):
-                if 0 <= x < imsize_x:
-                    y_min = y - trc_h
-                    y_max = y + trc_h
-                    if 0 <= y_min < imsize_y and 0 <= y_max < imsize_y:
-                        for yy in range(y_min, y_max + 1):
-                            wc_image[yy, x] = wavelen[x]
+        geometry = TraceGeometry.for_traces(trace_list, combined_image.shape,
+                                            below=trc_h, above=trc_h + 1, partial=False)
+        wc_image = geometry.paint(wavelen)
 
         # self.correct_telluric()
         # self.apply_fluxcal()
@@ -140,7 +134,7 @@ class MetisIfuWavecalImpl(BandIfuMixin, DetectorIfuMixin, DarkImageProcessor, Me
 
         product_wavecal = self.ProductSet.IfuWavecal(
             primary_header,
-            *map(self._process_single_detector, [1, 2, 3, 4])
+            *self.process_detectors([1, 2, 3, 4])
         )
 
         return {product_wavecal}
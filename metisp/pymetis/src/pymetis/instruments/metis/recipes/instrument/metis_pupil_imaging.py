@@ -23,10 +23,8 @@ You should have received a copy of the GNU General Public License
 along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
-from typing import Optional
-
 import cpl
-from cpl.core import Msg, Image, Table
+from cpl.core import Msg
 
 from pymetis.engine.core.parameter import ParameterList, ParameterEnum
 from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
@@ -69,46 +67,6 @@ class MetisPupilImagingImpl(DarkImageProcessor, MetisRecipeImpl):
     class ProductSet(PipelineProductSet):
         Reduced = PupilImagingReduced
 
-    def prepare_flat(self, flat: Image, bias: Optional[Image]):
-        """ Flat field preparation: subtract bias and normalize it to median 1 """
-        Msg.info(self.__class__.__qualname__, "Preparing flat field")
-
-        if flat is None:
-            raise RuntimeError("No flat frames found in the frameset.")
-        else:
-            if bias is not None:
-                flat.subtract(bias)
-            median = flat.get_median()
-            return flat
-
-            # return flat.divide_scalar(median)
-
-    def prepare_images(self,
-                       raw_frames: cpl.ui.FrameSet,
-                       bias: Optional[Image] = None,
-                       flat: Optional[Image] = None) -> cpl.core.ImageList:
-        prepared_images = cpl.core.ImageList()
-
-        """Prepare the images; bias subtracting and flat fielding"""
-
-        for index, frame in enumerate(raw_frames):
-            Msg.info(self.__class__.__qualname__, f"Processing {frame.file!r}...")
-
-            Msg.debug(self.__class__.__qualname__, f"Loading image {frame.file!r}")
-            raw_image = cpl.core.Image.load(frame.file, extension=1)
-
-            if bias:
-                Msg.debug(self.__class__.__qualname__, "Bias subtracting...")
-                raw_image.subtract(bias)
-
-            if flat:
-                Msg.debug(self.__class__.__qualname__, "Flat fielding...")
-                raw_image.divide(flat)
-
-            prepared_images.append(raw_image)
-
-        return prepared_images
-
     def process(self) -> set[DataItem]:
         """
         Runner for processing images. Currently setup to do dark/bias/flat/gain plus combining images.
@@ -119,10 +77,13 @@ class MetisPupilImagingImpl(DarkImageProcessor, MetisRecipeImpl):
 
         master_flat = self.inputset.master_flat.load_data('DET1.SCI')
         master_dark = self.inputset.master_dark.load_data('DET1.SCI')
-        gain = self.inputset.gain_map.load_data('DET1.SCI')
+        gain = self.detector_gain('DET1.SCI')
+        linearity = self.inputset.linearity.load_data('DET1.SCI')
+        linearity_dq = self.inputset.linearity.load_data('DET1.DQ')
 
-        master_flat = self.prepare_flat(master_flat, master_dark)
-        images = self.prepare_images(self.inputset.raw.frameset, master_flat, master_dark)
+        calibrated_images = self.calibrate_raw_images('DET1.DATA', dark=master_dark, flat=master_flat, gain=gain,
+                                                      linearity=linearity, linearity_dq=linearity_dq)
+        images = cpl.core.ImageList([calibrated.image.data for calibrated in calibrated_images])
         combined_image = self.combine_images(images, self.parameters["metis_pupil_imaging.stacking.method"].value)
         # Copying the header from the primary input causes
         #   TypeMismatchError: CPL error stack trace (most recent error last):
@@ -134,6 +95,8 @@ class MetisPupilImagingImpl(DarkImageProcessor, MetisRecipeImpl):
         # primary_header = cpl.core.PropertyList.load(self.inputset.master_flat.frame.file, 0)
         primary_header = create_dummy_header()
         header_image = create_dummy_header()
+        header_image.append(cpl.core.Property("BUNIT", cpl.core.Type.STRING, self.calibrated_unit(gain),
+                                              "Physical unit"))
 
         product = self.ProductSet.Reduced(
             primary_header,
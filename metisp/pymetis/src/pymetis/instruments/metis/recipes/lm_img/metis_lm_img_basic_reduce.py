@@ -23,7 +23,7 @@ import cpl
 from cpl.core import Msg
 
 from pymetis.engine.core.parameter import ParameterList, ParameterEnum
-from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
+from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet, load_header
 from pymetis.engine.qc import QcParameterSet, QcParameter
 from pymetis.engine.recipes import Recipe
 from pymetis.engine.core.functions.dummy import create_dummy_header
@@ -127,60 +127,43 @@ class MetisLmImgBasicReduceImpl(BandLmMixin, Detector2rgMixin, DarkImageProcesso
 
         flat = self.inputset.master_flat.load_data('DET1.SCI')
         dark = self.inputset.master_dark.load_data('DET1.SCI')
-        gain = self.inputset.gain_map.load_data('DET1.SCI')
+        gain = self.detector_gain('DET1.SCI')
+        unit = self.calibrated_unit(gain)
+        linearity = self.inputset.linearity.load_data('DET1.SCI')
+        linearity_dq = self.inputset.linearity.load_data('DET1.DQ')
 
-        Msg.info(self.__class__.__qualname__, "Loading raw images")
-        images = self.inputset.raw.load_data('DET1.DATA')
         Msg.info(self.__class__.__qualname__, "Pretending to correct crosstalk")
-        Msg.info(self.__class__.__qualname__, "Pretending to correct for linearity")
 
-        Msg.info(self.__class__.__qualname__, "Subtracting Dark")
-        images.subtract_image(dark)
-
-        Msg.info(self.__class__.__qualname__, "Flat fielding")
-        images.divide_image(flat)
+        Msg.info(self.__class__.__qualname__,
+                 "Correcting non-linearity, subtracting dark, flat fielding and calculating noise")
+        calibrated_images = self.calibrate_raw_images('DET1.DATA', dark=dark, flat=flat, gain=gain,
+                                                      linearity=linearity, linearity_dq=linearity_dq)
 
         Msg.info(self.__class__.__qualname__, "Pretending to remove masked regions")
 
-        Msg.info(self.__class__.__qualname__, "Combining Images")
-
-        # combined_image = self.combine_images(images,
-        #                                      self.parameters["metis_lm_img_basic_reduce.stacking.method"].value)
-
         product_set: set[DataItem] = set()
-        for i, image in enumerate(images):
-            frame = self.inputset.raw.frameset[i]
-
+        for frame, calibrated in zip(self.inputset.raw.frameset, calibrated_images):
             Msg.info(self.__class__.__qualname__, f"Processing frame {frame.file}")
 
-            primary_header = cpl.core.PropertyList.load(frame.file, 0)
-
-            Msg.info(self.__class__.__qualname__, "Pretending to calculate noise")
-
-            a = copy.deepcopy(image)
-            noise = cpl.core.Image(image)
-            noise.copy_into(image, 0, 0)
-            noise.power(0.5)
-
-            bmask = cpl.core.Image(a)
-            bmask.copy_into(image, 0, 0)
-            bmask.multiply_scalar(0)
+            primary_header = load_header(frame.file)
+            image = calibrated.image.data
 
-            Msg.info(self.__class__.__qualname__, "Pretending to calculate bad pixels")
-            Msg.info(self.__class__.__qualname__, "Actually Calculating QC Parameters")
-            Msg.info(self.__class__.__qualname__, "Appending QC Parameters to header")
+            Msg.info(self.__class__.__qualname__, "Calculating QC Parameters")
 
             header_reduced = create_dummy_header()
+            header_reduced.append(cpl.core.Property("BUNIT", cpl.core.Type.STRING, unit, "Physical unit"))
             header_reduced.append(cpl.core.Property("QC LM IMG MEDIAN", cpl.core.Type.DOUBLE,
-                                            image.get_median(), "[ADU] median value of image"))
+                                            image.get_median(), f"[{unit}] median value of image"))
             header_reduced.append(cpl.core.Property("QC LM IMG STDEV", cpl.core.Type.DOUBLE,
-                                            image.get_median(), "[ADU] stddev value of image"))
+                                            image.get_stdev(), f"[{unit}] stddev value of image"))
             header_reduced.append(cpl.core.Property("QC LM IMG MAX", cpl.core.Type.DOUBLE,
-                                            image.get_median(), "[ADU] max value of image"))
+                                            image.get_max(), f"[{unit}] max value of image"))
 
             product = self.ProductSet.BasicReduced(
                 copy.deepcopy(primary_header),
                 Hdu(header_reduced, image, name='DET1.DATA'),
+                calibrated.error,
+                calibrated.dq,
             )
             product_set |= {product}
 
@@ -18,7 +18,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
 from pymetis.engine.recipes import Recipe
-from pymetis.engine.core.parameter import ParameterList, ParameterEnum
+from pymetis.engine.core.parameter import ParameterList, ParameterEnum, ParameterValue
 
 from pymetis.instruments.metis.mixins import BandLmMixin, Detector2rgMixin
 from pymetis.instruments.metis.recipes.prefab import MetisBaseImgFlatImpl
@@ -53,6 +53,12 @@ class MetisLmImgFlat(Recipe):
             default="average",
             alternatives=("average", "median"),
         ),
+        ParameterValue(
+            name=f"{_name}.stacking.memory",
+            context=_name,
+            description="Memory budget for the raw frames held at once while stacking [MB]",
+            default=2048,
+        ),
     ])
 
     Impl = MetisLmImgFlatImpl
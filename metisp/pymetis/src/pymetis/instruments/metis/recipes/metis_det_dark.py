@@ -24,17 +24,16 @@ import re
 import numpy as np
 
 from abc import ABC
-from typing import Literal, Dict, Any
+from typing import Literal, Dict, Any, Iterator
 
 import cpl
 from cpl.core import Msg, ImageList, Image, Mask
 
 from pymetis.engine.core.parameter import ParameterList, ParameterEnum, ParameterValue
 
-from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
+from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet, load_header
 from pymetis.engine.qc import QcParameterSet
-from pymetis.engine.recipes import Recipe
-from pymetis.engine.core.functions.image import zeros_like
+from pymetis.engine.recipes import Recipe, component
 from pymetis.engine.core.functions.dummy import create_dummy_header
 from pymetis.instruments.metis.recipes.base import MetisRecipeImpl
 
@@ -45,6 +44,7 @@ from pymetis.instruments.metis.inputs import (RawInput, BadPixMapInput, Persiste
                                               LinearityInput, GainMapInput, OptionalInputMixin)
 from pymetis.instruments.metis.recipes.base import MetisRecipeImpl
 from pymetis.instruments.metis.recipes.prefab import RawImageProcessor
+from pymetis.instruments.metis.recipes.prefab.rawimage import StripeProcessorType
 
 from pymetis.instruments.metis.qc.dark import (DarkMean, DarkMedian, DarkRms, DarkNColdpix, DarkNHotpix, DarkNBadpix,
                                                DarkMedianMedian, DarkMedianMean,
@@ -59,6 +59,10 @@ class MetisDetDarkImpl(PersistenceCorrectionMixin, RawImageProcessor, MetisRecip
     # We start by deriving the implementation class from `MetisRecipeImpl`, or in this case, one of its subclasses,
     # namely `RawImageProcessor, as this recipe processes raw images and we would like to reuse the functionality.
 
+    # The detectors are processed independently of each other (see `_process_single_detector`),
+    # so we allow `process_detectors` to run them concurrently.
+    _parallel_detectors = True
+
     # First of all, we need to define the input set. Since we are deriving from `RawImageProcessor`,
     # we may reuse the `InputSet` class from it too. This automatically adds a `RawInput` for us.
     class InputSet(RawImageProcessor.InputSet):
@@ -148,60 +152,97 @@ class MetisDetDarkImpl(PersistenceCorrectionMixin, RawImageProcessor, MetisRecip
         self.stacking_method = self.parameters["metis_det_dark.stacking.method"].value
         self.kappa_low = self.parameters["metis_det_dark.outliers.kappa_low"].value
         self.kappa_high = self.parameters["metis_det_dark.outliers.kappa_high"].value
+        self.memory_limit = self.parameters["metis_det_dark.stacking.memory"].value
+
+    def raw_corrections(self, detector: Literal[1, 2, 3, 4], gain: Image) -> StripeProcessorType:
+        """
+        Return the corrections of the raw frames of `detector` (nonlinearity, gain and persistence)
+        as a stripe processor, so that they may be applied to stripes or to single frames alike.
+        """
+        linearity_map, linearity_dq = None, None
+        # The linearity map describes the raw counts, so it is applied first
+        if self.inputset.linearity.frame is not None:
+            linearity_map = self.inputset.linearity.load_data(extension=rf'DET{detector:1d}.SCI')
+            linearity_dq = self.inputset.linearity.load_data(extension=rf'DET{detector:1d}.DQ')
+        persistence = self.load_persistence_map()
+
+        def rows(image: Image, first: int, last: int) -> Image:
+            return image.extract(cpl.core.Window(0, first, image.width - 1, last - 1))
+
+        def correct(stripes: ImageList, first: int, last: int) -> ImageList:
+            if linearity_map is not None:
+                stripes = self.correct_nonlinearity(
+                    stripes,
+                    ImageList([rows(plane, first, last) for plane in linearity_map]),
+                    linearity_dq=None if linearity_dq is None else rows(linearity_dq, first, last),
+                )
+            stripes = self.correct_gain(stripes, rows(gain, first, last))
+            return self.correct_persistence(stripes, rows(persistence, first, last))
+
+        return correct
 
     def _process_single_detector(self, detector: Literal[1, 2, 3, 4]) -> list[Hdu]:
         assert detector in [1, 2, 3, 4], \
             f"Unknown detector {detector}"
 
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                  f"Processing detector {detector}")
 
-        raw_images = self.inputset.raw.load_data(extension=f'DET{detector:1d}.DATA')
-
-        # load raw data
+        extension = f'DET{detector:1d}.DATA'
+        height, width = self.inputset.raw.shape(extension)
+        count = len(self.inputset.raw.items)
 
         bad_bit = 1
         cold_bit = 2
         hot_bit = 4
 
-        Msg.info(self.__class__.__qualname__, f"Pretending to load DETLIN")
+        Msg.info(component(self.__class__.__qualname__), f"Pretending to load DETLIN")
 
-        Msg.info(self.__class__.__qualname__, f"Faking a gain map and badpix map")
+        Msg.info(component(self.__class__.__qualname__), f"Faking a gain map and badpix map")
 
         # fake the bp mask by initializing to zero
-        badpix_mask = zeros_like(raw_images[0], cpl.core.Type.FLOAT)
+        badpix_mask = Image.zeros(width, height, cpl.core.Type.FLOAT)
 
         # fake the gain at the moment by setting to 1
-        gain = cpl.core.Image.zeros_like(raw_images[0])
+        gain = Image.zeros(width, height, cpl.core.Type.FLOAT)
         gain.add_scalar(1)
 
-        raw_images = self.correct_gain(raw_images, gain)
-        raw_images = self.correct_persistence(raw_images)
-
-        linearity_map = self.inputset.linearity.load_data(extension=rf'DET{detector:1d}.SCI')
-        raw_images = self.correct_nonlinearity(raw_images, linearity_map)
-
-        if len(raw_images) > 1:
-            Msg.info(self.__class__.__qualname__,
-                     f"Calculating read noise from {len(raw_images)} raw dark frames")
-            diff = cpl.core.Image(raw_images[0])
-            diff.subtract(raw_images[1])
+        # The raw frames are never loaded all at once: they are corrected stripe by stripe for the combination,
+        # and frame by frame for the statistics of the stack
+        correct = self.raw_corrections(detector, gain)
+
+        def corrected_frames() -> Iterator[Image]:
+            for image in self.inputset.raw.iterate_data(extension):
+                yield correct(ImageList([image]), 0, height)[0]
+
+        if count > 1:
+            Msg.info(component(self.__class__.__qualname__),
+                     f"Calculating read noise from {count} raw dark frames")
+            frames = corrected_frames()
+            diff = next(frames)
+            diff.subtract(next(frames))
+            frames.close()
             read_noise = cpl.drs.detector.get_noise_window(diff, None)
         else:
-            Msg.warning(self.__class__.__qualname__,
+            Msg.warning(component(self.__class__.__qualname__),
                         f"Cannot calculate actual read noise as there is only one raw image")
             read_noise = (0, 0)
 
-        combined_image, noise = self.combine_images_with_error(raw_images, self.stacking_method, read_noise[0])
+        Msg.info(component(self.__class__.__qualname__), f"Combining images using method {self.stacking_method!r}")
 
-        Msg.info(self.__class__.__qualname__, f"Combining images using method {self.stacking_method!r}")
+        combined_image, noise = self.combine_images_with_error_streamed(self.inputset.raw, extension,
+                                                                        self.stacking_method, read_noise[0],
+                                                                        memory_limit=self.memory_limit,
+                                                                        preprocess=correct)
 
         mask_hot, mask_cold = self.calculate_outliers(combined_image, kappa_low=self.kappa_low, kappa_high=self.kappa_high)
         qcnhot, qcncold = mask_hot.count(), mask_cold.count()
-        mask_bad = self.metis_bpm_3d_compute(raw_images, kappa_low=self.kappa_low, kappa_high=self.kappa_high)
+        # A single pass over the stack feeds both the 3D bad pixel mask and the per-frame QC parameters
+        moments = self.stack_moments(corrected_frames())
+        mask_bad = self.metis_bpm_3d_compute(moments, kappa_low=self.kappa_low, kappa_high=self.kappa_high)
         qcnbad = mask_bad.count()
 
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                  f"Updating mask: {(mask_cold | mask_hot | mask_bad).count()} pixels masked: "
                  f"{qcnbad} bad + {qcnhot} hot + {qcncold} cold")
         mask_hot = cpl.core.Image(mask_hot, dtype=cpl.core.Type.INT)
@@ -222,26 +263,20 @@ class MetisDetDarkImpl(PersistenceCorrectionMixin, RawImageProcessor, MetisRecip
 
         ## how to copy mask into image?
 
-        Msg.info(self.__class__.__qualname__, "Actually Calculating QC parameters")
-
-        # calculate the stats in each individual image
-        medians = []
-        means = []
-        stdevs = []
-        mins = []
-        maxs = []
-        for im in raw_images:
-            medians.append(im.get_median())
-            means.append(im.get_mean())
-            stdevs.append(im.get_stdev())
-            mins.append(im.get_min())
-            maxs.append(im.get_max())
+        Msg.info(component(self.__class__.__qualname__), "Actually Calculating QC parameters")
+
+        # the stats in each individual image
+        medians = [frame.median for frame in moments.frames]
+        means = [frame.mean for frame in moments.frames]
+        stdevs = [frame.stdev for frame in moments.frames]
+        mins = [frame.min for frame in moments.frames]
+        maxs = [frame.max for frame in moments.frames]
 
         qcmed = combined_image.get_median()
         qcmean = combined_image.get_mean()
         qcrms = combined_image.get_stdev()
 
-        qcncoadd = len(raw_images)
+        qcncoadd = count
 
         qcmedmed = np.median(np.array(medians))
         qcmedrms = np.median(np.array(stdevs))
@@ -249,8 +284,8 @@ class MetisDetDarkImpl(PersistenceCorrectionMixin, RawImageProcessor, MetisRecip
         qcmedmax = np.median(np.array(maxs))
         qcmedmean = np.median(np.array(means))
 
-        header_image = cpl.core.PropertyList.load(self.inputset.raw.frameset[0].file, 0)
-        Msg.info(self.__class__.__qualname__, "Appending QC Parameters to header")
+        header_image = load_header(self.inputset.raw.frameset[0].file)
+        Msg.info(component(self.__class__.__qualname__), "Appending QC Parameters to header")
 
         header_image.append(
             self.collect_qc_parameters(
@@ -289,7 +324,7 @@ class MetisDetDarkImpl(PersistenceCorrectionMixin, RawImageProcessor, MetisRecip
         detector_count = len(list(filter(lambda x: re.match(r'DET[0-9].DATA', x) is not None,
                                   self.inputset.raw.items[0].hdus.keys() - ['PRIMARY'])))
 
-        hdus = functools.reduce(operator.add, map(self._process_single_detector, range(1, detector_count + 1)))
+        hdus = functools.reduce(operator.add, self.process_detectors(range(1, detector_count + 1)))
 
         product = self.ProductSet.MasterDark(
             create_dummy_header(),
@@ -328,6 +363,12 @@ class MetisDetDark(Recipe):
             default="average",
             alternatives=("add", "average", "median", "sigclip"),
         ),
+        ParameterValue(
+            name=f"{_name}.stacking.memory",
+            context=_name,
+            description="Memory budget for the raw frames held at once while stacking [MB]",
+            default=2048,
+        ),
         ParameterValue(
             name=f"{_name}.outliers.kappa_low",
             context=_name,
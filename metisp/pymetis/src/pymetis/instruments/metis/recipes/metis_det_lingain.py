@@ -26,9 +26,10 @@ from cpl.core import Msg
 from numpy._typing import NDArray
 
 from pymetis.engine.core.classes.image import EnhancedImage
-from pymetis.engine.core.classes.utilities import Stopwatch
-from pymetis.engine.core.functions.polyfit import weighted_polyfit
-from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
+from pymetis.engine.core.functions.bootstrap import bootstrap_moments, bootstrap_seed
+from pymetis.engine.core.functions.polyfit import NormalEquations
+from pymetis.engine.core.functions.sigclip import sigma_clip
+from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet, load_header
 from pymetis.engine.qc import QcParameterSet
 from pymetis.engine.core.functions.dummy import create_dummy_header
 from pymetis.engine.recipes import Recipe
@@ -44,7 +45,6 @@ from pymetis.instruments.metis.recipes.prefab import RawImageProcessor
 from pymetis.instruments.metis.qc.lingain import (LinGainMean, LinGainRms, LinNumBadpix, LinMinFlux, LinMaxFlux,
                                                   GainLin, GainCoeff)
 import numpy as np
-import astropy.stats
 
 
 
@@ -79,6 +79,8 @@ class MetisDetLinGainImpl(RawImageProcessor, MetisRecipeImpl):
         self.fitdegree = self.parameters["metis_det_lingain.fitdegree"].value
         self.linlimit = self.parameters["metis_det_lingain.linlimit"].value
         self.truelimit = self.parameters["metis_det_lingain.truelimit"].value
+        self.bootstrap_draws = self.parameters["metis_det_lingain.bootstrap.draws"].value
+        self.bootstrap_seed = bootstrap_seed(self.parameters["metis_det_lingain.bootstrap.seed"].value)
 
         # ToDo Static description. Move this out to instrument/metis, to a static calibration file or even IRDB.
         self.detector_size = 2048
@@ -88,6 +90,8 @@ class MetisDetLinGainImpl(RawImageProcessor, MetisRecipeImpl):
         self.border_ifu_y = 32
 
         self.median_cutoff = 2000
+        self.slit_percentile = 70  # IFU pixels whose 70th percentile over all frames exceeds the cutoff are on a trace
+        self.slit_cutoff = 2000
         self.ipc_alpha0 = 0.02  # alpha_edge EXTERNAL CALIBRATION
         self.ipc_alpha0_prime = 0.002  # alpha_corner EXTERNAL CALIBRATION
 
@@ -174,267 +178,193 @@ class MetisDetLinGainImpl(RawImageProcessor, MetisRecipeImpl):
             raise cpl.core.IllegalInputError(f"Unknown ESO DPR TECH {tech}")
         return self
 
+    def _mean_variance_gain(self, meanflux, varflux) -> float:
+        """
+        Gain from the mean-variance relation of the frame pairs below `linlimit`.
+        """
+        if np.sum(meanflux < self.linlimit) < 2:
+            raise cpl.core.IllegalInputError(
+                "metis_det_lingain (bootstrap iter): not enough data "
+                f"points below linlimit ({self.linlimit}) to determine "
+                "the gain in this bootstrap window. See the comment on "
+                "the equivalent nominal-gain check above.")
+
+        p, cov_p = np.polyfit(meanflux[meanflux < self.linlimit],
+                              varflux[meanflux < self.linlimit],
+                              deg=1, cov=True)
+        return 1 / p[0] * self.gain_correction_factor
+
     def bootstrap_gain_error(
             self,
-            images,
-            fws,
-            dits,
-            sel_mask,
+            samples: dict[int, tuple[np.ndarray, np.ndarray, np.ndarray]],
             *,
             draws: int = 100,
+            seed: int = 0,
     ) -> np.floating[Any]:
         """
         Bootstrap gain error from actual data.
+
+        `samples` maps the index of every usable unique DIT to the vectors of the valid pixels of
+        the mean dark-subtracted flux, the difference of the two ON frames and the difference of the two OFF frames.
+        Every draw resamples the pixels with replacement; as mean and variance only depend on the first two moments,
+        the resampled moments are computed by the bootstrap engine without ever copying the data.
         """
-        storegain = np.zeros(draws)
+        if not samples:
+            raise cpl.core.IllegalInputError("metis_det_lingain: no ON/OFF frame pairs to bootstrap the gain error from")
+
+        indices = list(samples)
+        # Rows: flux, on-difference and its square, off-difference and its square, for every usable DIT
+        rows = np.stack([row
+                         for flux, on_diff, off_diff in samples.values()
+                         for row in (flux, on_diff, on_diff ** 2, off_diff, off_diff ** 2)])
 
-        for i_win in np.arange(draws):
-            window = np.random.choice(np.sum(sel_mask), size=np.sum(sel_mask),
-                                      replace=True)  # this redraws the valid pixels
+        def gain(moments: np.ndarray) -> float:
+            flux, on_mean, on_square, off_mean, off_square = moments.reshape(len(indices), 5).T
             meanflux = np.zeros_like(self.unique_on)
             varflux = np.zeros_like(self.unique_on)
+            meanflux[indices] = flux
+            varflux[indices] = ((on_square - on_mean ** 2) - (off_square - off_mean ** 2)) / 2
+            return self._mean_variance_gain(meanflux, varflux)
 
-            Msg.debug(self.__class__.__qualname__,
-                      f"Bootstrap iteration {i_win:3d} of {draws:3d}")
-
-            for i_on, un_on in enumerate(self.unique_on):
-                if self.unique_on_counts[i_on] >= 2:
-                    # Safe-slice: see note at the equivalent check above.
-                    off_match = self.unique_off_counts[self.unique_off == un_on]
-
-                    if off_match.size > 0 and off_match[0] >= 2:
-                        sel_dits_on, sel_dits_off = self.split_dits(fws, dits, un_on)
-
-                        data_on1 = images[sel_dits_on][0][sel_mask][window]
-                        data_on2 = images[sel_dits_on][1][sel_mask][window]
-                        data_off1 = images[sel_dits_off][0][sel_mask][window]
-                        data_off2 = images[sel_dits_off][1][sel_mask][window]
-
-                        # TODO there should likely also be some logic to compensate the gain for the linearity (see the paper on Euclid detector characterization)
-
-                        # Mortara and Fowler mean-variance method. https://ui.adsabs.harvard.edu/abs/1981SPIE..290...28M/abstract
-
-                        meanflux[i_on] = (np.mean(data_on1 - data_off1) + np.mean(data_on2 - data_off2)) / 2
-                        varflux[i_on] = np.array(np.std(data_on1 - data_on2) ** 2 - np.std(data_off1 - data_off2) ** 2) / 2
-                    else:
-                        Msg.warning(self.__class__.__qualname__, "This combination does not have enough OFF frames")
-                else:
-                    Msg.warning(self.__class__.__qualname__, "This combination does not have enough ON frames")
-
-            if np.sum(meanflux < self.linlimit) < 2:
-                raise cpl.core.IllegalInputError(
-                    "metis_det_lingain (bootstrap iter): not enough data "
-                    f"points below linlimit ({self.linlimit}) to determine "
-                    "the gain in this bootstrap window. See the comment on "
-                    "the equivalent nominal-gain check above.")
-
-            p, cov_p = np.polyfit(meanflux[meanflux < self.linlimit],
-                                  varflux[meanflux < self.linlimit],
-                                  deg=1, cov=True)
-            storegain[i_win] = 1 / p[0] * self.gain_correction_factor
+        Msg.debug(self.__class__.__qualname__,
+                  f"Bootstrapping the gain with {draws} draws of {rows.shape[1]} pixels, seed {seed}")
 
-        return np.std(storegain)
+        return np.std(bootstrap_moments(rows, gain, draws=draws, seed=seed))
 
-    def _reject_outliers(self, linearity, sel_mask, bpm: NDArray) -> NDArray[np.bool_]:
+    def _reject_outliers(self, linearity, fitted, bpm: NDArray) -> NDArray[np.bool_]:
         # Reject pixels whose fitted coefficients are statistical outliers, adding them to the BPM.
         for i in range(self.fitdegree + 1): # check every polynomial coefficient
-            linearity_ma = np.ma.masked_array(linearity[i, :, :], mask=~sel_mask) # only consider pixels with good values
-            bpm += astropy.stats.sigma_clip(linearity_ma, sigma=self.kappa).mask # reject outliers, TODO: need to investigate the HDRL equivalent
-
-        bpm[bpm > 1] = 1 # truncate so it can act as a boolean, maybe this can be done with an OR in the previous line
+            # only consider pixels that were actually fitted: the coefficients of the others are just zero,
+            # clipped around the median as `astropy.stats.sigma_clip` does
+            rejected, _ = sigma_clip(linearity[i], mask=~fitted, centre='median', scale='stdev',
+                                     kappa_low=self.kappa, kappa_high=self.kappa)
+            bpm |= rejected
 
         return bpm
 
-    def _fit_linearity_loop(
+    def _accumulate_linearity(
         self,
-        fluxes_on: NDArray[np.float64],
-        dits_fluxrates: NDArray[np.float64],
-        sel_mask: NDArray[np.bool_],
-    ) -> tuple[NDArray[np.float64], NDArray[np.float64], NDArray[np.bool_]]:
+        fluxes: NDArray[np.float32],
+        dit: float,
+        true_sums: NDArray[np.float64],
+        equations: NormalEquations,
+    ) -> None:
         """
-        Per-pixel linearity fit via an explicit Python loop over the detector.
-
-        For every pixel selected by ``sel_mask`` the correction function (~1 in the linear
-        regime) is fit against flux, using only samples below ``self.linlimit`` and
-        normalising to a weighted-average 'true flux' built from samples below
-        ``self.truelimit``.
-
-        Inputs:
-        - fluxes_on: (N, H, W) on-frame flux cube (not dark-subtracted)
-        - dits_fluxrates: (N,) DIT rate per frame
-        - sel_mask: (H, W) True where the pixel is worth fitting
-        - gaincorrection_factor, gain, read_noise: detector scalars
-
-        Returns ``(linearity, err_linearity, bpm)``:
-        - linearity: (fitdegree+1, H, W) coefficients, highest degree first
-        - err_linearity: (fitdegree+1, H, W) 1-sigma coefficient errors (diagonal only)
-        - bpm: (H, W) bad-pixel mask, initialised from ``~sel_mask`` plus fit failures
-        """
-        n, height, width = fluxes_on.shape
-        linearity = np.zeros((self.fitdegree + 1, height, width))
-        err_linearity = np.zeros((self.fitdegree + 1, height, width))
-        bpm = ~sel_mask
-
-        for i_x in range(0, height):
-
-            # TODO additional optional bad pixel masking should go here
-
-            fluxes_x = fluxes_on[:, i_x, :] # note that for the linearity calculation this is not dark-subtracted.
-
-            if i_x % 64 == 0:
-                Msg.debug(self.__class__.__qualname__,
-                          f"Now at row {i_x:4d} of {height:4d}")
-
-            for i_y in range(0, width):
-                fluxes_x_y = fluxes_x[:, i_y] # working on a subarray is faster than directly indexing the 3D array
-                if sel_mask[i_x, i_y] == 1: # only fit pixels that are not known to be bad
-                    sel = (fluxes_x_y < self.linlimit) # only fit pixel values within the linlimit
-                    truesel = (fluxes_x_y < self.truelimit)
-
-                    if np.sum(sel) < self.fitdegree + 1:
-                        # If there are not enough below-linlimit samples to fit this pixel mark it bad and skip
-                        Msg.debug(self.__class__.__qualname__,
-                                  f"Pixel ({i_x}, {i_y}): too few below-linlimit samples; marking bad")
-                        bpm[i_x, i_y] = 1
-                        continue
-
-                    # Define a weighted average of the pixels below a certain 'true flux' cutoff.
-                    # This defines a weighted average flux rate to which all flux rates are corrected.
-                    trueflux = np.average(
-                        fluxes_x_y[truesel] / dits_fluxrates[truesel],
-                        weights=1 / (np.sqrt(self.gain_correction_factor) *
-                                     np.sqrt(self.read_noise ** 2 + fluxes_x_y[truesel] / (2 * self.gain)) /
-                                     dits_fluxrates[truesel]
-                        )**2
-                    )
+        Add the mean ON flux of a single DIT to the running sums of :meth:`_fit_linearity_streaming`.
 
-                    # define standard error on the weighted average
-                    e_trueflux = np.sqrt(
-                        1 / np.sum(
-                            (1 / np.sqrt(self.gain_correction_factor) *
-                             np.sqrt(self.read_noise **2 + fluxes_x_y[truesel] / (2 * self.gain)) /
-                             dits_fluxrates[truesel])**2
-                        )
-                    )
+        The linearity correction of a sample is corr = trueflux * dit / flux, fitted with the weight
+        fit_w = trueflux / sigma_rate. Both are proportional to the per-pixel 'true flux', which is
+        only known once all DITs have been seen. The normal equations are therefore accumulated
+        for y = dit / flux and w = 1 / sigma_rate, together with the sums that define the true flux,
+        and the true flux is factored back in when solving.
+        """
+        with np.errstate(divide="ignore", invalid="ignore"):
+            sigma_rate = np.sqrt(self.gain_correction_factor) * np.sqrt(self.read_noise ** 2 + fluxes / (2 * self.gain)) / dit
+            true_w = np.where(fluxes < self.truelimit, 1 / sigma_rate ** 2, 0.0)
+            true_sums[0] += true_w * (fluxes / dit)
+            true_sums[1] += true_w
 
-                    # the function that is fit is the correction function (which is ~1 when in the most linear regime) as function of the flux
-                    try:
-                        p, cov_p = np.polyfit(fluxes_x_y[sel],
-                                              trueflux / (fluxes_x_y[sel] / dits_fluxrates[sel]),
-                                              deg=self.fitdegree,
-                                              w=trueflux / (
-                                                  np.sqrt(self.gain_correction_factor) *
-                                                  np.sqrt(self.read_noise ** 2 + fluxes_x_y[sel] / (2 * self.gain)) /
-                                                  dits_fluxrates[sel]
-                                              ),
-                                              cov='unscaled')
-                        linearity[:, i_x, i_y] = p
-                        err_linearity[:, i_x, i_y] = np.sqrt(np.diag(cov_p))
-                        # This ignores the covariance term, but HDRL error propagation doesn't do covariance,
-                        # and it would be hard to store a covariance matrix per pixel as CPL only
-                        # does 3D objects per extension.
-                    except Exception as e:
-                        Msg.debug(self.__class__.__qualname__,
-                                  f"Fitting pixel {i_x}, {i_y} failed: {e}")
-                        bpm[i_x, i_y] = 1 # this pixel failed for some reason, so let's add it to the BPM
-
-        bpm = self._reject_outliers(linearity, sel_mask, bpm)
+            ratio = dit / fluxes
+            weights = 1 / sigma_rate
+        good = (fluxes < self.linlimit) & np.isfinite(ratio) & np.isfinite(weights)
 
-        return linearity, err_linearity, bpm
+        equations.add(fluxes, np.where(good, ratio, 0.0), np.where(good, weights, 0.0))
 
-    def _fit_linearity_vec(
+    def _fit_linearity_streaming(
         self,
-        fluxes_on: NDArray[np.float64],
-        dits_fluxrates: NDArray[np.float64],
+        true_sums: NDArray[np.float64],
+        equations: NormalEquations,
         sel_mask: NDArray[np.bool_],
     ) -> tuple[NDArray[np.float64], NDArray[np.float64], NDArray[np.bool_]]:
         """
-        Vectorized equivalent of :meth:`_fit_linearity_loop`: fits every pixel in a single
-        :func:`weighted_polyfit` call. Same inputs and outputs.
+        Fit the linearity correction of every pixel by solving the normal equations accumulated
+        by :meth:`_accumulate_linearity`, so no (N, H, W) flux cube is ever stored:
+        memory scales with the degree of the fit, not with the number of DITs.
 
-        The below-linlimit cut is ragged across pixels, so it is applied as zero weight
-        rather than by indexing; non-finite corrections (e.g. zero-flux samples) are
-        likewise dropped so they cannot poison a pixel's fit.
+        With the true flux T factored out the normal equations read (T^2 U) c = T^3 r, so the
+        coefficients are T times those of U c = r and their variances are divided by T^2.
+        The condition number does not depend on T, so the same fits are flagged as bad.
         """
-        n, height, width = fluxes_on.shape
-        linearity: NDArray[np.float64] = np.zeros((self.fitdegree + 1, height, width))
-        err_linearity: NDArray[np.float64] = np.zeros((self.fitdegree + 1, height, width))
+        linearity: NDArray[np.float64] = np.zeros((self.fitdegree + 1, *sel_mask.shape))
+        err_linearity: NDArray[np.float64] = np.zeros((self.fitdegree + 1, *sel_mask.shape))
         bpm: NDArray[np.bool_] = ~sel_mask
 
-        dits = dits_fluxrates[:, None, None]                     # (N, 1, 1)
-        flux_rate = fluxes_on / dits                             # (N, H, W)
-        sel = fluxes_on < self.linlimit                          # samples used in the fit
-        truesel = fluxes_on < self.truelimit                     # samples used for the trueflux average
-
         with np.errstate(divide="ignore", invalid="ignore"):
-            # Weighted-average flux rate ('true flux') per pixel, over samples below truelimit.
-            true_w = np.where(
-                truesel,
-                1 / (np.sqrt(self.gain_correction_factor) *
-                     np.sqrt(self.read_noise ** 2 + fluxes_on / (2 * self.gain)) / dits) ** 2,
-                0.0,
-            )
-            trueflux = np.sum(true_w * flux_rate, axis=0) / np.sum(true_w, axis=0)   # (H, W)
-
-            # Standard error on the weighted average (per pixel)
-            # FixMe This is not used anywhere!
-            e_trueflux = np.sqrt(1 / np.sum(
-                np.where(
-                    truesel,
-                    (1 / np.sqrt(self.gain_correction_factor) *
-                     np.sqrt(self.read_noise ** 2 + fluxes_on / (2 * self.gain)) / dits) ** 2,
-                    0.0,
-                ),
-                axis=0,
-            ))                                                   # (H, W)
-
-            corr = trueflux[None] / flux_rate                    # (N, H, W)
-            fit_w = trueflux[None] / (np.sqrt(self.gain_correction_factor) *
-                                      np.sqrt(self.read_noise ** 2 + fluxes_on / (2 * self.gain)) / dits)
-        good = sel & np.isfinite(corr) & np.isfinite(fit_w)
-
-        p, cov_p, ok = weighted_polyfit(fluxes_on, np.where(good, corr, 0.0),
-                                        deg=self.fitdegree, weights=np.where(good, fit_w, 0.0))
-        linearity[:] = p
-        # Per-pixel 1-sigma coefficient errors (diagonal of each pixel's covariance matrix).
-        err_linearity[:] = np.moveaxis(np.sqrt(np.diagonal(cov_p, axis1=0, axis2=1)), -1, 0)
-
-        # Adds pixels to the bad pixel map, if
-        # - they are in the selection
-        # - are under-determined (there are fewer usable samples than fitdegree + 1)
-        # - or are marked as unfittable by weighted_polyfit
-        bpm[sel_mask & ((good.sum(axis=0) < self.fitdegree + 1) | ~ok)] = 1
+            trueflux = true_sums[0] / true_sums[1]
 
-        # Reject pixels whose fitted coefficients are statistical outliers, adding them to the BPM.
-        for i in range(self.fitdegree + 1): # check every polynomial coefficient
-            linearity_ma = np.ma.masked_array(linearity[i, :, :], mask=~sel_mask) # only consider pixels with good values
-            bpm += astropy.stats.sigma_clip(linearity_ma, sigma=self.kappa).mask # reject outliers, TODO: need to investigate the HDRL equivalent
+        p, var_p, ok = equations.solve()
+
+        # Without a finite true flux no sample is usable, with a zero one all weights vanish
+        usable = np.isfinite(trueflux)
+        ok &= usable & (trueflux != 0)
+        fitted = ok & sel_mask
+
+        linearity[:, fitted] = p[:, fitted] * trueflux[fitted]
+        err_linearity[:, fitted] = np.sqrt(var_p[:, fitted]) / np.abs(trueflux[fitted])
 
-        bpm = self._reject_outliers(linearity, sel_mask, bpm)
+        # Same criteria as the other versions: under-determined or unfittable pixels are bad
+        count = np.where(usable, equations.count, 0)
+        bpm[sel_mask & ((count < self.fitdegree + 1) | ~ok)] = 1
+
+        bpm = self._reject_outliers(linearity, fitted, bpm)
 
         return linearity, err_linearity, bpm
 
+    def _update_slit_statistics(self, frame: NDArray[np.float32], statistics: tuple[NDArray, NDArray, NDArray]) -> None:
+        """
+        Update the running statistics that decide whether a pixel of the IFU lies on a trace:
+        the number of values above the cutoff, the largest value not above it and the smallest value above it.
+        """
+        above, largest_below, smallest_above = statistics
+        exceeds = frame > self.slit_cutoff
+        above += exceeds
+        np.maximum(largest_below, np.where(exceeds, -np.inf, frame), out=largest_below)
+        np.minimum(smallest_above, np.where(exceeds, frame, np.inf), out=smallest_above)
+
+    def _slit_mask(self, statistics: tuple[NDArray, NDArray, NDArray], length: int) -> NDArray[np.bool_]:
+        """
+        Whether the `slit_percentile`-th percentile of every pixel over all `length` frames exceeds the cutoff,
+        exactly as ``np.percentile(frames, slit_percentile, axis=0) > slit_cutoff`` (linear interpolation)
+        but from streamed statistics: the percentile interpolates between two neighbouring order statistics,
+        which lie either both on the same side of the cutoff, or are the two values next to it.
+        """
+        above, largest_below, smallest_above = statistics
+        position = self.slit_percentile / 100 * (length - 1)
+        lower = int(np.floor(position))
+        fraction = position - lower
+
+        # The order statistics at and above this index exceed the cutoff
+        first_above = length - above
+        straddles = (lower + 1 == first_above) & (fraction > 0)
+        with np.errstate(invalid="ignore"):
+            interpolated = largest_below + fraction * (smallest_above - largest_below)
+        return (lower >= first_above) | (straddles & (interpolated > self.slit_cutoff))
+
     def _process_single_detector(self, detector: Literal[1, 2, 3, 4]) -> dict[str, Hdu]:
         det_prefix = rf'DET{detector:1d}'
+        extension = rf'{det_prefix}.DATA'
+
+        # Frames are read one at a time straight from the mapped files, and each of them only once
+        raw = self.inputset.raw
+        shape = raw.shape(extension)
+        length = len(raw.items)
+
+        def read_frame(index: int) -> NDArray[np.float32]:
+            return raw.items[index].read_data_into(extension, np.empty(shape, dtype=np.float32))
 
-        raw_images = self.inputset.raw.load_data(rf'{det_prefix}.DATA') # this is an ImageList
-        length = len(raw_images)
-       
         # TODO we would likely need to apply "bias" corrections based on the reference pixels when we read in the data
        
         fws = []
         dits = []
-        images = []
         headers = []
 
         for i_frame in range(length):
-            header = cpl.core.PropertyList.load(self.inputset.raw.frameset[i_frame].file, 0)
+            header = load_header(self.inputset.raw.frameset[i_frame].file)
             headers.append(header)
             #print(header_linearity['ESO DET1 DIT'].value)
             #print(header_linearity['ESO DRS NDFILTER'].value)
             fws.append(header['ESO DRS FILTER'].value)
             dits.append(header['ESO DET DIT'].value)
-            images.append(raw_images[i_frame].as_array())
 
         if len(techs := list(set([header['ESO DPR TECH'].value for header in headers]))) != 1:
             raise cpl.core.IllegalInputError(f"More than one ESO DPR TECH detected in {headers}: {techs}")
@@ -444,24 +374,28 @@ class MetisDetLinGainImpl(RawImageProcessor, MetisRecipeImpl):
 
         dits = np.array(dits)
         fws = np.array(fws)
-       
-        images = np.array(images)
 
         self.unique_on, self.unique_on_counts = np.unique(dits[fws != 'closed'], return_counts=True)
         self.unique_off, self.unique_off_counts = np.unique(dits[fws == 'closed'], return_counts=True)
 
         meanflux = np.zeros_like(self.unique_on)
         varflux = np.zeros_like(self.unique_on)
-        dits_fluxrates = []
 
         sel_mask = self._get_detector_mask(self.tech, detector)
 
-        if 'IFU' in self.tech:
-            slit_mask = np.percentile(images, 70, axis=0) > 2000
-            sel_mask &= slit_mask # TODO additional optional bad pixel masking and windowing should go here
+        # The IFU traces are only known once all frames have been seen, so there the pixel selection
+        # is applied at the end: the linearity sums cover all pixels anyway, the pair differences are kept whole
+        slit = 'IFU' in self.tech
+        if slit:
+            slit_statistics = (np.zeros(shape, dtype=np.int32),
+                               np.full(shape, -np.inf, dtype=np.float32),
+                               np.full(shape, np.inf, dtype=np.float32))
+            frames_seen = set()
+
+        true_sums = np.zeros((2, *shape))
+        equations = NormalEquations(shape, self.fitdegree, reference=self.linlimit)
+        gain_samples = {}
 
-        fluxes_on = np.zeros(shape=(len(self.unique_on), self.detector_size, self.detector_size))
-       
         # calculation of nominal gain value using all pixels
         # TODO a lot of this code is replicated later, so this should be a function.
 
@@ -472,28 +406,43 @@ class MetisDetLinGainImpl(RawImageProcessor, MetisRecipeImpl):
 
                 if off_match.size > 0 and off_match[0] >= 2:
                     sel_dits_on, sel_dits_off = self.split_dits(fws, dits, un_on)
+                    pair = [*np.flatnonzero(sel_dits_on)[:2], *np.flatnonzero(sel_dits_off)[:2]]
+                    data_on1, data_on2, data_off1, data_off2 = [read_frame(index) for index in pair]
 
-                    data_on1 = images[sel_dits_on][0][sel_mask]
-                    data_on2 = images[sel_dits_on][1][sel_mask]
-                    data_off1 = images[sel_dits_off][0][sel_mask]
-                    data_off2 = images[sel_dits_off][1][sel_mask]
+                    if slit:
+                        for frame in (data_on1, data_on2, data_off1, data_off2):
+                            self._update_slit_statistics(frame, slit_statistics)
+                        frames_seen.update(pair)
 
                     # note that this doesn't dark subtract the fluxes. linearity also acts on dark current according to CRIRES.
-                    fluxes_on[i_on, :, :][sel_mask] = (data_on1 + data_on2) / 2
-                    dits_fluxrates.append(un_on)
+                    self._accumulate_linearity((data_on1 + data_on2) / 2, un_on, true_sums, equations)
                    
                     # TODO there should likely also be some logic to compensate the gain for the linearity (see the paper on Euclid detector characterization)
-           
-                    # Mortara and Fowler mean-variance method. https://ui.adsabs.harvard.edu/abs/1981SPIE..290...28M/abstract
-               
-                    meanflux[i_on] = (np.mean(data_on1 - data_off1) + np.mean(data_on2 - data_off2)) / 2
-                    varflux[i_on] = np.array(np.std(data_on1 - data_on2) ** 2 - np.std(data_off1 - data_off2) ** 2) / 2
+
+                    # keep the pixel vectors of the mean dark-subtracted flux and of the pair differences
+                    # for the gain and its bootstrap, so that every frame is only indexed once
+                    gain_samples[i_on] = tuple(
+                        plane if slit else plane[sel_mask]
+                        for plane in ((data_on1 - data_off1 + data_on2 - data_off2) / 2,
+                                      data_on1 - data_on2, data_off1 - data_off2)
+                    )
                 else:
                     Msg.warning(self.__class__.__qualname__, "This combination does not have enough OFF frames")
             else:
                 Msg.warning(self.__class__.__qualname__, "This combination does not have enough ON frames")
 
-        dits_fluxrates = np.array(dits_fluxrates)
+        if slit:
+            # The traces are defined by all frames, including those not used in any pair
+            for index in range(length):
+                if index not in frames_seen:
+                    self._update_slit_statistics(read_frame(index), slit_statistics)
+            sel_mask &= self._slit_mask(slit_statistics, length) # TODO additional optional bad pixel masking and windowing should go here
+            gain_samples = {i_on: tuple(plane[sel_mask] for plane in planes) for i_on, planes in gain_samples.items()}
+
+        for i_on, (flux, on_diff, off_diff) in gain_samples.items():
+            # Mortara and Fowler mean-variance method. https://ui.adsabs.harvard.edu/abs/1981SPIE..290...28M/abstract
+            meanflux[i_on] = np.mean(flux)
+            varflux[i_on] = np.array(np.std(on_diff) ** 2 - np.std(off_diff) ** 2) / 2
 
         if np.sum(meanflux < self.linlimit) < 2:
             raise cpl.core.IllegalInputError(
@@ -515,41 +464,22 @@ class MetisDetLinGainImpl(RawImageProcessor, MetisRecipeImpl):
         # bootstrapping the statistical error on the nominal gain value
         # we redraw the valid pixels and redetermine the gain based on those pixels
         # the standard deviation of these gains is a measure of the statistical error on the nominal gain calculated above
-        gain_err = self.bootstrap_gain_error(images, fws, dits, sel_mask, draws=100)
+        gain_err = self.bootstrap_gain_error(gain_samples, draws=self.bootstrap_draws, seed=self.bootstrap_seed)
         Msg.info(self.__class__.__qualname__,
-                 f"Gain error [e/ADU]: {gain_err}")
+                 f"Gain error [e/ADU]: {gain_err} ({self.bootstrap_draws} bootstrap draws, seed {self.bootstrap_seed})")
 
         Msg.debug(self.__class__.__qualname__,
                   f"Now actually determining linearity...")
 
-        # Both compute the same fit; the loop is the production path for now.
-        with Stopwatch() as loop_sw:
-            linearity, err_linearity, bpm = self._fit_linearity_loop(fluxes_on, dits_fluxrates, sel_mask)
-
-        with Stopwatch() as vec_sw:
-            linearity_vec, err_linearity_vec, bpm_vec = self._fit_linearity_vec(fluxes_on, dits_fluxrates, sel_mask)
-
-        m = sel_mask
-        # A small nonzero bpm mismatch count does not necessarily mean the fits diverge: the
-        # sigma-clip inside each method is a threshold operation, so a pixel sitting right at the
-        # kappa boundary can flip between the two paths purely from the minuscule coefficient difference.
-        Msg.info(self.__class__.__qualname__,
-                 f"Linearity vec-vs-loop: coeff max|d| = {np.max(np.abs(linearity[:, m] - linearity_vec[:, m])):.3e}, "
-                 f"err max|d| = {np.max(np.abs(err_linearity[:, m] - err_linearity_vec[:, m])):.3e}, "
-                 f"bpm mismatches = {int(np.sum(bpm != bpm_vec))}")
-        Msg.info(self.__class__.__qualname__,
-                 f"Linearity timing: "
-                 f"loop = {loop_sw.elapsed:.3f} s, "
-                 f"vectorized = {vec_sw.elapsed:.3f} s, "
-                 f"speedup = {loop_sw.elapsed / vec_sw.elapsed:.2f}×")
+        linearity, err_linearity, bpm = self._fit_linearity_streaming(true_sums, equations, sel_mask)
 
         # TODO: QC parameters should be populated here
        
-        header_linearity = cpl.core.PropertyList.load(self.inputset.raw.frameset[0].file, 0)
-        header_errlinearity = cpl.core.PropertyList.load(self.inputset.raw.frameset[0].file, 0)
-        header_dqlinearity = cpl.core.PropertyList.load(self.inputset.raw.frameset[0].file, 0)
-        header_gain = cpl.core.PropertyList.load(self.inputset.raw.frameset[0].file, 0)
-        header_badpix = cpl.core.PropertyList.load(self.inputset.raw.frameset[0].file, 0)
+        header_linearity = load_header(self.inputset.raw.frameset[0].file)
+        header_errlinearity = load_header(self.inputset.raw.frameset[0].file)
+        header_dqlinearity = load_header(self.inputset.raw.frameset[0].file)
+        header_gain = load_header(self.inputset.raw.frameset[0].file)
+        header_badpix = load_header(self.inputset.raw.frameset[0].file)
        
         gain_table = cpl.core.Table(input=np.rec.fromarrays(np.array([[gainval], [gain_err]]),
                                                             names=["gain", "gain_err"]))
@@ -620,15 +550,18 @@ class MetisDetLinGain(Recipe):
     The gain is determined from the slope of the average flux
     of the on-off maps and the variance of the on-on and off-off maps.
     A gain correction factor is applied to correct for the inter pixel capacitance.
-    The noise on the gain is derived by resampling with replacement.
+    The noise on the gain is derived by resampling the pixels with replacement, using independent seeded random streams.
     The linearity is determined following the CRIRES approach where for every pixel the flux rate
     (ADU/s; including dark current) is calculated and the weighted average of the flux rate
     at the lowest (most linear) fluxes are taken as the true ADU/s flux rate
     to which all flux rates should be corrected.
     This directly defines a correction factor as a function of flux with
     the most linear fluxes having a correction close to 1.
-    An Nth order polynomial is fit (np.polyfit; taking into account errors) to these correction values as function of flux.
-    We add pixels with linearity coefficients that are significantly different from the mean to the BPM (astropy.stats.sigma_clip)."""
+    An Nth order polynomial is fit (weighted least squares, taking into account errors) to these correction values
+    as function of flux, for every pixel independently (multithreaded kernel in libmetis if available).
+    The frames are read one at a time and only the per-pixel normal equations of the fit are kept,
+    so the memory needed does not grow with the number of DITs.
+    We add pixels with linearity coefficients that are significantly different from the median to the BPM (iterative sigma clipping)."""
 
     parameters = ParameterList([
         ParameterValue(
@@ -658,6 +591,19 @@ class MetisDetLinGain(Recipe):
                         "to the weighted average flux rate defined by the pixel values below this limit.",
             default=10000., # this should be dependent on read out mode and detector
         ),
+        ParameterValue(
+            name=rf"{_name}.bootstrap.draws",
+            context=_name,
+            description="Number of bootstrap draws used to estimate the statistical error of the gain",
+            default=100,
+        ),
+        ParameterValue(
+            name=rf"{_name}.bootstrap.seed",
+            context=_name,
+            description="Seed of the random streams of the gain bootstrap, for reproducible gain errors. "
+                        "A negative value draws a fresh seed, which is then reported in the log.",
+            default=0,
+        ),
     ])
 
     Impl = MetisDetLinGainImpl
@@ -17,14 +17,20 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 import copy
+from typing import Optional
 
+import cpl
+import numpy as np
 from cpl.core import Msg
 
-from pymetis.engine.core.parameter import ParameterList, ParameterEnum
-from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
-from pymetis.engine.qc import QcParameterSet
+from pymetis.engine.core.parameter import ParameterList, ParameterEnum, ParameterRange, ParameterValue
+from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet, load_header
+from pymetis.engine.qc import QcParameter, QcParameterSet
 from pymetis.engine.recipes import Recipe
+from pymetis.engine.core.functions.calibrate import calibrate_frames, DQ_INVALID
+from pymetis.engine.core.functions.chopnod import BEAMS, ChopNodAccumulator, ChopNodResult, classify_frames
 from pymetis.engine.core.functions.dummy import create_dummy_header
+from pymetis.engine.core.functions.image import as_cpl_image
 
 from pymetis.instruments.metis.mixins import DetectorGeoMixin, BandNMixin
 from pymetis.instruments.metis.dataitems.background.subtracted import NBackgroundSubtracted
@@ -94,6 +100,84 @@ class MetisNImgChopnodImpl(BandNMixin, DetectorGeoMixin, DarkImageProcessor, Met
         class PeakCnt(QcStdPeakCounts):
             _description_template = "Peak counts of the source"
 
+        class NCycles(BandNMixin, QcParameter):
+            _name_template = "QC {band} CHOPNOD NCYCLES"
+            _type = int
+            _unit = "1"
+            _description_template = "Number of complete chop-nod cycles combined"
+
+        class RejFrac(BandNMixin, QcParameter):
+            _name_template = "QC {band} CHOPNOD REJFRAC"
+            _type = float
+            _unit = "1"
+            _description_template = "Fraction of the pixels of all cycles rejected as outliers"
+
+    # Header keywords with the chop and the nod position ('A' or 'B') of every frame
+    chopnod_keywords: tuple[str, str] = ('ESO SEQ CHOPPOS', 'ESO SEQ NODPOS')
+
+    # Number of raw frames read and calibrated at once
+    calibration_chunk: int = 16
+
+    def chopnod_positions(self, extension: int | str = 'DET1.DATA') -> Optional[tuple[list, list, list]]:
+        """
+        Return the raw items in the order of observation together with their chop and nod positions,
+        or None if any frame lacks the keywords.
+        """
+        raw_input = self.inputset.raw
+        raw_input.shape(extension)                  # Make sure the items are loaded
+
+        headers = [load_header(item.filename) for item in raw_input.items]
+        try:
+            positions = [(header[self.chopnod_keywords[0]].value, header[self.chopnod_keywords[1]].value)
+                         for header in headers]
+        except KeyError:
+            return None
+
+        try:
+            order = np.argsort([header['MJD-OBS'].value for header in headers], kind='stable')
+        except KeyError:
+            order = np.arange(len(headers))
+
+        items = [raw_input.items[index] for index in order]
+        return items, [positions[index][0] for index in order], [positions[index][1] for index in order]
+
+    def reduce_chopnod(self,
+                       items: list,
+                       beams: np.ndarray,
+                       cycles: np.ndarray,
+                       *,
+                       extension: int | str = 'DET1.DATA',
+                       **calibrations) -> ChopNodResult:
+        """
+        Calibrate the raw frames, see `calibrate_frames`, and accumulate their double differences,
+        see `ChopNodAccumulator`. Only `calibration_chunk` frames are held in memory at any time.
+        """
+        kappa = self.parameters[f"{self.name}.chopnod.kappa"].value
+        warmup = self.parameters[f"{self.name}.chopnod.warmup"].value
+
+        height, width = self.inputset.raw.shape(extension)
+        accumulator = ChopNodAccumulator((height, width), kappa=kappa, warmup=warmup)
+        buffer = np.empty((max(1, min(self.calibration_chunk, len(items))), height, width), dtype=np.float32)
+
+        Msg.info(self.__class__.__qualname__,
+                 f"Differencing {len(items)} frames in {cycles[-1] + 1 if len(cycles) else 0} chop-nod cycles, "
+                 f"rejecting outliers beyond {kappa} sigma")
+
+        for start in range(0, len(items), len(buffer)):
+            chunk = slice(start, min(start + len(buffer), len(items)))
+            raw = buffer[:chunk.stop - chunk.start]
+            for plane, item in zip(raw, items[chunk]):
+                item.read_data_into(extension, plane)
+
+            sci, err, dq = calibrate_frames(raw, **calibrations)
+            accumulator.add_frames(sci, err, dq, beams[chunk], cycles[chunk])
+
+        result = accumulator.result()
+        if result.nskipped > 0:
+            Msg.warning(self.__class__.__qualname__,
+                        f"Left out {result.nskipped} incomplete chop-nod cycles")
+        return result
+
 
     def process(self) -> set[DataItem]:
         """
@@ -108,21 +192,63 @@ class MetisNImgChopnodImpl(BandNMixin, DetectorGeoMixin, DarkImageProcessor, Met
 
         flat = self.inputset.master_flat.load_data('DET1.SCI')
         dark = self.inputset.master_dark.load_data('DET1.SCI')
-        gain = self.inputset.gain_map.load_data('DET1.SCI')
-
-        images = self.inputset.raw.load_data('DET1.DATA')
-
-        combined_image = self.combine_images(images, self.parameters["metis_n_img_chopnod.stacking.method"].value)
+        gain = self.detector_gain('DET1.SCI')
+        linearity = self.inputset.linearity.load_data('DET1.SCI')
+        linearity_dq = self.inputset.linearity.load_data('DET1.DQ')
 
+        positions = self.chopnod_positions()
         primary_header = self.inputset.raw.items[0].primary_header
+        unit = cpl.core.Property("BUNIT", cpl.core.Type.STRING, self.calibrated_unit(gain), "Physical unit")
         header_reduced = create_dummy_header()
-        header_background = create_dummy_header()
+        header_reduced.append(unit)
 
         self.target = self.inputset.tag_matches['target']
 
+        if positions is None:
+            Msg.warning(self.__class__.__qualname__,
+                        f"Frames without chop and nod positions ({', '.join(self.chopnod_keywords)}), "
+                        f"stacking them instead of differencing")
+            calibrated_images = self.calibrate_raw_images('DET1.DATA', dark=dark, flat=flat, gain=gain,
+                                                          linearity=linearity, linearity_dq=linearity_dq)
+            images = cpl.core.ImageList([calibrated.image.data for calibrated in calibrated_images])
+
+            combined_image = self.combine_images(images, self.parameters["metis_n_img_chopnod.stacking.method"].value)
+
+            product_reduced = self.ProductSet.Reduced(
+                copy.deepcopy(primary_header),
+                Hdu(header_reduced, combined_image, name='DET1.DATA')
+            )
+            return {product_reduced}
+
+        items, chop, nod = positions
+        beams, cycles = classify_frames(chop, nod)
+        result = self.reduce_chopnod(
+            items, beams, cycles,
+            dark=np.array(dark),
+            flat=np.array(flat),
+            gain=1.0 if gain is None else gain,
+            linearity=np.array(linearity, dtype=np.float64),
+            linearity_dq=np.array(linearity_dq) != 0,
+        )
+
+        empty = result.coverage == 0
+        total = int(result.coverage.sum() + result.rejected.sum())
+        header_reduced = self.collect_qc_parameters(
+            self.Qc.NCycles(result.ncycles),
+            self.Qc.RejFrac(float(result.rejected.sum()) / total if total > 0 else 0.0),
+        )
+        header_reduced.append(unit)
+        header_error = create_dummy_header()
+        header_error.append(unit)
+
         product_reduced = self.ProductSet.Reduced(
             copy.deepcopy(primary_header),
-            Hdu(header_reduced, combined_image, name='DET1.DATA')
+            Hdu(header_reduced, as_cpl_image(np.nan_to_num(result.image)), name='DET1.DATA'),
+            Hdu(header_error, as_cpl_image(np.nan_to_num(result.error)), name='DET1.ERR'),
+            Hdu(create_dummy_header(), as_cpl_image(np.where(empty, DQ_INVALID, 0).astype(np.int32)),
+                name='DET1.DQ'),
+            *[Hdu(create_dummy_header(), as_cpl_image(np.nan_to_num(noise)), name=f'DET1.NOISE.{beam}')
+              for beam, noise in zip(BEAMS, result.beam_noise)],
         )
         #product_background = self.ProductSet.Background(
         #    copy.deepcopy(primary_header),
@@ -149,16 +275,22 @@ class MetisNImgChopnod(Recipe):
     _copyright = "GPL-3.0-or-later"
     _synopsis: str = "Basic science image data processing"
     _description: str = (
-            "The recipe combines all science input files in the input set-of-frames using\n"
-            + "the given method. For each input science image the master dark is subtracted,\n"
-            + "and it is divided by the master flat."
+            "The recipe calibrates all science input files in the input set-of-frames and forms\n"
+            + "the chop-nod double differences (A - B) - (C - D) of every cycle, which it averages\n"
+            + "after rejecting outliers. For each input science image the master dark is subtracted,\n"
+            + "and it is divided by the master flat. Frames without chop and nod positions are\n"
+            + "combined using the given method instead."
     )
 
     _matched_keywords: set[str] = {'DET.DIT', 'DET.NDIT', 'DRS.FILTER'}
     _algorithm = """Remove crosstalk, correct non-linearity
         Analyse and optionally remove masked regions
         Subtract dark, divide by flat
-        Remove blank sky pattern"""
+        Classify the frames into the four beams of the chop and nod positions, and into cycles
+        Remove blank sky pattern: difference the beam means of every cycle to (A - B) - (C - D),
+            streamed in constant memory
+        Reject outliers of every cycle against the median of the first cycles, then the running mean
+        Average the accepted cycles, propagate the errors and measure the noise of every beam"""
 
     parameters = ParameterList([
         ParameterEnum(
@@ -167,7 +299,22 @@ class MetisNImgChopnod(Recipe):
             description="Name of the method used to combine the input images",
             default="add",
             alternatives=("add", "average", "median"),
-        )
+        ),
+        ParameterValue(
+            name=rf"{_name}.chopnod.kappa",
+            context=_name,
+            description="Rejection threshold for the double difference of a cycle, "
+                        "in units of its propagated error; 0 disables the rejection",
+            default=5.0,
+        ),
+        ParameterRange(
+            name=rf"{_name}.chopnod.warmup",
+            context=_name,
+            description="Number of first cycles whose median is their reference for the rejection",
+            default=3,
+            min=1,
+            max=100,
+        ),
     ])
 
     Impl = MetisNImgChopnodImpl
@@ -22,8 +22,9 @@ from abc import ABC
 import cpl
 from cpl.core import Msg, Image
 
+from pymetis.engine.recipes import component
 from pymetis.instruments.metis.inputs.common import MasterDarkInput
-from pymetis.instruments.metis.recipes.prefab.rawimage import RawImageProcessor
+from pymetis.instruments.metis.recipes.prefab.rawimage import RawImageProcessor, StripeProcessorType
 
 
 class DarkImageProcessor(RawImageProcessor, ABC):
@@ -63,7 +64,18 @@ class DarkImageProcessor(RawImageProcessor, ABC):
         # - _subtract_darks for all detectors that calls the single one for each of them
         master_dark: Image = self.inputset.master_dark.load_data('DET1.SCI')
 
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                  f"Subtracting the master dark from raw images")
         images.subtract_image(master_dark)
-        return images
\ No newline at end of file
+        return images
+
+    def subtract_dark_stripes(self) -> StripeProcessorType:
+        """
+        Load the associated master dark frame and return a stripe processor that subtracts it,
+        for use with the streamed combine methods. Equivalent to `subtract_dark` on the full frames.
+        """
+        master_dark: Image = self.inputset.master_dark.load_data('DET1.SCI')
+
+        Msg.info(component(self.__class__.__qualname__),
+                 f"Subtracting the master dark from raw image stripes")
+        return self.subtract_stripe(master_dark)
\ No newline at end of file
@@ -0,0 +1,191 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import tempfile
+from abc import ABC
+from dataclasses import dataclass
+
+import cpl
+import numpy as np
+from astropy.table import QTable
+from cpl.core import Msg
+
+from pymetis.engine.core.functions.adi import AdiResult, adi_pca
+from pymetis.engine.core.functions.contrast import (ContrastCurve, RadialProfile, contrast_curve,
+                                                    fake_companion_throughput, gaussian_psf, radial_profile, snr_map,
+                                                    stellar_psf)
+from pymetis.engine.dataitems import load_header
+from pymetis.engine.inputs import SinglePipelineInput
+from pymetis.instruments.metis.dataitems.hci.hci import OffAxisPsfRaw
+from pymetis.instruments.metis.inputs import OptionalInputMixin
+from pymetis.instruments.metis.recipes.prefab.rawimage import RawImageProcessor
+
+
+@dataclass(frozen=True)
+class AdiContrast:
+    """
+    Detection limits of an ADI reduction: the raw contrast profile (relative to the stellar peak)
+    of the derotated frames, the throughput (branches, nseparations) of the reduction at the separations
+    of the contrast curve, the curve itself, the SNR map, and the size of lambda/D in pixels.
+    """
+    raw: RadialProfile
+    throughput: np.ndarray
+    curve: ContrastCurve
+    snr: np.ndarray
+    lamd: float
+
+
+class MetisBaseImgAdiImpl(RawImageProcessor, ABC):
+    """
+    Base of the ADI post-processing recipes: PCA speckle subtraction, derotation and combination
+    of a pupil-tracking sequence of calibrated frames, see `adi_pca`, and its detection limits.
+
+    The recipe is expected to define the parameters `adi.ncomp`, `adi.method`, `adi.memory`,
+    `contrast.lamd`, `contrast.branches` and `contrast.sigma`.
+    """
+    class InputSet(RawImageProcessor.InputSet):
+        # Unocculted image of the star, which calibrates the contrast
+        class OffAxisPsfInput(OptionalInputMixin, SinglePipelineInput):
+            Item = OffAxisPsfRaw
+
+    # Header keywords with the parallactic angle at the start and at the end of every exposure
+    parallactic_angle_keywords: tuple[str, str] = ('ESO TEL PARANG START', 'ESO TEL PARANG END')
+
+    def parallactic_angles(self) -> np.ndarray:
+        """
+        Return the mean parallactic angle of every raw frame, in degrees.
+        Frames without the keywords are assumed not to rotate at all, with a warning.
+        """
+        start, end = self.parallactic_angle_keywords
+        angles = []
+        for frame in self.inputset.raw.frameset:
+            header = load_header(frame.file)
+            try:
+                angles.append(0.5 * (header[start].value + header[end].value))
+            except KeyError:
+                Msg.warning(self.__class__.__qualname__,
+                            f"No parallactic angle in {frame.file}, assuming no field rotation")
+                angles.append(0.0)
+        return np.unwrap(np.asarray(angles, dtype=np.float64), period=360.0)
+
+    def reduce_adi(self, extension: int | str = 'DET1.DATA') -> AdiResult:
+        """
+        Load the sequence and run the ADI reduction with the parameters of the recipe.
+
+        If the sequence and the processed frames do not fit into the memory budget `adi.memory`,
+        both are kept in memory-mapped files in the temporary directory instead, and only
+        as many frames as fit into the budget are processed at a time.
+        """
+        ncomp = self.parameters[f"{self.name}.adi.ncomp"].value
+        method = self.parameters[f"{self.name}.adi.method"].value
+        budget = self.parameters[f"{self.name}.adi.memory"].value * 2 ** 20
+
+        nframes = len(self.inputset.raw.frameset)
+        height, width = self.inputset.raw.shape(extension)
+        frame_bytes = height * width * np.dtype(np.float32).itemsize
+        # The sequence itself, and for the median the three processed sequences
+        needed = nframes * frame_bytes * (4 if method == 'median' else 1)
+        # A chunk of frames is held in double precision a few times over while it is processed
+        chunk = int(max(1, min(nframes, budget // (10 * frame_bytes))))
+        angles = self.parallactic_angles()
+
+        Msg.info(self.__class__.__qualname__,
+                 f"ADI reduction of {nframes} frames of {height}x{width} with {ncomp} principal components, "
+                 f"field rotation {np.ptp(angles):.1f} deg, {method} combination, {chunk} frames at a time")
+
+        if needed <= budget:
+            cube = self.inputset.raw.load_cube(extension, dtype=np.float32)
+            return adi_pca(cube, angles, ncomp=ncomp, method=method, chunk=chunk)
+
+        Msg.info(self.__class__.__qualname__,
+                 f"Sequence of {needed / 2 ** 20:.0f} MB exceeds the memory budget, streaming from disk")
+        with tempfile.TemporaryDirectory() as scratch:
+            cube = np.lib.format.open_memmap(f"{scratch}/sequence.npy", mode='w+', dtype=np.float32,
+                                             shape=(nframes, height, width))
+            self.inputset.raw.load_cube(extension, out=cube)
+            return adi_pca(cube, angles, ncomp=ncomp, method=method, chunk=chunk, scratch=scratch)
+
+    def evaluate_contrast(self, adi: AdiResult) -> AdiContrast:
+        """
+        Compute the contrast curve, throughput and SNR map of an ADI reduction.
+
+        The throughput is measured with fake companions at separations two lambda/D apart, all injected
+        at once on `contrast.branches` radial lines and processed with the principal components and
+        derotation of `adi`, so the sequence is not reduced again.
+
+        The PSF of the companions and the flux of the star are measured in the off-axis PSF, if it is given.
+        It is expected in the same setup and units as the sequence. Otherwise the PSF is modelled as a Gaussian
+        with a FWHM of lambda/D, which is good enough for the throughput, but as the star is hidden
+        by the coronagraph the contrasts cannot be calibrated and are NaN.
+        """
+        lamd = self.parameters[f"{self.name}.contrast.lamd"].value
+        branches = self.parameters[f"{self.name}.contrast.branches"].value
+        sigma = self.parameters[f"{self.name}.contrast.sigma"].value
+
+        if self.inputset.off_axis_psf.frame is not None:
+            star = stellar_psf(np.asarray(self.inputset.off_axis_psf.load_data('DET1.DATA')), lamd)
+            psf, star_flux, star_peak = star.template, star.flux, star.peak
+        else:
+            Msg.warning(self.__class__.__qualname__,
+                        "No off-axis PSF given, the contrast curves cannot be calibrated and are NaN")
+            psf, star_flux, star_peak = gaussian_psf(lamd), np.nan, np.nan
+        aperture = lamd / 2
+
+        height, width = adi.derotated.shape
+        separations = np.arange(2 * lamd, min(height, width) / 2 - 2 * lamd, 2 * lamd)
+        Msg.info(self.__class__.__qualname__,
+                 f"Measuring the throughput with {branches} x {len(separations)} fake companions")
+
+        throughput = fake_companion_throughput(adi, separations, psf=psf, aperture=aperture, branches=branches)
+        curve = contrast_curve(adi.derotated_psfsub, separations, np.nanmean(throughput, axis=0),
+                               psf=psf, star_flux=star_flux, aperture=aperture, fwhm=lamd, sigma=sigma,
+                               centre=adi.centre)
+
+        return AdiContrast(raw=radial_profile(adi.derotated / star_peak, centre=adi.centre),
+                           throughput=throughput,
+                           curve=curve,
+                           snr=snr_map(adi.derotated_psfsub, fwhm=lamd, centre=adi.centre),
+                           lamd=lamd)
+
+    @staticmethod
+    def contrast_tables(contrast: AdiContrast) -> tuple[cpl.core.Table, cpl.core.Table, cpl.core.Table]:
+        """
+        Tabulate the raw contrast profile, the contrast curve and the throughput,
+        with separations both in pixels and in units of lambda/D.
+        """
+        raw = QTable()
+        raw['SEPARATION'] = contrast.raw.radius
+        raw['SEPARATION_LAMD'] = contrast.raw.radius / contrast.lamd
+        raw['CONTRAST'] = contrast.raw.mean
+
+        curve = QTable()
+        curve['SEPARATION'] = contrast.curve.separation
+        curve['SEPARATION_LAMD'] = contrast.curve.separation / contrast.lamd
+        curve['NOISE'] = contrast.curve.noise
+        curve['THROUGHPUT'] = contrast.curve.throughput
+        curve['CONTRAST'] = contrast.curve.contrast
+        curve['CONTRAST_MAG'] = contrast.curve.magnitudes
+
+        throughput = QTable()
+        throughput['SEPARATION'] = contrast.curve.separation
+        throughput['SEPARATION_LAMD'] = contrast.curve.separation / contrast.lamd
+        throughput['THROUGHPUT'] = np.nanmean(contrast.throughput, axis=0)
+        throughput['THROUGHPUT_STDEV'] = np.nanstd(contrast.throughput, axis=0)
+
+        return cpl.core.Table(raw), cpl.core.Table(curve), cpl.core.Table(throughput)
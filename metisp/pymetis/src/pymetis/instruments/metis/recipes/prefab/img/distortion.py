@@ -19,10 +19,14 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 import copy
 from abc import ABC
 
+import numpy as np
+from cpl.core import Msg
+
 from pymetis.engine.dataitems import DataItem, Hdu, PipelineProductSet
 from pymetis.engine.inputs import MultiplePipelineInput
 from pymetis.engine.qc import QcParameter, QcParameterSet
 from pymetis.engine.core.functions.dummy import create_dummy_table, create_dummy_image, create_dummy_header
+from pymetis.engine.core.functions.psf import PsfMeasurements, measure_psfs
 
 from pymetis.instruments.metis.dataitems.distortion import (DistortionMap, DistortionRaw,
                                                             DistortionReduced, DistortionTable)
@@ -63,14 +67,34 @@ class MetisBaseImgDistortionImpl(RawImageProcessor, MetisRecipeImpl, ABC):
         Rms = QcDistortRms
         NSource = QcDistortNSource
 
+    # Detection and measurement of the pinhole grid images
+    detection_threshold: float = 10.0   # in units of the clipped background sigma
+    psf_half_width: int = 7             # half size of the measurement window [pix]
+
+    def measure_grid(self, background: np.ndarray) -> PsfMeasurements:
+        """
+        Measure every pinhole of the grid in all background-subtracted distortion frames at once.
+        The pinholes are detected on the mean of the frames and then measured in every frame.
+        """
+        frames = self.inputset.distortion.load_cube('DET1.DATA', dtype=np.float32)
+        frames -= background
+
+        psf = measure_psfs(frames, threshold=self.detection_threshold, half_width=self.psf_half_width)
+        Msg.info(self.__class__.__qualname__,
+                 f"Measured {psf.xcen.shape[-1]} pinhole images in {len(frames)} frames")
+        return psf
+
     def process(self) -> set[DataItem]:
         raw_images = self.inputset.raw.load_data('DET1.DATA')
 
         combined_image = self.combine_images(raw_images, "average")
-        distortion = self.inputset.distortion.load_data('DET1.DATA')
         primary_header = self.inputset.distortion.items[0].primary_header
 
-        header_distortion_table = create_dummy_header()
+        psf = self.measure_grid(np.asarray(combined_image.as_array(), dtype=np.float32))
+        # Sources with a centroid in every frame
+        nsource = int(np.sum(np.all(np.isfinite(psf.xcen), axis=0)))
+
+        header_distortion_table = self.collect_qc_parameters(self.Qc.NSource(nsource))
         header_distortion_map = create_dummy_header()
         header_distortion_reduced = create_dummy_header()
         table = create_dummy_table()
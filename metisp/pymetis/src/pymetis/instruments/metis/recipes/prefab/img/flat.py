@@ -81,18 +81,20 @@ class MetisBaseImgFlatImpl(DarkImageProcessor, MetisRecipeImpl, ABC):
         # target = self.inputset.tag_parameters['target']
 
         self.inputset.raw.load_structure()
-        raw_images = self.inputset.raw.load_data('DET1.DATA')
-        dark_corrected = self.subtract_dark(raw_images)
 
         # FixMe: At skeleton level we just copy the header from the first raw
         primary_header = self.inputset.raw.items[0].primary_header
 
         # Combine the images in the image list using the image stacking option requested by the user.
         method = self.parameters[f"{self.name}.stacking.method"].value
+        memory_limit = self.parameters[f"{self.name}.stacking.memory"].value
 
         # TODO: preprocessing steps like persistence correction / nonlinearity (or not) should come here
         # ToDo: And this should be moved to the base class anyway
-        combined_image = self.combine_images(dark_corrected, method)
+        # The raws are dark-subtracted and combined stripe by stripe, never holding the full stack in memory
+        combined_image = self.combine_images_streamed(self.inputset.raw, 'DET1.DATA', method,
+                                                      memory_limit=memory_limit,
+                                                      preprocess=self.subtract_dark_stripes())
         header_master_flat = create_dummy_header()
         # ToDo actually produce the flat
 
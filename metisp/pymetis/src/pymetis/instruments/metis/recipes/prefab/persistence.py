@@ -1,18 +1,27 @@
-from cpl.core import ImageList, Msg
+from typing import Optional
+
+from cpl.core import Image, ImageList, Msg
+
+from pymetis.engine.recipes import component
 
 
 class PersistenceCorrectionMixin:
     """
     A mixin that performs persistence correction.
     """
-    def correct_persistence(self, raw_images: ImageList) -> ImageList:
+    def load_persistence_map(self) -> Image:
+        return self.inputset.persistence_map.load_data(extension=rf'PERSISTENCE_MAP')
+
+    def correct_persistence(self, raw_images: ImageList, persistence: Optional[Image] = None) -> ImageList:
         """
-        Correct the raw image list for persistence.
+        Correct the raw image list for persistence. If the images only cover some of the rows of the detector,
+        pass the matching rows of the persistence map, see `load_persistence_map`.
 
         # FixMe Currently only a mockup, does not actually do anything.
         """
-        persistence = self.inputset.persistence_map.load_data(extension=rf'PERSISTENCE_MAP')
+        if persistence is None:
+            persistence = self.load_persistence_map()
         raw_images.subtract_image(persistence)
 
-        Msg.info(self.__class__.__qualname__, f"Pretending to do persistence correction")
+        Msg.info(component(self.__class__.__qualname__), f"Pretending to do persistence correction")
         return raw_images
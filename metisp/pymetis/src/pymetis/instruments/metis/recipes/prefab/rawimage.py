@@ -20,18 +20,28 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 import numpy as np
 
 from abc import ABC
-from typing import Literal, Optional
+from typing import Callable, Iterable, Literal, Optional
 
 import cpl
-from cpl.core import Msg, Image, ImageList
-
-from pymetis.engine.recipes import RecipeImpl
-from pymetis.engine.inputs import PipelineInputSet
+from cpl.core import Msg, Image, ImageList, Mask
+
+from pymetis.engine.core.classes.image import EnhancedImage
+from pymetis.engine.core.classes.moments import StackMoments
+from pymetis.engine.core.classes.utilities import profiled
+from pymetis.engine.core.functions.calibrate import calibrate_frames, correct_nonlinearity, DQ_BAD_PIXEL
+from pymetis.engine.core.functions.combine import combine_with_error
+from pymetis.engine.core.functions.image import as_cpl_image
+from pymetis.engine.core.functions.sigclip import sigma_clip
+from pymetis.engine.recipes import RecipeImpl, component
+from pymetis.engine.inputs import PipelineInputSet, MultiplePipelineInput
 
 from pymetis.instruments.metis.inputs import RawInput, BadPixMapInput, OptionalInputMixin
 
 CombineMethodType = Literal['add', 'average', 'median', 'sigclip']
 
+# Hook applied to every stripe before combining: receives the stripes and the half-open row range they cover
+StripeProcessorType = Callable[[ImageList, int, int], ImageList]
+
 
 class RawImageProcessor(RecipeImpl, ABC):
     """
@@ -46,6 +56,7 @@ class RawImageProcessor(RecipeImpl, ABC):
             pass
 
     @classmethod
+    @profiled('combine_images')
     def combine_images(cls,
                        images: cpl.core.ImageList,
                        method: CombineMethodType) -> cpl.core.Image:
@@ -53,13 +64,16 @@ class RawImageProcessor(RecipeImpl, ABC):
         Basic helper method to combine images using one of `add`, `average`, `median` or `sigclip`.
         Probably not a panacea, but it recurs often enough to warrant being here.
 
+        Every method works pixel by pixel along the stack, so `combine_images_streamed`,
+        which applies this to stripes of the frames, gives identical results.
+
         Raises
         ------
         ValueError
             If an unknown combine method is used.
 
         """
-        Msg.info(cls.__qualname__,
+        Msg.info(component(cls.__qualname__),
                  f"Combining {len(images)} images using method {method!r}")
         combined_image: Optional[cpl.core.Image] = None
 
@@ -75,14 +89,73 @@ class RawImageProcessor(RecipeImpl, ABC):
             case "median":
                 combined_image = images.collapse_median_create()
             case "sigclip":
-                combined_image = images.collapse_sigclip_create()
+                # Clipped by the same engine as every other rejection along a stack, see `sigma_clip`
+                combined_image, _ = cls.combine_images_fused(images, method)
             case _:
-                Msg.error(cls.__qualname__,
+                Msg.error(component(cls.__qualname__),
                           f"Got unknown stacking method {method!r}. Stopping right here!")
                 raise ValueError(f"Unknown stacking method {method!r}")
 
         return combined_image
 
+    @classmethod
+    @profiled('combine_images')
+    def combine_images_fused(cls,
+                             images: ImageList,
+                             method: CombineMethodType,
+                             *,
+                             read_noise: Optional[float] = None) -> tuple[Image, Optional[Image]]:
+        """
+        Combine images and, if `read_noise` is given, propagate the errors, in a single pass over the stack.
+        Rejected pixels of the input images are excluded, pixels without any good input are rejected.
+
+        Parameters
+        ----------
+        images : ImageList
+            List of raw images to combine
+        method : CombineMethodType = Literal['add', 'average', 'median', 'sigclip']
+            Method to combine images using one of `add`, `average`, `median` or `sigclip`.
+        read_noise : float, optional
+            Read noise, added in quadrature to the shot noise of every frame
+
+        Returns
+        -------
+        combined_image, error : tuple[Image, Image | None]
+            Combined image and its propagated error (None if no read noise was given)
+
+        Raises
+        ------
+        ValueError
+            If an unknown combine method is used.
+        """
+        Msg.info(component(cls.__qualname__),
+                 f"Combining {len(images)} images using method {method!r}")
+
+        stack = np.array(images, dtype=np.float32)
+        masks = [image.bpm for image in images]
+        bpm = None if all(mask is None for mask in masks) else np.array([
+            np.zeros(stack.shape[1:], dtype=bool) if mask is None else np.array(mask, dtype=bool)
+            for mask in masks
+        ])
+
+        try:
+            combined, error, rejected = combine_with_error(stack, method, read_noise, bpm=bpm)
+        except ValueError:
+            Msg.error(component(cls.__qualname__),
+                      f"Got unknown stacking method {method!r}. Stopping right here!")
+            raise
+
+        combined_image = Image(combined)
+        error_image = Image(error) if error is not None else None
+
+        if rejected.any():
+            mask = cpl.core.Mask(rejected)
+            combined_image.reject_from_mask(mask)
+            if error_image is not None:
+                error_image.reject_from_mask(mask)
+
+        return combined_image, error_image
+
     @classmethod
     def combine_images_with_error(cls,
                                   images: ImageList,
@@ -91,6 +164,9 @@ class RawImageProcessor(RecipeImpl, ABC):
         """
         Collapse and imagelist of raw frames and propagate the errors
 
+        The error is the read noise plus shot noise of every frame added in quadrature,
+        see `combine_images_fused`.
+
         Parameters
         ----------
         images : ImageList
@@ -100,34 +176,249 @@ class RawImageProcessor(RecipeImpl, ABC):
         read_noise : float
             Read noise # ToDo what does this mean precisely?
 
+        Returns
+        -------
+        combined_image, error : tuple[Image, Image]
+            Combined image and its propagated error
+        """
+        return cls.combine_images_fused(images, method, read_noise=read_noise)
+
+    @classmethod
+    def stripe_height(cls,
+                      count: int,
+                      shape: tuple[int, int],
+                      memory_limit: float) -> int:
+        """
+        Determine how many rows of `count` frames of the given shape can be combined at once
+        without exceeding `memory_limit` megabytes.
+
+        The loaded stripes are single precision and the collapse needs roughly the same amount again
+        for temporaries, hence the factor of two. At least one row is always processed.
+        """
+        height, width = shape
+        bytes_per_row = 2 * count * width * np.dtype(np.float32).itemsize
+        rows = int(memory_limit * 2 ** 20 // bytes_per_row)
+        return max(1, min(height, rows))
+
+    @staticmethod
+    def subtract_stripe(image: Image) -> StripeProcessorType:
+        """
+        Return a stripe processor that subtracts the matching rows of the full-size `image` from every stripe,
+        for use as `preprocess` in the streamed combine methods.
+        """
+        def subtract(stripes: ImageList, first: int, last: int) -> ImageList:
+            stripes.subtract_image(image.extract(cpl.core.Window(0, first, image.width - 1, last - 1)))
+            return stripes
+
+        return subtract
+
+    @classmethod
+    def _combine_stripes(cls,
+                         raw_input: MultiplePipelineInput,
+                         extension: int | str,
+                         combine: Callable[[ImageList], tuple[Image, ...]],
+                         *,
+                         memory_limit: float,
+                         preprocess: Optional[StripeProcessorType] = None) -> tuple[Image, ...]:
+        """
+        Run `combine` over horizontal stripes of all frames of `raw_input` and assemble the full-size results.
+
+        Every supported combine method works pixel by pixel along the stack,
+        so the assembled result is identical to combining the fully loaded frames.
+        """
+        shape = raw_input.shape(extension)
+        rows = cls.stripe_height(len(raw_input.items), shape, memory_limit)
+
+        Msg.info(component(cls.__qualname__),
+                 f"Streaming {len(raw_input.items)} frames of shape {shape} "
+                 f"in stripes of {rows} rows ({memory_limit} MB budget)")
+
+        results: Optional[tuple[Image, ...]] = None
+
+        for first, last, stripes in raw_input.load_data_stripes(extension, rows):
+            if preprocess is not None:
+                stripes = preprocess(stripes, first, last)
+
+            partial = combine(stripes)
+
+            if results is None:
+                results = tuple(Image.zeros(shape[1], shape[0], image.type) for image in partial)
+
+            for result, image in zip(results, partial):
+                result.copy_into(image, 0, first)
+
+        return results
+
+    @classmethod
+    @profiled('combine_images')
+    def combine_images_streamed(cls,
+                                raw_input: MultiplePipelineInput,
+                                extension: int | str,
+                                method: CombineMethodType,
+                                *,
+                                memory_limit: float,
+                                preprocess: Optional[StripeProcessorType] = None) -> Image:
+        """
+        Out-of-core counterpart of `combine_images`: combine the `extension` of all frames of `raw_input`
+        while holding at most `memory_limit` megabytes of the stack in memory.
+
+        Parameters
+        ----------
+        raw_input : MultiplePipelineInput
+            Input whose frames are to be combined
+        extension : int | str
+            Extension to combine
+        method : CombineMethodType = Literal['add', 'average', 'median', 'sigclip']
+            Method to combine images using one of `add`, `average`, `median` or `sigclip`.
+        memory_limit : float
+            Memory budget for the loaded stripes, in megabytes
+        preprocess : StripeProcessorType, optional
+            Calibration to apply to each stripe before combining (e.g. dark subtraction)
+
         Returns
         -------
         combined_image : Image
-            Combined image
+            Combined image, identical to `combine_images` applied to the fully loaded frames
         """
-        combined_image = cls.combine_images(images, method)
-        # for each image, calculate the noise (read noise + shot noise, added in quadrature)
-        error = Image.zeros_like(images[0])
+        combined_image, = cls._combine_stripes(raw_input, extension,
+                                               lambda stripes: (cls.combine_images(stripes, method),),
+                                               memory_limit=memory_limit, preprocess=preprocess)
+        return combined_image
 
-        for im in images:
-            # shot noise as sqrt of signal in, after applying gain
-            poisson_noise = cpl.core.Image.zeros_like(im)
-            poisson_noise.copy_into(im, 0, 0)
+    @classmethod
+    @profiled('combine_images')
+    def combine_images_with_error_streamed(cls,
+                                           raw_input: MultiplePipelineInput,
+                                           extension: int | str,
+                                           method: CombineMethodType,
+                                           read_noise: float,
+                                           *,
+                                           memory_limit: float,
+                                           preprocess: Optional[StripeProcessorType] = None) -> tuple[Image, Image]:
+        """
+        Out-of-core counterpart of `combine_images_with_error`, see `combine_images_streamed`.
 
-            # add read noise plus shot noise
-            totalNoise = cpl.core.Image.zeros_like(poisson_noise)
-            totalNoise.add(poisson_noise)
-            totalNoise.add_scalar(read_noise ** 2)
+        Returns
+        -------
+        combined_image, error : tuple[Image, Image]
+            Combined image and its propagated error
+        """
+        return cls._combine_stripes(raw_input, extension,
+                                    lambda stripes: cls.combine_images_with_error(stripes, method, read_noise),
+                                    memory_limit=memory_limit, preprocess=preprocess)
 
-            # this is square of the noise; add to a running total
-            error.add(totalNoise)
+    @profiled('calibrate_images')
+    def calibrate_raw_images(self,
+                             extension: int | str = 'DET1.DATA',
+                             *,
+                             dark: Optional[Image] = None,
+                             flat: Optional[Image] = None,
+                             gain: Optional[float | Image] = None,
+                             linearity: Optional[ImageList] = None,
+                             linearity_dq: Optional[Image] = None,
+                             bpm: Optional[Mask] = None,
+                             read_noise: float = 0.0,
+                             saturation: Optional[float] = None,
+                             prefix: str = 'DET1') -> list[EnhancedImage]:
+        """
+        Apply the detector calibrations to every raw frame and return the calibrated frames in electrons
+        (or in ADU without a gain) with their error and data quality layers, see `calibrate_frames`.
+        The image and error layers are labelled with their unit in `BUNIT`.
 
-        # and take the sqrt
-        error.power(0.5)
-        error.divide_scalar(np.sqrt(len(images)))
+        The raw frames are read straight into a single cube and all three layers are produced
+        in one pass over it, so no intermediate images are created per calibration step.
 
-        return combined_image, error
+        Parameters
+        ----------
+        extension : int | str
+            Extension of the raw frames to calibrate
+        dark, flat : Image, optional
+            Master dark (in ADU) and normalised master flat
+        gain : float | Image, optional
+            Gain in e-/ADU, for the whole detector or per pixel
+        linearity : ImageList, optional
+            Nonlinearity correction coefficients, highest degree first
+        linearity_dq : Image, optional
+            Data quality layer of the linearity map, non-zero where the correction is not valid
+        bpm : Mask, optional
+            Bad pixel mask, flagged as `DQ_BAD_PIXEL` in every frame
+        read_noise : float
+            Read noise in electrons
+        saturation : float, optional
+            Raw level at which pixels saturate, in ADU
+        prefix : str
+            Prefix of the extensions of the calibrated images
 
+        Returns
+        -------
+        list[EnhancedImage]
+            One calibrated image per raw frame, in the order of the frameset
+        """
+        Msg.info(component(self.__class__.__qualname__),
+                 f"Calibrating {len(self.inputset.raw.items)} raw frames")
+
+        raw = self.inputset.raw.load_cube(extension, dtype=np.float32)
+        dq = None if bpm is None else np.where(np.array(bpm, dtype=bool), DQ_BAD_PIXEL, 0).astype(np.int32)
+
+        sci, err, flags = calibrate_frames(
+            raw,
+            dark=None if dark is None else np.array(dark),
+            flat=None if flat is None else np.array(flat),
+            gain=np.array(gain) if isinstance(gain, Image) else 1.0 if gain is None else gain,
+            linearity=None if linearity is None else np.array(linearity, dtype=np.float64),
+            linearity_dq=None if linearity_dq is None else np.array(linearity_dq) != 0,
+            dq=dq,
+            read_noise=read_noise,
+            saturation=saturation,
+        )
+
+        def header() -> cpl.core.PropertyList:
+            unit = cpl.core.Property('BUNIT', cpl.core.Type.STRING, self.calibrated_unit(gain), "Physical unit")
+            return cpl.core.PropertyList([unit])
+
+        return [
+            EnhancedImage(as_cpl_image(sci[i]), as_cpl_image(err[i]), as_cpl_image(flags[i]), prefix=prefix,
+                          header_image=header(), header_error=header())
+            for i in range(len(sci))
+        ]
+
+    def detector_gain(self, extension: str = 'DET1.SCI') -> Optional[float]:
+        """
+        Read the gain (in e-/ADU) of a detector from the gain map.
+        The gain map produced by `metis_det_lingain` is a table with a single row.
+
+        Without a gain map the frames cannot be converted to electrons: warn and return None,
+        so that they are kept in ADU (see `calibrated_unit`).
+
+        Raises
+        ------
+        cpl.core.DataNotFoundError
+            If the gain map has no valid gain for the detector
+        """
+        gain_input = getattr(self.inputset, 'gain_map', None)
+        if gain_input is None or gain_input.frame is None:
+            Msg.warning(component(self.__class__.__qualname__),
+                        f"No gain map, the data are not converted to electrons and stay in ADU")
+            return None
+
+        try:
+            gain = float(gain_input.load_data(extension)['gain', 0])
+        except (KeyError, IndexError, cpl.core.DataNotFoundError, cpl.core.IllegalInputError) as e:
+            raise cpl.core.DataNotFoundError(
+                f"Could not read the gain of {extension} from the gain map {gain_input.frame.file}: {e}"
+            ) from e
+
+        if not np.isfinite(gain) or gain <= 0:
+            raise cpl.core.DataNotFoundError(
+                f"Invalid gain {gain} of {extension} in the gain map {gain_input.frame.file}"
+            )
+
+        return gain
+
+    @staticmethod
+    def calibrated_unit(gain: Optional[float | Image]) -> str:
+        """ The unit of frames calibrated with `gain` (see `detector_gain`): electrons, or ADU without a gain. """
+        return 'ADU' if gain is None else 'e-'
 
     def correct_gain(self, raw_images: ImageList, gain: Image) -> ImageList:
         """
@@ -145,7 +436,7 @@ class RawImageProcessor(RecipeImpl, ABC):
         corrected_images : ImageList
             List of gain-corrected images
         """
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                  f"Pretending to correct raw images for gain")
 
         raw_images.divide_image(gain)
@@ -153,57 +444,140 @@ class RawImageProcessor(RecipeImpl, ABC):
         return raw_images
 
 
-    def correct_nonlinearity(self, raw_images: ImageList, linearity_map: Image) -> ImageList:
+    @classmethod
+    @profiled('correct_nonlinearity')
+    def correct_nonlinearity(cls,
+                             raw_images: ImageList,
+                             linearity_map: ImageList,
+                             *,
+                             linearity_dq: Optional[Image] = None) -> ImageList:
         """
-        Correct the raw image list for non-linearity.
-
-        # FixMe Currently only a mockup, does not actually do anything.
+        Correct the raw image list for non-linearity, with the per-pixel polynomials of a linearity map
+        (one coefficient plane per degree, highest first, as produced by `metis_det_lingain`).
 
         Parameters
         ----------
         raw_images : ImageList
             List of raw images to correct for nonlinearity.
+        linearity_map : ImageList
+            Coefficient planes of the linearity map
+        linearity_dq : Image, optional
+            Data quality layer of the linearity map, non-zero where the correction is not valid
 
         Returns
         -------
         ImageList
-            List of raws, now corrected for non-linearity.
+            List of raws, now corrected for non-linearity. Pixels that could not be corrected are rejected.
         """
-        Msg.info(self.__class__.__qualname__, f"Pretending to correct for non-linearity")
-        return raw_images
+        corrected, _ = cls._correct_nonlinearity(raw_images, None, linearity_map, None, linearity_dq)
+        return corrected
+
+    @classmethod
+    @profiled('correct_nonlinearity')
+    def correct_nonlinearity_with_error(cls,
+                                        raw_images: ImageList,
+                                        errors: ImageList,
+                                        linearity_map: ImageList,
+                                        linearity_error: ImageList,
+                                        *,
+                                        linearity_dq: Optional[Image] = None) -> tuple[ImageList, ImageList]:
+        """
+        Correct the raw image list for non-linearity as `correct_nonlinearity`, and propagate the errors
+        of the images and of the linearity map coefficients.
+
+        Returns
+        -------
+        corrected_images, errors : tuple[ImageList, ImageList]
+            List of raws corrected for non-linearity, and their errors
+        """
+        return cls._correct_nonlinearity(raw_images, errors, linearity_map, linearity_error, linearity_dq)
+
+    @classmethod
+    def _correct_nonlinearity(cls,
+                              raw_images: ImageList,
+                              errors: Optional[ImageList],
+                              linearity_map: ImageList,
+                              linearity_error: Optional[ImageList],
+                              linearity_dq: Optional[Image]) -> tuple[ImageList, Optional[ImageList]]:
+        Msg.info(component(cls.__qualname__),
+                 f"Correcting {len(raw_images)} images for non-linearity "
+                 f"with polynomials of degree {len(linearity_map) - 1}")
+
+        stack = np.array(raw_images, dtype=np.float32)
+        error = None if errors is None else np.array(errors, dtype=np.float32)
+        masks = [image.bpm for image in raw_images]
+
+        dq = correct_nonlinearity(
+            stack,
+            np.array(linearity_map, dtype=np.float64),
+            error=error,
+            coeffs_error=None if linearity_error is None else np.array(linearity_error, dtype=np.float64),
+            coeffs_dq=None if linearity_dq is None else np.array(linearity_dq) != 0,
+        )
+
+        if (count := np.count_nonzero(dq[0])) > 0:
+            Msg.info(component(cls.__qualname__), f"{count} pixels of the first image could not be corrected")
+
+        def as_image(plane: np.ndarray, rejected: np.ndarray) -> Image:
+            image = Image(plane)
+            if rejected.any():
+                image.reject_from_mask(Mask(rejected))
+            return image
+
+        corrected_images = ImageList()
+        corrected_errors = None if error is None else ImageList()
+        for i, mask in enumerate(masks):
+            rejected = dq[i] != 0
+            if mask is not None:
+                rejected |= np.array(mask, dtype=bool)
+
+            corrected_images.append(as_image(stack[i], rejected))
+            if corrected_errors is not None:
+                corrected_errors.append(as_image(error[i], rejected))
+
+        return corrected_images, corrected_errors
 
     def calculate_outliers(self,
                            image: Image,
                            *,
-                           kappa_low: int,
-                           kappa_high: int) -> tuple[cpl.core.Mask, cpl.core.Mask]:
+                           kappa_low: float,
+                           kappa_high: float,
+                           iterations: int = 5) -> tuple[cpl.core.Mask, cpl.core.Mask]:
         """
-        Calculate masks for outlier pixels, with kappa-sigma clipping:
-        mask those values are outside [median - kappa_low * sigma, median + kappa_high * sigma].
+        Calculate masks for outlier pixels, with iterative kappa-sigma clipping around the median:
+        hot pixels lie above median + kappa_high * sigma and cold pixels below median - kappa_low * sigma,
+        with sigma the normalised median absolute deviation of the pixels that survive the clipping,
+        so that neither estimate is dragged by the outliers themselves. Rejected pixels are never outliers.
         """
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                  f"Identifying outlier pixels ({kappa_low=}, {kappa_high=})")
 
-        # get masks from thresholds for bad, hot and cold pixels
-        # count the number of bad pixels in each, for later, then
-        # change to Image type from mask for later calculations
-
-        image_median = image.get_median()
-        image_rms = image.get_stdev()
+        data = np.array(image, dtype=np.float32)
+        bpm = None if image.bpm is None else np.array(image.bpm, dtype=bool)
 
-        # create a cpl.Mask based on thresholds; anything outside the low to high range is set to True (masked)
-        # anything inside it is set to False (unmasked)
-        # no image operation is performed. 
+        _, stats = sigma_clip(data, mask=bpm, centre='median', scale='mad',
+                              kappa_low=kappa_low, kappa_high=kappa_high, iterations=iterations)
 
-        # hot pixels (set the low value to something well below expected pixels)
-        mask_hot = cpl.core.Mask.threshold_image(image, -1e6, image_median + kappa_high * image_rms, 0)
-        # cold pixels (set the high value to something outside the range of expected values)
-        mask_cold = cpl.core.Mask.threshold_image(image, image_median - kappa_low * image_rms, 1e10, 0)
+        valid = np.isfinite(data) if bpm is None else np.isfinite(data) & ~bpm
+        mask_hot = cpl.core.Mask(valid & (data > stats.high))
+        mask_cold = cpl.core.Mask(valid & (data < stats.low))
 
         return mask_hot, mask_cold
 
+    @classmethod
+    def stack_moments(cls, images: Iterable[Image]) -> StackMoments:
+        """
+        Accumulate per-pixel and per-frame statistics of `images` in a single pass, without modifying them.
+        `images` may be an ImageList or a generator loading the frames one at a time
+        (e.g. `MultiplePipelineInput.iterate_data`). Rejected pixels are excluded.
+        """
+        return StackMoments.from_frames(
+            (np.array(image), None if image.bpm is None else np.array(image.bpm, dtype=bool))
+            for image in images
+        )
+
     def metis_bpm_3d_compute(self,
-                             imagelist: ImageList,
+                             moments: StackMoments,
                              *,
                              kappa_low: float,
                              kappa_high: float) -> cpl.core.Mask:
@@ -214,8 +588,8 @@ class RawImageProcessor(RecipeImpl, ABC):
 
         Parameters
         ----------
-        imagelist : ImageList
-            List of raw images to combine
+        moments : StackMoments
+            Statistics of the stack of raw images, see `stack_moments`
 
         kappa_low : float
             Lower bound of kappa for outlier pixels
@@ -228,35 +602,20 @@ class RawImageProcessor(RecipeImpl, ABC):
         mask : cpl.core.Mask
             Mask for outlier pixels.
         """
-        Msg.info(self.__class__.__qualname__,
+        Msg.info(component(self.__class__.__qualname__),
                  f"Calculating bad pixel mask ({kappa_low=}, {kappa_high=})")
 
-        image_sum = Image.zeros_like(imagelist[0])
-        image_sum_squared = Image.zeros_like(imagelist[0])
-
-        # image_sum = self.combine_images(imagelist, method="add")
+        # Squared mean plus mean of the squares of every pixel along the stack
+        statistic = Image(np.sqrt(np.nan_to_num(moments.mean ** 2 + moments.mean_square)))
 
-        for im in imagelist:
-            imTem = cpl.core.Image.zeros_like(im)
-            # copy_into means "copy other into this image", not the other way around!
-            imTem.copy_into(im, 0, 0)
-            image_sum.add(im)
-            im.power(2)
-            image_sum_squared.add(im)
+        if (empty := moments.count == 0).any():
+            statistic.reject_from_mask(cpl.core.Mask(empty))
 
-        image_sum.divide_scalar(len(imagelist))
-        image_sum.power(2)
-        image_sum_squared.divide_scalar(len(imagelist))
+        image_median = statistic.get_median()
+        image_rms = statistic.get_stdev()
 
-        image_sum.add(image_sum_squared)
-        image_sum.power(0.5)
-
-        image_median = image_sum.get_median()
-        image_rms = image_sum.get_stdev()
-
-        mask = cpl.core.Mask.threshold_image(image_sum,
+        mask = cpl.core.Mask.threshold_image(statistic,
                                              image_median - kappa_low * image_rms,
                                              image_median + kappa_high * image_rms,
                                              1)
         return mask
-
@@ -22,7 +22,8 @@ import pytest
 from pymetis.instruments.metis.recipes.ifu.metis_ifu_rsrf import (MetisIfuRsrf as Recipe,
                                                 MetisIfuRsrfImpl as Impl)
 from pymetis.tests.classes import BaseRecipeTest, BaseProductSetTest, RawInputSetTest
-from pymetis.instruments.metis.recipes.ifu.metis_ifu_rsrf import create_ifu_blackbody_image, extract_ifu_1d_spectra
+from pymetis.instruments.metis.recipes.ifu.metis_ifu_rsrf import (create_ifu_blackbody_image, extract_ifu_1d_spectra,
+                                                                 WavelengthLookup)
 
 from pytest import approx
 import numpy as np
@@ -83,6 +84,23 @@ class TestBlackBodyImg:
         assert bb_img.get_max() == approx(3.265, rel=1e-3)
 
 
+class TestWavelengthLookup:
+    def test_paint(self):
+        rng = np.random.default_rng(42)
+        wdata = rng.choice([0.0, 3.6, 3.7, 3.8, 3.9], size=(64, 48))
+        lookup = WavelengthLookup(wdata)
+
+        np.testing.assert_array_equal(lookup.wavelengths, [3.6, 3.7, 3.8, 3.9])
+        painted = lookup.paint(2 * lookup.wavelengths)
+        np.testing.assert_array_equal(painted, 2 * wdata)
+
+    def test_cached_per_image(self):
+        wdata = np.linspace(3.5, 4.0, 512 * 16).reshape(16, 512)
+
+        assert WavelengthLookup.for_image(wdata) is WavelengthLookup.for_image(wdata.copy())
+        assert WavelengthLookup.for_image(wdata) is not WavelengthLookup.for_image(wdata + 0.1)
+
+
 class TestExtractTraces:
     def test_extract_traces(self):
         # build a dummy trace list
@@ -0,0 +1,172 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+from types import SimpleNamespace
+from typing import Optional
+
+import numpy as np
+import pytest
+
+import cpl
+from cpl.core import Image, ImageList, Mask
+
+from pymetis.instruments.metis.recipes.prefab.rawimage import RawImageProcessor
+
+
+METHODS = ['add', 'average', 'median', 'sigclip']
+ROWS = 3
+
+
+def make_image(data: np.ndarray, rejected: Optional[np.ndarray] = None) -> Image:
+    """A float `Image` of `data`, with the pixels flagged in `rejected` rejected."""
+    image = Image(np.ascontiguousarray(data, dtype=np.float32))
+    if rejected is not None and rejected.any():
+        image.reject_from_mask(Mask(np.ascontiguousarray(rejected)))
+    return image
+
+
+class StripedInput:
+    """
+    A stand-in for `MultiplePipelineInput` that serves a stack held in memory
+    through the same `shape` / `load_data_stripes` interface as the FITS-backed input.
+    """
+    def __init__(self, stack: np.ndarray, rejected: np.ndarray):
+        self.stack = stack
+        self.rejected = rejected
+        self.items = list(range(len(stack)))
+        self.stripes: list[tuple[int, int]] = []
+
+    def shape(self, extension: int | str) -> tuple[int, int]:
+        return self.stack.shape[1:]
+
+    def load_data(self) -> ImageList:
+        return ImageList([make_image(frame, mask) for frame, mask in zip(self.stack, self.rejected)])
+
+    def load_data_stripes(self, extension: int | str, rows: int):
+        for first in range(0, self.stack.shape[1], rows):
+            last = min(first + rows, self.stack.shape[1])
+            self.stripes.append((first, last))
+            yield first, last, ImageList([make_image(frame[first:last], mask[first:last])
+                                          for frame, mask in zip(self.stack, self.rejected)])
+
+
+@pytest.fixture
+def raw_input() -> StripedInput:
+    """ Seven frames of 20 x 16 pixels with a few rejected samples, and one pixel rejected in all frames. """
+    rng = np.random.default_rng(2024)
+    stack = rng.normal(1000.0, 30.0, size=(7, 20, 16)).astype(np.float32)
+    stack[2, 5, 7] = 5000.0
+    rejected = rng.random(stack.shape) < 0.05
+    rejected[:, 11, 3] = True
+    return StripedInput(stack, rejected)
+
+
+@pytest.fixture
+def memory_limit(raw_input: StripedInput) -> float:
+    """ A memory budget that fits exactly `ROWS` rows of the stack, see `RawImageProcessor.stripe_height`. """
+    count, _, width = raw_input.stack.shape
+    return ROWS * 2 * count * width * np.dtype(np.float32).itemsize / 2 ** 20
+
+
+def rejected_pixels(image: Image) -> np.ndarray:
+    return np.zeros(np.array(image).shape, dtype=bool) if image.bpm is None else np.array(image.bpm, dtype=bool)
+
+
+def assert_images_equal(actual: Image, expected: Image) -> None:
+    np.testing.assert_array_equal(np.array(actual), np.array(expected))
+    np.testing.assert_array_equal(rejected_pixels(actual), rejected_pixels(expected))
+
+
+class TestCombineStreamed:
+    """ Combining in stripes must reproduce combining the fully loaded stack bit for bit. """
+
+    def test_memory_limit_forces_several_stripes(self, raw_input, memory_limit):
+        assert RawImageProcessor.stripe_height(len(raw_input.items), raw_input.shape(0), memory_limit) == ROWS
+
+        RawImageProcessor.combine_images_streamed(raw_input, 0, 'average', memory_limit=memory_limit)
+
+        assert len(raw_input.stripes) == 7
+        assert raw_input.stripes[-1] == (18, 20)
+
+    @pytest.mark.parametrize('method', METHODS)
+    def test_combine_matches_full_stack(self, raw_input, memory_limit, method):
+        expected = RawImageProcessor.combine_images(raw_input.load_data(), method)
+        combined = RawImageProcessor.combine_images_streamed(raw_input, 0, method, memory_limit=memory_limit)
+
+        assert len(raw_input.stripes) > 1
+        assert_images_equal(combined, expected)
+
+    @pytest.mark.parametrize('method', METHODS)
+    def test_combine_with_error_matches_full_stack(self, raw_input, memory_limit, method):
+        expected, expected_error = RawImageProcessor.combine_images_with_error(raw_input.load_data(), method, 5.0)
+        combined, error = RawImageProcessor.combine_images_with_error_streamed(raw_input, 0, method, 5.0,
+                                                                               memory_limit=memory_limit)
+
+        assert len(raw_input.stripes) > 1
+        assert_images_equal(combined, expected)
+        assert_images_equal(error, expected_error)
+
+    @pytest.mark.parametrize('method', METHODS)
+    def test_preprocess_matches_full_stack(self, raw_input, memory_limit, method):
+        dark = make_image(np.linspace(0.0, 50.0, 20 * 16).reshape(20, 16))
+        images = raw_input.load_data()
+        images.subtract_image(dark)
+
+        expected = RawImageProcessor.combine_images(images, method)
+        combined = RawImageProcessor.combine_images_streamed(raw_input, 0, method, memory_limit=memory_limit,
+                                                             preprocess=RawImageProcessor.subtract_stripe(dark))
+
+        assert_images_equal(combined, expected)
+
+
+class GainMapInput:
+    """ A stand-in for the gain map input that serves `table` (or raises it) for every extension. """
+    frame = SimpleNamespace(file='gain_map.fits')
+
+    def __init__(self, table):
+        self.table = table
+
+    def load_data(self, extension: int | str):
+        if isinstance(self.table, Exception):
+            raise self.table
+        return self.table
+
+
+def with_gain_map(gain_map: Optional[GainMapInput]) -> SimpleNamespace:
+    """ Just enough of a recipe for `RawImageProcessor.detector_gain`. """
+    return SimpleNamespace(inputset=SimpleNamespace(gain_map=gain_map))
+
+
+class TestDetectorGain:
+    """ Without a gain map the data stay in ADU, a broken gain map is an error. """
+
+    def test_gain_is_read_from_the_map(self):
+        recipe = with_gain_map(GainMapInput({('gain', 0): 2.5}))
+
+        assert RawImageProcessor.detector_gain(recipe) == 2.5
+        assert RawImageProcessor.calibrated_unit(2.5) == 'e-'
+
+    def test_no_gain_map_keeps_adu(self):
+        assert RawImageProcessor.detector_gain(with_gain_map(None)) is None
+        assert RawImageProcessor.calibrated_unit(None) == 'ADU'
+
+    @pytest.mark.parametrize('table', [KeyError('gain'), {('gain', 0): 0.0}, {('gain', 0): float('nan')}])
+    def test_broken_gain_map_raises(self, table):
+        with pytest.raises(cpl.core.DataNotFoundError, match='gain'):
+            RawImageProcessor.detector_gain(with_gain_map(GainMapInput(table)))
@@ -17,12 +17,17 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 """
 
+from types import SimpleNamespace
+
+import numpy as np
 import pytest
 
 import cpl
+from cpl.core import Image, ImageList
 
 from pymetis.instruments.metis.recipes.metis_det_dark import (MetisDetDark as Recipe,
                                                               MetisDetDarkImpl as Impl)
+from pymetis.instruments.metis.tests.recipes.prefab.test_rawimage import StripedInput, make_image
 from pymetis.tests.classes import BandParamRecipeTest, RawInputSetTest
 from pymetis.tests.classes.product import ImageProductSetTest
 
@@ -66,3 +71,50 @@ class TestProduct(ImageProductSetTest):
     Product = Impl.ProductSet.MasterDark
 
 
+
+
+class TestRawCorrections:
+    """ The dark is combined from corrected stripes, which must match correcting the fully loaded frames. """
+    @pytest.fixture
+    def impl(self) -> Impl:
+        rng = np.random.default_rng(7)
+        stack = rng.normal(1000.0, 30.0, size=(5, 20, 16)).astype(np.float32)
+        raw = StripedInput(stack, rng.random(stack.shape) < 0.05)
+
+        calibrations = {
+            'DET1.SCI': ImageList([make_image(rng.normal(0.0, 1e-6, (20, 16))),
+                                   make_image(np.ones((20, 16))),
+                                   make_image(np.zeros((20, 16)))]),
+            'DET1.DQ': make_image((rng.random((20, 16)) < 0.1).astype(np.float32)),
+            'PERSISTENCE_MAP': make_image(np.full((20, 16), 3.0)),
+        }
+
+        def load_data(extension: str):
+            return calibrations[extension]
+
+        # `raw_corrections` and the combination only need the inputs, not a whole recipe run
+        impl = object.__new__(Impl)
+        impl.inputset = SimpleNamespace(raw=raw,
+                                        linearity=SimpleNamespace(frame=object(), load_data=load_data),
+                                        persistence_map=SimpleNamespace(load_data=load_data))
+        return impl
+
+    @pytest.mark.parametrize('method', ['average', 'median', 'sigclip'])
+    def test_streamed_matches_full_stack(self, impl, method):
+        gain = make_image(np.full((20, 16), 2.0))
+        raw = impl.inputset.raw
+        # Three rows of all five frames at a time, see `RawImageProcessor.stripe_height`
+        memory_limit = 2 * 5 * 16 * 4 * 3 / 2 ** 20
+
+        combined, error = impl.combine_images_with_error_streamed(raw, 'DET1.DATA', method, 5.0,
+                                                                  memory_limit=memory_limit,
+                                                                  preprocess=impl.raw_corrections(1, gain))
+
+        full = impl.correct_nonlinearity(raw.load_data(), impl.inputset.linearity.load_data('DET1.SCI'),
+                                         linearity_dq=impl.inputset.linearity.load_data('DET1.DQ'))
+        full = impl.correct_persistence(impl.correct_gain(full, gain))
+        expected, expected_error = impl.combine_images_fused(full, method, read_noise=5.0)
+
+        assert len(raw.stripes) > 1
+        np.testing.assert_allclose(np.array(combined), np.array(expected), rtol=1e-6)
+        np.testing.assert_allclose(np.array(error), np.array(expected_error), rtol=1e-6)
@@ -0,0 +1,67 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import argparse
+import sys
+import tempfile
+from pathlib import Path
+
+from pymetis.tests.benchmarks.runner import default_steps, run_benchmarks
+
+
+def parse_args(argv: list[str]) -> argparse.Namespace:
+    parser = argparse.ArgumentParser(
+        prog='python -m pymetis.tests.benchmarks',
+        description="Run the METIS recipes end to end on synthetic full-size data and record "
+                    "wall time, frames per second, peak memory and I/O for every recipe.",
+    )
+    parser.add_argument('-d', '--directory', type=Path, default=None,
+                        help="working directory for the synthetic data and products (default: a temporary one)")
+    parser.add_argument('-o', '--output', type=Path, default=Path('benchmark.json'),
+                        help="file to write the results to (default: %(default)s)")
+    parser.add_argument('-n', '--frames', type=int, default=5,
+                        help="number of raw frames per recipe (default: %(default)s)")
+    parser.add_argument('-s', '--seed', type=int, default=0,
+                        help="seed of the synthetic data (default: %(default)s)")
+    parser.add_argument('--size', type=int, default=2048,
+                        help="size of the synthetic detectors in pixels (default: %(default)s)")
+    parser.add_argument('-r', '--recipes', nargs='+', default=None,
+                        choices=[step.name for step in default_steps(1)],
+                        help="run only these steps and what they depend on (default: all)")
+    return parser.parse_args(argv)
+
+
+def main(argv: list[str]) -> int:
+    args = parse_args(argv)
+
+    with tempfile.TemporaryDirectory(prefix='pymetis-benchmark-') as scratch:
+        report = run_benchmarks(args.directory or scratch,
+                                frames=args.frames, seed=args.seed, size=args.size,
+                                recipes=args.recipes, output=args.output)
+
+    for result in report['results']:
+        print(f"{result['step']:<24} {result['wall_time']:9.2f} s {result['frames_per_second']:8.2f} fps "
+              f"{result['peak_rss'] / 2**20:9.1f} MiB RSS "
+              f"{result['read_chars'] / 2**20:9.1f} MiB read {result['write_chars'] / 2**20:9.1f} MiB written")
+    print(f"Results written to {args.output}")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
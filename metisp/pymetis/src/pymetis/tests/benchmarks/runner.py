@@ -0,0 +1,242 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import datetime
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+from dataclasses import dataclass, field, asdict
+from pathlib import Path
+from typing import Any, Callable, Optional
+
+import numpy as np
+
+from pymetis.engine.core.functions.resources import io_counters, peak_rss, reset_peak_rss
+from pymetis.tests.benchmarks.synthetic import SyntheticDataGenerator, SyntheticFrame, write_sof, read_sof
+
+# Version of the layout of the results file, to be bumped whenever it changes incompatibly
+RESULTS_SCHEMA = 1
+
+
+@dataclass
+class BenchmarkResult:
+    """ Resources consumed by a single recipe invocation, as measured from within its own process. """
+    recipe: str
+    frames: int
+    wall_time: float                # s
+    cpu_time: float                 # s, user + system
+    peak_rss: int                   # bytes
+    read_bytes: int                 # bytes actually fetched from storage
+    write_bytes: int                # bytes actually sent to storage
+    read_chars: int                 # bytes passed to read(2) and friends, including the page cache
+    write_chars: int                # bytes passed to write(2) and friends
+    products: list[dict[str, str]] = field(default_factory=list)
+
+    @property
+    def frames_per_second(self) -> float:
+        return self.frames / self.wall_time if self.wall_time > 0 else float('nan')
+
+    def as_dict(self) -> dict[str, Any]:
+        return asdict(self) | {'frames_per_second': self.frames_per_second}
+
+
+@dataclass(frozen=True)
+class BenchmarkStep:
+    """
+    One recipe invocation of the benchmark chain: the raw frames it reduces,
+    plus the products of earlier steps it needs as calibrations.
+    """
+    name: str
+    recipe: str
+    raw: Callable[[SyntheticDataGenerator], list[SyntheticFrame]]
+    requires: tuple[str, ...] = ()
+    static: Callable[[SyntheticDataGenerator], list[SyntheticFrame]] = lambda generator: []
+    settings: dict[str, Any] = field(default_factory=dict)
+
+
+def default_steps(frames: int, dits: tuple[float, ...] = (1.0, 2.0, 4.0, 8.0)) -> list[BenchmarkStep]:
+    """ The standard chain: LM imaging from darks to basic reduction, and the IFU relative spectral response. """
+    return [
+        BenchmarkStep('dark_2rg', 'metis_det_dark',
+                      lambda g: g.darks('2RG', frames)),
+        BenchmarkStep('lingain_2rg', 'metis_det_lingain',
+                      lambda g: g.detlin('2RG', dits)),
+        BenchmarkStep('lm_img_flat', 'metis_lm_img_flat',
+                      lambda g: g.lamp_flats('LM', '2RG', frames),
+                      requires=('dark_2rg', 'lingain_2rg')),
+        BenchmarkStep('lm_img_basic_reduce', 'metis_lm_img_basic_reduce',
+                      lambda g: g.science('LM', '2RG', frames),
+                      requires=('dark_2rg', 'lingain_2rg', 'lm_img_flat')),
+        BenchmarkStep('dark_ifu', 'metis_det_dark',
+                      lambda g: g.darks('IFU', frames)),
+        BenchmarkStep('ifu_rsrf', 'metis_ifu_rsrf',
+                      lambda g: g.ifu_rsrf(frames) + g.ifu_wcu_off(frames),
+                      requires=('dark_ifu',),
+                      static=lambda g: [g.ifu_distortion_table(), g.ifu_wavecal()]),
+    ]
+
+
+def measure(recipe: str, sof: Path, settings: dict[str, Any]) -> BenchmarkResult:
+    """
+    Run a single recipe on the frames listed in `sof` within the current process and measure it.
+    Products are written to the current working directory, as with `pyesorex`.
+    """
+    import cpl
+    from pymetis.engine.recipes.recipe import Recipe
+    import pymetis.instruments.metis.recipes                # noqa: F401 -- fills the recipe registry
+
+    frameset = cpl.ui.FrameSet()
+    frames = read_sof(sof)
+    for frame in frames:
+        frameset.append(cpl.ui.Frame(str(frame.path), tag=frame.tag))
+
+    reset_peak_rss()
+    io_start = io_counters()
+    cpu_start = time.process_time()
+    start = time.perf_counter()
+
+    products = Recipe._registry[recipe]().run(frameset, settings)
+
+    wall_time = time.perf_counter() - start
+    cpu_time = time.process_time() - cpu_start
+    io_end = io_counters()
+
+    return BenchmarkResult(
+        recipe=recipe,
+        frames=sum(frame.is_raw for frame in frames),
+        wall_time=wall_time,
+        cpu_time=cpu_time,
+        peak_rss=peak_rss(),
+        read_bytes=io_end['read_bytes'] - io_start['read_bytes'],
+        write_bytes=io_end['write_bytes'] - io_start['write_bytes'],
+        read_chars=io_end['rchar'] - io_start['rchar'],
+        write_chars=io_end['wchar'] - io_start['wchar'],
+        products=[{'file': str(Path(product.file).resolve()), 'tag': product.tag} for product in products],
+    )
+
+
+def run_isolated(recipe: str, sof: Path, workdir: Path, settings: Optional[dict[str, Any]] = None) -> BenchmarkResult:
+    """
+    Run and measure a single recipe in a fresh interpreter, so that peak memory and I/O
+    are not polluted by the generator or by the recipes that ran before.
+    """
+    workdir.mkdir(parents=True, exist_ok=True)
+    completed = subprocess.run(
+        [sys.executable, '-m', 'pymetis.tests.benchmarks.runner', recipe, str(sof.resolve()),
+         json.dumps(settings or {})],
+        cwd=workdir, capture_output=True, text=True,
+    )
+    (workdir / 'recipe.log').write_text(completed.stderr)
+
+    if completed.returncode != 0:
+        raise RuntimeError(f"Recipe {recipe} failed with exit code {completed.returncode}, "
+                           f"see {workdir / 'recipe.log'}")
+
+    result = json.loads(completed.stdout.splitlines()[-1])
+    result.pop('frames_per_second')
+    return BenchmarkResult(**result)
+
+
+def metadata(**parameters) -> dict[str, Any]:
+    """ Describe the machine and the software stack, so that results can be compared across runs. """
+    try:
+        from importlib.metadata import version
+        pymetis_version = version('pymetis')
+    except Exception:
+        pymetis_version = None
+
+    return {
+        'schema': RESULTS_SCHEMA,
+        'timestamp': datetime.datetime.now(datetime.timezone.utc).isoformat(timespec='seconds'),
+        'hostname': platform.node(),
+        'platform': platform.platform(),
+        'processor': platform.processor() or platform.machine(),
+        'cpu_count': os.cpu_count(),
+        'python': platform.python_version(),
+        'numpy': np.__version__,
+        'pymetis': pymetis_version,
+        'parameters': parameters,
+    }
+
+
+def run_benchmarks(directory: Path | str,
+                   *,
+                   frames: int = 5,
+                   seed: int = 0,
+                   size: int = 2048,
+                   recipes: Optional[list[str]] = None,
+                   output: Optional[Path | str] = None) -> dict[str, Any]:
+    """
+    Generate the synthetic data, run the benchmark chain and return (and optionally write) the results.
+
+    `recipes` restricts the chain to the named steps, but the steps they depend on are always run too.
+    """
+    directory = Path(directory)
+    generator = SyntheticDataGenerator(directory / 'raw', seed=seed, size=size)
+    steps = default_steps(frames)
+
+    selected = {step.name for step in steps} if recipes is None else set(recipes)
+    unknown = selected - {step.name for step in steps}
+    if unknown:
+        raise ValueError(f"Unknown benchmark steps: {', '.join(sorted(unknown))}")
+    for step in reversed(steps):
+        if step.name in selected:
+            selected.update(step.requires)
+
+    products: dict[str, list[SyntheticFrame]] = {}
+    results = []
+    for step in steps:
+        if step.name not in selected:
+            continue
+
+        frames_in = step.raw(generator) + step.static(generator)
+        for required in step.requires:
+            frames_in += products[required]
+
+        workdir = directory / step.name
+        workdir.mkdir(parents=True, exist_ok=True)
+        result = run_isolated(step.recipe, write_sof(workdir / f'{step.name}.sof', frames_in), workdir, step.settings)
+        products[step.name] = [SyntheticFrame(Path(product['file']), product['tag']) for product in result.products]
+        results.append({'step': step.name} | result.as_dict())
+
+    report = {
+        'metadata': metadata(frames=frames, seed=seed, size=size, steps=[r['step'] for r in results]),
+        'results': results,
+    }
+
+    if output is not None:
+        Path(output).write_text(json.dumps(report, indent=2))
+
+    return report
+
+
+def main(argv: list[str]) -> int:
+    """ Child process entry point: `runner <recipe> <sof> [<settings as JSON>]`, prints the result as JSON. """
+    recipe, sof = argv[0], Path(argv[1])
+    settings = json.loads(argv[2]) if len(argv) > 2 else {}
+    result = measure(recipe, sof, settings)
+    sys.stdout.write(json.dumps(result.as_dict()) + '\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
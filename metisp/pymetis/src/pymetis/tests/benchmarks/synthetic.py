@@ -0,0 +1,223 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import itertools
+from dataclasses import dataclass
+from pathlib import Path
+from typing import Iterable, Literal, Optional
+
+import numpy as np
+from astropy.io import fits
+
+
+DetectorName = Literal['2RG', 'GEO', 'IFU']
+
+
+@dataclass(frozen=True)
+class Detector:
+    """ Static description of a detector system, as far as the synthetic data are concerned. """
+    name: DetectorName
+    tech: str
+    extensions: int
+    gain: float             # e- / ADU
+    read_noise: float       # ADU
+    dark_current: float     # ADU / s
+
+
+DETECTORS: dict[DetectorName, Detector] = {
+    '2RG': Detector('2RG', 'IMAGE,LM', 1, gain=4.0, read_noise=70 / 4.0, dark_current=0.05 / 4.0),
+    'GEO': Detector('GEO', 'IMAGE,N', 1, gain=201.0, read_noise=300 / 201.0, dark_current=1e5 / 201.0),
+    'IFU': Detector('IFU', 'IFU', 4, gain=2.0, read_noise=70 / 2.0, dark_current=0.1 / 2.0),
+}
+
+
+@dataclass(frozen=True)
+class SyntheticFrame:
+    """ A generated file together with its tag, ready to be listed in a SOF. """
+    path: Path
+    tag: str
+
+    @property
+    def is_raw(self) -> bool:
+        return self.tag.endswith('_RAW')
+
+
+class SyntheticDataGenerator:
+    """
+    Deterministic generator of realistic raw frames (and the few static calibrations that cannot be produced
+    by running another recipe) for benchmarking the recipes end to end.
+
+    Every frame gets its own random stream derived from the seed and a running frame number,
+    so the same sequence of calls always produces bitwise identical files.
+    Pixels are written as float32, as produced by the instrument simulator.
+    """
+    bias: float = 1000.0            # ADU
+    nonlinearity: float = 2e-6      # fractional loss of signal per ADU
+
+    def __init__(self,
+                 directory: Path | str,
+                 *,
+                 seed: int = 0,
+                 size: int = 2048):
+        self.directory = Path(directory)
+        self.directory.mkdir(parents=True, exist_ok=True)
+        self.seed = seed
+        self.size = size
+        self._counter = itertools.count()
+
+    def _signal(self, detector: Detector, rng: np.random.Generator, flux: float | np.ndarray, dit: float) -> np.ndarray:
+        """ Counts of one detector: bias, dark current, mildly nonlinear flux, shot and read noise. """
+        electrons = np.broadcast_to(np.asarray(flux, dtype=np.float64) * dit, (self.size, self.size))
+        signal = electrons * (1 - self.nonlinearity * electrons) + detector.dark_current * dit
+        noisy = rng.normal(signal, np.sqrt(np.maximum(signal, 0) / detector.gain + detector.read_noise ** 2))
+        return (noisy + self.bias).astype(np.float32)
+
+    def _illumination(self, level: float) -> np.ndarray:
+        """ A smooth, slightly vignetted illumination pattern with the given mean level [ADU / s]. """
+        axis = np.linspace(-1, 1, self.size)
+        return level * (1 - 0.1 * (axis[np.newaxis, :] ** 2 + axis[:, np.newaxis] ** 2))
+
+    def frame(self,
+              tag: str,
+              detector: DetectorName,
+              *,
+              catg: str,
+              dpr_type: str,
+              dit: float,
+              ndit: int = 1,
+              flux: float | np.ndarray = 0.0,
+              filter_name: str = 'open',
+              pro_catg: Optional[str] = None) -> SyntheticFrame:
+        """ Write a single multi-extension raw frame with the given exposure and illumination. """
+        number = next(self._counter)
+        rng = np.random.default_rng([self.seed, number])
+        system = DETECTORS[detector]
+
+        primary = fits.PrimaryHDU()
+        header = primary.header
+        header['INSTRUME'] = 'METIS'
+        header['MJD-OBS'] = 60000.0 + number / 86400
+        header['HIERARCH ESO DPR CATG'] = catg
+        header['HIERARCH ESO DPR TYPE'] = dpr_type
+        header['HIERARCH ESO DPR TECH'] = system.tech
+        header['HIERARCH ESO DET DIT'] = float(dit)
+        header['HIERARCH ESO DET NDIT'] = int(ndit)
+        header['HIERARCH ESO DRS FILTER'] = filter_name
+        header['HIERARCH ESO DRS IFU'] = 'open'
+        if pro_catg is not None:
+            header['HIERARCH ESO PRO CATG'] = pro_catg
+
+        extensions = [fits.ImageHDU(self._signal(system, rng, flux, dit), name=f'DET{det:d}.DATA')
+                      for det in range(1, system.extensions + 1)]
+
+        path = self.directory / f'{tag}.{number:04d}.fits'
+        fits.HDUList([primary, *extensions]).writeto(path, overwrite=True)
+        return SyntheticFrame(path, tag)
+
+    def darks(self, detector: DetectorName, count: int, *, dit: float = 10.0) -> list[SyntheticFrame]:
+        return [self.frame(f'DARK_{detector}_RAW', detector, catg='CALIB', dpr_type='DARK', dit=dit)
+                for _ in range(count)]
+
+    def detlin(self,
+               detector: DetectorName,
+               dits: Iterable[float],
+               *,
+               pairs: int = 2,
+               rate: float = 2000.0) -> list[SyntheticFrame]:
+        """
+        Detector linearity sequence: for every DIT, `pairs` illuminated frames and as many frames with the filter
+        wheel closed, as `metis_det_lingain` pairs them for the mean-variance method.
+        """
+        frames = []
+        illumination = self._illumination(rate)
+        for dit in dits:
+            for filter_name, flux in (('open', illumination), ('closed', 0.0)):
+                frames += [self.frame(f'DETLIN_{detector}_RAW', detector, catg='CALIB', dpr_type='DETLIN',
+                                      dit=dit, flux=flux, filter_name=filter_name)
+                           for _ in range(pairs)]
+        return frames
+
+    def lamp_flats(self, band: str, detector: DetectorName, count: int, *,
+                   dit: float = 1.0, rate: float = 5000.0) -> list[SyntheticFrame]:
+        return [self.frame(f'{band}_FLAT_LAMP_RAW', detector, catg='CALIB', dpr_type='FLAT,LAMP',
+                           dit=dit, flux=self._illumination(rate))
+                for _ in range(count)]
+
+    def science(self, band: str, detector: DetectorName, count: int, *,
+                dit: float = 1.0, rate: float = 3000.0) -> list[SyntheticFrame]:
+        return [self.frame(f'{band}_IMAGE_SCI_RAW', detector, catg='SCIENCE', dpr_type='OBJECT',
+                           dit=dit, flux=self._illumination(rate))
+                for _ in range(count)]
+
+    def ifu_rsrf(self, count: int, *, dit: float = 1.0, rate: float = 4000.0) -> list[SyntheticFrame]:
+        return [self.frame('IFU_RSRF_RAW', 'IFU', catg='CALIB', dpr_type='RSRF', dit=dit, flux=self._illumination(rate))
+                for _ in range(count)]
+
+    def ifu_wcu_off(self, count: int, *, dit: float = 1.0, rate: float = 50.0) -> list[SyntheticFrame]:
+        return [self.frame('IFU_WCU_OFF_RAW', 'IFU', catg='CALIB', dpr_type='DARK,WCUOFF',
+                           dit=dit, flux=self._illumination(rate))
+                for _ in range(count)]
+
+    def ifu_wavecal(self) -> SyntheticFrame:
+        """ A static IFU wavelength map: a linear dispersion along the columns of every detector [um]. """
+        primary = fits.PrimaryHDU()
+        primary.header['INSTRUME'] = 'METIS'
+        primary.header['HIERARCH ESO PRO CATG'] = 'IFU_WAVECAL'
+
+        start = [3.5565, 3.5284, 3.5275, 3.5557]
+        end = [3.5823, 3.5547, 3.5541, 3.5820]
+        extensions = []
+        for det in range(4):
+            wavelengths = np.linspace(start[det], end[det], self.size)
+            extensions.append(fits.ImageHDU(np.tile(wavelengths, (self.size, 1)), name=f'DET{det + 1:d}'))
+
+        path = self.directory / 'IFU_WAVECAL.fits'
+        fits.HDUList([primary, *extensions]).writeto(path, overwrite=True)
+        return SyntheticFrame(path, 'IFU_WAVECAL')
+
+    def ifu_distortion_table(self) -> SyntheticFrame:
+        """ The IFU trace table, written through CPL from the same coefficients as `metis_ifu_distortion` uses. """
+        import cpl
+        from pymetis.instruments.metis.recipes.ifu.metis_ifu_distortion import create_distortion_table
+
+        path = self.directory / 'IFU_DISTORTION_TABLE.fits'
+        primary = cpl.core.PropertyList()
+        primary.append(cpl.core.Property('ESO PRO CATG', cpl.core.Type.STRING, 'IFU_DISTORTION_TABLE'))
+
+        for det in range(1, 5):
+            header = cpl.core.PropertyList()
+            header.append(cpl.core.Property('EXTNAME', cpl.core.Type.STRING, f'DET{det:d}'))
+            create_distortion_table(det).save(primary, header, str(path),
+                                              cpl.core.io.CREATE if det == 1 else cpl.core.io.EXTEND)
+
+        return SyntheticFrame(path, 'IFU_DISTORTION_TABLE')
+
+
+def write_sof(path: Path | str, frames: Iterable[SyntheticFrame]) -> Path:
+    """ Write a set-of-frames file, one ``<path> <tag>`` line per frame. """
+    path = Path(path)
+    path.write_text(''.join(f"{frame.path} {frame.tag}\n" for frame in frames))
+    return path
+
+
+def read_sof(path: Path | str) -> list[SyntheticFrame]:
+    """ Read a set-of-frames file written by `write_sof` (or by hand). """
+    return [SyntheticFrame(Path(tokens[0]), tokens[1])
+            for tokens in (line.split() for line in Path(path).read_text().splitlines())
+            if len(tokens) >= 2 and not tokens[0].startswith('#')]
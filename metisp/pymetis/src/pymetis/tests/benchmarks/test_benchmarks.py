@@ -0,0 +1,105 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import json
+import os
+from pathlib import Path
+
+import pytest
+
+from pymetis.engine.dataitems.fitsindex import fits_index
+from pymetis.tests.benchmarks.runner import default_steps, run_benchmarks
+from pymetis.tests.benchmarks.synthetic import SyntheticDataGenerator, write_sof, read_sof
+
+# Set to a file name to keep the results of the full benchmark run
+OUTPUT_VARIABLE = 'PYMETIS_BENCHMARK_OUTPUT'
+
+
+class TestSyntheticDataGenerator:
+    """ Small-size checks of the generator, the full-size data are only produced by the benchmark itself. """
+    size = 64
+
+    def test_raw_frame_structure(self, tmp_path):
+        generator = SyntheticDataGenerator(tmp_path, size=self.size)
+        frame = generator.darks('IFU', 1, dit=5.0)[0]
+        index = fits_index(frame.path)
+
+        assert frame.tag == 'DARK_IFU_RAW'
+        assert len(index) == 5
+        assert [hdu.extname for hdu in index][1:] == [f'DET{det}.DATA' for det in range(1, 5)]
+        assert index[1].shape == (self.size, self.size)
+        assert index[0].keywords['ESO DPR TECH'] == 'IFU'
+        assert index[0].keywords['ESO DET DIT'] == 5.0
+
+    def test_detlin_has_on_and_off_frames_for_every_dit(self, tmp_path):
+        generator = SyntheticDataGenerator(tmp_path, size=self.size)
+        frames = generator.detlin('2RG', [1.0, 2.0], pairs=2)
+        keywords = [fits_index(frame.path)[0].keywords for frame in frames]
+
+        assert len(frames) == 8
+        for dit in [1.0, 2.0]:
+            filters = [kw['ESO DRS FILTER'] for kw in keywords if kw['ESO DET DIT'] == dit]
+            assert sorted(filters) == ['closed', 'closed', 'open', 'open']
+
+    def test_illuminated_frames_scale_with_dit(self, tmp_path):
+        generator = SyntheticDataGenerator(tmp_path, size=self.size)
+        short, long = (generator.science('LM', '2RG', 1, dit=dit)[0] for dit in (1.0, 2.0))
+        short, long = (fits_index(frame.path).memmap(1).mean() - generator.bias for frame in (short, long))
+
+        assert long == pytest.approx(2 * short, rel=0.05)
+
+    def test_same_seed_gives_identical_files(self, tmp_path):
+        first = SyntheticDataGenerator(tmp_path / 'a', seed=42, size=self.size).darks('2RG', 2)
+        second = SyntheticDataGenerator(tmp_path / 'b', seed=42, size=self.size).darks('2RG', 2)
+        third = SyntheticDataGenerator(tmp_path / 'c', seed=43, size=self.size).darks('2RG', 2)
+
+        assert [f.path.read_bytes() for f in first] == [f.path.read_bytes() for f in second]
+        assert first[0].path.read_bytes() != third[0].path.read_bytes()
+        assert first[0].path.read_bytes() != first[1].path.read_bytes()
+
+    def test_sof_round_trip(self, tmp_path):
+        frames = SyntheticDataGenerator(tmp_path, size=self.size).lamp_flats('LM', '2RG', 3)
+        assert read_sof(write_sof(tmp_path / 'flat.sof', frames)) == frames
+
+
+class TestBenchmarkSteps:
+    def test_dependencies_precede_their_users(self):
+        seen = set()
+        for step in default_steps(1):
+            assert set(step.requires) <= seen
+            seen.add(step.name)
+
+    def test_unknown_step_is_rejected(self, tmp_path):
+        with pytest.raises(ValueError):
+            run_benchmarks(tmp_path, recipes=['metis_no_such_recipe'])
+
+
+@pytest.mark.slow
+@pytest.mark.external
+def test_benchmark_suite(tmp_path):
+    """ Run the whole chain on full-size data. Takes several minutes and a few GB of disk space. """
+    output = Path(os.environ.get(OUTPUT_VARIABLE, tmp_path / 'benchmark.json'))
+    report = run_benchmarks(tmp_path, output=output)
+
+    assert [result['step'] for result in report['results']] == [step.name for step in default_steps(1)]
+    for result in report['results']:
+        assert result['wall_time'] > 0
+        assert result['peak_rss'] > 0
+        assert result['products']
+    assert json.loads(output.read_text()) == report
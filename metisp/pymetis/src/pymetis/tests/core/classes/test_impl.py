@@ -0,0 +1,206 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import threading
+import time
+from types import SimpleNamespace
+from typing import Any, Callable
+
+import pytest
+
+from pymetis.engine.core.functions import resources
+from pymetis.engine.recipes import impl as module
+from pymetis.engine.recipes.impl import RecipeImpl, component
+
+TIMEOUT = 5.0
+
+
+class DetectorImpl(RecipeImpl):
+    """ Processes every detector with `work`, recording which detectors were started and finished. """
+    _parallel_detectors = True
+
+    def __init__(self, work: Callable[[int], Any], frameset: list = ()):
+        # The full initialisation needs a recipe and a frameset, none of which `process_detectors` uses
+        self.name = 'detectors'
+        self.frameset = list(frameset)
+        self.work = work
+        self.started: list[int] = []
+        self.finished: list[int] = []
+        self.threads: set[int] = set()
+
+    def process(self):
+        return set()
+
+    def _process_single_detector(self, detector: int) -> Any:
+        self.started.append(detector)
+        self.threads.add(threading.get_ident())
+        result = self.work(detector)
+        self.finished.append(detector)
+        return result
+
+
+@pytest.fixture
+def cpus(monkeypatch):
+    """ Pretend there are eight CPUs, so that the pool is not limited by the machine running the tests. """
+    monkeypatch.setattr(resources.os, 'sched_getaffinity', lambda pid: set(range(8)), raising=False)
+    monkeypatch.delenv(resources.MAX_WORKERS_VARIABLE, raising=False)
+    monkeypatch.setattr(module, 'available_memory', lambda: None)
+
+
+class TestProcessDetectors:
+    def test_results_in_detector_order(self, cpus):
+        # Every detector waits for the next one, so they finish in reverse order
+        done = {detector: threading.Event() for detector in range(1, 5)}
+
+        def work(detector: int) -> str:
+            if detector + 1 in done:
+                assert done[detector + 1].wait(TIMEOUT)
+            done[detector].set()
+            return f"DET{detector}"
+
+        recipe = DetectorImpl(work)
+        assert recipe.process_detectors([1, 2, 3, 4]) == ['DET1', 'DET2', 'DET3', 'DET4']
+        assert recipe.finished == [4, 3, 2, 1]
+        assert len(recipe.threads) == 4
+
+    def test_first_failure_in_detector_order_is_raised(self, cpus):
+        # Detector 3 fails first, but detector 2 comes first in the order of the detectors
+        failed = threading.Event()
+
+        def work(detector: int) -> int:
+            if detector == 2:
+                assert failed.wait(TIMEOUT)
+                raise ValueError("detector 2")
+            if detector == 3:
+                failed.set()
+                raise RuntimeError("detector 3")
+            return detector
+
+        with pytest.raises(ValueError, match="detector 2"):
+            DetectorImpl(work).process_detectors([1, 2, 3])
+
+    def test_failure_cancels_pending_detectors(self, cpus, monkeypatch):
+        monkeypatch.setenv(resources.MAX_WORKERS_VARIABLE, '2')
+        failed = threading.Event()
+
+        def work(detector: int) -> int:
+            if detector == 1:
+                assert failed.wait(TIMEOUT)
+            elif detector == 2:
+                failed.set()
+                raise ValueError("detector 2")
+            else:
+                # Keep both workers busy until the failure has been seen
+                time.sleep(0.2)
+            return detector
+
+        recipe = DetectorImpl(work)
+        with pytest.raises(ValueError, match="detector 2"):
+            recipe.process_detectors(range(1, 9))
+
+        # Only the two detectors picked up while the failure was being raised may have started
+        assert {1, 2} <= set(recipe.started) <= {1, 2, 3, 4}
+
+    def test_workers_share_the_cpus(self, cpus, monkeypatch):
+        limits = {}
+        monkeypatch.setattr(module, 'set_num_threads', lambda threads: limits.__setitem__(threading.get_ident(), threads))
+
+        recipe = DetectorImpl(lambda detector: detector)
+        recipe.process_detectors([1, 2, 3, 4])
+
+        # Eight CPUs shared by four workers, every one of which limited its own kernels
+        assert set(limits.values()) == {2}
+        assert set(limits) == recipe.threads
+
+    def test_messages_are_tagged_with_the_detector(self, cpus):
+        recipe = DetectorImpl(lambda detector: component('Dark'))
+
+        assert recipe.process_detectors([1, 2]) == ['Dark[DET1]', 'Dark[DET2]']
+        assert component('Dark') == 'Dark'
+
+    def test_serial_without_opt_in(self, cpus, monkeypatch):
+        def no_pool(*args, **kwargs):
+            raise AssertionError("A serial recipe must not start a thread pool")
+
+        monkeypatch.setattr(module, 'ThreadPoolExecutor', no_pool)
+
+        recipe = DetectorImpl(lambda detector: detector * 10)
+        recipe._parallel_detectors = False
+
+        monkeypatch.setattr(module, 'set_num_threads', no_pool)
+
+        assert recipe.process_detectors([3, 1, 2]) == [30, 10, 20]
+        assert recipe.finished == [3, 1, 2]
+        assert recipe.threads == {threading.get_ident()}
+
+    def test_serial_failure_stops_at_failed_detector(self, cpus):
+        def work(detector: int) -> int:
+            if detector == 2:
+                raise ValueError("detector 2")
+            return detector
+
+        recipe = DetectorImpl(work)
+        recipe._parallel_detectors = False
+
+        with pytest.raises(ValueError, match="detector 2"):
+            recipe.process_detectors([1, 2, 3])
+        assert recipe.started == [1, 2]
+
+
+class TestDetectorWorkers:
+    def test_limited_by_detectors_and_cpus(self, cpus):
+        recipe = DetectorImpl(lambda detector: detector)
+        assert recipe.detector_workers(4) == 4
+        assert recipe.detector_workers(12) == 8
+
+    @pytest.mark.parametrize('limit, expected', [('1', 1), ('3', 3), ('16', 4)])
+    def test_limited_by_environment(self, cpus, monkeypatch, limit, expected):
+        monkeypatch.setenv(resources.MAX_WORKERS_VARIABLE, limit)
+        assert DetectorImpl(lambda detector: detector).detector_workers(4) == expected
+
+    def test_single_worker_is_serial(self, cpus, monkeypatch):
+        monkeypatch.setenv(resources.MAX_WORKERS_VARIABLE, '1')
+        recipe = DetectorImpl(lambda detector: detector)
+
+        assert recipe.process_detectors([1, 2, 3]) == [1, 2, 3]
+        assert recipe.threads == {threading.get_ident()}
+
+    def test_limited_by_memory(self, cpus, monkeypatch, tmp_path):
+        frames = []
+        for index in range(4):
+            (path := tmp_path / f"raw{index}.fits").write_bytes(b'\0' * 1000)
+            frames.append(SimpleNamespace(file=str(path)))
+
+        recipe = DetectorImpl(lambda detector: detector, frames)
+
+        # All four files, four times over for the conversion, shared by four detectors
+        assert recipe.detector_memory_footprint(4) == 4000
+
+        monkeypatch.setattr(module, 'available_memory', lambda: 2 * 4000 + 1)
+        assert recipe.detector_workers(4) == 2
+
+        monkeypatch.setattr(module, 'available_memory', lambda: 100)
+        assert recipe.detector_workers(4) == 1
+
+    def test_missing_files_do_not_count(self, cpus, monkeypatch):
+        recipe = DetectorImpl(lambda detector: detector, [SimpleNamespace(file='/nonexistent/raw.fits')])
+        monkeypatch.setattr(module, 'available_memory', lambda: 1)
+
+        assert recipe.detector_memory_footprint(4) == 0
+        assert recipe.detector_workers(4) == 4
@@ -0,0 +1,79 @@
+"""
+Unit tests for StackMoments.
+
+The streamed statistics must match NumPy applied to the whole stack, honour bad pixel masks,
+and leave the input frames untouched.
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.classes.moments import StackMoments
+
+
+def random_stack(seed: int = 0, n: int = 7, h: int = 13, w: int = 11) -> tuple[np.ndarray, np.ndarray]:
+    rng = np.random.default_rng(seed)
+    # A large offset makes the naive sum-of-squares formula lose precision
+    stack = 1e6 + rng.normal(0.0, 3.0, (n, h, w))
+    bpm = rng.uniform(size=stack.shape) < 0.15
+    bpm[:, 0, 0] = True
+    return stack, bpm
+
+
+class TestStackMoments:
+    def test_matches_numpy_without_mask(self):
+        stack, _ = random_stack()
+        moments = StackMoments.from_frames(stack)
+
+        assert moments.nframes == len(stack)
+        np.testing.assert_allclose(moments.mean, stack.mean(axis=0), rtol=1e-14)
+        np.testing.assert_allclose(moments.variance(), stack.var(axis=0), rtol=1e-9)
+        np.testing.assert_allclose(moments.stdev(ddof=1), stack.std(axis=0, ddof=1), rtol=1e-9)
+        np.testing.assert_array_equal(moments.min, stack.min(axis=0))
+        np.testing.assert_array_equal(moments.max, stack.max(axis=0))
+        assert not moments.rejected.any()
+
+    def test_honours_bad_pixel_mask(self):
+        stack, bpm = random_stack(1)
+        moments = StackMoments.from_frames(zip(stack, bpm))
+        masked = np.ma.masked_array(stack, bpm)
+
+        np.testing.assert_array_equal(moments.rejected, bpm.sum(axis=0))
+        np.testing.assert_array_equal(moments.count, (~bpm).sum(axis=0))
+        assert np.isnan(moments.mean[0, 0])
+
+        good = moments.count > 0
+        np.testing.assert_allclose(moments.mean[good], masked.mean(axis=0)[good], rtol=1e-14)
+        np.testing.assert_allclose(moments.variance()[good], masked.var(axis=0)[good], rtol=1e-9)
+        np.testing.assert_array_equal(moments.min[good], masked.min(axis=0)[good])
+        np.testing.assert_array_equal(moments.max[good], masked.max(axis=0)[good])
+
+    def test_frame_statistics(self):
+        stack, bpm = random_stack(2)
+        moments = StackMoments.from_frames(zip(stack, bpm))
+
+        for frame, flags, statistics in zip(stack, bpm, moments.frames):
+            good = frame[~flags]
+            assert statistics.median == pytest.approx(np.median(good))
+            assert statistics.mean == pytest.approx(good.mean())
+            assert statistics.stdev == pytest.approx(good.std(ddof=1))
+            assert statistics.min == good.min()
+            assert statistics.max == good.max()
+
+    def test_inputs_are_not_modified(self):
+        stack, bpm = random_stack(3)
+        original = stack.copy()
+
+        StackMoments.from_frames(zip(stack, bpm))
+
+        np.testing.assert_array_equal(stack, original)
+
+    def test_consumes_generator(self):
+        stack, _ = random_stack(4)
+        moments = StackMoments.from_frames(frame for frame in stack)
+
+        np.testing.assert_allclose(moments.mean, stack.mean(axis=0), rtol=1e-14)
+
+    def test_empty(self):
+        with pytest.raises(ValueError):
+            StackMoments.from_frames([])
@@ -0,0 +1,71 @@
+"""
+Unit tests for TraceGeometry.
+
+Collapsing and painting through the sparse index must give the same result as walking
+every trace column by column, and identical traces must share a single index.
+"""
+
+import numpy as np
+
+from pymetis.engine.core.classes.traces import TraceGeometry
+
+
+SHAPE = (120, 96)
+
+
+def make_traces(count: int = 4) -> list[tuple[np.ndarray, np.ndarray]]:
+    # Traces slightly wider than the detector and starting near its bottom edge
+    x = np.arange(-2, SHAPE[1] + 2, dtype=float)
+    return [(x, 0.05 * x + 30 * i + 3 + 0.4 * np.sin(x / 5)) for i in range(count)]
+
+
+def collapse_by_columns(traces, data, mask, half_width):
+    masked = np.ma.masked_array(data, mask=mask)
+    result = np.zeros((len(traces), SHAPE[1]))
+    for t, (xs, ys) in enumerate(traces):
+        for x, y in zip(xs.astype(int), ys):
+            if 0 <= x < SHAPE[1]:
+                value = masked[max(int(y - half_width), 0):int(y + half_width), x].mean()
+                result[t, x] = np.nan if value is np.ma.masked else value
+    return result
+
+
+class TestTraceGeometry:
+    def test_collapse_matches_column_walk(self):
+        rng = np.random.default_rng(7)
+        data = rng.normal(size=SHAPE)
+        mask = rng.uniform(size=SHAPE) < 0.2
+        traces = make_traces()
+
+        geometry = TraceGeometry(traces, SHAPE, below=6, above=6)
+        np.testing.assert_allclose(geometry.collapse(data, mask),
+                                   collapse_by_columns(traces, data, mask, 6), equal_nan=True)
+
+    def test_collapse_sum(self):
+        data = np.ones(SHAPE)
+        geometry = TraceGeometry(make_traces(1), SHAPE, below=2, above=3)
+
+        collapsed = geometry.collapse(data, average=False)
+        assert collapsed.shape == (1, SHAPE[1])
+        np.testing.assert_array_equal(collapsed[0, 10:], 5)
+
+    def test_paint_drops_spans_off_the_detector(self):
+        traces = make_traces()
+        wavelengths = np.linspace(3.5, 3.6, SHAPE[1])
+        painted = TraceGeometry(traces, SHAPE, below=5, above=6, partial=False).paint(wavelengths)
+
+        expected = np.zeros(SHAPE)
+        for xs, ys in traces:
+            for x, y in zip(xs.astype(int), ys.astype(int)):
+                if 0 <= x < SHAPE[1] and y - 5 >= 0 and y + 5 < SHAPE[0]:
+                    expected[y - 5:y + 6, x] = wavelengths[x]
+
+        np.testing.assert_array_equal(painted, expected)
+
+    def test_shared_between_identical_traces(self):
+        traces = make_traces()
+        geometry = TraceGeometry.for_traces(traces, SHAPE, below=4, above=4)
+
+        assert TraceGeometry.for_traces([(x.copy(), y.copy()) for x, y in traces], SHAPE,
+                                        below=4, above=4) is geometry
+        assert TraceGeometry.for_traces(traces, SHAPE, below=5, above=5) is not geometry
@@ -0,0 +1,119 @@
+"""
+Unit tests for the hierarchical profiler.
+
+Spans must nest under the innermost open span of the active profiler, also across worker threads,
+and cost nothing when no profiler is active.
+"""
+
+import contextvars
+import json
+from concurrent.futures import ThreadPoolExecutor
+
+from pymetis.engine.core.classes.utilities import Profiler, Stopwatch, profile, profiled
+
+
+@profiled('work')
+def work(n: int) -> int:
+    return sum(range(n))
+
+
+class TestStopwatch:
+    def test_measures_wall_and_cpu(self):
+        with Stopwatch() as sw:
+            work(10000)
+        assert sw.elapsed > 0
+        assert sw.cpu >= 0
+
+
+class TestProfiler:
+    def test_spans_are_no_ops_without_profiler(self):
+        with profile('orphan') as span:
+            assert span is None
+        assert work(10) == 45
+
+    def test_nested_spans(self):
+        profiler = Profiler('recipe')
+        with profiler.activate():
+            with profile('process'):
+                work(10)
+                with profile('detector', detector=1):
+                    work(10)
+        profiler.finish()
+
+        process, = profiler.root.children
+        assert process.name == 'process'
+        assert [child.name for child in process.children] == ['work', 'detector']
+        assert process.children[1].args == {'detector': 1}
+        assert process.children[1].children[0].name == 'work'
+        assert profiler.root.elapsed >= process.elapsed >= 0
+
+    def test_totals_do_not_count_nested_spans_of_the_same_name_twice(self):
+        profiler = Profiler('recipe')
+        with profiler.activate():
+            with profile('load_data'):
+                with profile('load_data'):
+                    pass
+            with profile('load_data'):
+                pass
+
+        totals = profiler.totals()
+        assert totals['load_data']['count'] == 2
+
+    def test_disabled_profiler_collects_nothing(self):
+        profiler = Profiler('recipe', enabled=False)
+        with profiler.activate():
+            with profile('process') as span:
+                assert span is None
+        profiler.finish()
+        assert profiler.root.children == []
+
+    def test_threads_nest_under_submitter(self):
+        profiler = Profiler('recipe')
+        with profiler.activate():
+            with profile('process'):
+                with ThreadPoolExecutor(max_workers=2) as executor:
+                    futures = [executor.submit(contextvars.copy_context().run, work, 100) for _ in range(4)]
+                    assert [future.result() for future in futures] == [4950] * 4
+
+        process, = profiler.root.children
+        assert [child.name for child in process.children] == ['work'] * 4
+
+    def test_chrome_trace(self, tmp_path):
+        profiler = Profiler('recipe')
+        with profiler.activate():
+            with profile('process'):
+                work(10)
+        profiler.finish()
+
+        trace = json.loads(profiler.write(tmp_path / 'profile.json').read_text())
+        events = trace['traceEvents']
+        assert [event['name'] for event in events] == ['recipe', 'process', 'work']
+        assert all(event['ph'] == 'X' and event['dur'] >= 0 for event in events)
+        assert events[1]['ts'] <= events[2]['ts']
+        assert trace['otherData']['totals']['work']['count'] == 1
+
+    def test_summary(self):
+        profiler = Profiler('recipe')
+        with profiler.activate():
+            with profile('process'):
+                pass
+
+        summary = dict((keyword, value) for keyword, value, _ in profiler.summary())
+        assert summary['ESO DRS PROFILE WALL'] >= summary['ESO DRS PROFILE PROCESS WALL']
+        assert all(isinstance(value, float) for value in summary.values())
+
+    def test_peak_rss_is_relative_to_span_entry(self):
+        profiler = Profiler('recipe')
+        with profiler.activate():
+            with profile('allocate') as allocate:
+                buffer = bytearray(64 * 2 ** 20)
+                buffer[::4096] = b'\1' * len(buffer[::4096])
+                del buffer
+            with profile('idle') as idle:
+                pass
+        profiler.finish()
+
+        # The memory touched by the first span must not be charged to the second one
+        assert allocate.peak_rss >= 32 * 2 ** 20
+        assert idle.peak_rss < 32 * 2 ** 20
+        assert profiler.root.peak_rss >= allocate.peak_rss
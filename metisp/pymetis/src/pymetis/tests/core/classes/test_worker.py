@@ -0,0 +1,171 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import contextlib
+import io
+import json
+import os
+from dataclasses import dataclass
+from pathlib import Path
+
+import pytest
+
+from pymetis.engine.recipes import worker as module
+from pymetis.engine.recipes.impl import RecipeImpl
+from pymetis.engine.recipes.recipe import Recipe
+from pymetis.engine.recipes.worker import Job, RequestError, Worker
+
+
+@dataclass
+class Product:
+    file: str
+    tag: str
+
+
+@dataclass
+class Parameter:
+    name: str
+    default: int
+    value: int = None
+
+
+class EchoImpl(RecipeImpl):
+    pass
+
+
+class EchoRecipe:
+    """ Stands in for a recipe: writes a product with the value of its only parameter. """
+    Impl = EchoImpl
+    parameters = [Parameter('echo.value', 0)]
+
+    def __init__(self):
+        self.implementation = None
+
+    def run(self, frameset, settings):
+        # Instantiating the abstract implementation is not possible, but its type is all the worker looks at
+        self.implementation = type('Promoted', (), {'_promotion': {'target': 'SCI'}})()
+        for key, value in settings.items():
+            next(p for p in self.parameters if p.name == key).value = value
+        Path('echo.txt').write_text(str(self.parameters[0].value))
+        return [Product('echo.txt', 'ECHO')]
+
+
+class FailingRecipe(EchoRecipe):
+    def run(self, frameset, settings):
+        raise RuntimeError("no luck")
+
+
+class DyingRecipe(EchoRecipe):
+    def run(self, frameset, settings):
+        os._exit(3)
+
+
+@pytest.fixture
+def recipes(monkeypatch):
+    monkeypatch.setattr(module, 'job_log', lambda path, level: contextlib.nullcontext())
+    for name, recipe in (('echo', EchoRecipe), ('failing', FailingRecipe), ('dying', DyingRecipe)):
+        monkeypatch.setitem(Recipe._registry, name, recipe)
+    EchoRecipe.parameters[0].value = None
+
+
+def serve(worker: Worker, *requests) -> list[dict]:
+    responses = io.BytesIO()
+    worker.serve(io.BytesIO(b''.join(
+        (request if isinstance(request, bytes) else json.dumps(request).encode()) + b'\n' for request in requests
+    )), responses)
+    return [json.loads(line) for line in responses.getvalue().splitlines()]
+
+
+class TestJob:
+    def test_frames_from_sof_file(self, recipes, tmp_path):
+        (tmp_path / 'input.sof').write_text("# comment\n/data/a.fits DARK_2RG_RAW\n\nb.fits DARK_2RG_RAW\n")
+        job = Job.from_request({'recipe': 'echo', 'sof': 'input.sof', 'output_dir': str(tmp_path)})
+        assert job.frames == [('/data/a.fits', 'DARK_2RG_RAW'), ('b.fits', 'DARK_2RG_RAW')]
+        assert job.log_file == tmp_path / 'echo.log'
+
+    @pytest.mark.parametrize('request_', [
+        [], {'sof': []}, {'recipe': 'nonexistent', 'sof': []}, {'recipe': 'echo'},
+        {'recipe': 'echo', 'sof': [['a.fits']]}, {'recipe': 'echo', 'sof': 'missing.sof'},
+        {'recipe': 'echo', 'sof': [], 'parameters': [1]}, {'recipe': 'echo', 'sof': [], 'log_level': 'loud'},
+    ])
+    def test_malformed_requests(self, recipes, tmp_path, request_):
+        if isinstance(request_, dict):
+            request_['output_dir'] = str(tmp_path)
+        with pytest.raises(RequestError):
+            Job.from_request(request_)
+
+
+@pytest.mark.parametrize('isolate', [False, True])
+class TestWorker:
+    def test_jobs(self, recipes, tmp_path, isolate):
+        worker = Worker(isolate=isolate, preload=())
+        responses = serve(
+            worker,
+            {'id': 1, 'recipe': 'echo', 'sof': [['a.fits', 'RAW']], 'parameters': {'echo.value': 7},
+             'output_dir': str(tmp_path / 'first')},
+            b'this is not JSON',
+            {'id': 3, 'recipe': 'failing', 'sof': [], 'output_dir': str(tmp_path)},
+            {'id': 4, 'recipe': 'echo', 'sof': [], 'output_dir': str(tmp_path / 'second')},
+        )
+
+        first, garbage, failed, second = responses
+        assert first['status'] == 'ok' and first['id'] == 1
+        assert first['products'] == [{'file': str(tmp_path / 'first' / 'echo.txt'), 'tag': 'ECHO'}]
+        assert (tmp_path / 'first' / 'echo.txt').read_text() == '7'
+        assert '_promotion' not in first
+
+        # The worker has promoted the implementation for itself
+        assert (EchoImpl, (('target', 'SCI'),)) in RecipeImpl._promoted
+
+        assert garbage['status'] == 'error' and garbage['type'] == 'JSONDecodeError'
+        assert failed == failed | {'id': 3, 'status': 'error', 'type': 'RuntimeError', 'error': 'no luck'}
+
+        # Parameters of the first job must not leak into the next one
+        assert second['status'] == 'ok'
+        assert (tmp_path / 'second' / 'echo.txt').read_text() == '0'
+        assert os.getcwd() != str(tmp_path / 'second')
+
+    def test_dying_job(self, recipes, tmp_path, isolate):
+        if not isolate:
+            pytest.skip("A job that exits kills a worker without isolation")
+        worker = Worker(isolate=isolate, preload=())
+        died, alive = serve(worker,
+                            {'recipe': 'dying', 'sof': [], 'output_dir': str(tmp_path)},
+                            {'recipe': 'echo', 'sof': [], 'output_dir': str(tmp_path)})
+        assert died['status'] == 'error' and died['type'] == 'ChildProcessError'
+        assert alive['status'] == 'ok'
+
+
+class TestPromoted:
+    def test_cached_and_isolated(self):
+        class Impl(RecipeImpl):
+            pass
+
+        science = Impl.promoted(target='SCI')
+        assert Impl.promoted(target='SCI') is science
+        assert Impl.promoted(target='STD') is not science
+        assert issubclass(science, Impl) and science.__qualname__ == Impl.__qualname__
+        assert science._promotion == {'target': 'SCI'}
+
+        # The class itself is never touched
+        assert science.ProductSet is not Impl.ProductSet and science.Qc is not Impl.Qc
+        assert Impl._promotion is None
+
+        # Promoting a promoted class starts over from the original one
+        assert science.promoted(target='STD') is Impl.promoted(target='STD')
@@ -0,0 +1,39 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import pytest
+
+from pymetis.engine.core.native import LIBRARY_PATH_VARIABLE, libmetis
+
+
+@pytest.fixture(params=['libmetis', 'numpy'])
+def backend(request, monkeypatch) -> str:
+    """
+    Run a test once with the kernels of `libmetis` and once with the NumPy implementations.
+    Both must satisfy the same tests; the `libmetis` run is skipped where the library is not available.
+    """
+    if request.param == 'numpy':
+        monkeypatch.setenv(LIBRARY_PATH_VARIABLE, '')
+
+    libmetis.cache_clear()
+    if request.param == 'libmetis' and libmetis() is None:
+        pytest.skip("libmetis is not available")
+
+    yield request.param
+    libmetis.cache_clear()
@@ -0,0 +1,152 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.adi import adi_pca, derotate, mean_frame, pca_basis
+
+
+def adi_sequence(nframes=40, size=48, rotation=60.0, planet=(10.0, 4.0), seed=2):
+    """
+    A pupil-tracking sequence: a static stellar halo with a few speckle patterns that vary in strength,
+    and a faint planet at a fixed offset on the sky, rotating with the field.
+    """
+    rng = np.random.default_rng(seed)
+    angles = np.linspace(-rotation / 2, rotation / 2, nframes)
+    centre = (size - 1) / 2
+    rows, columns = np.indices((size, size))
+    halo = 500.0 * np.exp(-((columns - centre) ** 2 + (rows - centre) ** 2) / (2 * 5.0 ** 2))
+    speckles = rng.normal(0.0, 10.0, (3, size, size))
+
+    cube = np.empty((nframes, size, size), dtype=np.float32)
+    for n, angle in enumerate(angles):
+        c, s = np.cos(np.deg2rad(angle)), np.sin(np.deg2rad(angle))
+        px = centre + c * planet[0] - s * planet[1]
+        py = centre + s * planet[0] + c * planet[1]
+        cube[n] = (halo * (1 + 0.05 * np.sin(n / 4))
+                   + np.tensordot(rng.normal(1.0, 0.3, 3), speckles, axes=1)
+                   + 20.0 * np.exp(-((columns - px) ** 2 + (rows - py) ** 2) / (2 * 1.5 ** 2))
+                   + rng.normal(0.0, 0.5, (size, size)))
+    return cube, angles
+
+
+@pytest.mark.usefixtures('backend')
+class TestDerotate:
+    """ `derotate` must interpolate exactly what it can. """
+
+    def test_zero_rotation_is_identity(self):
+        cube, _ = adi_sequence(nframes=3)
+        np.testing.assert_array_equal(derotate(cube, np.zeros(3)), cube)
+
+    def test_quarter_turns(self):
+        frame = np.arange(7 * 7, dtype=np.float32).reshape(1, 7, 7)
+        # Undoing a counter-clockwise quarter turn of the field is a clockwise one of the array
+        np.testing.assert_allclose(derotate(frame, [90.0])[0], np.rot90(frame[0], k=1), atol=1e-4)
+        np.testing.assert_allclose(derotate(frame, [180.0])[0], frame[0, ::-1, ::-1], atol=1e-4)
+
+    def test_plane_is_interpolated_exactly(self):
+        rows, columns = np.indices((30, 40))
+        frame = (2.0 * columns - 3.0 * rows + 1.0).astype(np.float32)[None]
+        result = derotate(frame, [25.0], centre=(18.0, 13.5))[0]
+
+        c, s = np.cos(np.deg2rad(25.0)), np.sin(np.deg2rad(25.0))
+        sx = 18.0 + c * (columns - 18.0) - s * (rows - 13.5)
+        sy = 13.5 + s * (columns - 18.0) + c * (rows - 13.5)
+        inside = (sx >= 0) & (sx <= 39) & (sy >= 0) & (sy <= 29)
+        np.testing.assert_allclose(result[inside], (2.0 * sx - 3.0 * sy + 1.0)[inside], atol=1e-3)
+        assert np.isnan(result[~inside]).all()
+
+
+class TestPcaBasis:
+    def test_matches_exact_svd(self):
+        cube, _ = adi_sequence()
+        basis, singular = pca_basis(cube, 4, chunk=7)
+
+        centred = cube.reshape(len(cube), -1).astype(np.float64)
+        centred -= centred.mean(axis=0)
+        _, exact, vt = np.linalg.svd(centred, full_matrices=False)
+
+        np.testing.assert_allclose(singular, exact[:4], rtol=1e-3)
+        flat = basis.reshape(4, -1).astype(np.float64)
+        np.testing.assert_allclose(flat @ flat.T, np.eye(4), atol=1e-5)
+        # The same subspace, up to the signs of the components
+        np.testing.assert_allclose(np.abs(np.sum(flat * vt[:4], axis=1)), 1.0, atol=1e-3)
+
+    def test_chunking_does_not_matter(self):
+        cube, _ = adi_sequence(nframes=20)
+        first, _ = pca_basis(cube, 3, chunk=3)
+        second, _ = pca_basis(cube, 3, chunk=20)
+        np.testing.assert_allclose(np.abs(np.sum(first * second, axis=(1, 2))), 1.0, atol=1e-4)
+
+    def test_mean_frame_ignores_non_finite(self):
+        cube = np.ones((4, 3, 3), dtype=np.float32)
+        cube[0, 1, 1] = np.nan
+        cube[:, 0, 0] = np.inf
+        mean = mean_frame(cube, chunk=3)
+        assert mean[1, 1] == 1.0 and np.isnan(mean[0, 0])
+
+
+@pytest.mark.usefixtures('backend')
+class TestAdiPca:
+    @pytest.mark.parametrize('method', ['average', 'median'])
+    def test_recovers_planet(self, method, tmp_path):
+        cube, angles = adi_sequence()
+        result = adi_pca(cube, angles, ncomp=4, method=method, chunk=9, scratch=tmp_path)
+
+        centre = (48 - 1) / 2
+        x, y = int(round(centre + 10.0)), int(round(centre + 4.0))
+        residual = result.derotated_psfsub
+        annulus = np.hypot(*(np.indices(residual.shape) - centre)) < 20
+        annulus[y - 4:y + 5, x - 4:x + 5] = False
+
+        # The planet stands out of the subtracted speckles, and the scratch files are gone
+        assert residual[y, x] > 10 * np.nanstd(residual[annulus])
+        assert list(tmp_path.iterdir()) == []
+
+        # Without subtraction the halo dominates; the speckle model holds the halo in detector orientation
+        assert result.derotated[24, 24] > 400
+        assert result.speckle[24, 24] > 400
+        assert result.coverage.max() == len(cube) and result.coverage[0, 0] < len(cube)
+        assert np.isnan(result.derotated[0, 0]) == (result.coverage[0, 0] == 0)
+
+    def test_streamed_from_memory_map(self, tmp_path):
+        cube, angles = adi_sequence(nframes=16)
+        mapped = np.lib.format.open_memmap(tmp_path / 'cube.npy', mode='w+', dtype=np.float32, shape=cube.shape)
+        mapped[...] = cube
+
+        in_memory = adi_pca(cube, angles, ncomp=2, method='median', chunk=16)
+        streamed = adi_pca(mapped, angles, ncomp=2, method='median', chunk=5, scratch=tmp_path)
+        np.testing.assert_allclose(streamed.derotated_psfsub, in_memory.derotated_psfsub, atol=1e-3)
+        np.testing.assert_array_equal(streamed.coverage, in_memory.coverage)
+
+    def test_classical_adi(self):
+        cube, angles = adi_sequence(nframes=10)
+        result = adi_pca(cube, angles, ncomp=0, method='average')
+        assert result.basis.shape == (0, 48, 48)
+        np.testing.assert_allclose(result.speckle, mean_frame(cube), rtol=1e-5)
+
+    def test_invalid_arguments(self):
+        cube, angles = adi_sequence(nframes=5)
+        with pytest.raises(ValueError):
+            adi_pca(cube, angles, method='sigclip')
+        with pytest.raises(ValueError):
+            adi_pca(cube, angles[:3])
+        with pytest.raises(ValueError):
+            adi_pca(cube, angles, ncomp=6)
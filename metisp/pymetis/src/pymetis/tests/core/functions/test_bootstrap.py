@@ -0,0 +1,54 @@
+"""
+Unit tests for bootstrap_moments.
+
+The resampled means must equal the means of an explicit resample drawn from the same stream,
+and the result must not depend on the number of worker threads.
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.bootstrap import bootstrap_moments, bootstrap_seed
+
+
+def random_samples(seed=0, rows=3, size=1000):
+    rng = np.random.default_rng(seed)
+    return rng.normal(loc=5.0, scale=2.0, size=(rows, size))
+
+
+class TestBootstrapMoments:
+    def test_matches_explicit_resampling(self):
+        samples = random_samples()
+        result = bootstrap_moments(samples, lambda means: means[0] - means[2], draws=5, seed=11, block=128)
+
+        for draw, stream in enumerate(np.random.SeedSequence(11).spawn(5)):
+            window = np.random.default_rng(stream).integers(0, samples.shape[1], size=samples.shape[1])
+            resampled = samples[:, window]
+            assert result[draw] == pytest.approx(resampled[0].mean() - resampled[2].mean(), rel=1e-12)
+
+    def test_reproducible_across_workers(self):
+        samples = random_samples(1).astype(np.float32)
+        serial = bootstrap_moments(samples, lambda means: means[1], draws=16, seed=3, workers=1)
+        parallel = bootstrap_moments(samples, lambda means: means[1], draws=16, seed=3, workers=4)
+
+        np.testing.assert_array_equal(serial, parallel)
+        assert not np.array_equal(serial, bootstrap_moments(samples, lambda means: means[1], draws=16, seed=4))
+
+    def test_spread_of_the_mean(self):
+        samples = random_samples(2, rows=1, size=4000)
+        spread = np.std(bootstrap_moments(samples, lambda means: means[0], draws=200, seed=0))
+
+        assert spread == pytest.approx(2.0 / np.sqrt(4000), rel=0.2)
+
+    def test_requires_draws(self):
+        with pytest.raises(ValueError):
+            bootstrap_moments(random_samples(), lambda means: means[0], draws=0, seed=0)
+
+
+class TestBootstrapSeed:
+    def test_explicit(self):
+        assert bootstrap_seed(42) == 42
+
+    @pytest.mark.parametrize('seed', [None, -1])
+    def test_fresh(self, seed):
+        assert bootstrap_seed(seed) >= 0
@@ -0,0 +1,177 @@
+"""
+Unit tests for calibrate_frames and correct_nonlinearity.
+
+The calibrated frames, errors and data quality layers are checked against a straightforward
+per-pixel implementation, including nonlinearity correction, gain maps, saturated and invalid pixels.
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.calibrate import (calibrate_frames, correct_nonlinearity,
+                                                     single_precision_suffices,
+                                                     DQ_BAD_PIXEL, DQ_NONLINEAR, DQ_SATURATED, DQ_INVALID)
+
+
+def reference(raw, dark, flat, gain, linearity, dq, read_noise, saturation):
+    """ Per-pixel reference implementation, straight from the definitions """
+    r = raw.astype(np.float64)
+    value = r * np.polynomial.polynomial.polyval(r, linearity[::-1].astype(np.float64), tensor=False) \
+        if linearity is not None else r
+    electrons = (value - dark) * gain
+    with np.errstate(divide='ignore', invalid='ignore'):
+        sci = electrons / flat
+        err = np.sqrt(np.maximum(electrons, 0.0) + read_noise ** 2) / flat
+    invalid = ~np.isfinite(r) | ~(flat > 0) | ~np.isfinite(sci)
+    flags = dq | np.where(r >= saturation, DQ_SATURATED, 0) | np.where(invalid, DQ_INVALID, 0)
+    return np.where(invalid, 0.0, sci), np.where(invalid, 0.0, err), flags
+
+
+def random_frames(seed, n=3, h=37, w=61):
+    """ Raw frames with an invalid and a saturated pixel, and all the calibrations (with a dead flat pixel). """
+    rng = np.random.default_rng(seed)
+    raw = rng.uniform(100.0, 20000.0, (n, h, w)).astype(np.float32)
+    raw[0, 0, 0] = np.nan
+    raw[1, 1, 1] = 50000.0
+    dark = rng.normal(50.0, 2.0, (h, w)).astype(np.float32)
+    flat = rng.uniform(0.8, 1.2, (h, w)).astype(np.float32)
+    flat[2, 2] = 0.0
+    gain = rng.uniform(1.5, 2.5, (h, w)).astype(np.float32)
+    linearity = np.stack([np.full((h, w), 1e-10), np.full((h, w), 2e-6), np.ones((h, w))]).astype(np.float32)
+    dq = np.where(rng.uniform(size=(h, w)) < 0.05, DQ_BAD_PIXEL, 0).astype(np.int32)
+    return raw, dark, flat, gain, linearity, dq
+
+
+@pytest.mark.usefixtures('backend')
+class TestCalibrateFrames:
+    """ `calibrate_frames` must agree with the per-pixel definitions. """
+
+    def test_matches_reference(self):
+        raw, dark, flat, gain, linearity, dq = random_frames(1)
+
+        sci, err, flags = calibrate_frames(raw, dark=dark, flat=flat, gain=gain, linearity=linearity,
+                                           dq=dq, read_noise=12.0, saturation=40000.0)
+        sci_ref, err_ref, flags_ref = reference(raw, dark, flat, gain, linearity, dq, 12.0, 40000.0)
+
+        np.testing.assert_array_equal(flags, flags_ref)
+        np.testing.assert_allclose(sci, sci_ref, rtol=1e-5)
+        np.testing.assert_allclose(err, err_ref, rtol=1e-5)
+        assert flags[0, 0, 0] & DQ_INVALID and sci[0, 0, 0] == 0.0
+        assert flags[1, 1, 1] & DQ_SATURATED
+        assert (flags[:, 2, 2] & DQ_INVALID).all()
+
+    def test_scalar_gain_without_calibrations(self):
+        raw, *_ = random_frames(2)
+
+        sci, err, flags = calibrate_frames(raw, gain=2.0, read_noise=3.0)
+
+        good = np.isfinite(raw)
+        np.testing.assert_allclose(sci[good], 2.0 * raw[good], rtol=1e-6)
+        np.testing.assert_allclose(err[good], np.sqrt(2.0 * raw[good] + 9.0), rtol=1e-6)
+        np.testing.assert_array_equal(flags != 0, ~good)
+
+    def test_block_size_does_not_matter(self):
+        raw, dark, flat, gain, linearity, dq = random_frames(3)
+
+        first = calibrate_frames(raw, dark=dark, flat=flat, gain=gain, linearity=linearity, dq=dq, rows=5)
+        second = calibrate_frames(raw, dark=dark, flat=flat, gain=gain, linearity=linearity, dq=dq, rows=64)
+
+        for a, b in zip(first, second):
+            np.testing.assert_array_equal(a, b)
+
+    def test_linearity_in_either_precision(self):
+        raw, dark, flat, gain, linearity, dq = random_frames(5)
+        linearity_dq = np.zeros(dq.shape, dtype=bool)
+        linearity_dq[3, 4] = True
+
+        single = calibrate_frames(raw, dark=dark, flat=flat, gain=gain, linearity=linearity,
+                                  linearity_dq=linearity_dq, saturation=40000.0, precision='single')
+        double = calibrate_frames(raw, dark=dark, flat=flat, gain=gain, linearity=linearity,
+                                  linearity_dq=linearity_dq, saturation=40000.0, precision='double')
+        uncorrected, *_ = calibrate_frames(raw[:, 3:4, 4:5], dark=dark[3:4, 4:5], flat=flat[3:4, 4:5],
+                                           gain=gain[3:4, 4:5])
+
+        np.testing.assert_array_equal(single[2], double[2])
+        np.testing.assert_allclose(single[0], double[0], rtol=1e-6)
+        np.testing.assert_allclose(single[1], double[1], rtol=1e-6)
+        assert (single[2][:, 3, 4] & DQ_NONLINEAR).all()
+        np.testing.assert_allclose(single[0][:, 3, 4], uncorrected[:, 0, 0], rtol=1e-6)
+        assert single[2][1, 1, 1] & DQ_SATURATED
+
+    def test_shape_mismatch(self):
+        raw, dark, *_ = random_frames(4)
+
+        with pytest.raises(AssertionError):
+            calibrate_frames(raw, dark=dark[1:])
+
+
+def random_linearity(seed, n=4, h=29, w=53):
+    """ A stack with its error, and quadratic linearity coefficients with their errors and data quality. """
+    rng = np.random.default_rng(seed)
+    stack = rng.uniform(100.0, 30000.0, (n, h, w)).astype(np.float32)
+    error = np.sqrt(stack)
+    coeffs = np.stack([rng.normal(1e-10, 1e-11, (h, w)),
+                       rng.normal(2e-6, 1e-7, (h, w)),
+                       np.ones((h, w))])
+    coeffs_error = np.abs(coeffs) * 0.01
+    coeffs_dq = rng.uniform(size=(h, w)) < 0.05
+    return stack, error, coeffs, coeffs_error, coeffs_dq
+
+
+@pytest.mark.usefixtures('backend')
+class TestCorrectNonlinearity:
+    """ Nonlinearity correction with error propagation, in either precision """
+
+    @pytest.mark.parametrize('precision', ['single', 'double'])
+    def test_matches_reference(self, precision):
+        stack, error, coeffs, coeffs_error, coeffs_dq = random_linearity(1)
+        r, e = stack.astype(np.float64), error.astype(np.float64)
+        value = r * ((coeffs[0] * r + coeffs[1]) * r + coeffs[2])
+        slope = (3 * coeffs[0] * r + 2 * coeffs[1]) * r + coeffs[2]
+        variance = (r ** 3 * coeffs_error[0]) ** 2 + (r ** 2 * coeffs_error[1]) ** 2 + (r * coeffs_error[2]) ** 2
+        expected_value = np.where(coeffs_dq, r, value)
+        expected_error = np.where(coeffs_dq, e, np.sqrt((slope * e) ** 2 + variance))
+
+        dq = correct_nonlinearity(stack, coeffs, error=error, coeffs_error=coeffs_error, coeffs_dq=coeffs_dq,
+                                  precision=precision)
+
+        np.testing.assert_array_equal(dq, np.where(np.broadcast_to(coeffs_dq, dq.shape), DQ_NONLINEAR, 0))
+        np.testing.assert_allclose(stack, expected_value, rtol=1e-6)
+        np.testing.assert_allclose(error, expected_error, rtol=1e-5)
+
+    def test_flags_are_added(self):
+        stack, _, coeffs, _, _ = random_linearity(2)
+        stack[0, 0, 0] = 3e38             # the correction overflows
+        stack[0, 0, 1] = np.nan           # left to the caller
+        dq = np.full(stack.shape, DQ_BAD_PIXEL, dtype=np.int32)
+
+        result = correct_nonlinearity(stack, coeffs, dq=dq)
+
+        assert result is dq
+        assert dq[0, 0, 0] == DQ_BAD_PIXEL | DQ_NONLINEAR
+        assert stack[0, 0, 0] == np.float32(3e38)
+        assert (dq[0, 0, 1:] == DQ_BAD_PIXEL).all()
+        assert (dq[1:] == DQ_BAD_PIXEL).all()
+
+    def test_precision_choice(self):
+        _, _, coeffs, _, _ = random_linearity(3)
+
+        assert single_precision_suffices(coeffs, 30000.0)
+
+        # Large terms cancelling each other: single precision would lose most digits
+        cancelling = np.stack([np.full((2, 2), 1e-4), np.full((2, 2), -3.0), np.full((2, 2), 1e4)])
+        assert not single_precision_suffices(cancelling, 3e4)
+        assert single_precision_suffices(cancelling, 3e4, valid=np.zeros((2, 2), dtype=bool))
+
+    def test_block_size_does_not_matter(self):
+        first = random_linearity(4)
+        second = random_linearity(4)
+
+        dq1 = correct_nonlinearity(first[0], first[2], error=first[1], coeffs_error=first[3], coeffs_dq=first[4],
+                                   precision='double', rows=3)
+        dq2 = correct_nonlinearity(second[0], second[2], error=second[1], coeffs_error=second[3],
+                                   coeffs_dq=second[4], precision='double', rows=64)
+
+        np.testing.assert_array_equal(first[0], second[0])
+        np.testing.assert_array_equal(first[1], second[1])
+        np.testing.assert_array_equal(dq1, dq2)
@@ -0,0 +1,150 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.chopnod import ChopNodAccumulator, classify_frames
+
+
+def chopnod_sequence(ncycles: int = 12, frames: int = 3, size: int = 24, sigma: float = 5.0, seed: int = 3):
+    """
+    A calibrated chop-nod sequence of `ncycles` cycles with `frames` frames per beam and noise `sigma`:
+    a bright sky that differs between the chop positions and drifts from cycle to cycle,
+    and a source seen in the beams A and D, so that the double difference is twice the source.
+    """
+    rng = np.random.default_rng(seed)
+    rows, columns = np.indices((size, size))
+    source = 200.0 * np.exp(-((columns - 10.0) ** 2 + (rows - 13.0) ** 2) / 8.0)
+    sky = 5e4 + 30.0 * columns
+
+    chops, nods = [], []
+    for cycle in range(ncycles):
+        for nod in 'AB':
+            for _ in range(frames):
+                for chop in 'AB':
+                    chops.append(chop)
+                    nods.append(nod)
+
+    beams, cycles = classify_frames(chops, nods)
+    sci = np.empty((len(beams), size, size), dtype=np.float32)
+    for index, (beam, cycle) in enumerate(zip(beams, cycles)):
+        drift = 100.0 * cycle + (40.0 if beam % 2 else 0.0)
+        sci[index] = sky + drift + (source if beam in (0, 3) else 0.0) + rng.normal(0.0, sigma, (size, size))
+    err = np.full(sci.shape, sigma, dtype=np.float32)
+    return sci, err, beams, cycles, 2 * source
+
+
+class TestClassifyFrames:
+    def test_abba_cycles(self):
+        beams, cycles = classify_frames(list('ABABABAB'), list('AABBBBAA'))
+        np.testing.assert_array_equal(beams, [0, 1, 2, 3, 2, 3, 0, 1])
+        np.testing.assert_array_equal(cycles, [0, 0, 0, 0, 0, 0, 1, 1])
+
+    def test_abab_cycles(self):
+        _, cycles = classify_frames(['A', 'b', ' A', 'B'] * 2, ['A', 'A', 'B', 'B'] * 2)
+        np.testing.assert_array_equal(cycles, [0, 0, 0, 0, 1, 1, 1, 1])
+
+    def test_unknown_position(self):
+        with pytest.raises(ValueError):
+            classify_frames(['A', 'C'], ['A', 'A'])
+        with pytest.raises(ValueError):
+            classify_frames(['A', 'B'], ['A'])
+
+
+@pytest.mark.usefixtures('backend')
+class TestChopNodAccumulator:
+    """ `ChopNodAccumulator` must remove the sky and its drifts exactly and propagate the noise correctly. """
+
+    def test_double_difference(self):
+        sci, err, beams, cycles, truth = chopnod_sequence()
+        accumulator = ChopNodAccumulator(sci.shape[1:])
+        accumulator.add_frames(sci, err, None, beams, cycles)
+        result = accumulator.result()
+
+        assert (result.ncycles, result.nskipped) == (12, 0)
+        assert result.coverage.sum() + result.rejected.sum() == 12 * truth.size
+        assert result.rejected.sum() <= 2
+
+        # Every beam mean has variance sigma^2 / 3, each difference their sum, the mean of 12 cycles a twelfth
+        np.testing.assert_allclose(result.error, 2 * 5.0 / np.sqrt(3 * 12), rtol=1e-3, atol=0.02)
+        assert abs(np.mean((result.image - truth) / result.error)) < 0.1
+        assert np.std((result.image - truth) / result.error) == pytest.approx(1.0, abs=0.1)
+        assert np.median(result.scatter / result.error) == pytest.approx(1.0, abs=0.15)
+
+        # The frame-to-frame noise of a beam also contains the drift of the sky from cycle to cycle
+        assert result.beam_noise.shape == (4, *truth.shape)
+        assert np.all(result.beam_noise > 5.0)
+
+    def test_glitches_are_rejected(self):
+        sci, err, beams, cycles, truth = chopnod_sequence()
+        clean = ChopNodAccumulator(sci.shape[1:])
+        clean.add_frames(sci, err, None, beams, cycles)
+        expected = clean.result()
+
+        # One glitch in a cycle held back for its median, one in a later cycle
+        first = np.flatnonzero(cycles == 1)[2]
+        later = np.flatnonzero(cycles == 8)[5]
+        sci[first, 4, 4] += 1e4
+        sci[later, 20, 7] -= 1e4
+
+        accumulator = ChopNodAccumulator(sci.shape[1:], kappa=5.0, warmup=3)
+        accumulator.add_frames(sci, err, None, beams, cycles)
+        result = accumulator.result()
+
+        assert result.rejected[4, 4] == expected.rejected[4, 4] + 1
+        assert result.rejected[20, 7] == expected.rejected[20, 7] + 1
+        for y, x in [(4, 4), (20, 7)]:
+            assert abs(result.image[y, x] - truth[y, x]) < 5 * result.error[y, x]
+
+    def test_without_rejection(self):
+        sci, err, beams, cycles, truth = chopnod_sequence(ncycles=4)
+        sci[3, 0, 0] = 1e6
+        accumulator = ChopNodAccumulator(sci.shape[1:], kappa=0.0)
+        accumulator.add_frames(sci, err, None, beams, cycles)
+        result = accumulator.result()
+
+        assert not result.rejected.any()
+        np.testing.assert_array_equal(result.coverage, 4)
+        assert abs(result.image[0, 0] - truth[0, 0]) > 1e4
+
+    def test_flagged_pixels_and_incomplete_cycles(self):
+        sci, err, beams, cycles, truth = chopnod_sequence(ncycles=3)
+        dq = np.zeros(sci.shape, dtype=np.int32)
+        dq[:, 2, 3] = 1                                 # Bad in every frame
+        dq[cycles == 1, 5, 5] = 1                       # Bad in one cycle
+
+        # A last cycle that never nods
+        keep = np.ones(len(beams), dtype=bool)
+        keep[(cycles == 2) & (beams >= 2)] = False
+
+        accumulator = ChopNodAccumulator(sci.shape[1:])
+        accumulator.add_frames(sci[keep], err[keep], dq[keep], beams[keep], cycles[keep])
+        result = accumulator.result()
+
+        assert (result.ncycles, result.nskipped) == (2, 1)
+        assert result.coverage[2, 3] == 0 and np.isnan(result.image[2, 3])
+        assert result.coverage[5, 5] + result.rejected[5, 5] == 1
+        assert np.isnan(result.scatter[5, 5])
+
+    def test_frames_in_order(self):
+        accumulator = ChopNodAccumulator((2, 2))
+        accumulator.add(np.zeros((2, 2)), None, None, beam=0, cycle=1)
+        with pytest.raises(ValueError):
+            accumulator.add(np.zeros((2, 2)), None, None, beam=1, cycle=0)
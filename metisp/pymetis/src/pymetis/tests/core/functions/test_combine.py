@@ -0,0 +1,91 @@
+"""
+Unit tests for combine_with_error.
+
+Every combination method is checked against a straightforward per-pixel implementation,
+including bad pixel masks, pixels without any good sample and the propagated error.
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.combine import combine_with_error
+
+
+def reference(stack, good, method, read_noise, kappa=3.0, iterations=5):
+    """ Per-pixel reference implementation, straight from the definitions """
+    n, h, w = stack.shape
+    combined = np.zeros((h, w))
+    error = np.zeros((h, w))
+    for i in range(h):
+        for j in range(w):
+            values = stack[good[:, i, j], i, j].astype(np.float64)
+            if len(values) == 0:
+                continue
+            error[i, j] = np.sqrt(max(np.mean(values + read_noise ** 2), 0.0))
+            if method == 'add':
+                combined[i, j] = values.sum()
+            elif method == 'average':
+                combined[i, j] = values.mean()
+            elif method == 'median':
+                combined[i, j] = np.median(values)
+            else:
+                for _ in range(iterations):
+                    if len(values) < 2:
+                        break
+                    mean, sigma = values.mean(), values.std(ddof=1)
+                    inside = values[(values >= mean - kappa * sigma) & (values <= mean + kappa * sigma)]
+                    if len(inside) == len(values) or len(inside) < 2:
+                        break
+                    values = inside
+                combined[i, j] = values.mean()
+    return combined, error
+
+
+def random_stack(seed, n=9, h=40, w=31):
+    """ A stack with cosmics and bad pixels, among them a pixel without any good sample. """
+    rng = np.random.default_rng(seed)
+    stack = rng.normal(100.0, 5.0, (n, h, w)).astype(np.float32)
+    stack[rng.uniform(size=stack.shape) < 0.02] = 1e4      # cosmics, to be clipped
+    bpm = rng.uniform(size=stack.shape) < 0.1
+    bpm[:, 0, 0] = True                                     # no good sample at all
+    return stack, bpm
+
+
+@pytest.mark.usefixtures('backend')
+class TestCombineWithError:
+    """ `combine_with_error` must agree with the per-pixel definitions. """
+
+    @pytest.mark.parametrize('method', ['add', 'average', 'median', 'sigclip'])
+    def test_matches_reference(self, method):
+        stack, bpm = random_stack(3)
+
+        combined, error, rejected = combine_with_error(stack, method, 4.0, bpm=bpm)
+        combined_ref, error_ref = reference(stack, ~bpm, method, 4.0)
+
+        np.testing.assert_array_equal(rejected, ~(~bpm).any(axis=0))
+        np.testing.assert_allclose(combined, combined_ref, rtol=1e-6)
+        np.testing.assert_allclose(error, error_ref, rtol=1e-6)
+
+    def test_without_mask_or_error(self):
+        stack, _ = random_stack(4)
+
+        combined, error, rejected = combine_with_error(stack, 'average')
+
+        assert error is None
+        assert not rejected.any()
+        np.testing.assert_allclose(combined, stack.astype(np.float64).mean(axis=0), rtol=1e-6)
+
+    def test_block_size_does_not_matter(self):
+        stack, bpm = random_stack(5)
+
+        combined1, error1, _ = combine_with_error(stack, 'sigclip', 1.0, bpm=bpm, rows=7)
+        combined2, error2, _ = combine_with_error(stack, 'sigclip', 1.0, bpm=bpm, rows=64)
+
+        np.testing.assert_array_equal(combined1, combined2)
+        np.testing.assert_array_equal(error1, error2)
+
+    def test_unknown_method(self):
+        stack, _ = random_stack(6)
+
+        with pytest.raises(ValueError):
+            combine_with_error(stack, 'mode')
@@ -0,0 +1,134 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.adi import adi_pca, derotate
+from pymetis.engine.core.functions.contrast import (aperture_sums, contrast_curve, fake_companion_throughput,
+                                                    gaussian_psf, radial_profile, render_companions, snr_map,
+                                                    stellar_psf)
+
+from pymetis.tests.core.functions.test_adi import adi_sequence
+
+
+class TestRadialStatistics:
+    def test_profile_of_radial_image(self):
+        rows, columns = np.indices((41, 41))
+        radius = np.hypot(columns - 20, rows - 20)
+        image = np.floor(radius)
+        image[0, 0] = np.nan
+
+        profile = radial_profile(image)
+        assert profile.count.sum() == 41 * 41 - 1
+        np.testing.assert_allclose(profile.mean[:20], np.arange(20))
+        np.testing.assert_allclose(profile.sigma[1:20], 0.0)
+        assert np.isnan(profile.sigma[0])          # a single pixel at the centre
+
+    def test_snr_of_white_noise(self):
+        rng = np.random.default_rng(4)
+        image = rng.normal(0.0, 2.0, (101, 101))
+        image[50, 80] += 30.0
+
+        snr = snr_map(image, fwhm=3.0)
+        assert abs(np.nanstd(snr) - 1.0) < 0.1
+        assert snr[50, 80] > 10
+
+    def test_aperture_sums_match_direct_sums(self):
+        rng = np.random.default_rng(5)
+        image = rng.normal(size=(30, 25))
+        sums = aperture_sums(image, 2.5)
+
+        rows, columns = np.indices(image.shape)
+        for y, x in [(0, 0), (10, 12), (29, 24), (15, 1)]:
+            inside = np.hypot(columns - x, rows - y) <= 2.5
+            assert sums[y, x] == pytest.approx(image[inside].sum())
+
+    def test_render_companions(self):
+        psf = gaussian_psf(3.0)
+        image = render_companions((50, 60), psf, np.array([[20.3, 30.6], [45.0, 10.0]]), np.array([100.0, 50.0]))
+        assert image.sum() == pytest.approx(150.0, rel=1e-3)
+
+        rows, columns = np.indices(image.shape)
+        near = np.hypot(columns - 20, rows - 30) < 6
+        weights = image * near
+        assert np.sum(weights * columns) / weights.sum() == pytest.approx(20.3, abs=0.01)
+        assert np.sum(weights * rows) / weights.sum() == pytest.approx(30.6, abs=0.01)
+
+    def test_stellar_psf(self):
+        psf = gaussian_psf(3.0)
+        image = 7.0 + render_companions((50, 60), psf, np.array([[40.0, 12.0]]), np.array([1000.0]))
+
+        star = stellar_psf(image, 3.0)
+        assert star.template.shape == (19, 19)
+        assert star.template.sum() == pytest.approx(1.0)
+        assert star.flux == pytest.approx(1000.0, rel=1e-3)
+        assert star.peak == pytest.approx(1000.0 * psf.max(), rel=1e-3)
+        assert np.unravel_index(np.argmax(star.template), star.template.shape) == (9, 9)
+
+
+class TestThroughput:
+    def test_matches_actual_injection(self):
+        """ Without principal components the reduction is exactly linear, so injecting must give the same. """
+        cube, angles = adi_sequence(nframes=24, size=64)
+        psf = gaussian_psf(3.0)
+        separations = np.array([6.0, 13.0, 20.0])
+
+        reduction = adi_pca(cube, angles, ncomp=0, method='average')
+        throughput = fake_companion_throughput(reduction, separations, psf=psf, aperture=1.5, branches=1, chunk=5)
+
+        centre = reduction.centre
+        positions = np.stack([centre[0] + separations, np.full(3, centre[1])], axis=-1)
+        sky = render_companions(cube.shape[1:], psf, positions, np.full(3, 1000.0))
+        fakes = np.nan_to_num(derotate(np.broadcast_to(sky.astype(np.float32), cube.shape), -angles))
+        injected = adi_pca(cube + fakes, angles, ncomp=0, method='average')
+
+        recovered = aperture_sums(np.nan_to_num(injected.derotated_psfsub - reduction.derotated_psfsub), 1.5)
+        expected = aperture_sums(sky, 1.5)
+        rows, columns = np.round(positions[:, 1]).astype(int), np.round(positions[:, 0]).astype(int)
+        np.testing.assert_allclose(throughput[0], recovered[rows, columns] / expected[rows, columns], rtol=1e-3)
+
+        # Self-subtraction is strongest close to the star
+        assert np.all(np.diff(throughput[0]) > 0) and throughput[0, -1] < 1.0
+
+    def test_branches_with_principal_components(self):
+        cube, angles = adi_sequence(nframes=24, size=64)
+        reduction = adi_pca(cube, angles, ncomp=3, method='median')
+        throughput = fake_companion_throughput(reduction, np.array([8.0, 16.0]), psf=gaussian_psf(3.0),
+                                               aperture=1.5, branches=3)
+        assert throughput.shape == (3, 2)
+        assert np.all((throughput > 0) & (throughput < 1))
+
+
+class TestContrastCurve:
+    def test_white_noise_limits(self):
+        rng = np.random.default_rng(6)
+        residual = rng.normal(0.0, 1.0, (121, 121))
+        psf = gaussian_psf(4.0)
+        separations = np.array([15.0, 30.0, 45.0])
+
+        curve = contrast_curve(residual, separations, np.full(3, 0.5), psf=psf, star_flux=1e6,
+                               aperture=2.0, fwhm=4.0, sigma=5.0)
+
+        # The noise of a sum of n independent pixels, somewhat inflated for the few elements close in
+        pixels = (aperture_sums(np.ones_like(residual), 2.0))[60, 60]
+        np.testing.assert_allclose(curve.noise, np.sqrt(pixels), rtol=0.25)
+        enclosed = aperture_sums(psf, 2.0)[psf.shape[0] // 2, psf.shape[1] // 2]
+        np.testing.assert_allclose(curve.contrast, 5.0 * curve.noise / (0.5 * 1e6 * enclosed))
+        np.testing.assert_allclose(curve.magnitudes, -2.5 * np.log10(curve.contrast))
@@ -6,8 +6,9 @@ of a polynomial from noiseless data, batch independence, weighting behaviour,
 covariance correctness, and handling of singular pixels.
 """
 import numpy as np
+import pytest
 
-from pymetis.engine.core.functions.polyfit import weighted_polyfit
+from pymetis.engine.core.functions.polyfit import NormalEquations, weighted_polyfit, weighted_polyfit_diagonal
 
 
 def single_pixel(x, y, w, deg):
@@ -146,3 +147,96 @@ class TestWeightedPolyfit:
         assert p.shape == (deg + 1, H, W)
         assert cov.shape == (deg + 1, deg + 1, H, W)
         assert ok.shape == (H, W)
+
+
+def random_stack(seed, n=12, h=70, w=9):
+    """ Noisy samples of a linear relation at random abscissae, with random weights. """
+    rng = np.random.default_rng(seed)
+    x = rng.uniform(100, 30000, (n, h, w))
+    y = 1.0 + 1e-5 * x + rng.normal(0, 0.01, (n, h, w))
+    weights = rng.uniform(0.5, 2.0, (n, h, w))
+    return x, y, weights
+
+
+@pytest.mark.usefixtures('backend')
+class TestWeightedPolyfitDiagonal:
+    """ `weighted_polyfit_diagonal` must agree with the full fit. """
+
+    def test_matches_full_fit(self):
+        x, y, weights = random_stack(5)
+
+        p_ref, cov_ref, ok_ref = weighted_polyfit(x, y, 2, weights=weights)
+        p, var, ok = weighted_polyfit_diagonal(x, y, 2, weights=weights)
+
+        np.testing.assert_array_equal(ok, ok_ref)
+        np.testing.assert_allclose(p, p_ref, rtol=1e-7)
+        np.testing.assert_allclose(var, np.moveaxis(np.diagonal(cov_ref, axis1=0, axis2=1), -1, 0), rtol=1e-7)
+
+    def test_block_size_does_not_matter(self):
+        x, y, weights = random_stack(6)
+
+        p1, var1, ok1 = weighted_polyfit_diagonal(x, y, 1, weights=weights, rows=7)
+        p2, var2, ok2 = weighted_polyfit_diagonal(x, y, 1, weights=weights, rows=64)
+
+        np.testing.assert_array_equal(ok1, ok2)
+        np.testing.assert_allclose(p1, p2, rtol=1e-12)
+        np.testing.assert_allclose(var1, var2, rtol=1e-12)
+
+    def test_singular_pixel_flagged_and_zeroed(self):
+        x, y, weights = random_stack(7)
+        weights[2:, 0, 0] = 0
+
+        p, var, ok = weighted_polyfit_diagonal(x, y, 3, weights=weights)
+        assert not ok[0, 0]
+        assert ok[1:].all()
+        assert np.all(p[:, 0, 0] == 0) and np.all(var[:, 0, 0] == 0)
+
+
+@pytest.mark.usefixtures('backend')
+class TestNormalEquations:
+    """
+    Streaming the samples into `NormalEquations` one plane at a time must give the same fit
+    as `weighted_polyfit_diagonal` on the whole stack, whatever abscissa reference is used.
+    """
+    @staticmethod
+    def stream(x, y, weights, deg, reference):
+        equations = NormalEquations(x.shape[1:], deg, reference=reference)
+        for plane in zip(x, y, weights):
+            equations.add(*plane)
+        return equations
+
+    @pytest.mark.parametrize('reference', [1.0, 22000.0])
+    def test_matches_full_fit(self, reference):
+        x, y, weights = random_stack(8)
+        weights[3:6, 4, 2] = 0
+
+        p_ref, var_ref, ok_ref = weighted_polyfit_diagonal(x, y, 2, weights=weights)
+        equations = self.stream(x, y, weights, 2, reference)
+        p, var, ok = equations.solve(rows=16)
+
+        np.testing.assert_array_equal(ok, ok_ref)
+        np.testing.assert_allclose(p, p_ref, rtol=1e-7)
+        np.testing.assert_allclose(var, var_ref, rtol=1e-7)
+        assert equations.count[4, 2] == len(x) - 3
+
+    def test_excluded_samples_may_be_non_finite(self):
+        x, y, weights = random_stack(9)
+        weights[0] = 0
+        y[0] = np.inf
+        x[0] = np.nan
+
+        p_ref, var_ref, _ = weighted_polyfit_diagonal(x[1:], y[1:], 1, weights=weights[1:])
+        p, var, ok = self.stream(x, y, weights, 1, 30000.0).solve()
+
+        assert ok.all()
+        np.testing.assert_allclose(p, p_ref, rtol=1e-7)
+        np.testing.assert_allclose(var, var_ref, rtol=1e-7)
+
+    def test_under_determined_pixel_flagged_and_zeroed(self):
+        x, y, weights = random_stack(10)
+        weights[2:, 0, 0] = 0
+
+        p, var, ok = self.stream(x, y, weights, 3, 30000.0).solve()
+        assert not ok[0, 0]
+        assert ok[1:].all()
+        assert np.all(p[:, 0, 0] == 0) and np.all(var[:, 0, 0] == 0)
@@ -0,0 +1,121 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.psf import detect_sources, measure_psfs, PSF_STATISTICS
+
+SIGMA_TO_FWHM = 2 * np.sqrt(2 * np.log(2))
+
+
+def gaussians(shape, sources, sigma=1.5, background=50.0, noise=0.0, seed=0):
+    """ Render circular Gaussians (x, y, amplitude) on a flat background, with optional Gaussian noise. """
+    rng = np.random.default_rng(seed)
+    rows, columns = np.indices(shape)
+    image = np.full(shape, background)
+    for x, y, amplitude in sources:
+        image += amplitude * np.exp(-((columns - x) ** 2 + (rows - y) ** 2) / (2 * sigma ** 2))
+    if noise > 0:
+        image += rng.normal(0.0, noise, shape)
+    return image.astype(np.float32)
+
+
+SOURCES = [(20.3, 25.6, 1000.0), (60.0, 30.2, 500.0), (41.7, 70.4, 2000.0)]
+
+
+@pytest.mark.usefixtures('backend')
+class TestMeasurePsfs:
+    """ `measure_psfs` must recover the parameters of synthetic sources. """
+
+    def test_recovers_noiseless_sources(self):
+        image = gaussians((96, 90), SOURCES)
+        result = measure_psfs(image, np.array([[20, 26], [60, 30], [42, 70]]))
+
+        np.testing.assert_allclose(result.xcen, [s[0] for s in SOURCES], atol=0.02)
+        np.testing.assert_allclose(result.ycen, [s[1] for s in SOURCES], atol=0.02)
+        np.testing.assert_allclose(result.background, 50.0, atol=1e-3)
+        np.testing.assert_allclose(result.flux, [2 * np.pi * 1.5 ** 2 * s[2] for s in SOURCES], rtol=1e-2)
+        np.testing.assert_allclose(result.fwhm_x, SIGMA_TO_FWHM * 1.5, rtol=0.05)
+        np.testing.assert_allclose(result.fwhm_y, SIGMA_TO_FWHM * 1.5, rtol=0.05)
+        np.testing.assert_allclose(result.peak, [s[2] + 50.0 for s in SOURCES], rtol=0.1)
+
+    def test_uncertainties_and_snr_follow_noise(self):
+        image = gaussians((96, 90), SOURCES, noise=2.0, seed=3)
+        result = measure_psfs(image, np.array([s[:2] for s in SOURCES]))
+
+        np.testing.assert_allclose(result.noise, 2.0, rtol=0.3)
+        assert np.all(result.xcen_err > 0) and np.all(result.xcen_err < 0.1)
+        assert np.all(np.abs(result.xcen - [s[0] for s in SOURCES]) < 5 * result.xcen_err + 0.02)
+        # Brighter sources have a higher SNR
+        assert result.snr[2] > result.snr[0] > result.snr[1] > 10
+
+    def test_detection_by_threshold(self):
+        image = gaussians((96, 90), SOURCES, noise=1.0, seed=5)
+        positions = detect_sources(image, threshold=20.0)
+        assert len(positions) == 3
+
+        result = measure_psfs(image, threshold=20.0)
+        order = np.argsort(result.xcen)
+        np.testing.assert_allclose(result.xcen[order], [20.3, 41.7, 60.0], atol=0.1)
+        assert len(measure_psfs(image, threshold=20.0, max_sources=2).xcen) == 2
+
+    def test_cube_and_per_frame_positions(self):
+        shifted = [(x + 1.5, y - 0.5, a) for x, y, a in SOURCES]
+        cube = np.stack([gaussians((96, 90), SOURCES), gaussians((96, 90), shifted)])
+        guesses = np.array([[[s[0], s[1]] for s in sources] for sources in (SOURCES, shifted)])
+
+        result = measure_psfs(cube, guesses)
+        for name in PSF_STATISTICS:
+            assert getattr(result, name).shape == (2, 3)
+        np.testing.assert_allclose(result.xcen[1] - result.xcen[0], 1.5, atol=0.05)
+        np.testing.assert_allclose(result.ycen[1] - result.ycen[0], -0.5, atol=0.05)
+        assert result.positions.shape == (2, 3, 2)
+
+        # Shared guesses find the same sources in every frame
+        single = measure_psfs(cube, guesses[0])
+        np.testing.assert_allclose(single.xcen, result.xcen, atol=1e-6)
+
+    def test_masked_pixels_are_ignored(self):
+        image = gaussians((96, 90), SOURCES)
+        mask = np.zeros(image.shape, dtype=bool)
+        mask[26, 23] = True
+        image[26, 23] = 1e6
+
+        clean = measure_psfs(gaussians((96, 90), SOURCES), np.array([[20, 26]]))
+        masked = measure_psfs(image, np.array([[20, 26]]), mask=mask)
+        np.testing.assert_allclose(masked.xcen, clean.xcen, atol=0.05)
+        np.testing.assert_allclose(masked.fwhm_x, clean.fwhm_x, rtol=0.02)
+
+    def test_outside_frame_is_nan(self):
+        result = measure_psfs(gaussians((96, 90), SOURCES), np.array([[20, 26], [500, 500]]))
+        assert np.isfinite(result.xcen[0])
+        for name in PSF_STATISTICS:
+            assert np.isnan(getattr(result, name)[1])
+
+    def test_invalid_arguments(self):
+        image = gaussians((32, 32), [])
+        with pytest.raises(ValueError):
+            measure_psfs(image)
+        with pytest.raises(ValueError):
+            measure_psfs(image, np.zeros((1, 2)), threshold=5.0)
+        with pytest.raises(ValueError):
+            measure_psfs(image, np.zeros((1, 2)), half_width=0)
+        with pytest.raises(ValueError):
+            measure_psfs(image, np.zeros((1, 2)), mask=np.zeros((3, 3), dtype=bool))
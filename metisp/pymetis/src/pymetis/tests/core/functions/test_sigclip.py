@@ -0,0 +1,126 @@
+"""
+This file is part of an A* Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import numpy as np
+import pytest
+
+from pymetis.engine.core.functions.sigclip import sigma_clip, MAD_TO_SIGMA
+
+
+def reference(values: np.ndarray, centre: str, scale: str, kappa: float, iterations: int):
+    """ Straightforward clipping of a single set of samples, returning the kept ones and their centre and scale. """
+    def estimate(v):
+        c = np.median(v) if centre == 'median' else v.mean()
+        if scale == 'mad':
+            s = MAD_TO_SIGMA * np.median(np.abs(v - c))
+        else:
+            s = v.std(ddof=1) if len(v) > 1 else 0.0          # around the mean, as astropy
+        return c, s
+
+    values = values[np.isfinite(values)].astype(np.float64)
+    c, s = estimate(values) if len(values) else (0.0, 0.0)
+    for _ in range(iterations):
+        if len(values) < 2:
+            break
+        inside = values[(values >= c - kappa * s) & (values <= c + kappa * s)]
+        if len(inside) == len(values) or len(inside) < 2:
+            break
+        values = inside
+        c, s = estimate(values)
+    return values, c, s
+
+
+ESTIMATORS = [('median', 'stdev'), ('median', 'mad'), ('mean', 'stdev'), ('mean', 'mad')]
+
+
+def random_map(seed, h=150, w=131):
+    """ A noise map with hot, cold and invalid pixels, and a random mask. """
+    rng = np.random.default_rng(seed)
+    data = rng.normal(100.0, 5.0, (h, w)).astype(np.float32)
+    data[rng.uniform(size=data.shape) < 0.01] = 1e4        # hot pixels
+    data[rng.uniform(size=data.shape) < 0.01] = -1e3       # cold pixels
+    data[0, :3] = np.nan
+    mask = rng.uniform(size=data.shape) < 0.05
+    return data, mask
+
+
+@pytest.mark.usefixtures('backend')
+class TestSigmaClip:
+    """ `sigma_clip` must agree with the straightforward definition. """
+
+    @pytest.mark.parametrize('centre, scale', ESTIMATORS)
+    def test_map_matches_reference(self, centre, scale):
+        data, mask = random_map(1)
+
+        rejected, stats = sigma_clip(data, mask=mask, centre=centre, scale=scale, kappa_low=2.5, kappa_high=2.5)
+        kept, c, s = reference(data[~mask], centre, scale, 2.5, 5)
+
+        assert stats.kept == len(kept) == (~rejected).sum()
+        np.testing.assert_array_equal(np.sort(data[~rejected]), np.sort(kept.astype(np.float32)))
+        assert rejected[mask].all() and rejected[0, :3].all()
+        assert stats.low <= kept.min() and kept.max() <= stats.high
+        np.testing.assert_allclose([stats.centre, stats.sigma], [c, s], rtol=1e-6)
+
+    @pytest.mark.parametrize('centre, scale', ESTIMATORS)
+    def test_stack_matches_reference(self, centre, scale):
+        rng = np.random.default_rng(2)
+        stack = rng.normal(100.0, 5.0, (9, 40, 31)).astype(np.float32)
+        stack[rng.uniform(size=stack.shape) < 0.05] = 1e4          # cosmics
+        mask = rng.uniform(size=stack.shape) < 0.1
+        mask[:, 0, 0] = True                                        # no good sample at all
+
+        rejected, stats = sigma_clip(stack, mask=mask, axis=0, centre=centre, scale=scale)
+
+        assert rejected.shape == stack.shape and rejected[mask].all()
+        for i in range(stack.shape[1]):
+            for j in range(stack.shape[2]):
+                kept, c, s = reference(stack[~mask[:, i, j], i, j], centre, scale, 3.0, 5)
+                assert stats.kept[i, j] == len(kept) == (~rejected[:, i, j]).sum()
+                np.testing.assert_allclose([stats.centre[i, j], stats.sigma[i, j]], [c, s], rtol=1e-6, atol=1e-12)
+
+    def test_per_side_kappas(self):
+        data = np.concatenate([np.linspace(-1, 1, 1001), [-6, 6]]).astype(np.float32)
+
+        rejected, _ = sigma_clip(data, centre='median', scale='stdev', kappa_low=100.0, kappa_high=3.0)
+
+        assert not rejected[-2] and rejected[-1]
+
+    def test_agrees_with_astropy(self):
+        astropy_stats = pytest.importorskip('astropy.stats')
+        data, mask = random_map(3)
+        data[np.isnan(data)] = 100.0
+
+        rejected, _ = sigma_clip(data, mask=mask, kappa_low=3.0, kappa_high=3.0)
+        expected = astropy_stats.sigma_clip(np.ma.masked_array(data, mask=mask), sigma=3.0, maxiters=5).mask
+
+        np.testing.assert_array_equal(rejected, expected)
+
+    def test_block_size_does_not_matter(self):
+        stack = np.random.default_rng(4).normal(0.0, 1.0, (5, 23, 7)).astype(np.float32)
+
+        first, stats_first = sigma_clip(stack, axis=0, rows=4)
+        second, stats_second = sigma_clip(stack, axis=0, rows=64)
+
+        np.testing.assert_array_equal(first, second)
+        np.testing.assert_array_equal(stats_first.centre, stats_second.centre)
+
+    @pytest.mark.parametrize('options', [{'centre': 'mode'}, {'scale': 'iqr'}, {'axis': 1}])
+    def test_unknown_options(self, options):
+        with pytest.raises(ValueError):
+            sigma_clip(np.zeros((3, 4, 5), dtype=np.float32), **options)
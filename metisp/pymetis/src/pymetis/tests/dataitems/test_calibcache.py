@@ -0,0 +1,159 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import os
+
+import numpy as np
+import pytest
+
+from pymetis.engine.dataitems.calibcache import CalibrationCache, calibration_cache, CACHE_SIZE_VARIABLE
+
+
+@pytest.fixture
+def master(tmp_path):
+    path = tmp_path / 'master.fits'
+    path.write_bytes(b'master dark' * 100)
+    return path
+
+
+class Loader:
+    """ Count how many times the plane actually had to be decoded. """
+    def __init__(self, shape=(16, 16), value=1.5):
+        self.calls = 0
+        self.shape = shape
+        self.value = value
+
+    def __call__(self) -> np.ndarray:
+        self.calls += 1
+        return np.full(self.shape, self.value, dtype=np.float32)
+
+
+class TestCalibrationCache:
+    def test_second_load_is_a_hit(self, tmp_path, master):
+        cache = CalibrationCache(tmp_path / 'cache', 2 ** 20)
+        loader = Loader()
+
+        first = cache.get(master, 'DET1.SCI', loader)
+        second = cache.get(master, 'DET1.SCI', loader)
+
+        assert loader.calls == 1
+        assert (cache.hits, cache.misses) == (1, 1)
+        np.testing.assert_array_equal(first, second)
+        assert second.dtype == np.float32
+        assert not second.flags.writeable
+
+    def test_shared_between_processes(self, tmp_path, master):
+        CalibrationCache(tmp_path / 'cache', 2 ** 20).get(master, 'DET1.SCI', Loader())
+
+        # A new instance sees the store of the previous one, as another process would
+        loader = Loader()
+        CalibrationCache(tmp_path / 'cache', 2 ** 20).get(master, 'DET1.SCI', loader)
+        assert loader.calls == 0
+
+    def test_keyed_by_content_and_extension(self, tmp_path, master):
+        cache = CalibrationCache(tmp_path / 'cache', 2 ** 20)
+        cache.get(master, 'DET1.SCI', Loader())
+
+        copy = tmp_path / 'copy.fits'
+        copy.write_bytes(master.read_bytes())
+        loader = Loader()
+        cache.get(copy, 'DET1.SCI', loader)
+        assert loader.calls == 0
+
+        cache.get(master, 'DET1.ERR', loader)
+        assert loader.calls == 1
+
+        master.write_bytes(b'another master dark')
+        cache.get(master, 'DET1.SCI', loader)
+        assert loader.calls == 2
+
+    def test_evicts_least_recently_used(self, tmp_path):
+        plane = Loader()().nbytes
+        cache = CalibrationCache(tmp_path / 'cache', 2 * plane + 1000)
+        files = []
+        for i in range(3):
+            files.append(path := tmp_path / f'master{i}.fits')
+            path.write_bytes(f'master {i}'.encode())
+
+        cache.get(files[0], 'DET1.SCI', Loader())
+        cache.get(files[1], 'DET1.SCI', Loader())
+        os.utime(cache._entry(cache.file_hash(files[1]), 'DET1.SCI'), ns=(0, 0))
+        cache.get(files[2], 'DET1.SCI', Loader())
+
+        assert cache.size <= cache.limit
+        survivors = [cache._entry(cache.file_hash(path), 'DET1.SCI').exists() for path in files]
+        assert survivors == [True, False, True]
+
+    def test_remembered_hashes_go_with_their_entries(self, tmp_path):
+        plane = Loader()().nbytes
+        cache = CalibrationCache(tmp_path / 'cache', 2 * plane + 1000)
+        hashes = tmp_path / 'cache' / 'hashes'
+        files = []
+        for i in range(3):
+            files.append(path := tmp_path / f'master{i}.fits')
+            path.write_bytes(f'master {i}'.encode())
+
+        cache.get(files[0], 'DET1.SCI', Loader())
+        cache.get(files[1], 'DET1.SCI', Loader())
+        assert len(list(hashes.iterdir())) == 2
+        assert cache.size == sum(file.stat().st_size for file in (tmp_path / 'cache').rglob('*')
+                                 if file.is_file() and file.name != 'lock')
+
+        os.utime(cache._entry(cache.file_hash(files[1]), 'DET1.SCI'), ns=(0, 0))
+        cache.get(files[2], 'DET1.SCI', Loader())
+
+        # The hash of the evicted content is forgotten by the store, the others are still known to new processes
+        assert sorted(file.read_text() for file in hashes.iterdir()) == \
+            sorted(cache.file_hash(path) for path in (files[0], files[2]))
+
+        loader = Loader()
+        other = CalibrationCache(tmp_path / 'cache', 2 * plane + 1000)
+        other.get(files[2], 'DET1.SCI', loader)
+        assert loader.calls == 0
+
+    def test_hashes_count_towards_the_limit(self, tmp_path):
+        plane = Loader()().nbytes
+        cache = CalibrationCache(tmp_path / 'cache', 4 * plane)
+        for i in range(50):
+            (path := tmp_path / f'master{i}.fits').write_bytes(f'master {i}'.encode())
+            cache.get(path, 'DET1.SCI', Loader())
+
+        assert cache.size <= cache.limit
+        assert len(list((tmp_path / 'cache' / 'hashes').iterdir())) <= len(list((tmp_path / 'cache').glob('*.npy')))
+
+    def test_clear_removes_hashes(self, tmp_path, master):
+        cache = CalibrationCache(tmp_path / 'cache', 2 ** 20)
+        cache.get(master, 'DET1.SCI', Loader())
+        cache.clear()
+
+        assert cache.size == 0
+        assert list((tmp_path / 'cache' / 'hashes').iterdir()) == []
+
+    def test_oversized_planes_are_not_stored(self, tmp_path, master):
+        cache = CalibrationCache(tmp_path / 'cache', 100)
+        cache.get(master, 'DET1.SCI', Loader())
+        assert cache.size == 0
+
+    def test_disabled_from_environment(self, monkeypatch):
+        monkeypatch.setenv(CACHE_SIZE_VARIABLE, '0')
+        calibration_cache.cache_clear()
+        try:
+            assert calibration_cache() is None
+        finally:
+            calibration_cache.cache_clear()
@@ -0,0 +1,183 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import os
+
+import numpy as np
+import pytest
+
+import cpl
+
+from pymetis.engine.dataitems import fitsindex
+from pymetis.engine.dataitems.fitsindex import BLOCK_SIZE, FitsIndex, fits_index
+
+
+def _card(keyword: str, value) -> bytes:
+    if isinstance(value, str):
+        escaped = value.replace("'", "''")
+        return f"{keyword:8s}= '{escaped:8s}'".ljust(80).encode('ascii')
+    if isinstance(value, bool):
+        value = 'T' if value else 'F'
+    return f"{keyword:8s}= {value!s:>20s}".ljust(80).encode('ascii')
+
+
+def _hdu(cards: list[tuple[str, object]], data: np.ndarray | None = None) -> bytes:
+    header = b''.join(_card(keyword, value) for keyword, value in cards) + b'END'.ljust(80)
+    header = header.ljust(-(-len(header) // BLOCK_SIZE) * BLOCK_SIZE, b' ')
+    if data is None:
+        return header
+    payload = data.astype(data.dtype.newbyteorder('>')).tobytes()
+    return header + payload.ljust(-(-len(payload) // BLOCK_SIZE) * BLOCK_SIZE, b'\0')
+
+
+def _write(path, image_shape=(5, 7)) -> None:
+    image = np.arange(np.prod(image_shape), dtype=np.float32).reshape(image_shape)
+    primary = _hdu([('SIMPLE', True), ('BITPIX', 8), ('NAXIS', 0),
+                    ('OBJECT', "it's a test"), ('EXPTIME', 1.5)])
+    extension = _hdu([('XTENSION', 'IMAGE'), ('BITPIX', -32), ('NAXIS', 2),
+                      ('NAXIS1', image_shape[1]), ('NAXIS2', image_shape[0]),
+                      ('PCOUNT', 0), ('GCOUNT', 1), ('EXTNAME', 'DET1.DATA')], image)
+    cube = _hdu([('XTENSION', 'IMAGE'), ('BITPIX', 16), ('NAXIS', 3),
+                 ('NAXIS1', 4), ('NAXIS2', 3), ('NAXIS3', 2),
+                 ('PCOUNT', 0), ('GCOUNT', 1), ('EXTNAME', 'CUBE')], np.zeros((2, 3, 4), dtype=np.int16))
+    # Unsigned 16-bit raw counts, stored as signed integers with the conventional offset
+    counts = np.array([[0, 1, 32767], [32768, 40000, 65535]], dtype=np.uint16)
+    unsigned = _hdu([('XTENSION', 'IMAGE'), ('BITPIX', 16), ('NAXIS', 2), ('NAXIS1', 3), ('NAXIS2', 2),
+                     ('PCOUNT', 0), ('GCOUNT', 1), ('BZERO', 32768), ('EXTNAME', 'RAW')],
+                    (counts.astype(np.int32) - 32768).astype(np.int16))
+    path.write_bytes(primary + extension + cube + unsigned)
+
+
+class TestFitsIndex:
+    def test_structure(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        index = FitsIndex(path)
+
+        assert len(index) == 4
+        assert [hdu.extname for hdu in index] == [None, 'DET1.DATA', 'CUBE', 'RAW']
+        assert index[0].naxis == 0 and index[0].data_size == 0
+        assert index['DET1.DATA'].shape == (7, 5)
+        assert index['DET1.DATA'].bitpix == -32
+        assert index['CUBE'].naxis == 3
+        assert index['CUBE'].header_offset == index['DET1.DATA'].data_offset + BLOCK_SIZE
+
+    def test_data_offsets(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        hdu = FitsIndex(path)['DET1.DATA']
+
+        data = np.fromfile(path, dtype='>f4', count=35, offset=hdu.data_offset)
+        np.testing.assert_array_equal(data, np.arange(35))
+        assert hdu.data_size == 35 * 4
+
+    def test_keywords(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        keywords = FitsIndex(path)[0].keywords
+
+        assert keywords['SIMPLE'] is True
+        assert keywords['NAXIS'] == 0
+        assert keywords['EXPTIME'] == pytest.approx(1.5)
+        assert keywords['OBJECT'] == "it's a test"
+
+    def test_missing_extension(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        with pytest.raises(KeyError):
+            _ = FitsIndex(path)['DET2.DATA']
+
+    def test_not_fits(self, tmp_path):
+        (path := tmp_path / 'test.txt').write_bytes(b'Not a FITS file'.ljust(2 * BLOCK_SIZE))
+        with pytest.raises(cpl.core.BadFileFormatError):
+            _ = FitsIndex(path)
+
+
+class TestFitsIndexMemmap:
+    def test_memmap_is_read_only_view(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        mapped = FitsIndex(path).memmap('DET1.DATA')
+
+        assert mapped.shape == (5, 7)
+        assert mapped.dtype == np.dtype('>f4')
+        assert not mapped.flags.writeable
+        np.testing.assert_array_equal(mapped, np.arange(35).reshape(5, 7))
+
+    def test_memmap_rejects_primary(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        with pytest.raises(TypeError):
+            _ = FitsIndex(path).memmap(0)
+
+    def test_native_dtype(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        index = FitsIndex(path)
+
+        assert index['DET1.DATA'].dtype == np.float32
+        assert index['CUBE'].dtype == np.int16
+        assert index['RAW'].dtype == np.uint16
+
+    @pytest.mark.parametrize('dtype', [np.uint16, np.int32, np.float32, np.float64])
+    def test_read_into_applies_offset(self, tmp_path, dtype):
+        _write(path := tmp_path / 'test.fits')
+        out = np.empty((3, 2, 3), dtype=dtype)
+
+        FitsIndex(path).read_into('RAW', out[1])
+        np.testing.assert_array_equal(out[1], [[0, 1, 32767], [32768, 40000, 65535]])
+
+    def test_read_into_rows(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        out = np.empty((1, 3), dtype=np.int32)
+
+        FitsIndex(path).read_into('RAW', out, rows=(1, 2))
+        np.testing.assert_array_equal(out, [[32768, 40000, 65535]])
+
+    def test_read_into_rejects_lossy_integer_scaling(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        with pytest.raises(TypeError):
+            FitsIndex(path).read_into('RAW', np.empty((2, 3), dtype=np.int16))
+
+
+class TestFitsIndexCache:
+    def test_shared(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        assert fits_index(path) is fits_index(str(path))
+
+    def test_invalidated_on_change(self, tmp_path):
+        _write(path := tmp_path / 'test.fits')
+        first = fits_index(path)
+
+        _write(path, image_shape=(6, 7))
+        status = os.stat(path)
+        os.utime(path, ns=(status.st_atime_ns, status.st_mtime_ns + 1_000_000_000))
+
+        second = fits_index(path)
+        assert second is not first
+        assert second['DET1.DATA'].shape == (7, 6)
+
+    def test_least_recently_used_evicted(self, tmp_path, monkeypatch):
+        monkeypatch.setattr(fitsindex, 'CACHE_SIZE', 2)
+        monkeypatch.setattr(fitsindex, '_cache', fitsindex.OrderedDict())
+        paths = [tmp_path / f'test{i}.fits' for i in range(3)]
+        for path in paths:
+            _write(path)
+
+        first, second = fits_index(paths[0]), fits_index(paths[1])
+        assert fits_index(paths[0]) is first
+        fits_index(paths[2])
+
+        # The second index was used least recently and had to make room for the third
+        assert len(fitsindex._cache) == 2
+        assert fits_index(paths[0]) is first
+        assert fits_index(paths[1]) is not second
@@ -0,0 +1,207 @@
+"""
+This file is part of the METIS Pipeline.
+Copyright (C) 2024 European Southern Observatory
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+"""
+
+import threading
+from types import SimpleNamespace
+
+import numpy as np
+import pytest
+
+from cpl.core import Image as CplImage, ImageList as CplImageList
+
+from pymetis.engine.dataitems.fitsindex import BLOCK_SIZE, CARD_SIZE, FitsIndex
+from pymetis.engine.dataitems.writer import Compression, ProductWriter, format_card, write_extensions
+
+
+def _property(name, value, comment=None):
+    return SimpleNamespace(name=name, value=value, comment=comment)
+
+
+def _hdu(name, data, klass=CplImage, **keywords):
+    """ A stand-in for `Hdu` whose data are plain NumPy arrays. """
+    header = [_property('EXTNAME', name), _property('NAXIS', 99)]
+    header += [_property(keyword, value, "a comment") for keyword, value in keywords.items()]
+    saved = []
+    return SimpleNamespace(name=name, header=header, data=data, klass=klass,
+                           save=lambda filename: saved.append(filename), saved=saved)
+
+
+@pytest.fixture
+def primary(tmp_path):
+    path = tmp_path / 'product.fits'
+    header = b''.join([format_card('SIMPLE', True), format_card('BITPIX', 8),
+                       format_card('NAXIS', 0), format_card('EXTEND', True)]) + b'END'.ljust(CARD_SIZE)
+    path.write_bytes(header + b' ' * (-len(header) % BLOCK_SIZE))
+    return path
+
+
+class TestFormatCard:
+    @pytest.mark.parametrize('name, value, expected', [
+        ('NAXIS', 2, "NAXIS   =                    2"),
+        ('EXTEND', True, "EXTEND  =                    T"),
+        ('EXTNAME', 'DET1.SCI', "EXTNAME = 'DET1.SCI'"),
+        ('OBJECT', "O'Hara", "OBJECT  = 'O''Hara '"),
+        ('ESO DET DIT', 1.5, "HIERARCH ESO DET DIT =                  1.5"),
+        ('ESO QC COUNT', 3.0, "HIERARCH ESO QC COUNT =                   3."),
+    ])
+    def test_values(self, name, value, expected):
+        card = format_card(name, value)
+        assert len(card) == CARD_SIZE
+        assert card.decode().rstrip() == expected
+
+    def test_comment_is_truncated(self):
+        card = format_card('ESO DET DIT', 1.5, "x" * 100)
+        assert len(card) == CARD_SIZE
+        assert b' / xxx' in card
+
+    @pytest.mark.parametrize('value', [float('nan'), 'y' * 80, object()])
+    def test_unrepresentable_values(self, value):
+        with pytest.raises(ValueError):
+            format_card('ESO DRS VALUE', value)
+
+
+class TestWriteExtensions:
+    def test_round_trip(self, primary):
+        rng = np.random.default_rng(1)
+        sci = rng.normal(size=(5, 7)).astype(np.float32)
+        dq = rng.integers(0, 2, size=(5, 7)).astype(np.int32)
+        cube = rng.normal(size=(3, 5, 7))
+
+        write_extensions(str(primary), [
+            _hdu('DET1.SCI', sci, **{'ESO QC MEAN': 1.25}),
+            _hdu('DET1.DQ', dq),
+            _hdu('DET1.CUBE', cube, klass=CplImageList),
+        ])
+
+        assert primary.stat().st_size % BLOCK_SIZE == 0
+        index = FitsIndex(primary)
+        assert [hdu.extname for hdu in index] == [None, 'DET1.SCI', 'DET1.DQ', 'DET1.CUBE']
+        assert index['DET1.SCI'].keywords['ESO QC MEAN'] == 1.25
+        assert index['DET1.SCI'].keywords['NAXIS'] == 2
+        np.testing.assert_array_equal(index.memmap('DET1.SCI'), sci)
+        np.testing.assert_array_equal(index.memmap('DET1.DQ'), dq)
+        np.testing.assert_array_equal(index.memmap('DET1.CUBE'), cube)
+
+    def test_matches_astropy(self, primary):
+        fits = pytest.importorskip('astropy.io.fits')
+        data = np.arange(12, dtype=np.float64).reshape(3, 4)
+        write_extensions(str(primary), [_hdu('DET1.DATA', data, **{'ESO DET DIT': 2.0})])
+
+        with fits.open(primary) as hdul:
+            assert hdul['DET1.DATA'].header['ESO DET DIT'] == 2.0
+            np.testing.assert_array_equal(hdul['DET1.DATA'].data, data)
+
+    def test_falls_back_to_cpl_for_other_hdus(self, primary):
+        table = _hdu('TABLE', None, klass=object)
+        long = _hdu('LONG', np.zeros((2, 2), dtype=np.float32), **{'ESO DRS NOTE': 'z' * 80})
+        image = _hdu('IMAGE', np.zeros((2, 2), dtype=np.float32))
+
+        write_extensions(str(primary), [table, long, image])
+
+        assert table.saved == [str(primary)]
+        assert long.saved == [str(primary)]
+        assert [hdu.extname for hdu in FitsIndex(primary)] == [None, 'IMAGE']
+
+
+class TestCompression:
+    def test_tiles_span_whole_rows(self):
+        compression = Compression('lossless', tile_rows=16)
+        assert compression.tile_shape(np.zeros((100, 40))) == (16, 40)
+        assert compression.tile_shape(np.zeros((3, 8, 40))) == (1, 8, 40)
+
+    def test_integers_are_always_rice(self):
+        for mode in ('lossless', 'quantised'):
+            assert Compression(mode).options(np.zeros((4, 4), dtype=np.int32))['compression_type'] == 'RICE_1'
+
+    def test_unknown_mode(self):
+        with pytest.raises(ValueError):
+            Compression('lossy')
+
+    @pytest.mark.parametrize('mode', ['lossless', 'quantised'])
+    def test_round_trip(self, primary, mode):
+        rng = np.random.default_rng(2)
+        sci = rng.normal(100, 5, size=(70, 30)).astype(np.float32)
+        dq = (rng.random((70, 30)) < 0.01).astype(np.int32)
+        cube = rng.normal(size=(3, 40, 30))
+        uncompressed = primary.stat().st_size
+
+        write_extensions(str(primary), [
+            _hdu('DET1.SCI', sci, **{'ESO QC MEAN': 1.25}),
+            _hdu('DET1.DQ', dq),
+            _hdu('DET1.CUBE', cube, klass=CplImageList),
+        ], compression=Compression(mode, tile_rows=16))
+
+        index = FitsIndex(primary)
+        assert [hdu.extname for hdu in index] == [None, 'DET1.SCI', 'DET1.DQ', 'DET1.CUBE']
+        assert all(hdu.is_compressed and not hdu.is_image for hdu in index.hdus[1:])
+        assert index['DET1.SCI'].keywords['ESO QC MEAN'] == 1.25
+        assert index['DET1.SCI'].image_shape == (30, 70)
+        assert index['DET1.CUBE'].naxis == 3
+        assert index['DET1.DQ'].dtype == np.int32
+        # The mostly empty data quality map shrinks to almost nothing
+        assert index['DET1.DQ'].data_size < dq.nbytes // 10
+        assert primary.stat().st_size > uncompressed
+
+        np.testing.assert_array_equal(index.read_into('DET1.DQ', np.empty_like(dq)), dq)
+        science = index.read_into('DET1.SCI', np.empty_like(sci))
+        if mode == 'lossless':
+            np.testing.assert_array_equal(science, sci)
+            np.testing.assert_array_equal(index.read_into('DET1.CUBE', np.empty_like(cube)), cube)
+        else:
+            np.testing.assert_allclose(science, sci, atol=5 / 16)
+
+        with pytest.raises(TypeError):
+            index.memmap('DET1.SCI')
+
+    def test_partial_rows(self, primary):
+        cube = np.arange(2 * 50 * 8, dtype=np.int32).reshape(2, 50, 8)
+        write_extensions(str(primary), [_hdu('CUBE', cube, klass=CplImageList)],
+                         compression=Compression('lossless', tile_rows=8))
+
+        index = FitsIndex(primary)
+        np.testing.assert_array_equal(index.section('CUBE', rows=(13, 29)), cube[:, 13:29])
+        out = np.empty((2, 16, 8), dtype=np.float32)
+        np.testing.assert_array_equal(index.read_into('CUBE', out, rows=(13, 29)), cube[:, 13:29])
+
+
+class TestProductWriter:
+    def test_runs_in_order_on_one_background_thread(self):
+        writer = ProductWriter()
+        calls = []
+        for i in range(5):
+            writer.submit(lambda i=i: calls.append((i, threading.current_thread().name)))
+        writer.wait()
+
+        assert [i for i, _ in calls] == list(range(5))
+        assert len({name for _, name in calls}) == 1
+        assert calls[0][1] != threading.current_thread().name
+
+    def test_wait_raises_first_failure(self):
+        writer = ProductWriter()
+
+        def fail():
+            raise OSError("disk full")
+
+        writer.submit(fail)
+        with pytest.raises(OSError, match="disk full"):
+            writer.wait()
+
+        # The writer is usable again
+        writer.submit(lambda: None)
+        writer.wait()
@@ -32,7 +32,6 @@
 #include "metis_dfs.h"
 
 #include <cpl.h>
-#include <string.h>
 
 /*----------------------------------------------------------------------------*/
 /**
@@ -111,14 +110,13 @@ static int metis_calib(
   const cpl_parameter *param;
   const char          *str_option;
   int                 bool_option;
-  cpl_frameset        *rawframes;
+  metis_dfs_tag_index *index;
   const cpl_frame     *firstframe;
   double              qc_param;
   cpl_propertylist    *plist;
   cpl_propertylist    *applist;
   cpl_image           *image;
-  int                 nraw;
-  int                 i;
+  cpl_size            nraw;
 
 
   if (metis_check_and_set_groups(frameset) != CPL_ERROR_NONE) {
@@ -148,19 +146,12 @@ static int metis_calib(
 
   /* HOW TO ACCESS INPUT DATA */
 
-  /*  - A required file */
-  rawframes = cpl_frameset_new();
-  nraw = 0;
-  for (i = 0; i<cpl_frameset_get_size(frameset); i++) {
-      const cpl_frame * current_frame;
-      current_frame = cpl_frameset_get_position_const(frameset, i);
-      if(!strcmp(cpl_frame_get_tag(current_frame), METIS_CALIB_RAW)) {
-          cpl_frame * new_frame = cpl_frame_duplicate(current_frame);
-          cpl_frameset_insert(rawframes, new_frame);
-          nraw++;
-      }
-  }
-  if (nraw == 0) {
+  /*  - A required file: the index refers to the frames of the frameset,
+   *    so nothing is copied */
+  index = metis_dfs_tag_index_new(frameset);
+  nraw = metis_dfs_tag_index_count(index, METIS_CALIB_RAW);
+  if (nraw <= 0) {
+      metis_dfs_tag_index_delete(index);
       return (int)cpl_error_set_message(cpl_func, CPL_ERROR_DATA_NOT_FOUND,
                                         "SOF does not have any file tagged "
                                         "with %s", METIS_CALIB_RAW);
@@ -168,7 +159,8 @@ static int metis_calib(
 
 
   /* HOW TO GET THE FIRST FRAME OF A FRAME */
-  firstframe = cpl_frameset_get_position_const(rawframes, 0);
+  firstframe = metis_dfs_tag_index_get(index, METIS_CALIB_RAW, 0);
+  metis_dfs_tag_index_delete(index);
 
 
   /* HOW TO GET THE VALUE OF A FITS KEYWORD */
@@ -71,7 +71,7 @@ lm_image_std_raw_class = classification_rule("LM_IMAGE_STD_RAW",
      metis_kwd.dpr_tech: "IMAGE,LM",
     })
 
-lm_off_axis_psf_raw = classification_rule("LM_OFF_AXIS_PSF_RAW",
+lm_off_axis_psf_raw_class = classification_rule("LM_OFF_AXIS_PSF_RAW",
     {metis_kwd.instrume: "METIS",
      metis_kwd.dpr_catg: "CALIB",
      metis_kwd.dpr_type: "PSF,OFFAXIS",
@@ -63,6 +63,11 @@ lm_image_std_raw = (data_source()
             .with_match_keywords(["instrume"])
             .build())
 
+lm_off_axis_psf_raw = (data_source()
+            .with_classification_rule(lm_off_axis_psf_raw_class)
+            .with_match_keywords(["instrume"])
+            .build())
+
 # ------- N IMG BAND DATA SOURCES ---------
 
 detlin_geo_raw = (data_source()
@@ -8,6 +8,7 @@ from .metis_lm_img_wkf import *
 metis_lm_ravc_post_task = (task('metis_lm_ravc_post')
              .with_recipe('metis_img_adi_cgrph')
              .with_main_input(lm_img_calib_task, [lm_sci_calibrated_class])
+             .with_associated_input(lm_off_axis_psf_raw, min_ret=0)
              .with_meta_targets([SCIENCE])
              .build())
 # QC1